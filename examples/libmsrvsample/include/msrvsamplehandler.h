@@ -16,6 +16,7 @@
 #define __MSRVSAMPLEHANDLER_H__
 
 #include <magicserver/msrvrequest.h>
+#include <magicserver/msrvframe.h>
 
 /*******************************************************************************
  * Sample request handler
@@ -36,6 +37,8 @@ class MyHandler : public MSrv::RequestHandler {
 
   protected:
 	MSrvResult			processData	(MSrv::DataRequest& rRequest);
+
+	MSrv::LineFramer	mFramer;	/**< Requests are lines of text. */
 };
 
 #endif
@@ -37,12 +37,36 @@ struct TestArgs {
 		logfile   = NULL;
 		portno    = MSRVTEST_PORTNO;
 		udp       = false;
+		backend   = 0;
+		reactors  = 0;
+		queue     = 0;
+		policy    = 0;
+		ordered   = false;
+		backlog   = MSRV_LISTEN_BACKLOG;
+		maxconns  = 0;
+		maxperip  = 0;
+		idle      = 0;
+		loglevel  = MSrv::Log::Debug;
+		logsize   = 0;
+		admin     = NULL;
 	}
 	
 	bool        daemonize; /**< Should the server detach from tty?            */
 	const char* logfile;   /**< Log file to write to or - for standard output.*/
 	int         portno;    /**< Port number to listen to.                     */
 	bool        udp;       /**< Should UDP be used instead of TCP?            */
+	int         backend;   /**< Event backend type of the listener.           */
+	int         reactors;  /**< Number of reactors, or 0 for one listener.    */
+	int         queue;     /**< Request queue type of the worker pool.        */
+	int         policy;    /**< Scheduling policy of the worker pool.         */
+	bool        ordered;   /**< Process connection requests in order?         */
+	int         backlog;   /**< Queue length of pending connections.          */
+	int         maxconns;  /**< Most open connections, or 0 for no limit.     */
+	int         maxperip;  /**< Most connections per address, or 0.           */
+	long        idle;      /**< Idle timeout in milliseconds, or 0.           */
+	int         loglevel;  /**< Least severe fatality written to the log.     */
+	long        logsize;   /**< Rotate the log file at this length, or 0.     */
+	const char* admin;     /**< Admin port or Unix socket path, or NULL.      */
 };
 
 /*******************************************************************************
@@ -36,6 +36,10 @@ MSrvResult MyHandler::init (ServerListener& rListener)
 							  Request::Shutdown);
 
 	/* Only Request::Timeout is not enabled. */
+
+	/* Each line is a request, however it was split or merged */
+	/* in transfer.                                           */
+	rListener.setFramer (&mFramer);
 	
 	return 0;
 }
@@ -84,8 +88,8 @@ MSrvResult MyHandler::process (NewConnectionRequest& rRequest)
 /******************************************************************************/
 MSrvResult MyHandler::process (ConnectionLostRequest& rRequest)
 {
-	rRequest.serverListener().log().message ("SAMPLE", Log::Info, 0,
-											  "Connection lost");
+	MSRV_LOG (rRequest.serverListener().log(), "SAMPLE", Log::Info, 0,
+			  "Connection lost");
 
 	return 0;
 }
@@ -113,15 +117,17 @@ MSrvResult MyHandler::process (DatagramRequest& rRequest)
 /******************************************************************************/
 MSrvResult MyHandler::processData (DataRequest& rRequest)
 {
+	/* The data is terminated, and on TCP, the framer has cut the */
+	/* line end. Datagrams are not framed, so cut it here.        */
 	char*      data   = rRequest.getData ();
 	MSrvResult result = 0;
-	
-	/* Cut at newline. */
-	for (int i=0; i<rRequest.dataLen(); ++i)
-		if (data[i] < '\x20') {
-			data[i] = 0x00;
-			break;
-		}
+
+	if (rRequest.getType () == Request::Datagram)
+		for (int i=0; i<rRequest.dataLen(); ++i)
+			if (data[i] < '\x20') {
+				data[i] = 0x00;
+				break;
+			}
 	
 	/* Shutdown command. */
 	if (!strcmp (data, "shutdown"))
@@ -139,28 +145,34 @@ MSrvResult MyHandler::processData (DataRequest& rRequest)
 		result = rSDRequest.connection().close ();
 	}
 	else {
-		/* Format and send a response. */
+		Connection* pSender = NULL;
+		if (rRequest.getType () == Request::StreamData)
+			pSender = &dynamic_cast<StreamDataRequest&> (rRequest).connection ();
+
+		/* Format and send a response. A connection queues what */
+		/* does not fit in the socket, instead of blocking.     */
 		char msg[1024];
 		snprintf (msg, 1024, "004 Well well well, '%s' to you too!\n",
 				  data);
-		write (rRequest.socket(), msg, strlen (msg));
-
-		/* Relay the message to all other clients. */
-		snprintf (msg, 1024, "005 Someone else said: '%s'.\n",
-				  data);
-
-		/* Iterate through connections in the listener. */
-		for (ServerListener::ConnIter serv_i (rRequest.serverListener());
-			 !serv_i.exhausted ();
-			 serv_i.next()) {
-			if (serv_i.get().socket() != rRequest.socket())
-				write (serv_i.get().socket(), msg, strlen (msg));
+		if (pSender)
+			pSender->send (msg, strlen (msg));
+		else
+			rRequest.serverListener().reply (dynamic_cast<DatagramRequest&> (rRequest),
+											 msg, strlen (msg));
+
+		/* Relay the message to all other clients. It is formatted */
+		/* only once and shared by all the outbound queues.        */
+		SharedBuffer* pRelay = SharedBuffer::format ("005 Someone else said: '%s'.\n",
+													 data);
+		if (pRelay) {
+			rRequest.serverListener().broadcast (*pRelay, pSender);
+			pRelay->unref ();
 		}
 	}
 	
-	rRequest.serverListener().log().message ("SAMPLE", Log::Info, 0,
-											 "Received message '%s'.",
-											 data);
+	MSRV_LOG (rRequest.serverListener().log(), "SAMPLE", Log::Info, 0,
+			  "Received message '%s'.",
+			  data);
 
 	return result;
 }
@@ -173,6 +185,12 @@ MSrvResult MyHandler::process (ShutdownRequest& rRequest)
 	rRequest.serverListener().log().message ("SAMPLE", Log::Info, 0,
 											 "Server is shutting down.");
 
+	/* Show that the requests were recycled rather than allocated. */
+	RequestPool& rPool = rRequest.serverListener().requestPool ();
+	rRequest.serverListener().log().message ("SAMPLE", Log::Info, 0,
+											 "%ld requests used %ld heap allocations.",
+											 rPool.requests (), rPool.allocations ());
+
 	/* Send shutdown message to all connected clients. */
 	const char* msg = "003 Server shutting down immediately! (bye bye)\n";
 	
@@ -44,10 +44,44 @@ int parse_cmd (int       argc,
 			args.logfile = argv[++arg];
 		else if (!strcmp (argv[arg], "-p") && arg < argc-1)
 			args.portno = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-select"))
+			args.backend = EventBackend::Select;
+		else if (!strcmp (argv[arg], "-epoll"))
+			args.backend = EventBackend::Epoll;
+		else if (!strcmp (argv[arg], "-uring"))
+			args.backend = EventBackend::Uring;
+		else if (!strcmp (argv[arg], "-reactors") && arg < argc-1)
+			args.reactors = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-lockfree"))
+			args.queue = WorkerPool::LockFreeQueue;
+		else if (!strcmp (argv[arg], "-steal"))
+			args.policy = WorkerPool::StealRoundRobin;
+		else if (!strcmp (argv[arg], "-stealconn"))
+			args.policy = WorkerPool::StealByConnection;
+		else if (!strcmp (argv[arg], "-ordered"))
+			args.ordered = true;
+		else if (!strcmp (argv[arg], "-backlog") && arg < argc-1)
+			args.backlog = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-maxconn") && arg < argc-1)
+			args.maxconns = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-maxperip") && arg < argc-1)
+			args.maxperip = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-idle") && arg < argc-1)
+			args.idle = atol (argv[++arg]);
+		else if (!strcmp (argv[arg], "-loglevel") && arg < argc-1)
+			args.loglevel = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-logsize") && arg < argc-1)
+			args.logsize = atol (argv[++arg]);
+		else if (!strcmp (argv[arg], "-admin") && arg < argc-1)
+			args.admin = argv[++arg];
 		else {
 			fprintf (stderr, "Invalid command line argument '%s'\n",
 					 argv[arg]);
-			fprintf (stderr, "Usage: %s [-d] [-udp] [-l <logfile>] [-p <portno>]\n",
+			fprintf (stderr, "Usage: %s [-d] [-udp] [-l <logfile>] [-p <portno>] "
+					 "[-select|-epoll|-uring] [-reactors <count>] "
+					 "[-lockfree] [-steal|-stealconn] [-ordered] [-backlog <len>] "
+					 "[-maxconn <count>] [-maxperip <count>] [-idle <msec>] "
+					 "[-loglevel <0-7>] [-logsize <bytes>] [-admin <port|path>]\n",
 					 argv[0]);
 			return 1;
 		}
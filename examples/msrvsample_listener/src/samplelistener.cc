@@ -14,6 +14,7 @@
 
 #include <magicserver/msrvserver.h>
 #include <magicserver/msrvworker.h>
+#include <magicserver/msrvgroup.h>
 #include <magicserver/msrvlog.h>
 
 #include <msrvsamplehandler.h>
@@ -27,6 +28,47 @@
 
 using namespace MSrv;
 
+/*******************************************************************************
+ * Runs the server as a group of reactors sharing the port
+ ******************************************************************************/
+static int groupMain (const TestArgs& args, MyHandler& rHandler, Log& rLog)
+{
+	/* All the reactors share the handler, which has no state. */
+	ServerGroup myGroup (rHandler, &rLog, args.reactors, args.backend);
+
+	/* The connection limits apply to each reactor separately. */
+	for (int i=0; i<myGroup.reactorCount (); ++i) {
+		myGroup.reactor (i).setBacklog (args.backlog);
+		myGroup.reactor (i).setMaxConnections (args.maxconns);
+		myGroup.reactor (i).setMaxPerAddress (args.maxperip);
+		myGroup.reactor (i).setIdleTimeout (args.idle);
+	}
+
+	MSrvResult msrvResult = myGroup.bind (args.portno,
+										  args.udp? ServerListener::UDP : ServerListener::TCP,
+										  0);
+	if (msrvResult < 0) {
+		rLog.message ("SMPLLIST", Log::Critical, 0,
+					  "Server initialization failed with error %d.",
+					  -msrvResult);
+		return MSRVTEST_RETVAL_INIT_FAILED;
+	}
+
+	/* Run the reactors until one of them is shut down. */
+	msrvResult = myGroup.listen ();
+	if (msrvResult < 0) {
+		rLog.message ("SMPLLIST", Log::Critical, 0,
+					  "Server execution failed with error %d.",
+					  -msrvResult);
+		return MSRVTEST_RETVAL_EXEC_FAILED;
+	}
+
+	rLog.message ("SMPLLIST", Log::Info, 0,
+				  "Server stopped. Closing log and exiting.");
+
+	return 0;
+}
+
 /*******************************************************************************
  * Initializes and runs the server
  ******************************************************************************/
@@ -38,6 +80,7 @@ int serverMain (const TestArgs& args)
 	/* Open log to file or standard output. */
 	LogFile log (args.logfile? args.logfile : "-");
 	log.message ("SMPLLIST", Log::Info, 0, "Log opened.");
+	log.setLevel (args.loglevel);
 	
 	if (args.daemonize)
 		if (daemon (0, 0) < 0) {
@@ -46,11 +89,24 @@ int serverMain (const TestArgs& args)
 						 errno, strerror (errno));
 		}
 	
+	/* Rotate the log file by length and reopen it on SIGHUP. */
+	if (args.logfile && strcmp (args.logfile, "-")) {
+		log.setRotation (args.logsize);
+		log.reopenOnHangup ();
+	}
+
 	/* Create transaction handler. */
 	MyHandler myHandler;
 	
+	if (args.reactors > 0)
+		return groupMain (args, myHandler, log);
+
 	/* Create and configure server object. */
-	ServerListener myServer (myHandler, &log);
+	ServerListener myServer (myHandler, &log, args.backend);
+	myServer.setBacklog (args.backlog);
+	myServer.setMaxConnections (args.maxconns);
+	myServer.setMaxPerAddress (args.maxperip);
+	myServer.setIdleTimeout (args.idle);
 	
 	/* Create a server socket and bind it to an address. */
 	msrvResult = myServer.bind (args.portno,
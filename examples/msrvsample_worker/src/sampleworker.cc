@@ -15,6 +15,7 @@
 #include <magicserver/msrvserver.h>
 #include <magicserver/msrvworker.h>
 #include <magicserver/msrvlog.h>
+#include <magicserver/msrvadmin.h>
 
 #include <msrvsamplehandler.h>
 #include <msrvsamplemain.h>
@@ -38,6 +39,7 @@ int serverMain (const TestArgs& args)
 	/* Open log to standard output. */
 	LogFile log (args.logfile? args.logfile : "-");
 	log.message ("SMPLWRKR", Log::Info, 0, "Log opened.");
+	log.setLevel (args.loglevel);
 	
 	if (args.daemonize)
 		if (daemon (0, 0) < 0) {
@@ -46,14 +48,25 @@ int serverMain (const TestArgs& args)
 						 errno, strerror (errno));
 		}
 	
+	/* Rotate the log file by length and reopen it on SIGHUP. */
+	if (args.logfile && strcmp (args.logfile, "-")) {
+		log.setRotation (args.logsize);
+		log.reopenOnHangup ();
+	}
+
 	/* Create transaction handler. */
 	MyHandler myHandler;
 	
 	/* Create a worker thread pool. */
-	WorkerPool workers (myHandler, log, 10);
+	WorkerPool workers (myHandler, log, 10, args.queue, args.policy);
+	workers.setOrdered (args.ordered);
 	
 	/* Create and configure server object. */
-	ServerListener myServer (workers, &log);
+	ServerListener myServer (workers, &log, args.backend);
+	myServer.setBacklog (args.backlog);
+	myServer.setMaxConnections (args.maxconns);
+	myServer.setMaxPerAddress (args.maxperip);
+	myServer.setIdleTimeout (args.idle);
 	
 	/* Create a server socket and bind it to an address. */
 	msrvResult = myServer.bind (args.portno,
@@ -65,6 +78,28 @@ int serverMain (const TestArgs& args)
 					 -msrvResult);
 		exitValue = MSRVTEST_RETVAL_INIT_FAILED;
 	}
+
+	/* Serve snapshots on a port, or on a Unix socket if given a path. */
+	AdminServer admin (&log);
+	if (msrvResult >= 0 && args.admin) {
+		admin.handler().addListener (myServer, "server");
+		admin.handler().addPool (workers, "workers");
+		admin.handler().addLog (log, "log");
+
+		if (strchr (args.admin, '/'))
+			msrvResult = admin.bindUnix (args.admin);
+		else
+			msrvResult = admin.bind (atoi (args.admin));
+
+		if (msrvResult >= 0)
+			msrvResult = admin.start ();
+		if (msrvResult < 0) {
+			log.message ("SMPLWRKR", Log::Critical, 0,
+						 "Admin server initialization failed with error %d.",
+						 -msrvResult);
+			exitValue = MSRVTEST_RETVAL_INIT_FAILED;
+		}
+	}
 	
 	if (msrvResult >= 0) {
 		/* Enter the listener loop. */
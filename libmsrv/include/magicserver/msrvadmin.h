@@ -0,0 +1,137 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVADMIN_H__
+#define __MAGICSERVER_MSRVADMIN_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvthread.h>
+#include <magicserver/msrvserver.h>
+#include <magicserver/msrvrequest.h>
+#include <magicserver/msrvworker.h>
+#include <magicserver/msrvcontainer.h>
+
+begin_namespace (MSrv);
+
+class AdminServer;
+
+/*******************************************************************************
+ * Request handler that answers every connection with a text snapshot
+ * of the server and then closes its end.
+ *
+ * The snapshot lists, for each source added:
+ *
+ *   - a @ref ServerListener: the open connections, the descriptors
+ *     listened, the limit and idle disconnects and the first
+ *     MSRV_ADMIN_CONNECTIONS connections with their addresses;
+ *   - a @ref WorkerPool: the requests queued and whether each worker
+ *     is busy or idle;
+ *   - a @ref Log: the messages dropped;
+ *
+ * followed by the metrics of @ref MetricsRegistry::global(). The
+ * lines are of a name and a value, as those of the registry.
+ *
+ * A listener holds its thread lock only while its connections are
+ * copied; everything else is read without locks. The sources must be
+ * added before the handler is in use and exist as long as it.
+ ******************************************************************************/
+class AdminHandler : public RequestHandler {
+  public:
+						AdminHandler	();
+	virtual				~AdminHandler	();
+
+	void				addListener		(ServerListener& rListener, const char* name);
+	void				addPool			(WorkerPool& rPool, const char* name);
+	void				addLog			(Log& rLog, const char* name);
+	int					snapshot		(char* pBuffer, int len);
+
+	virtual MSrvResult	init			(ServerListener& rListener);
+	virtual MSrvResult	process			(NewConnectionRequest& rRequest);
+	virtual MSrvResult	process			(WritableRequest& rRequest);
+
+  private:
+	/** A source of the snapshot; one of the pointers is set. */
+	struct Source {
+		ServerListener*	mrpListener;
+		WorkerPool*		mrpPool;
+		Log*			mrpLog;
+		const char*		mpName;
+	};
+
+	void				addSource		(ServerListener* rpListener, WorkerPool* rpPool,
+										 Log* rpLog, const char* name);
+
+	Array<Source>		mSources;     /**< Sources in the order added.          */
+	ServerListener::ConnectionState* mpStates; /**< Connections of a listener.  */
+	char*				mpBuffer;     /**< Snapshot sent to a client.           */
+};
+
+/*******************************************************************************
+ * Thread that runs the listener loop of an @ref AdminServer.
+ ******************************************************************************/
+class AdminThread : public Thread {
+  public:
+					AdminThread		(AdminServer* pServer) : mpServer (pServer) {;}
+
+	virtual void*	execute			();
+
+  private:
+	AdminServer*	mpServer;   /**< Server whose loop is run. */
+};
+
+/*******************************************************************************
+ * Optional administrative endpoint serving snapshots of the server.
+ *
+ * Runs a @ref ServerListener of its own, with an @ref AdminHandler,
+ * in a thread of its own, on a separate TCP port or Unix socket.
+ * Every client gets one snapshot and then end of file, so that for
+ * example "nc host port" prints it. The admin listener records no
+ * @ref ServerMetrics.
+ ******************************************************************************/
+class AdminServer {
+  public:
+						AdminServer		(Log* rpLog=NULL, int backend=EventBackend::Default);
+						~AdminServer	();
+
+	MSrvResult			bind			(int portno);
+	MSrvResult			bindUnix		(const char* path);
+	MSrvResult			start			();
+	void				stop			();
+
+	AdminHandler&		handler			() {return mHandler;}
+	ServerListener&		listener		() {return *mpListener;}
+
+  private:
+	friend class AdminThread;
+
+	void*				run				();
+
+	AdminHandler		mHandler;     /**< Handler of the admin connections.   */
+	ServerListener*		mpListener;   /**< Listener of the admin socket.        */
+	AdminThread*		mpThread;     /**< Thread running the listener, or NULL. */
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -0,0 +1,114 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVASYNCLOG_H__
+#define __MAGICSERVER_MSRVASYNCLOG_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvlog.h>
+#include <magicserver/msrvthread.h>
+#include <time.h>
+
+begin_namespace (MSrv);
+
+class AsyncLog;
+struct LogRing;
+
+/*******************************************************************************
+ * Writer thread of an @ref AsyncLog.
+ ******************************************************************************/
+class AsyncLogWriter : public Thread {
+  public:
+					AsyncLogWriter	(AsyncLog* pLog) : mpLog (pLog) {;}
+
+	virtual void*	execute			();
+
+  private:
+	AsyncLog*		mpLog;      /**< Log whose messages are written.  */
+};
+
+/*******************************************************************************
+ * Text log written by a background thread.
+ *
+ * The log lines are the same as with @ref LogFile, but @ref message()
+ * does not write them. Instead, each thread that logs gets a ring
+ * buffer of its own, into which the message is formatted and from
+ * which the writer thread takes it. As only the calling thread writes
+ * to its ring and only the writer thread reads from it, the rings
+ * need no locks. The writer merges the messages of all the rings in
+ * time order, formats the rest of the lines and writes them to the
+ * file in batches.
+ *
+ * The message text is formatted by the caller, as the arguments may
+ * not outlive the call; texts longer than MSRV_LOG_MESSAGE_LEN are
+ * cut. If the ring of a thread is full, the message is dropped and
+ * the number of dropped messages is written to the log later, unless
+ * @ref setBlocking() has been set.
+ *
+ * Messages are normally written within MSRV_LOG_FLUSH_MSEC. Use @ref
+ * flush() to wait until the messages logged so far are in the file.
+ ******************************************************************************/
+class AsyncLog : public LogFile {
+  public:
+						AsyncLog	(FILE* stream = stdout, int ringLen=MSRV_LOG_RING_LEN);
+						AsyncLog	(const char* filename, int ringLen=MSRV_LOG_RING_LEN);
+	virtual 			~AsyncLog	();
+
+	virtual MSrvResult	message		(const char* modulename, int fatality, int errnum, const char* message, ...);
+	virtual MSrvResult	flush		();
+	void				setBlocking	(bool blocking) {mBlocking = blocking;}
+	virtual long		drops		() const {return __atomic_load_n (&mDrops, __ATOMIC_RELAXED);}
+
+  private:
+	friend class AsyncLogWriter;
+
+	void				start		();
+	LogRing*			ring		();
+	static void			ringExit	(void* pRing);
+	void*				run			();
+	int					drain		();
+	bool				pending		();
+	void				reap		();
+	void				writeLine	(const struct timespec& rTime, const char* modulename,
+									 int fatality, int errnum, const char* pText, int len);
+	void				writeBatch	();
+
+	int					mRingLen;     /**< Bytes in each ring, a power of two.     */
+	pthread_key_t		mRingKey;     /**< Ring of the calling thread.             */
+	LogRing*			mpRings;      /**< Rings of all the threads, newest first. */
+	ThreadLock			mRingLock;    /**< Guards adding and removing rings.       */
+	AsyncLogWriter*		mpWriter;     /**< Thread that writes the messages.        */
+	Semaphore			mWakeup;      /**< Posted to wake the writer up.           */
+	bool				mSleeping;    /**< Is the writer waiting for messages?     */
+	bool				mStopping;    /**< Should the writer exit when done?       */
+	bool				mBlocking;    /**< Wait for room in a full ring?           */
+	long				mDrops;       /**< Messages dropped because of a full ring. */
+	long				mDropsWritten; /**< Drops already reported in the log.     */
+	char*				mpBatch;      /**< Lines waiting to be written.            */
+	int					mBatchLen;    /**< Bytes in mpBatch.                       */
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVBINLOG_H__
+#define __MAGICSERVER_MSRVBINLOG_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvlog.h>
+#include <magicserver/msrvthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Header at the start of a binary log file.
+ ******************************************************************************/
+struct BinaryLogHeader {
+	char		mMagic[8];    /**< "MSRVBLOG".                              */
+	uint32_t	mVersion;     /**< Version of the record format.            */
+	uint32_t	mHeaderLen;   /**< Bytes before the first record.           */
+	uint64_t	mFileLen;     /**< Preallocated length of the file.         */
+	char		mReserved[40];
+};
+
+/*******************************************************************************
+ * A record of a binary log file.
+ *
+ * The payload follows the header, and the records are aligned to 8
+ * bytes. A record of zero length ends the log. The type is stored
+ * last, so a record whose type is still zero was not completed and is
+ * skipped.
+ *
+ * A Message record has the id of the module name and of the format
+ * string, followed by the raw arguments in the order of the format
+ * string: int and long values, doubles and pointers as they are in
+ * memory, strings as a 16-bit length followed by the characters. The
+ * strings are defined by String records before the records that use
+ * them. The ids start again from each Open record.
+ ******************************************************************************/
+struct BinaryLogRecord {
+	/** Type of a record. */
+	enum type {Open    = 1, /**< The log was opened.                          */
+			   String  = 2, /**< Defines the string of id mFormat.            */
+			   Message = 3, /**< Message with raw arguments.                  */
+			   Text    = 4, /**< Message with the module name and the text.   */
+			   Raw     = 5  /**< Data written as such to the log.             */};
+
+	uint32_t	mLength;      /**< Bytes in the record with the payload.    */
+	uint8_t		mType;        /**< Record type; 0 until it is complete.     */
+	uint8_t		mFatality;    /**< Severity of the event.                   */
+	uint16_t	mPayloadLen;  /**< Bytes after the header.                  */
+	int32_t		mErrnum;      /**< Message number.                          */
+	uint32_t	mModule;      /**< Id of the module name.                   */
+	uint32_t	mFormat;      /**< Id of the format string.                 */
+	uint32_t	mNsec;        /**< Nanoseconds of the time of the message.  */
+	int64_t		mSec;         /**< Seconds of the time of the message.      */
+};
+
+struct BinaryLogString;
+
+/*******************************************************************************
+ * Log of compact binary records in a memory-mapped file.
+ *
+ * @ref message() does not format the message. The module name and the
+ * format string are stored once, and each message is a record of
+ * their ids, the time, the fatality, the message number and the raw
+ * argument values, copied to a file mapped to memory. The threads
+ * reserve their records with an atomic add, so logging takes no
+ * locks and makes no system calls. Use @ref BinaryLogReader or the
+ * msrvlogdecode tool to render the records as the lines of a @ref
+ * LogFile.
+ *
+ * The file is preallocated to a fixed length. When it is full, the
+ * messages are dropped and counted in @ref drops(). Reopening an
+ * existing file continues after its last record.
+ *
+ * Format strings with conversions that can not be stored as raw
+ * values, such as %n, %m, %ls or positional arguments, are formatted
+ * into a Text record; so are all messages once MSRV_BINLOG_STRINGS
+ * strings are in use. Strings are cut to fit MSRV_LOG_MESSAGE_LEN.
+ *
+ * Do not close the log while other threads may log to it.
+ ******************************************************************************/
+class BinaryLog : public Log {
+  public:
+						BinaryLog	(const char* filename, long length=MSRV_BINLOG_LEN);
+	virtual 			~BinaryLog	();
+
+	virtual MSrvResult	open		();
+	virtual void		close		();
+
+	virtual MSrvResult	message		(const char* modulename, int fatality, int errnum, const char* message, ...);
+	MSrvResult			flush		();
+	virtual long		drops		() const {return __atomic_load_n (&mDrops, __ATOMIC_RELAXED);}
+
+  protected:
+	virtual MSrvResult	write		(const char* data, int len);
+
+  private:
+	BinaryLogString*	intern		(const char* pText);
+	BinaryLogRecord*	reserve		(int payloadLen);
+	void				commit		(BinaryLogRecord* pRecord, int type);
+	MSrvResult			writeText	(const char* modulename, int fatality, int errnum,
+									 const char* message, va_list ap);
+
+	char*				mpFilename;   /**< Name of the log file.                    */
+	long				mLength;      /**< Length of the file to preallocate.       */
+	int					mFd;          /**< The open file, or -1.                    */
+	char*				mpMap;        /**< The file mapped to memory.               */
+	long				mMapLen;      /**< Bytes mapped.                            */
+	long				mOffset;      /**< Offset of the next record.               */
+	long				mDrops;       /**< Messages dropped because the file was full. */
+	BinaryLogString*	mpStrings;    /**< Hash table of the stored strings.        */
+	int					mStringCount; /**< Strings in mpStrings.                    */
+	ThreadLock			mStringLock;  /**< Guards adding strings.                   */
+	LogClock			mClock;       /**< Reads the time of the messages.          */
+};
+
+/*******************************************************************************
+ * Renders the records of a @ref BinaryLog as text log lines.
+ *
+ * The lines are in the format of @ref LogFile.
+ ******************************************************************************/
+class BinaryLogReader {
+  public:
+						BinaryLogReader		();
+						~BinaryLogReader	();
+
+	MSrvResult			open				(const char* filename);
+	void				close				();
+	void				setPrecision		(int precision) {mClock.setPrecision (precision);}
+	int					next				(char* pBuffer, int len);
+
+  private:
+	void				define				(const BinaryLogRecord* pRecord);
+	const char*			string				(uint32_t id) const;
+	int					render				(const BinaryLogRecord* pRecord, char* pBuffer, int len);
+
+	int					mFd;          /**< The open file, or -1.                    */
+	const char*			mpMap;        /**< The file mapped to memory.               */
+	long				mMapLen;      /**< Bytes mapped.                            */
+	long				mOffset;      /**< Offset of the next record.               */
+	const char**		mpStrings;    /**< Strings by id in the current session.    */
+	int					mStringsLen;  /**< Entries in mpStrings.                    */
+	LogClock			mClock;       /**< Formats the time stamps.                 */
+};
+
+end_namespace (MSrv);
+
+#endif
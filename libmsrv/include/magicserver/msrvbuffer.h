@@ -0,0 +1,137 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVBUFFER_H__
+#define __MAGICSERVER_MSRVBUFFER_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrverror.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+
+struct iovec;
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Reference-counted immutable data buffer.
+ *
+ * A buffer is filled once when it is created and never changed after
+ * that, so it can be queued for sending on any number of connections
+ * at the same time without copying. Each queue holds a reference;
+ * the buffer is freed when the last reference is dropped, in
+ * whichever thread that happens.
+ *
+ * The creator holds the first reference and must drop it with @ref
+ * unref() when it has queued the buffer. @ref create() and @ref
+ * format() return NULL if out of memory.
+ ******************************************************************************/
+class SharedBuffer {
+  public:
+	static SharedBuffer*	create		(const char* pData, int len);
+	static SharedBuffer*	format		(const char* format, ...);
+
+	void					ref			() {__atomic_add_fetch (&mRefCount, 1, __ATOMIC_RELAXED);}
+	void					unref		();
+
+	const char*				data		() const {return (const char*) (this + 1);}
+	int						length		() const {return mLength;}
+
+  private:
+							SharedBuffer	() {}
+							~SharedBuffer	() {}
+	static SharedBuffer*	allocate	(int len);
+
+	long					mRefCount;  /**< Number of holders of the buffer. */
+	int						mLength;    /**< Length of the data.              */
+};
+
+/*******************************************************************************
+ * Queue of @ref SharedBuffer objects waiting to be sent.
+ *
+ * The queue is a ring of buffer references that grows as needed, so
+ * queueing a buffer does not allocate once the ring is large enough.
+ * The first buffer may have been partially sent already.
+ *
+ * The queue is not thread-safe; the owner must lock it.
+ ******************************************************************************/
+class OutputQueue {
+  public:
+						OutputQueue		();
+						~OutputQueue	();
+
+	MSrvResult			push			(SharedBuffer& rBuffer);
+	int					collect			(struct iovec* pVec, int maxVec) const;
+	void				consume			(long count);
+	void				clear			();
+
+	bool				isEmpty			() const {return mCount == 0;}
+	int					length			() const {return mCount;}
+	long				bytes			() const {return mBytes;}
+
+  private:
+	SharedBuffer**		mpRing;     /**< Ring of queued buffers.                 */
+	int					mSize;      /**< Capacity of the ring.                   */
+	int					mHead;      /**< Position of the first buffer.           */
+	int					mCount;     /**< Number of queued buffers.               */
+	int					mOffset;    /**< Bytes already sent of the first buffer. */
+	long				mBytes;     /**< Bytes waiting to be sent.               */
+};
+
+/*******************************************************************************
+ * Batch of outgoing datagrams, sent with one system call.
+ *
+ * The data of each datagram is copied to a buffer of the batch, which
+ * is reused from one batch to the next, so after warm-up adding a
+ * datagram does not allocate. On Linux the batch is sent with
+ * sendmmsg(), elsewhere with one sendto() per datagram.
+ *
+ * The batch is not thread-safe; each thread should use its own.
+ ******************************************************************************/
+class DatagramBatch {
+  public:
+						DatagramBatch	(int maxCount=MSRV_DATAGRAM_BATCH);
+						~DatagramBatch	();
+
+	MSrvResult			add				(const struct sockaddr_in& rAddr, const char* pData, int len);
+	int					send			(int socket);
+	void				clear			() {mCount = 0; mDataLen = 0;}
+
+	int					length			() const {return mCount;}
+	bool				isFull			() const {return mCount == mMaxCount;}
+
+  private:
+	struct sockaddr_in*	mpAddrs;     /**< Destination of each datagram.      */
+	long*				mpOffsets;   /**< Start of each datagram in mpData.  */
+	int*				mpLengths;   /**< Length of each datagram.           */
+	int					mCount;      /**< Number of datagrams in the batch.  */
+	int					mMaxCount;   /**< Capacity of the batch.             */
+	char*				mpData;      /**< Data of all the datagrams.         */
+	long				mDataLen;    /**< Bytes used in mpData.              */
+	long				mDataSize;   /**< Size of mpData.                    */
+};
+
+end_namespace (MSrv);
+
+#endif
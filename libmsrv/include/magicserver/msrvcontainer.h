@@ -25,8 +25,10 @@
 #ifndef __MAGICSERVER_MSRVCONTAINER_H__
 #define __MAGICSERVER_MSRVCONTAINER_H__
 
+#include <magicserver/msrvdef.h>
 #include <magicserver/msrverror.h>
 #include <stdlib.h>
+#include <string.h>
 
 begin_namespace (MSrv);
 
@@ -85,6 +87,7 @@ class Queue {
 	Queue () {
 		mpFirstItem = NULL;
 		mpLastItem  = NULL;
+		mLength     = 0;
 	}
 
 	/** Destroys the queue and all the items is contains. */
@@ -110,6 +113,8 @@ class Queue {
 
 		if (!mpLastItem)
 			mpLastItem = mpFirstItem;
+
+		__atomic_store_n (&mLength, mLength + 1, __ATOMIC_RELAXED);
 	
 		mThreadLock.unlock ();
 	}
@@ -142,20 +147,160 @@ class Queue {
 			
 			pLastItem->set (NULL);
 			delete pLastItem;
+
+			__atomic_store_n (&mLength, mLength - 1, __ATOMIC_RELAXED);
 		}
 
 		mThreadLock.unlock ();
 
 		return pResult;
 	}
-	
+
+	/** Returns the number of items in the queue, without locking. */
+	int length () const {return __atomic_load_n (&mLength, __ATOMIC_RELAXED);}
 	
   private:
 	ListItem<TYPE>*	mpFirstItem; /**< First item in the queue.     */
 	ListItem<TYPE>*	mpLastItem;  /**< Last item in the queue.      */
+	int				mLength;     /**< Number of items.             */
 	ThreadLock		mThreadLock;
 };
 
+/*******************************************************************************
+ * Bounded lock-free queue.
+ *
+ * A ring buffer of fixed capacity that any number of threads may push
+ * to and pull from concurrently without locks. Each cell carries a
+ * sequence number that tells whether it is free for the producer or
+ * filled for the consumer of a given lap, so producers and consumers
+ * only contend on their own position counter (D. Vyukov's MPMC
+ * queue). Nothing is allocated after construction.
+ *
+ * The items are pulled in the order they were pushed. Items still in
+ * the queue are deleted when the queue is destroyed, as with @ref
+ * Queue.
+ ******************************************************************************/
+template <class TYPE>
+class BoundedQueue {
+  public:
+	/** Creates an empty queue. The capacity is rounded up to a power of two. */
+	BoundedQueue (int capacity) {
+		mCapacity = 2;
+		while (mCapacity < capacity)
+			mCapacity *= 2;
+
+		mpCells = new Cell [mCapacity];
+		for (int i=0; i<mCapacity; ++i) {
+			mpCells[i].mSequence = i;
+			mpCells[i].mpData    = NULL;
+		}
+
+		mPushPos = 0;
+		mPullPos = 0;
+	}
+
+	/** Destroys the queue and all the items it contains. */
+	~BoundedQueue () {
+		while (TYPE* pItem = pull ())
+			delete pItem;
+
+		delete [] mpCells;
+	}
+
+	/** Pushes an item to the end of the queue.
+	 *
+	 *  @return 0 if successful, MSRVERR_QUEUE_FULL if the queue is full.
+	 */
+	MSrvResult push (TYPE* pItem) {
+		unsigned long pos = __atomic_load_n (&mPushPos, __ATOMIC_RELAXED);
+		Cell*         pCell;
+
+		while (1) {
+			pCell = &mpCells[pos & (mCapacity - 1)];
+
+			unsigned long seq  = __atomic_load_n (&pCell->mSequence, __ATOMIC_ACQUIRE);
+			long          diff = (long) seq - (long) pos;
+
+			if (diff == 0) {
+				/* The cell is free on this lap; try to claim it. */
+				if (__atomic_compare_exchange_n (&mPushPos, &pos, pos + 1, true,
+												 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (diff < 0) {
+				/* The cell still holds an item of the previous lap. */
+				return MSRVERR_QUEUE_FULL;
+			} else
+				/* Another producer claimed the cell; catch up. */
+				pos = __atomic_load_n (&mPushPos, __ATOMIC_RELAXED);
+		}
+
+		/* Publish the item to the consumer of this lap. */
+		pCell->mpData = pItem;
+		__atomic_store_n (&pCell->mSequence, pos + 1, __ATOMIC_RELEASE);
+
+		return 0;
+	}
+
+	/** Pulls an item from the beginning of the queue.
+	 *
+	 *  @return The item, or NULL if the queue is empty.
+	 */
+	TYPE* pull () {
+		unsigned long pos = __atomic_load_n (&mPullPos, __ATOMIC_RELAXED);
+		Cell*         pCell;
+
+		while (1) {
+			pCell = &mpCells[pos & (mCapacity - 1)];
+
+			unsigned long seq  = __atomic_load_n (&pCell->mSequence, __ATOMIC_ACQUIRE);
+			long          diff = (long) seq - (long) (pos + 1);
+
+			if (diff == 0) {
+				/* The cell is filled on this lap; try to claim it. */
+				if (__atomic_compare_exchange_n (&mPullPos, &pos, pos + 1, true,
+												 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (diff < 0) {
+				/* Nothing pushed to the cell yet. */
+				return NULL;
+			} else
+				/* Another consumer claimed the cell; catch up. */
+				pos = __atomic_load_n (&mPullPos, __ATOMIC_RELAXED);
+		}
+
+		/* Free the cell for the producer of the next lap. */
+		TYPE* pItem = pCell->mpData;
+		__atomic_store_n (&pCell->mSequence, pos + mCapacity, __ATOMIC_RELEASE);
+
+		return pItem;
+	}
+
+	/** Returns the capacity of the queue. */
+	int capacity () const {return mCapacity;}
+
+	/** Returns the number of items in the queue; only a hint while it changes. */
+	int length () const {
+		long len = (long) (__atomic_load_n (&mPushPos, __ATOMIC_RELAXED) -
+						   __atomic_load_n (&mPullPos, __ATOMIC_RELAXED));
+		return len < 0? 0 : len > mCapacity? mCapacity : len;
+	}
+
+  private:
+	/** Cell of the ring buffer. */
+	struct Cell {
+		unsigned long	mSequence; /**< Lap position the cell is ready for. */
+		TYPE*			mpData;    /**< Item in the cell.                  */
+	};
+
+	Cell*			mpCells;    /**< The ring buffer.                      */
+	int				mCapacity;  /**< Number of cells, a power of two.      */
+	char			mPad0[MSRV_CACHE_LINE_LEN];
+	unsigned long	mPushPos;   /**< Position of the next push.            */
+	char			mPad1[MSRV_CACHE_LINE_LEN];
+	unsigned long	mPullPos;   /**< Position of the next pull.            */
+	char			mPad2[MSRV_CACHE_LINE_LEN];
+};
+
 /*******************************************************************************
  * Generic array container
  ******************************************************************************/
@@ -267,7 +412,166 @@ class Array {
 };
 
 
+/*******************************************************************************
+ * Array of items indexed by small non-negative integer keys.
+ *
+ * Intended for descriptors and other keys that the system allocates
+ * lowest-first. The items are kept in a dense array for fast
+ * iteration, and a table indexed by the key gives the position of
+ * each item, so that adding, removing and finding an item by key are
+ * all constant-time operations. Storage grows by doubling and is
+ * never shrunk, so steady-state use does not allocate.
+ *
+ * Removing an item moves the last item into its place, so the order
+ * of the items is not preserved.
+ *
+ * The array is not thread-safe; the owner must guard it with its own
+ * lock.
+ ******************************************************************************/
+template <class TYPE>
+class KeyedArray {
+  public:
+	/** Creates an empty array. */
+	KeyedArray () {
+		mpItems        = NULL;
+		mpKeys         = NULL;
+		mItemCount     = 0;
+		mCapacity      = 0;
+		mpPositions    = NULL;
+		mPositionCount = 0;
+	}
+
+	/** Destroys the array. The items are not destroyed. */
+	~KeyedArray () {
+		free (mpItems);
+		free (mpKeys);
+		free (mpPositions);
+	}
+
+	/** Adds an item with the given key. The key must not already exist. */
+	MSrvResult add (int key, const TYPE& item) {
+		if (key < 0 || find (key))
+			return MSRVERR_INVALID_ARGUMENT;
+
+		/* Grow the key table to cover the key. */
+		if (key >= mPositionCount) {
+			int newCount = mPositionCount? mPositionCount : 64;
+			while (newCount <= key)
+				newCount *= 2;
+
+			int* pNewPositions = (int*) realloc (mpPositions, newCount * sizeof (int));
+			if (!pNewPositions)
+				return MSRVERR_INVALID_ARGUMENT;
+			for (int i=mPositionCount; i<newCount; ++i)
+				pNewPositions[i] = -1;
+
+			mpPositions    = pNewPositions;
+			mPositionCount = newCount;
+		}
+
+		/* Grow the dense arrays. */
+		if (mItemCount == mCapacity) {
+			int   newCapacity = mCapacity? mCapacity * 2 : 64;
+			TYPE* pNewItems   = (TYPE*) realloc (mpItems, newCapacity * sizeof (TYPE));
+			if (pNewItems)
+				mpItems = pNewItems;
+			int*  pNewKeys    = (int*) realloc (mpKeys, newCapacity * sizeof (int));
+			if (pNewKeys)
+				mpKeys = pNewKeys;
+			if (!pNewItems || !pNewKeys)
+				return MSRVERR_INVALID_ARGUMENT;
+
+			mCapacity = newCapacity;
+		}
+
+		/* Append the new item. */
+		memcpy (&mpItems[mItemCount], &item, sizeof (TYPE));
+		mpKeys[mItemCount] = key;
+		mpPositions[key]   = mItemCount;
+		mItemCount++;
+
+		return 0;
+	}
+
+	/** Removes the item with the given key. */
+	MSrvResult remove (int key) {
+		if (!find (key))
+			return MSRVERR_INVALID_ARGUMENT;
+
+		/* Move the last item into the hole. */
+		int pos  = mpPositions[key];
+		int last = mItemCount - 1;
+		if (pos != last) {
+			memcpy (&mpItems[pos], &mpItems[last], sizeof (TYPE));
+			mpKeys[pos]              = mpKeys[last];
+			mpPositions[mpKeys[pos]] = pos;
+		}
+
+		mpPositions[key] = -1;
+		mItemCount--;
+
+		return 0;
+	}
 
+	/** Returns the item with the given key, or NULL if there is none. */
+	TYPE* find (int key) {
+		if (key < 0 || key >= mPositionCount || mpPositions[key] < 0)
+			return NULL;
+		return &mpItems[mpPositions[key]];
+	}
+
+	/** Returns the number of items in the array. */
+	int length	() const {
+		return mItemCount;
+	}
+
+	/** Returns a reference to the item in given position. */
+	TYPE& operator[] (int pos) {return mpItems[pos];}
+
+	/** Returns the key of the item in given position. */
+	int keyAt (int pos) const {return mpKeys[pos];}
+
+	/** Array iterator.
+	 *
+	 *  The item at the current position may be removed during the
+	 *  iteration; the item moved into its place is visited next.
+	 */
+	class Iterator {
+	  public:
+		/** Creates an iterator for the given array. */
+		Iterator (KeyedArray<TYPE>& array) : mrArray (array) {
+			mPos = 0;
+			mKey = exhausted ()? -1 : mrArray.keyAt (0);
+		}
+
+		/** Retrieves reference to the data item at current position. */
+		TYPE&	get		() {return mrArray[mPos];}
+
+		/** Moves to next array position. */
+		void	next	() {
+			/* Stay in place if the current item was removed. */
+			if (!exhausted () && mrArray.keyAt (mPos) == mKey)
+				mPos++;
+			mKey = exhausted ()? -1 : mrArray.keyAt (mPos);
+		}
+
+		/** Are there any more items? */
+		bool	exhausted	() {return mPos >= mrArray.length ();}
+
+	  private:
+		int               mPos;    /**< Current position.              */
+		int               mKey;    /**< Key of the item at mPos.       */
+		KeyedArray<TYPE>& mrArray;
+	};
+
+  private:
+	TYPE*		mpItems;        /**< Items in dense order.                */
+	int*		mpKeys;         /**< Key of each item in dense order.     */
+	int			mItemCount;     /**< Number of items.                     */
+	int			mCapacity;      /**< Allocated length of the dense arrays. */
+	int*		mpPositions;    /**< Position of each key, or -1.         */
+	int			mPositionCount; /**< Allocated length of mpPositions.     */
+};
 
 end_namespace (MSrv);
 
@@ -61,5 +61,44 @@ typedef unsigned int uint;
  ******************************************************************************/
 #define MSRV_MAX_SELECT_ERROR_COUNT    10   /**< Maximum number of successive errors before exiting. */
 #define MSRV_READ_BUFFER_LEN           1024 /**< Read buffer length for reading data from socket.    */
+#define MSRV_MIN_BUFFER_LEN            64   /**< Smallest pooled read buffer.                       */
+#define MSRV_MAX_READ_LEN              65536 /**< Largest single read from a socket.                */
+#define MSRV_MAX_READY_EVENTS          256  /**< Maximum number of ready descriptors per wait.       */
+#define MSRV_URING_ENTRIES             1024 /**< Submission queue size of an io_uring backend.      */
+#define MSRV_URING_RECV_LEN            4096 /**< Receive buffer length of an io_uring read.         */
+#define MSRV_CACHE_LINE_LEN            64   /**< Padding to keep hot counters on separate lines.    */
+#define MSRV_WORKER_QUEUE_LEN          4096 /**< Capacity of a lock-free worker request queue.      */
+#define MSRV_MAX_OUTPUT_LEN            262144 /**< Default limit of unsent data per connection.    */
+#define MSRV_MAX_IOVEC                 64   /**< Most queued buffers sent with one call.            */
+#define MSRV_DATAGRAM_BATCH            32   /**< Most datagrams received or sent with one call.     */
+#define MSRV_DATAGRAM_LEN              4096 /**< Default receive buffer length of a datagram.      */
+#define MSRV_MAX_FRAME_LEN             65536 /**< Default longest frame of a framer.               */
+#define MSRV_FRAME_BATCH               64   /**< Most frames found with one pass over the data.    */
+#define MSRV_TIMER_BATCH               64   /**< Most timers expired with one call.                 */
+#define MSRV_LISTEN_BACKLOG            128  /**< Default queue length of pending TCP connections.  */
+#define MSRV_LOG_RING_LEN              65536 /**< Bytes in the asynchronous log ring of a thread.   */
+#define MSRV_LOG_MESSAGE_LEN           1024 /**< Longest message text of an asynchronous log.      */
+#define MSRV_LOG_BATCH_LEN             65536 /**< Most log bytes written with one call.             */
+#define MSRV_LOG_FLUSH_MSEC            100  /**< Longest delay of an asynchronous log message.     */
+#define MSRV_LOG_LIMIT_COUNT           10   /**< Default messages per interval of a rate limit.    */
+#define MSRV_LOG_LIMIT_MSEC            1000 /**< Default interval of a log rate limit.             */
+#define MSRV_LOG_ROTATE_KEEP           5    /**< Default number of rotated log files kept.        */
+#define MSRV_LOG_ROTATE_MSEC           1000 /**< Longest wait of the log rotator between checks.   */
+#define MSRV_BINLOG_LEN                67108864 /**< Default preallocated length of a binary log.   */
+#define MSRV_BINLOG_STRINGS            4096 /**< Module names and formats stored in a binary log.   */
+#define MSRV_BINLOG_ARGS               16   /**< Most raw arguments of a binary log message.        */
+#define MSRV_METRIC_SHARDS             16   /**< Shards of a metric; one is shared by extra threads. */
+#define MSRV_HISTOGRAM_SUB_BITS        5    /**< Buckets of a histogram per power of two, as bits.  */
+#define MSRV_ADMIN_SNAPSHOT_LEN        65536 /**< Longest text snapshot of an admin server.        */
+#define MSRV_ADMIN_CONNECTIONS         256  /**< Connections of a listener listed in a snapshot.   */
+#define MSRV_ADMIN_MAX_CONNECTIONS     16   /**< Most clients of an admin server at a time.        */
+#define MSRV_ADMIN_IDLE_MSEC           10000 /**< Idle time to disconnect an admin client.         */
+
+/* Least severe fatality kept by MSRV_LOG(); 7 keeps Log::Debug. libmsrv.mk */
+/* sets 5 for release builds, which compiles Info and Debug out, and 7 for  */
+/* debug builds. This default applies when the define is not given.        */
+#ifndef MSRV_LOG_LEVEL
+#define MSRV_LOG_LEVEL                 7
+#endif
 
 #endif
@@ -35,6 +35,8 @@
 #define MSRVERR_TIMEOUT                   (MSRVERR_GENERIC_BASE - 4)
 #define MSRVERR_INVALID_ARGUMENT          (MSRVERR_GENERIC_BASE - 5)
 #define MSRVERR_UNSPECIFIED_LOWERLEVEL    (MSRVERR_GENERIC_BASE - 6)
+#define MSRVERR_QUEUE_FULL                (MSRVERR_GENERIC_BASE - 7)
+#define MSRVERR_OUT_OF_MEMORY             (MSRVERR_GENERIC_BASE - 8)
 
 /*******************************************************************************
  * Listener and socket related error codes
@@ -51,6 +53,13 @@
 #define MSRVERR_CONNECTION_NO_SOCKET      (MSRVERR_SERVER_BASE - 9)
 #define MSRVERR_NO_LISTENER               (MSRVERR_SERVER_BASE - 10)
 #define MSRVERR_SET_SOCKET_OPTIONS_FAILED (MSRVERR_SERVER_BASE - 10)
+#define MSRVERR_DESCRIPTOR_OUT_OF_RANGE   (MSRVERR_SERVER_BASE - 11)
+#define MSRVERR_EVENT_BACKEND_FAILED      (MSRVERR_SERVER_BASE - 12)
+#define MSRVERR_WRITE_FAILED              (MSRVERR_SERVER_BASE - 13)
+#define MSRVERR_OUTPUT_FULL               (MSRVERR_SERVER_BASE - 14)
+#define MSRVERR_FRAME_TOO_LONG            (MSRVERR_SERVER_BASE - 15)
+#define MSRVERR_TIMER_NOT_FOUND           (MSRVERR_SERVER_BASE - 16)
+#define MSRVERR_CONNECTION_LIMIT          (MSRVERR_SERVER_BASE - 17)
 
 /*******************************************************************************
  * Log module error codes
@@ -62,6 +71,9 @@
 #define MSRVERR_LOG_NO_FILENAME           (MSRVERR_LOG_BASE - 4)
 #define MSRVERR_LOG_ALREADY_OPEN          (MSRVERR_LOG_BASE - 5)
 #define MSRVERR_LOG_INVALID_FATALITY      (MSRVERR_LOG_BASE - 6)
+#define MSRVERR_LOG_RING_FULL             (MSRVERR_LOG_BASE - 7)
+#define MSRVERR_LOG_FULL                  (MSRVERR_LOG_BASE - 8)
+#define MSRVERR_LOG_INVALID_FILE          (MSRVERR_LOG_BASE - 9)
 
 /*******************************************************************************
  * Thread module error codes
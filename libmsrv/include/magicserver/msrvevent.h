@@ -0,0 +1,282 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVEVENT_H__
+#define __MAGICSERVER_MSRVEVENT_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvlog.h>
+#include <magicserver/msrvthread.h>
+
+#include <sys/select.h>
+
+/* io_uring is available on Linux if the kernel headers know about it. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MSRV_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef MSRV_HAVE_IO_URING
+#include <netinet/in.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Descriptor reported ready by @ref EventBackend::wait().
+ ******************************************************************************/
+struct ReadyEvent {
+	int					mFd;       /**< Descriptor.                               */
+	int					mEvents;   /**< Combination of EventBackend::event_type.  */
+};
+
+/*******************************************************************************
+ * Event notification backend of a @ref Listener.
+ *
+ * The backend watches a set of descriptors and reports which of them
+ * have become readable. The @ref Listener registers its descriptors
+ * with @ref add() and @ref remove(), and calls @ref wait() in its
+ * event loop.
+ *
+ * Descriptors are also watched for becoming writable while @ref
+ * watchWrite() is on for them, which is while they have data waiting
+ * to be sent.
+ *
+ * Use @ref create() to create a backend of the wanted type.
+ ******************************************************************************/
+class EventBackend {
+  public:
+	/** Type of the event backend. */
+	enum backend_type {Default = 0, /**< Best available for the platform.    */
+					   Select  = 1, /**< Portable select(), max FD_SETSIZE. */
+					   Epoll   = 2, /**< Linux epoll.                        */
+					   Uring   = 3  /**< Linux io_uring completions.         */};
+
+	/** Readiness reported for a descriptor. */
+	enum event_type {Readable = 0x1, /**< Data or a connection to accept.  */
+					 Writable = 0x2  /**< Room in the send buffer.         */};
+
+	static EventBackend*	create		(int type, Log& rLog);
+
+	virtual					~EventBackend	() {}
+
+	/** Returns a human-readable name of the backend. */
+	virtual const char*		name		() const = 0;
+
+	/** Starts watching a descriptor. */
+	virtual MSrvResult		add			(int fd) = 0;
+
+	/** Stops watching a descriptor. */
+	virtual MSrvResult		remove		(int fd) = 0;
+
+	/** Starts or stops watching a descriptor for becoming writable. */
+	virtual MSrvResult		watchWrite	(int fd, bool on) = 0;
+
+	/** Waits for descriptors to become ready. */
+	virtual int				wait		(ReadyEvent* pReady, int maxEvents, long seconds, long microseconds) = 0;
+};
+
+/*******************************************************************************
+ * Event backend using the portable select() call.
+ *
+ * Keeps a master descriptor set that is updated incrementally, so the
+ * set does not need to be rebuilt for every wait. The number of
+ * descriptors is limited to FD_SETSIZE.
+ ******************************************************************************/
+class SelectBackend : public EventBackend {
+  public:
+							SelectBackend	();
+
+	virtual const char*		name		() const {return "select";}
+	virtual MSrvResult		add			(int fd);
+	virtual MSrvResult		remove		(int fd);
+	virtual MSrvResult		watchWrite	(int fd, bool on);
+	virtual int				wait		(ReadyEvent* pReady, int maxEvents, long seconds, long microseconds);
+
+  private:
+	fd_set					mReadSet;    /**< Master set of watched descriptors. */
+	fd_set					mWriteSet;   /**< Descriptors watched for writing.   */
+	int						mMaxFd;      /**< Highest descriptor in the set.     */
+	ThreadLock				mThreadLock; /**< Protects the master set.           */
+};
+
+#ifdef __linux__
+/*******************************************************************************
+ * Event backend using the Linux epoll interface.
+ *
+ * The kernel keeps the interest list, so a wait costs only in
+ * proportion to the number of ready descriptors, not the number of
+ * watched descriptors. There is no FD_SETSIZE limit.
+ ******************************************************************************/
+class EpollBackend : public EventBackend {
+  public:
+							EpollBackend	();
+	virtual					~EpollBackend	();
+
+	MSrvResult				open		();
+
+	virtual const char*		name		() const {return "epoll";}
+	virtual MSrvResult		add			(int fd);
+	virtual MSrvResult		remove		(int fd);
+	virtual MSrvResult		watchWrite	(int fd, bool on);
+	virtual int				wait		(ReadyEvent* pReady, int maxEvents, long seconds, long microseconds);
+
+  protected:
+	int						epollFd		() const {return mEpollFd;}
+
+  private:
+	int						mEpollFd;    /**< The epoll instance. */
+};
+#endif
+
+#ifdef MSRV_HAVE_IO_URING
+/*******************************************************************************
+ * Completion of an operation submitted to a @ref UringBackend.
+ ******************************************************************************/
+struct UringCompletion {
+	int					mFd;       /**< Descriptor of the operation.              */
+	int					mOp;       /**< One of UringBackend::op_type.             */
+	int					mResult;   /**< Byte count, new socket, or -errno.        */
+	char*				mpBuffer;  /**< Received data; the receiver owns it.      */
+	struct sockaddr_in	mAddr;     /**< Peer address of an accepted connection.   */
+};
+
+/*******************************************************************************
+ * Completion-based backend using the Linux io_uring interface.
+ *
+ * In completion mode, accepts and reads are submitted to the kernel
+ * as operations with @ref armAccept() and @ref armRecv(), and all
+ * operations queued during one loop iteration are submitted with a
+ * single system call in @ref complete(). A completed read delivers
+ * the data already in a buffer, so no separate accept() or read()
+ * calls are needed. @ref ServerListener uses this mode when it is
+ * created with the @ref EventBackend::Uring backend type.
+ *
+ * Outside completion mode, the backend behaves exactly as the
+ * @ref EpollBackend it inherits, so it is usable by any @ref Listener.
+ *
+ * Removing a descriptor cancels its pending operation right away. It
+ * may be done in any thread, as the rings are locked except while
+ * @ref complete() waits in the kernel.
+ *
+ * In completion mode, the descriptors watched for writing are kept in
+ * the epoll interest list of the inherited @ref EpollBackend, and
+ * the epoll descriptor itself is polled through the ring. A watch
+ * set from any thread thus wakes the loop right away, and the
+ * writable descriptors are reported as @ref OpWritable completions.
+ ******************************************************************************/
+class UringBackend : public EpollBackend {
+  public:
+	/** Operation type of a completion. */
+	enum op_type {OpAccept  = 1, /**< Accept on a server socket.   */
+				  OpRecv    = 2, /**< Receive on a socket.         */
+				  OpTimeout = 3, /**< Wait timeout (internal).     */
+				  OpWritable = 4, /**< Socket has become writable. */
+				  OpPollWrite = 5, /**< Poll of writable sockets (internal). */
+				  OpReadable = 6 /**< Socket has become readable. */};
+
+							UringBackend	();
+	virtual					~UringBackend	();
+
+	MSrvResult				open			(int entries=MSRV_URING_ENTRIES);
+
+	void					setCompletionMode	(bool on) {mCompletionMode = on;}
+	bool					completionMode		() const {return mCompletionMode;}
+
+	virtual const char*		name			() const {return mCompletionMode? "io_uring" : "epoll";}
+	virtual MSrvResult		add				(int fd);
+	virtual MSrvResult		remove			(int fd);
+	virtual MSrvResult		watchWrite		(int fd, bool on);
+
+	MSrvResult				armAccept		(int fd);
+	MSrvResult				armRecv			(int fd, int len);
+	MSrvResult				armReadable		(int fd);
+	int						complete		(UringCompletion* pCompletions, int maxCompletions,
+											 long seconds, long microseconds);
+	void					drain			();
+
+  private:
+	/** An operation in flight. The address is used as the user data. */
+	struct Operation {
+		int					mFd;         /**< Descriptor of the operation.        */
+		int					mOp;         /**< Operation type.                     */
+		bool				mCancelled;  /**< Was the descriptor removed?         */
+		char*				mpBuffer;    /**< Receive buffer.                     */
+		struct sockaddr_in	mAddr;       /**< Accepted peer address.              */
+		unsigned int		mAddrLen;    /**< Length of the accepted address.     */
+		Operation*			mpNextFree;  /**< Next operation in the free list.    */
+	};
+
+	Operation*				allocOp			(int fd, int op);
+	void					freeOp			(Operation* pOp);
+	struct io_uring_sqe*	getSqe			();
+	unsigned int			publish			();
+	int						submit			(int waitCount);
+	MSrvResult				setRead			(int fd, Operation* pOp);
+	void					armPollWrite	();
+	int						collectWritable	(UringCompletion* pCompletions, int maxCompletions);
+	void					cancel			(Operation* pOp);
+
+	bool					mCompletionMode; /**< Are operations used instead of readiness? */
+	int						mRingFd;         /**< The io_uring instance.                    */
+
+	/* Submission queue, shared with the kernel. */
+	void*					mpSqRing;
+	unsigned int			mSqRingSize;
+	unsigned int*			mpSqHead;
+	unsigned int*			mpSqTail;
+	unsigned int*			mpSqMask;
+	unsigned int*			mpSqArray;
+	unsigned int			mSqEntries;
+	struct io_uring_sqe*	mpSqes;
+	unsigned int			mSqesSize;
+	unsigned int			mSqTail;         /**< Local tail, published at submit.          */
+	ThreadLock				mRingLock;       /**< For locking the rings and the operations. */
+
+	/* Completion queue, shared with the kernel. */
+	void*					mpCqRing;
+	unsigned int			mCqRingSize;
+	unsigned int*			mpCqHead;
+	unsigned int*			mpCqTail;
+	unsigned int*			mpCqMask;
+	struct io_uring_cqe*	mpCqes;
+
+	Operation**				mpReads;         /**< Pending accept or read, by descriptor.    */
+	int						mReadCount;      /**< Number of slots in mpReads.               */
+	Operation*				mpFreeOps;       /**< Recycled operation records.               */
+	int						mInFlight;       /**< Operations submitted and not completed.   */
+	Operation*				mpTimeoutOp;     /**< Pending timeout, if any.                  */
+	Operation*				mpPollWriteOp;   /**< Pending poll of writable sockets, if any. */
+	bool					mActivity;       /**< Completions since the timeout was armed?  */
+	long long				mTimeoutSpec[2]; /**< Kernel timespec of the pending timeout.   */
+};
+#endif
+
+end_namespace (MSrv);
+
+#endif
@@ -0,0 +1,167 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVFRAME_H__
+#define __MAGICSERVER_MSRVFRAME_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrverror.h>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Position of a frame found by @ref Framer::frames().
+ ******************************************************************************/
+struct FrameSpan {
+	int					mStart;     /**< Start of the payload in the data. */
+	int					mLength;    /**< Length of the payload.            */
+	int					mEnd;       /**< End of the frame in the data.     */
+};
+
+/*******************************************************************************
+ * Splits a byte stream into messages (frames).
+ *
+ * A TCP socket delivers whatever bytes one read returns, so a message
+ * may arrive in pieces or several messages at once. When a framer is
+ * set for a @ref Connection, the @ref ServerListener collects the
+ * received data into the @ref FrameBuffer of the connection and sends
+ * one @ref StreamDataRequest for each complete frame, holding only
+ * the payload of the frame.
+ *
+ * A framer has no state of its own, so one framer object can be
+ * shared by any number of connections and threads.
+ *
+ * The inheritor must reimplement the virtual @ref frame() method, and
+ * may reimplement @ref frames() to find many frames more efficiently
+ * than one at a time.
+ ******************************************************************************/
+class Framer {
+  public:
+	virtual				~Framer		() {}
+	virtual int			frame		(const char* pData, int len, int scanned,
+									 int& rStart, int& rLength) const = 0;
+	virtual int			frames		(const char* pData, int len, int scanned,
+									 FrameSpan* pFrames, int maxFrames) const;
+};
+
+/*******************************************************************************
+ * Frames delimited by a newline.
+ *
+ * The payload is the line without the newline and a carriage return
+ * preceding it.
+ *
+ * The newlines are searched with SSE2 or AVX2 instructions when the
+ * processor has them, which is checked once at startup. Otherwise
+ * memchr() is used.
+ ******************************************************************************/
+class LineFramer : public Framer {
+  public:
+						LineFramer	(int maxLen=MSRV_MAX_FRAME_LEN) : mMaxLen (maxLen) {}
+
+	virtual int			frame		(const char* pData, int len, int scanned,
+									 int& rStart, int& rLength) const;
+	virtual int			frames		(const char* pData, int len, int scanned,
+									 FrameSpan* pFrames, int maxFrames) const;
+	static const char*	scanner		();
+	static bool			setScanner	(const char* name);
+
+  private:
+	int					mMaxLen;    /**< Longest line accepted. */
+};
+
+/*******************************************************************************
+ * Frames that begin with the length of the payload.
+ *
+ * The length is an unsigned integer of 1, 2 or 4 bytes, in big-endian
+ * (network) or little-endian byte order. It does not include the
+ * prefix itself.
+ ******************************************************************************/
+class LengthFramer : public Framer {
+  public:
+	enum byte_order		{BigEndian=0, LittleEndian=1};
+
+						LengthFramer	(int prefixLen, int byteOrder=BigEndian,
+										 int maxLen=MSRV_MAX_FRAME_LEN);
+
+	virtual int			frame		(const char* pData, int len, int scanned,
+									 int& rStart, int& rLength) const;
+
+  private:
+	int					mPrefixLen; /**< Bytes in the length prefix. */
+	int					mByteOrder; /**< One of @ref byte_order.     */
+	int					mMaxLen;    /**< Longest payload accepted.   */
+};
+
+/*******************************************************************************
+ * Frames of a fixed size.
+ ******************************************************************************/
+class FixedFramer : public Framer {
+  public:
+						FixedFramer	(int size);
+
+	virtual int			frame		(const char* pData, int len, int scanned,
+									 int& rStart, int& rLength) const;
+
+  private:
+	int					mSize;      /**< Size of a frame. */
+};
+
+/*******************************************************************************
+ * Reassembly buffer for the partial frames of a connection.
+ *
+ * The buffer holds the received data that does not yet make up a
+ * complete frame. It is reused for the life of the connection and
+ * only grows when a frame does not fit, so reassembly does not
+ * allocate once the buffer is large enough. Consumed data is dropped
+ * from the front lazily, by moving the rest when new data would not
+ * otherwise fit.
+ *
+ * The buffer is not thread-safe; it is only used by the listener
+ * thread of the connection.
+ ******************************************************************************/
+class FrameBuffer {
+  public:
+						FrameBuffer		();
+						~FrameBuffer	();
+
+	MSrvResult			append			(const char* pData, int len);
+	void				consume			(int count);
+	void				clear			() {mStart = 0; mLen = 0; mScanned = 0;}
+
+	const char*			data			() const {return mpData + mStart;}
+	int					length			() const {return mLen;}
+	int					scanned			() const {return mScanned;}
+	void				setScanned		(int scanned) {mScanned = scanned;}
+
+  private:
+	char*				mpData;     /**< Buffer.                                 */
+	int					mSize;      /**< Size of mpData.                         */
+	int					mStart;     /**< Start of the unconsumed data.           */
+	int					mLen;       /**< Length of the unconsumed data.          */
+	int					mScanned;   /**< Data examined without finding a frame.  */
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -0,0 +1,118 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVGROUP_H__
+#define __MAGICSERVER_MSRVGROUP_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvthread.h>
+#include <magicserver/msrvserver.h>
+
+begin_namespace (MSrv);
+
+class Reactor;
+
+/*******************************************************************************
+ * Factory to create a @ref RequestHandler for each reactor of a @ref
+ * ServerGroup.
+ *
+ * The inheritor must reimplement the virtual @ref create() method.
+ ******************************************************************************/
+class HandlerFactory {
+  public:
+	virtual ~HandlerFactory	() {}
+	virtual RequestHandler*	create	(int reactor) = 0;
+};
+
+/*******************************************************************************
+ * Group of @ref ServerListener reactors sharing one port.
+ *
+ * Each reactor is a ServerListener running its own listener loop in
+ * its own thread. All of them bind the same port with SO_REUSEPORT,
+ * so the kernel balances new connections (or datagrams) between
+ * them. A connection stays with the reactor that accepted it, and
+ * the reactors share no locks on the data path.
+ *
+ * The reactors can either share one @ref RequestHandler, which must
+ * then be thread-safe (a @ref WorkerPool is), or each get its own
+ * handler from a @ref HandlerFactory.
+ *
+ * A @ref ServerListener::ConnIter of a reactor iterates only the
+ * connections of that reactor.
+ *
+ * When any reactor shuts down, the whole group is shut down.
+ ******************************************************************************/
+class ServerGroup {
+  public:
+						ServerGroup		(RequestHandler& rHandler, Log* rpLog=NULL,
+										 int reactors=0, int backend=EventBackend::Default);
+						ServerGroup		(HandlerFactory& rFactory, Log* rpLog=NULL,
+										 int reactors=0, int backend=EventBackend::Default);
+	virtual				~ServerGroup	();
+
+	MSrvResult			bind					(int portno, ServerListener::protocol_type protocol, uint flags);
+	MSrvResult			listen					();
+	void				startShutdown			();
+
+	int					reactorCount			() const {return mReactorCount;}
+	ServerListener&		reactor					(int i);
+	void				setRequestMask			(uint mask);
+	void				setConnectionFactory	(ConnectionFactory& factory);
+
+  private:
+	void				create			(RequestHandler* rpHandler, HandlerFactory* rpFactory,
+										 Log* rpLog, int reactors, int backend);
+
+	Reactor**			mpReactors;     /**< The reactors of the group.        */
+	int					mReactorCount;  /**< Number of reactors.               */
+	Log*				mrpLog;         /**< Log to write messages. May be NULL. */
+};
+
+/*******************************************************************************
+ * Reactor thread of a @ref ServerGroup.
+ *
+ * Runs the listener loop of one @ref ServerListener.
+ ******************************************************************************/
+class Reactor : public Thread {
+  public:
+						Reactor		(ServerGroup* pGroup, RequestHandler* pHandler,
+									 bool ownsHandler, Log* rpLog, int backend);
+	virtual				~Reactor	();
+
+	virtual void*		execute		();
+
+	ServerListener&		listener	() {return *mpListener;}
+	MSrvResult			result		() const {return mResult;}
+
+  private:
+	ServerGroup*		mpGroup;       /**< Owner group.                         */
+	RequestHandler*		mpHandler;     /**< Handler of the requests.             */
+	bool				mOwnsHandler;  /**< Should the handler be deleted?       */
+	ServerListener*		mpListener;    /**< Listener run by the reactor.         */
+	MSrvResult			mResult;       /**< Result of the listener loop.         */
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -29,6 +29,8 @@
 #include <magicserver/msrvlog.h>
 #include <magicserver/msrvthread.h>
 #include <magicserver/msrvcontainer.h>
+#include <magicserver/msrvevent.h>
+#include <magicserver/msrvtimer.h>
 
 begin_namespace (MSrv);
 
@@ -37,6 +39,7 @@ begin_namespace (MSrv);
  ******************************************************************************/
 struct Descriptor {
   public:
+	Descriptor () : mFd (-1), mpData (NULL) {;}
 	Descriptor (int fd, void* pData) : mFd (fd), mpData (pData) {;}
 	
 	int   mFd;     /**< Descriptor.                          */
@@ -64,7 +67,20 @@ struct Descriptor {
  * sockets are managed with \ref ServerListener class.
  *
  * The Listener can also generate timeout events, which can be set
- * with @ref setTimeout().
+ * with @ref setTimeout(). They occur only while there are no other
+ * events. Timers that expire regardless of the load can be set with
+ * @ref addTimer(); they are kept in a @ref TimerWheel, which is
+ * checked on every turn of the listener loop.
+ *
+ * The descriptors are watched with an @ref EventBackend, which is
+ * chosen when the Listener is created. By default, epoll is used
+ * where available, so that a wait costs only in proportion to the
+ * number of ready descriptors. The portable select() backend is used
+ * otherwise.
+ *
+ * The descriptors are kept in a @ref KeyedArray indexed by the
+ * descriptor number, so that finding the data of a ready descriptor,
+ * adding and removing are constant-time operations.
  *
  * Listener can be associated with a @ref Log, to which it writes
  * various messages. The log must be associated immediately after
@@ -72,32 +88,55 @@ struct Descriptor {
  ******************************************************************************/
 class Listener {
   public:
-						Listener			(Log* rpLog=NULL);
+						Listener			(Log* rpLog=NULL, int backend=EventBackend::Default);
 	virtual				~Listener			();
 
 	virtual MSrvResult	listen				();
 
 	void				startShutdown		();
-	bool				isShutdown			() const {return mShutdownStatus;}
+	bool				isShutdown			() const {return __atomic_load_n (&mShutdownStatus, __ATOMIC_ACQUIRE);}
 	void				setTimeout			(long seconds, long microseconds);
 	void				timeoutLeft			(long& seconds, long& microseconds) const;
+	long				addTimer			(long msec, long periodMSec=0) {return mTimers.add (msec, periodMSec);}
+	MSrvResult			cancelTimer			(long id) {return mTimers.cancel (id);}
+	TimerWheel&			timers				() {return mTimers;}
 	void				setLog				(Log& rLog) {mrpLog = &rLog;}
 	Log&				log					() {return *mrpLog;}
+	const char*			backendName			() const {return mpBackend->name();}
+	MSrvResult			addDescriptor		(int fd, void* pData);
 	MSrvResult			removeDescriptor	(int fd);
+	MSrvResult			watchWrite			(int fd, bool on);
+	bool				findDescriptor		(int fd, void*& rpData);
 	
   protected:
 	virtual MSrvResult	descriptorEvent		(int fd, void* data);
+	virtual MSrvResult	writableEvent		(int fd, void* data);
 	virtual MSrvResult	timeoutEvent		();
+	virtual MSrvResult	timerEvent			(long id, void* pData);
+	virtual void		descriptorRemoved	(int fd, void* data);
 	virtual MSrvResult	shutdown			();
+	void				closeDescriptors	();
+	EventBackend&		backend				() {return *mpBackend;}
+	long				timeoutSec			() const {return mTimeoutSec;}
+	long				timeoutUSec			() const {return mTimeoutUSec;}
+	void				waitTimeout			(long& seconds, long& microseconds);
+	bool				idleExpired			();
+	void				idleRestart			() {mLastEvent = TimerWheel::now ();}
+	unsigned long		lastEvent			() const {return mLastEvent;}
+	void				expireTimers		();
 
 	ThreadLock			mThreadLock;		/**< Thread lock of the Listener object. */
-	Array<Descriptor>	mDescriptors;		/**< Array of descriptors listened.      */
+	KeyedArray<Descriptor> mDescriptors;	/**< Descriptors listened, by descriptor. */
 
   private:
 	long				mTimeoutSec;		/**< Timeout in seconds.                 */
 	long				mTimeoutUSec;		/**< Timeout in microseconds.            */
 	bool				mShutdownStatus;    /**< Is the server in shutdown state?    */
+	unsigned long		mLastEvent;         /**< Time of the last event, in msec.    */
+	TimerWheel			mTimers;            /**< Timers set with @ref addTimer().    */
+	long				mLimiterTimer;      /**< Timer of the log limiter reports.   */
 	Log*				mrpLog;             /**< Log to write messages.              */
+	EventBackend*		mpBackend;          /**< Watches the descriptors.            */
 };
 
 end_namespace (MSrv);
@@ -26,11 +26,61 @@
 #define __MAGICSERVER_MSRVLOG_H__
 
 #include <stdio.h>
+#include <time.h>
 #include <magicserver/msrvdef.h>
 #include <magicserver/msrvthread.h>
 
 begin_namespace (MSrv);
 
+/*******************************************************************************
+ * Writes a message to a log, if its fatality passes the log level.
+ *
+ * The fatality is checked against MSRV_LOG_LEVEL at compile time and
+ * against @ref Log::level() at run time before the arguments are
+ * evaluated, so that a filtered message costs no formatting and no
+ * calls such as strerror().
+ ******************************************************************************/
+#define MSRV_LOG(rLog, modulename, fatality, errnum, ...)						\
+	do {																		\
+		if ((fatality) <= MSRV_LOG_LEVEL && (rLog).isLogged (fatality))			\
+			(rLog).message (modulename, fatality, errnum, __VA_ARGS__);			\
+	} while (0)
+
+/*******************************************************************************
+ * Writes a message to a log at most count times in msec milliseconds.
+ *
+ * Like @ref MSRV_LOG, but each place where the macro is used has a
+ * @ref LogLimiter of its own. Messages beyond the limit are counted.
+ * The count is written before the next message that passes, or by
+ * @ref LogLimiter::reportAll() when the interval is over, whichever
+ * comes first.
+ ******************************************************************************/
+#define MSRV_LOG_LIMIT(count, msec, rLog, modulename, fatality, errnum, ...)	\
+	do {																		\
+		static MSrv::LogLimiter msrvLimiter (count, msec);						\
+		long msrvSuppressed;													\
+		if ((fatality) <= MSRV_LOG_LEVEL && (rLog).isLogged (fatality)) {		\
+			if (!msrvLimiter.allow (msrvSuppressed))							\
+				msrvLimiter.enlist (rLog, modulename, fatality, errnum,			\
+									__FILE__, __LINE__);						\
+			else {																\
+				if (msrvSuppressed > 0)											\
+					(rLog).message (modulename, fatality, errnum,				\
+								"Suppressed %ld messages like the next one.",	\
+								msrvSuppressed);								\
+				(rLog).message (modulename, fatality, errnum, __VA_ARGS__);		\
+			}																	\
+		}																		\
+	} while (0)
+
+/*******************************************************************************
+ * Writes a message to a log at most MSRV_LOG_LIMIT_COUNT times in
+ * MSRV_LOG_LIMIT_MSEC milliseconds; see @ref MSRV_LOG_LIMIT.
+ ******************************************************************************/
+#define MSRV_LOG_LIMITED(rLog, modulename, fatality, errnum, ...)				\
+	MSRV_LOG_LIMIT (MSRV_LOG_LIMIT_COUNT, MSRV_LOG_LIMIT_MSEC, rLog,			\
+					modulename, fatality, errnum, __VA_ARGS__)
+
 /*******************************************************************************
  * Abstract log
  ******************************************************************************/
@@ -46,16 +96,125 @@ class Log {
 				   Info      = 6, /**< Informational.                      */
 				   Debug     = 7  /**< Debug-level messages.               */};
 
+						Log			() : mLevel (Debug) {}
 	virtual 			~Log		() {}
 
+	void				setLevel	(int level) {__atomic_store_n (&mLevel, level, __ATOMIC_RELAXED);}
+	int					level		() const {return __atomic_load_n (&mLevel, __ATOMIC_RELAXED);}
+	bool				isLogged	(int fatality) const {return fatality <= level ();}
+
 	virtual MSrvResult	open		() = 0;
 	virtual void		close		() = 0;
-	virtual MSrvResult	message		(const char* modulename, int fatality, int errno, const char* message, ...) = 0;
+	virtual MSrvResult	message		(const char* modulename, int fatality, int errnum, const char* message, ...) = 0;
+
+	/** Returns the number of messages the log has dropped. */
+	virtual long		drops		() const {return 0;}
+
+	static const char*	fatalityName	(int fatality);
 	
   protected:
 	virtual MSrvResult	write		(const char* data, int len) = 0;
-	
+
+	int					mLevel;     /**< Least severe fatality written. */
+};
+
+/*******************************************************************************
+ * Rate limit of the messages written at one place.
+ *
+ * Passes at most a given number of messages in each interval and
+ * counts the rest. @ref allow() takes no locks, so that a storm of
+ * failures costs a few atomic operations per message instead of
+ * writing them all. Used by @ref MSRV_LOG_LIMIT.
+ *
+ * A limiter that has suppressed messages is enlisted, so that @ref
+ * reportAll() can write the count when the interval is over, even if
+ * no message passes after it. An enlisted limiter stays listed for
+ * good, so it must be static.
+ ******************************************************************************/
+class LogLimiter {
+  public:
+						LogLimiter	(int count=MSRV_LOG_LIMIT_COUNT, long msec=MSRV_LOG_LIMIT_MSEC);
+
+	bool				allow		(long& rSuppressed);
+	void				enlist		(Log& rLog, const char* modulename, int fatality,
+									 int errnum, const char* file, int line);
+
+	static void			reportAll	();
+
+  private:
+	void				report		(long msec);
+
+	int					mLimit;       /**< Messages passed in an interval.        */
+	long				mInterval;    /**< Length of an interval in milliseconds. */
+	long				mStart;       /**< Start of the current interval.         */
+	long				mCount;       /**< Messages in the current interval.      */
+	long				mSuppressed;  /**< Messages not passed and not reported.  */
+
+	Log*				mrpLog;       /**< Log of the reports; NULL until enlisted. */
+	const char*			mpModule;     /**< Module of the limited messages.        */
+	int					mFatality;    /**< Fatality of the limited messages.      */
+	int					mErrnum;      /**< Number of the limited messages.        */
+	const char*			mpFile;       /**< Source file of the limited messages.   */
+	int					mLine;        /**< Source line of the limited messages.   */
+	LogLimiter*			mpNext;       /**< Next enlisted limiter.                 */
+
+	static LogLimiter*	spEnlisted;   /**< First enlisted limiter.                */
+};
+
+/*******************************************************************************
+ * Time stamps of log lines.
+ *
+ * The date and time of a line change once a second, so they are
+ * formatted only when the second changes and copied to the lines of
+ * the same second. @ref now() reads a coarse clock, which costs less
+ * than the full-resolution one and is exact enough for seconds.
+ *
+ * With the Microseconds precision, the time is read from the
+ * monotonic clock and shifted to the wall clock time of @ref
+ * setPrecision(), so that the stamps keep their order even if the
+ * system clock is set. The microseconds are appended to the cached
+ * prefix.
+ *
+ * @ref format() is not thread-safe; the log calls it under its own
+ * lock or from its writer thread.
+ ******************************************************************************/
+class LogClock {
+  public:
+	/** Precision of the time stamps. */
+	enum precision {Seconds      = 0, /**< Wall clock time in seconds.      */
+					Microseconds = 1  /**< Monotonic time in microseconds.  */};
+
+						LogClock		(int precision=Seconds);
+
+	void				setPrecision	(int precision);
+	int					precision		() const {return mPrecision;}
+	void				now				(struct timespec& rTime) const;
+	int					format			(const struct timespec& rTime, char* pBuffer);
+
+	/** Longest prefix written by @ref format(). */
+	enum {PrefixLen = 32};
+
   private:
+	int					mPrecision;   /**< Seconds or Microseconds.                   */
+	struct timespec		mOffset;      /**< Wall clock time minus the monotonic time.  */
+	time_t				mSecond;      /**< Second of the cached prefix.               */
+	char				mPrefix[PrefixLen]; /**< Date and time of that second.        */
+	int					mPrefixLen;   /**< Length of mPrefix.                         */
+};
+
+class LogFile;
+
+/*******************************************************************************
+ * Thread that rotates and reopens the file of a @ref LogFile.
+ ******************************************************************************/
+class LogRotator : public Thread {
+  public:
+					LogRotator		(LogFile* pLog) : mpLog (pLog) {;}
+
+	virtual void*	execute			();
+
+  private:
+	LogFile*		mpLog;      /**< Log whose file is rotated.  */
 };
 
 /*******************************************************************************
@@ -63,11 +222,22 @@ class Log {
  *
  * The log format is as follows:
  *
- * \code <modulename> <fatality> <errno>: <message> \endcode
+ * \code <date> <time> <modulename> <fatality> <errno>: <message> \endcode
  *
  * For example:
  *
- * \code MYMODULE WARNING 1234: This is a simple warning. \endcode
+ * \code 2003/05/21 12:01:07 MYMODULE WARNING 1234: This is a simple warning. \endcode
+ *
+ * The time has microseconds if @ref setPrecision() is given
+ * LogClock::Microseconds.
+ *
+ * A log opened by file name can be rotated when it grows to a given
+ * length or at given intervals; see @ref setRotation(). It can also
+ * be reopened after an external tool has renamed it; see @ref
+ * reopenOnHangup(). Renaming and opening the files is done without
+ * the log lock by a rotator thread, and the logging threads only
+ * wait while the new stream is swapped in. Start the rotation after
+ * daemon() or fork(), as the thread does not survive them.
  ******************************************************************************/
 class LogFile : public Log {
   public:
@@ -80,15 +250,45 @@ class LogFile : public Log {
 	virtual MSrvResult	open		();
 	virtual void		close		();
 
-	virtual MSrvResult	message		(const char* modulename, int fatality, int errno, const char* message, ...);
+	virtual MSrvResult	message		(const char* modulename, int fatality, int errnum, const char* message, ...);
+	virtual MSrvResult	flush		();
+	void				setPrecision	(int precision);
+
+	MSrvResult			setRotation		(long maxLen, long interval=0, int keep=MSRV_LOG_ROTATE_KEEP);
+	MSrvResult			rotate			();
+	MSrvResult			reopen			();
+	void				requestReopen	();
+	MSrvResult			reopenOnHangup	();
 	
   protected:
 	virtual MSrvResult	write		(const char* data, int len);
 
+	LogClock			mClock;       /**< Formats the time stamps of the lines. */
+
   private:
-	const char* mpFilename;
+	friend class LogRotator;
+
+	/** Work requested from the rotator. */
+	enum rotation {RotateFile = 1, ReopenFile = 2};
+
+	MSrvResult			startRotator	();
+	void				requestRotation	(int rotation);
+	void*				runRotator		();
+	MSrvResult			swapStream		(bool rotateFiles);
+
+	char*		mpFilename;
 	FILE*		mpLogStream;
 	ThreadLock  mThreadLock;
+	long		mFileLen;         /**< Bytes in the current file.                */
+	long		mMaxLen;          /**< Rotate at this length, or 0.              */
+	long		mInterval;        /**< Rotate every this many seconds, or 0.     */
+	int			mKeep;            /**< Rotated files kept.                       */
+	time_t		mNextRotation;    /**< Time of the next rotation by interval.    */
+	int			mRotation;        /**< Requested rotation flags.                 */
+	bool		mRotatorStopping; /**< Should the rotator exit?                  */
+	LogRotator*	mpRotator;        /**< Thread that renames and opens the files.  */
+	Semaphore	mRotatorWakeup;   /**< Posted to wake the rotator up.            */
+	ThreadLock	mRotateLock;      /**< Serializes the rotations.                 */
 };
 
 /*******************************************************************************
@@ -96,10 +296,11 @@ class LogFile : public Log {
  ******************************************************************************/
 class DummyLog : public Log {
   public:
+						DummyLog	() {mLevel = -1;}
 	virtual 			~DummyLog	() {}
 	virtual MSrvResult	open		() {return 0;}
 	virtual void		close		() {;}
-	virtual MSrvResult	message		(const char* modulename, int fatality, int errno, const char* message, ...) {return 0;}
+	virtual MSrvResult	message		(const char* modulename, int fatality, int errnum, const char* message, ...) {return 0;}
 
   protected:
 	virtual MSrvResult	write		(const char* data, int len) {return 0;}
@@ -0,0 +1,235 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVMETRICS_H__
+#define __MAGICSERVER_MSRVMETRICS_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvthread.h>
+
+begin_namespace (MSrv);
+
+class MetricsRegistry;
+
+/*******************************************************************************
+ * A named measurement of the server.
+ *
+ * The values of a metric are split into MSRV_METRIC_SHARDS shards,
+ * each on cache lines of its own. A thread is given a shard on its
+ * first recording, and as it is the only writer of the shard, it
+ * records with a plain load and store, without a lock or a locked
+ * instruction. When more threads record than there are shards, the
+ * rest share the last shard and add to it atomically. The shard of
+ * an exited thread is given to the next new thread. Reading sums the
+ * shards.
+ *
+ * A metric is listed by @ref MetricsRegistry::format() once added to
+ * a registry. The name is not copied.
+ ******************************************************************************/
+class Metric {
+  public:
+						Metric			(const char* name=NULL);
+	virtual				~Metric			();
+
+	const char*			name			() const {return mpName;}
+	void				setName			(const char* name) {mpName = name;}
+
+	/** Writes the metric as text lines, like snprintf(). */
+	virtual int			format			(char* pBuffer, int len) const = 0;
+
+	/** Returns the shard of the calling thread. */
+	static int			shard			() {return sShard? sShard - 1 : assignShard ();}
+
+	/** Adds n to the value of a shard of the calling thread. */
+	static void			addTo			(long& rValue, int shard, long n) {
+							if (shard < MSRV_METRIC_SHARDS - 1)
+								__atomic_store_n (&rValue, __atomic_load_n (&rValue, __ATOMIC_RELAXED) + n,
+												  __ATOMIC_RELAXED);
+							else
+								__atomic_add_fetch (&rValue, n, __ATOMIC_RELAXED);
+						}
+
+	static long			now				();
+
+  private:
+	static int			assignShard		();
+	static void			releaseShard	(void* pShard);
+	static void			createShardKey	();
+
+	friend class MetricsRegistry;
+
+	const char*			mpName;       /**< Name of the metric.                 */
+	Metric*				mpNext;       /**< Next metric of the registry.        */
+	MetricsRegistry*	mrpRegistry;  /**< Registry listing the metric, or NULL. */
+
+	static __thread int	sShard;       /**< Shard of the thread plus one, or 0. */
+};
+
+/*******************************************************************************
+ * A count of events.
+ ******************************************************************************/
+class Counter : public Metric {
+  public:
+						Counter			(const char* name=NULL);
+
+	/** Adds n to the count. */
+	void				add				(long n=1) {int i = shard (); addTo (mShards[i].mValue, i, n);}
+	long				value			() const;
+	virtual int			format			(char* pBuffer, int len) const;
+
+  private:
+	/** Value of one shard, alone on its cache line. */
+	struct Shard {
+		long			mValue;
+		char			mPad[MSRV_CACHE_LINE_LEN - sizeof (long)];
+	};
+
+	Shard				mShards[MSRV_METRIC_SHARDS];
+};
+
+/*******************************************************************************
+ * A level that goes up and down, such as the length of a queue.
+ *
+ * The shards hold the changes made by their threads, so a shard may
+ * be negative; only the sum is meaningful.
+ ******************************************************************************/
+class Gauge : public Counter {
+  public:
+						Gauge			(const char* name=NULL) : Counter (name) {}
+
+	/** Subtracts n from the level. */
+	void				sub				(long n=1) {add (-n);}
+};
+
+/*******************************************************************************
+ * Distribution of values, such as latencies in nanoseconds.
+ *
+ * The buckets are log-linear, as in an HDR histogram: each power of
+ * two is split into 2^MSRV_HISTOGRAM_SUB_BITS buckets of equal width,
+ * so a value is known within 1/2^MSRV_HISTOGRAM_SUB_BITS of itself
+ * over the range of long. Recording adds to one bucket and to
+ * the sum of the shard. The count, percentiles and maximum are
+ * derived from the buckets when read.
+ ******************************************************************************/
+class Histogram : public Metric {
+  public:
+						Histogram		(const char* name=NULL);
+	virtual				~Histogram		();
+
+	void				record			(long value);
+	long				count			() const;
+	long				sum				() const;
+	long				max				() const;
+	void				percentiles		(const double* pPercents, long* pValues, int count) const;
+	virtual int			format			(char* pBuffer, int len) const;
+
+	static int			bucket			(long value);
+	static long			bucketValue		(int bucket);
+
+	/** Number of buckets in a shard. */
+	enum {Buckets = (64 - MSRV_HISTOGRAM_SUB_BITS) << MSRV_HISTOGRAM_SUB_BITS};
+
+  private:
+	/** Longs before the buckets of a shard; the first is the sum. */
+	enum {SumLen = MSRV_CACHE_LINE_LEN / sizeof (long)};
+
+	long				bucketCount		(int bucket) const;
+
+	long*				mpBuckets;    /**< Sum and buckets of each shard.      */
+	int					mShardLen;    /**< Longs of a shard.                   */
+};
+
+/*******************************************************************************
+ * A list of metrics that can be written out as text.
+ *
+ * The registry only lists the metrics; they are owned by the caller
+ * and remove themselves when destroyed. The lock of the registry is
+ * taken when the list changes or is written, never when a value is
+ * recorded.
+ ******************************************************************************/
+class MetricsRegistry {
+  public:
+						MetricsRegistry	();
+						~MetricsRegistry	();
+
+	void				add				(Metric& rMetric);
+	void				remove			(Metric& rMetric);
+	int					format			(char* pBuffer, int len);
+
+	static MetricsRegistry& global		();
+
+  private:
+	Metric*				mpFirst;      /**< First listed metric.               */
+	ThreadLock			mLock;        /**< Guards the list.                   */
+};
+
+/*******************************************************************************
+ * Metrics recorded by the library itself.
+ *
+ * There is one set for the process, listed in the global registry:
+ *
+ *   - server.accepts           Connections accepted.
+ *   - server.connections_lost  Connections closed by the client.
+ *   - server.bytes_read        Bytes received from connections and datagrams.
+ *   - requests.<type>          Requests created, per @ref Request::requesttype.
+ *   - workers.queue_depth      Requests queued for the workers of @ref WorkerPool.
+ *   - workers.wait_ns          Time from queueing a request to handling it.
+ *   - workers.handler_ns       Time taken by the handler of the workers.
+ ******************************************************************************/
+class ServerMetrics {
+  public:
+	/** Number of request types, one bit each in @ref Request::requesttype. */
+	enum {RequestTypes = 7};
+
+	void				accepted		() {mAccepts.add ();}
+	void				connectionLost	() {mConnectionsLost.add ();}
+	void				bytesRead		(long n) {mBytesRead.add (n);}
+	void				request			(int type);
+	void				queued			() {mQueueDepth.add ();}
+	void				dequeued		() {mQueueDepth.sub ();}
+	void				waited			(long nsec) {mWaitTime.record (nsec);}
+	void				handled			(long nsec) {mHandlerTime.record (nsec);}
+
+	long				requests		(int type) const;
+	long				queueDepth		() const {return mQueueDepth.value ();}
+	const Histogram&	waitTime		() const {return mWaitTime;}
+	const Histogram&	handlerTime		() const {return mHandlerTime;}
+
+	static ServerMetrics& global		();
+
+  private:
+						ServerMetrics	();
+
+	Counter				mAccepts;          /**< server.accepts.               */
+	Counter				mConnectionsLost;  /**< server.connections_lost.      */
+	Counter				mBytesRead;        /**< server.bytes_read.            */
+	Counter				mRequests[RequestTypes]; /**< requests.<type>.        */
+	Gauge				mQueueDepth;       /**< workers.queue_depth.          */
+	Histogram			mWaitTime;         /**< workers.wait_ns.              */
+	Histogram			mHandlerTime;      /**< workers.handler_ns.           */
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -28,8 +28,95 @@
 #include <magicserver/msrvdef.h>
 #include <magicserver/msrvserver.h>
 
+#include <stddef.h>
+#include <netinet/in.h>
+
 begin_namespace (MSrv);
 
+/*******************************************************************************
+ * Pool of recycled memory blocks.
+ *
+ * The blocks come in power-of-two size classes. Each block remembers
+ * its pool, so it may be released with @ref release() in any thread;
+ * it returns to a lock-free list of its size class. The owner thread
+ * takes the returned blocks in one exchange when its own free list
+ * of the class runs out, so after warm-up no block is allocated from
+ * the heap.
+ *
+ * Blocks may be allocated only by the owner thread. The pool lives
+ * until the owner has released it with @ref unref() and every block
+ * has returned.
+ ******************************************************************************/
+class BlockPool {
+  public:
+						BlockPool		(size_t minLen, size_t maxLen);
+
+	void*				allocate		(size_t size);
+	static void*		allocateHeap	(size_t size);
+	static void			release			(void* pBlock);
+	void				unref			();
+
+	/** Returns the number of blocks served by the pool. */
+	long				served			() const {return __atomic_load_n (&mServed, __ATOMIC_RELAXED);}
+
+	/** Returns the number of blocks allocated from the heap. */
+	long				allocations		() const {return __atomic_load_n (&mAllocations, __ATOMIC_RELAXED);}
+
+  protected:
+	virtual				~BlockPool		();
+
+  private:
+	/** Header of a block, in front of the object. */
+	struct Block {
+		BlockPool*		mpPool;      /**< Owner pool, or NULL if from heap. */
+		Block*			mpNext;      /**< Next free block.                  */
+		long			mClass;      /**< Size class of the block.          */
+	};
+
+	/** Free lists of one size class. */
+	struct SizeClass {
+		Block*			mpFree;      /**< Free blocks of the owner thread.  */
+		Block*			mpReturned;  /**< Blocks released by any thread.    */
+		size_t			mLen;        /**< Size of the blocks.               */
+	};
+
+	SizeClass*			mpClasses;    /**< Size classes, smallest first.      */
+	int					mClassCount;  /**< Number of size classes.            */
+	long				mRefCount;    /**< Blocks in use plus the owner.      */
+	long				mServed;      /**< Number of allocations served.      */
+	long				mAllocations; /**< Number of blocks from the heap.    */
+};
+
+/*******************************************************************************
+ * Pool of memory blocks for @ref Request objects.
+ *
+ * A @ref ServerListener creates its requests in its own pool, so that
+ * after the first few requests, no request allocates memory. The
+ * blocks fit any of the request classes of the library; a request
+ * may be destroyed with plain delete in any thread.
+ ******************************************************************************/
+class RequestPool : public BlockPool {
+  public:
+						RequestPool		();
+
+	/** Returns the number of requests created in the pool. */
+	long				requests		() const {return served ();}
+
+  private:
+	static size_t		requestLen		();
+};
+
+/*******************************************************************************
+ * Pool of data buffers for @ref DataRequest objects.
+ *
+ * A @ref ServerListener reads received data straight into a buffer of
+ * the right size class, and the @ref DataRequest adopts the buffer.
+ ******************************************************************************/
+class BufferPool : public BlockPool {
+  public:
+						BufferPool		() : BlockPool (MSRV_MIN_BUFFER_LEN, MSRV_MAX_READ_LEN) {}
+};
+
 /*******************************************************************************
  * Request from client.
  ******************************************************************************/
@@ -41,13 +128,21 @@ class Request {
 					  Datagram       = 0x0004,
 					  ConnectionLost = 0x0008,
 					  Shutdown       = 0x0010,
-					  Timeout        = 0x0020};
+					  Timeout        = 0x0020,
+					  Writable       = 0x0040};
 
 	virtual			~Request		() {}
 
 	int				socket			() const {return mSocket;}
 	ServerListener&	serverListener	() {return *mpServerListener;}
 	int				getType			() const {return mRequestType;}
+	void			setQueueTime	(long nsec) {mQueueTime = nsec;}
+	long			queueTime		() const {return mQueueTime;}
+
+	static void*	operator new	(size_t size);
+	static void*	operator new	(size_t size, BlockPool& rPool);
+	static void		operator delete	(void* pObject);
+	static void		operator delete	(void* pObject, BlockPool& rPool);
 
   protected:
 					Request			(int socket, int requesttype, ServerListener& rListener);
@@ -57,6 +152,7 @@ class Request {
 	int				mRequestType;
 	int				mSocket;			/**< Socket to read request data from. */
 	ServerListener* mpServerListener;
+	long			mQueueTime;			/**< When queued for workers, or 0.    */
 };
 
 /*******************************************************************************
@@ -89,9 +185,9 @@ class NewConnectionRequest : public ConnectionRequest {
  ******************************************************************************/
 class DataRequest : virtual public Request {
   public:
-	virtual			~DataRequest	() {delete mpData;}
+	virtual			~DataRequest	();
 
-	void			setData			(char* data, int len);
+	void			setData			(char* data, int len, bool pooled=false);
 	virtual char*	getData			() const {return mpData;}
 	virtual long	dataLen			() const {return mDataLen;}
 
@@ -102,6 +198,7 @@ class DataRequest : virtual public Request {
   private:
 	char*			mpData;
 	int				mDataLen;
+	bool			mPooled;   /**< Is the data from a @ref BufferPool? */
 };
 
 /*******************************************************************************
@@ -114,10 +211,19 @@ class StreamDataRequest : public DataRequest, public ConnectionRequest {
 
 /*******************************************************************************
  * An UDP datagram has arrived on socket.
+ *
+ * The request carries the address of the sender, so that the handler
+ * can reply with @ref ServerListener::reply().
  ******************************************************************************/
 class DatagramRequest : public DataRequest {
   public:
-	DatagramRequest		(int socket, ServerListener& rListener);
+						DatagramRequest		(int socket, ServerListener& rListener);
+
+	const sockaddr_in&	address				() const {return mAddress;}
+	void				setAddress			(const sockaddr_in& rAddr) {mAddress = rAddr;}
+
+  private:
+	sockaddr_in			mAddress;  /**< Address of the sender. */
 };
 
 /*******************************************************************************
@@ -129,6 +235,17 @@ class ConnectionLostRequest : public ConnectionRequest {
 				~ConnectionLostRequest	();
 };
 
+/*******************************************************************************
+ * A connection that had more unsent data than its output limit has
+ * sent it all.
+ *
+ * See @ref Connection::send().
+ ******************************************************************************/
+class WritableRequest : public ConnectionRequest {
+  public:
+				WritableRequest	(int socket, Connection& rConn, ServerListener& rListener);
+};
+
 /*******************************************************************************
  * @ref Listener has requested shutdown.
  ******************************************************************************/
@@ -138,13 +255,25 @@ class ShutdownRequest : public Request {
 };
 
 /*******************************************************************************
- * Timeout in @ref Listener.
+ * Timeout in @ref Listener, or an expired timer.
+ *
+ * For the timeout set with @ref Listener::setTimeout(), the timer
+ * identifier is -1. A timer set with @ref Listener::addTimer() has no
+ * connection; one set with @ref Connection::addTimer() has the
+ * connection it was set for.
  ******************************************************************************/
 class TimeoutRequest : public Request {
   public:
-	TimeoutRequest	(ServerListener& rListener) : Request (-1, Request::Timeout, rListener) {;}
+				TimeoutRequest	(ServerListener& rListener)
+						: Request (-1, Request::Timeout, rListener), mTimerId (-1), mrpConn (NULL) {;}
+				TimeoutRequest	(int socket, long timerId, Connection* pConn, ServerListener& rListener);
+
+	long		timerId			() const {return mTimerId;}
+	Connection*	connection		() {return mrpConn;}
 
   private:
+	long		mTimerId; /**< Identifier of the expired timer, or -1.        */
+	Connection*	mrpConn;  /**< Connection the timer was set for. May be NULL. */
 };
 
 /*******************************************************************************
@@ -164,6 +293,7 @@ class RequestHandler {
 	virtual MSrvResult process 	(DatagramRequest&       pRequest);
 	virtual MSrvResult process 	(ShutdownRequest&       pRequest);
 	virtual MSrvResult process 	(TimeoutRequest&        pRequest);
+	virtual MSrvResult process 	(WritableRequest&       pRequest);
 };
 
 end_namespace (MSrv);
@@ -27,6 +27,8 @@
 
 #include <magicserver/msrvdef.h>
 #include <magicserver/msrvlistener.h>
+#include <magicserver/msrvbuffer.h>
+#include <magicserver/msrvframe.h>
 
 /*******************************************************************************
  * Predeclarations
@@ -36,14 +38,49 @@ struct sockaddr_in;
 namespace MSrv {
 	class IRequest;
 	class Request;
+	class RequestPool;
+	class BufferPool;
+	class DatagramRequest;
 	class RequestHandler;
 	class Log;
 	class Connection;
 	class ConnectionFactory;
+	class ServerMetrics;
 };
 
 begin_namespace (MSrv);
 
+/*******************************************************************************
+ * Counts the open connections of each client IP address.
+ *
+ * The counts are kept in an open-addressing hash table, so that
+ * counting a connection in or out is a constant-time operation. An
+ * address is dropped from the table when its count falls to zero.
+ ******************************************************************************/
+class AddressCounter {
+  public:
+				AddressCounter	();
+				~AddressCounter	();
+
+	int			count			(uint address) const;
+	int			increment		(uint address);
+	void		decrement		(uint address);
+	int			length			() const {return mUsed;}
+
+  private:
+	struct Entry {
+		uint	mAddress; /**< IPv4 address in network byte order. */
+		int		mCount;   /**< Open connections; 0 if unused.     */
+	};
+
+	int			slot			(uint address) const;
+	MSrvResult	grow			();
+
+	Entry*		mpEntries;  /**< Hash table, mCapacity entries.        */
+	int			mCapacity;  /**< Size of the table, a power of two.    */
+	int			mUsed;      /**< Addresses with open connections.      */
+};
+
 /*******************************************************************************
  * ServerListener object, capable of accepting connections and data.
  *
@@ -53,25 +90,100 @@ begin_namespace (MSrv);
  *
  * For UDP servers, ServerListener listens the UDP server socket,
  * receives any data sent to it and forwards the @ref Request to a
- * @ref RequestHandler.
+ * @ref RequestHandler. On each wakeup, a batch of up to
+ * MSRV_DATAGRAM_BATCH datagrams is received with one call, and the
+ * replies given with @ref reply() while handling the batch are sent
+ * together with one call after it.
+ *
+ * Received data is read with a single call into a buffer of the
+ * @ref BufferPool, sized by the amount of data pending in the socket,
+ * and the @ref DataRequest adopts the buffer without copying.
+ *
+ * If a @ref Framer is set with @ref setFramer(), the data of each
+ * connection is split into frames instead, and a @ref
+ * StreamDataRequest is sent for each complete frame. Partial frames
+ * are kept in the @ref FrameBuffer of the connection until the rest
+ * arrives.
+ *
+ * A message can be sent to all connections with @ref broadcast(). It
+ * is formatted once into a @ref SharedBuffer, which is queued on the
+ * outbound queue of every connection without copying. What happens
+ * to subscribers that can not keep up is set with @ref
+ * setSlowPolicy().
+ *
+ * The number of open connections can be limited in total with @ref
+ * setMaxConnections() and per client address with @ref
+ * setMaxPerAddress(). Connections over the limits are reset right
+ * after accepting, before anything is allocated for them, so that an
+ * overload does not slow down the connections already served.
+ * Connections that have received nothing for the time set with @ref
+ * setIdleTimeout() are disconnected. The connections are kept in a
+ * list ordered by their last activity, so finding the idle ones does
+ * not need to go through all the connections.
+ *
+ * The outbound queues are sent without blocking. While a connection
+ * has unsent data, its socket is watched for becoming writable, and
+ * the rest is sent from the listener loop.
+ *
+ * When created with the @ref EventBackend::Uring backend type, the
+ * ServerListener runs on io_uring completions instead of readiness
+ * events: accepts and reads are submitted to the kernel in batches,
+ * and received data arrives directly in the buffer that is handed to
+ * the @ref DataRequest. If io_uring is not available, the
+ * ServerListener falls back to the readiness-based backends.
  *
  * \image html flowcharts-listener2.png
  ******************************************************************************/
 class ServerListener : public Listener {
   public:
-						ServerListener	(RequestHandler& rHandler, Log* rpLog=NULL);
+						ServerListener	(RequestHandler& rHandler, Log* rpLog=NULL,
+										 int backend=EventBackend::Default);
 	virtual	     		~ServerListener	();
 
 	enum protocol_type {TCP=0, UDP=1};
 
-	enum bindflags     {BINDF_NOREUSE=0x00000001};
+	enum bindflags     {BINDF_NOREUSE=0x00000001,   /**< Do not set SO_REUSEADDR.            */
+						BINDF_REUSEPORT=0x00000002  /**< Share the port with SO_REUSEPORT.  */};
+
+	/** What @ref broadcast() does with a connection that can not keep up. */
+	enum slow_policy   {SlowDrop=0,        /**< Drop messages while unsent data is queued. */
+						SlowDisconnect=1,  /**< Disconnect when the limit is exceeded.     */
+						SlowBuffer=2       /**< Queue up to the limit, then drop.          */};
+
+	/** Copy of the state of a connection, taken by @ref snapshot(). */
+	struct ConnectionState {
+		int				mSocket;     /**< Socket of the connection.              */
+		int				mIpAddress;  /**< Client address in network order, or 0. */
+		int				mPort;       /**< Client port, or 0.                     */
+	};
 
 	virtual MSrvResult  bind					(int portno, protocol_type protocol, uint flags);
+	MSrvResult			bindUnix				(const char* path);
+	virtual MSrvResult	listen					();
 
 	void				setHandler				(RequestHandler& handler) {mrpHandler = &handler;}
 	void				setRequestMask			(uint mask) {mRequestMask = mask;}
 	uint				requestMask				() const {return mRequestMask;}
 	void				setConnectionFactory	(ConnectionFactory& factory) {mrpConnectionFactory = &factory;}
+	void				setFramer				(const Framer* pFramer) {mrpFramer = pFramer;}
+	RequestPool&		requestPool				() {return *mpRequestPool;}
+	void				setSlowPolicy			(int policy, long limit=MSRV_MAX_OUTPUT_LEN);
+	int					broadcast				(SharedBuffer& rBuffer, Connection* pExcept=NULL);
+	long				broadcastDrops			() const {return __atomic_load_n (&mBroadcastDrops, __ATOMIC_RELAXED);}
+	void				setDatagramLen			(int len) {mDatagramLen = len;}
+	void				setBacklog				(int backlog) {mBacklog = backlog;}
+	void				setMaxConnections		(int max) {mMaxConnections = max;}
+	void				setMaxPerAddress		(int max) {mMaxPerAddress = max;}
+	void				setIdleTimeout			(long msec);
+	int					connectionCount			() const {return __atomic_load_n (&mConnectionCount, __ATOMIC_RELAXED);}
+	long				rejectedConnections		() const {return __atomic_load_n (&mRejected, __ATOMIC_RELAXED);}
+	long				idleDisconnects			() const {return __atomic_load_n (&mIdleDisconnects, __ATOMIC_RELAXED);}
+	MSrvResult			reply					(DatagramRequest& rRequest, const char* pData, int len);
+	MSrvResult			flushReplies			();
+	BufferPool&			bufferPool				() {return *mpBufferPool;}
+	ServerMetrics*		metrics					() {return mrpMetrics;}
+	void				setMetrics				(ServerMetrics* pMetrics) {mrpMetrics = pMetrics;}
+	int					snapshot				(ConnectionState* pStates, int max, int& rDescriptors);
 
 	MSrvResult			close					(Connection* pConn);
 
@@ -85,23 +197,68 @@ class ServerListener : public Listener {
 		
 	  private:
 		ServerListener&				rServer;
-		Array<Descriptor>::Iterator mDescIter;
+		KeyedArray<Descriptor>::Iterator mDescIter;
 	};
 
   protected:
 	RequestHandler*		getHandler		() {return mrpHandler;}
 	virtual MSrvResult	descriptorEvent	(int fd, void* data);
+	virtual MSrvResult	writableEvent	(int fd, void* data);
 	virtual MSrvResult	timeoutEvent	();
+	virtual MSrvResult	timerEvent		(long id, void* pData);
+	virtual void		descriptorRemoved	(int fd, void* data);
 	virtual MSrvResult	shutdown		();
+	MSrvResult			dataEvent		(int fd, void* pDescriptorData, char* pData, int len,
+										 bool pooled=false, const struct sockaddr_in* pAddr=NULL);
+	MSrvResult			receiveDatagrams	();
+	MSrvResult			frameEvent		(int fd, Connection& rConn, char* pData, int len, bool pooled);
+	MSrvResult			frameReceived	(int fd, Connection& rConn, char* pData, int len, bool pooled);
+	MSrvResult			connectionLost	(int fd, void* pDescriptorData);
 
   private:
 	virtual MSrvResult	accept			();
+	MSrvResult			acceptConnection	(int clientsocket, const struct sockaddr_in& rAddr);
+	bool				admit				(const struct sockaddr_in& rAddr);
+	void				reject				(int clientsocket);
+	void				idleTouch			(Connection& rConn);
+	void				idleUnlink			(Connection& rConn);
+	void				reapIdle			();
+#ifdef MSRV_HAVE_IO_URING
+	MSrvResult			listenCompletions	(UringBackend& rUring);
+	MSrvResult			completionEvent		(UringBackend& rUring, UringCompletion& rCompletion);
+#endif
 
 	int					mSocket;    /**< The server socket.           */
 	int					mProtocol;  /**< Protocol, either TCP or UDP. */
 	RequestHandler*		mrpHandler;
 	ConnectionFactory*	mrpConnectionFactory;
+	const Framer*		mrpFramer;     /**< Framer of new connections. */
 	uint				mRequestMask;
+	RequestPool*		mpRequestPool; /**< Requests are created here. */
+	BufferPool*			mpBufferPool;  /**< Received data is read here. */
+	int					mSlowPolicy;     /**< One of @ref slow_policy.                */
+	long				mSlowLimit;      /**< Limit of unsent data per connection.    */
+	long				mBroadcastDrops; /**< Messages not queued by @ref broadcast(). */
+	int					mDatagramLen;    /**< Receive buffer length of a datagram.    */
+	char*				mpRecvBuffers[MSRV_DATAGRAM_BATCH]; /**< Buffers ready for datagrams. */
+	DatagramBatch*		mpReplies;       /**< Replies waiting to be sent.             */
+	ThreadLock			mReplyLock;      /**< Guards mpReplies.                       */
+	pthread_t			mListenerThread; /**< Thread running the listener loop.       */
+	bool				mDeferReplies;   /**< Is the listener thread in a batch?      */
+	int					mBacklog;        /**< Queue length of pending connections.    */
+	int					mMaxConnections; /**< Most open connections; 0 for no limit.  */
+	int					mMaxPerAddress;  /**< Most connections per address; 0 for no limit. */
+	int					mConnectionCount; /**< Connections open now.                  */
+	AddressCounter		mAddressCounts;  /**< Open connections by client address.     */
+	long				mRejected;       /**< Connections reset by the limits.        */
+	bool				mLimitReached;   /**< Has the current overload been logged?   */
+	long				mIdleTimeout;    /**< Idle time to disconnect, in msec.       */
+	long				mIdleTimer;      /**< Timer of the next idle check, or -1.    */
+	long				mIdleDisconnects; /**< Connections disconnected as idle.      */
+	Connection*			mrpIdleFirst;    /**< Connection idle for the longest time.   */
+	Connection*			mrpIdleLast;     /**< Connection active most recently.        */
+	ServerMetrics*		mrpMetrics;      /**< Metrics recorded to, or NULL.           */
+	char*				mpUnixPath;      /**< Path of a Unix server socket, or NULL.  */
 };
 
 /*******************************************************************************
@@ -117,12 +274,45 @@ class Connection {
 	const sockaddr_in&	address		() const {return *mpAddress;}
 	virtual	MSrvResult	close		();
 	ThreadLock&			threadLock	() {return mThreadLock;}
+
+	long				send		(const char* pData, int len);
+	long				send		(SharedBuffer& rBuffer);
+	MSrvResult			enqueue		(SharedBuffer& rBuffer, long limit=-1);
+	MSrvResult			flush		();
+	void				disconnect	();
+	long				pendingBytes	();
+	void				setOutputLimit	(long limit) {mOutputLimit = limit;}
+	bool				isBlocked		() const {return mBlocked;}
+	void				setFramer		(const Framer* pFramer) {mrpFramer = pFramer; mFrames.setScanned (0);}
+	const Framer*		framer			() const {return mrpFramer;}
+	long				addTimer		(long msec, long periodMSec=0);
+	MSrvResult			cancelTimer		(long id);
 	
   private:
+	friend class WorkerPool;
+	friend class ServerListener;
+
+	bool				unblock		();
+
 	Listener*		mrpListener;
 	int				mSocket;
 	sockaddr_in*	mpAddress;
 	ThreadLock		mThreadLock;
+	Queue<Request>	mOrderQueue; /**< Requests held back by an ordered WorkerPool. */
+	bool			mOrderBusy;  /**< Is a request of ours being processed?        */
+	ThreadLock		mOrderLock;  /**< Guards mOrderQueue and mOrderBusy.           */
+	OutputQueue		mOutput;     /**< Data waiting to be sent.                     */
+	ThreadLock		mOutputLock; /**< Guards the output state below and mOutput.   */
+	long			mOutputLimit; /**< Unsent bytes that block the connection.     */
+	bool			mBlocked;    /**< Has the output limit been exceeded?          */
+	bool			mWatching;   /**< Is the socket watched for writing?           */
+	const Framer*	mrpFramer;   /**< Splits the received data into frames.        */
+	FrameBuffer		mFrames;     /**< Partial frame received so far.               */
+	int				mTimers;     /**< Timers of the connection; an owner list.     */
+	Connection*		mrpIdlePrev; /**< Connection idle for longer than us.          */
+	Connection*		mrpIdleNext; /**< Connection active more recently than us.     */
+	unsigned long	mLastActive; /**< Time data was last received, in msec.        */
+	bool			mIdleListed; /**< Are we in the idle list of the listener?     */
 };
 
 /*******************************************************************************
@@ -58,6 +58,37 @@ class ThreadLock {
 	bool            mCondInited; /**< Has condition been initialized?            */
 };
 
+/*******************************************************************************
+ * Counting semaphore.
+ *
+ * The count tells how many @ref wait() calls may pass without
+ * blocking; @ref post() raises it and wakes waiters. Unlike waiting
+ * on a bare condition variable, a post is never lost: if it comes
+ * before the wait, the wait passes immediately.
+ *
+ * On Linux, the count is a futex word. Posting and waiting stay in
+ * user space when there is no need to block or wake, and the wake
+ * system call is skipped when no thread is waiting. Elsewhere, a
+ * mutex and a condition variable are used.
+ ******************************************************************************/
+class Semaphore {
+  public:
+				Semaphore	(int count=0);
+				~Semaphore	();
+
+	void		post		(int count=1);
+	MSrvResult	wait		(double seconds=0.0);
+	bool		tryWait		();
+
+  private:
+	int				mCount;     /**< Number of passes available.          */
+	int				mWaiters;   /**< Number of threads blocked in wait(). */
+#ifndef __linux__
+	pthread_mutex_t	mMutex;     /**< Guards the count.                    */
+	pthread_cond_t	mCond;      /**< Signalled when the count is raised.  */
+#endif
+};
+
 /*******************************************************************************
  * Thread object.
  *
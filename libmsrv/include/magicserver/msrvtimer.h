@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *  This library is free software; you can redistribute it and/or          *
+ *  modify it under the terms of the GNU Library General Public            *
+ *  License as published by the Free Software Foundation; either           *
+ *  version 2 of the License, or (at your option) any later version.       *
+ *                                                                         *
+ *  This library is distributed in the hope that it will be useful,        *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU      *
+ *  Library General Public License for more details.                       *
+ *                                                                         *
+ *  You should have received a copy of the GNU Library General Public      *
+ *  License along with this library; see the file COPYING.LIB.  If         *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place      *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                               *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef __MAGICSERVER_MSRVTIMER_H__
+#define __MAGICSERVER_MSRVTIMER_H__
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrverror.h>
+#include <magicserver/msrvthread.h>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * A timer returned by @ref TimerWheel::expire().
+ ******************************************************************************/
+struct TimerExpiry {
+	long				mId;        /**< Identifier of the timer.            */
+	void*				mpData;     /**< Data given when the timer was set.  */
+};
+
+/*******************************************************************************
+ * Hierarchical timer wheel.
+ *
+ * Keeps any number of one-shot and periodic timers with millisecond
+ * resolution. Setting and cancelling a timer are constant-time
+ * operations, and expiring costs only in proportion to the timers
+ * that expire, so that each of a hundred thousand connections can
+ * have its own timers.
+ *
+ * The first level of the wheel has a slot for each of the next 256
+ * milliseconds. Each of the three upper levels has 64 slots, each
+ * covering a whole turn of the level below it; when a lower level
+ * has turned around, the timers in the next slot of the level above
+ * are spread to it. Timers further than the wheel reaches, about 18
+ * hours, wait in the last slot of the top level.
+ *
+ * A timer can be linked to an owner list, an int held by the owner
+ * of the timers, so that all the timers of a connection can be
+ * cancelled when it is closed.
+ *
+ * The timers are kept in an array and linked by index, so the array
+ * can grow without fixing links, and freed timers are reused.
+ *
+ * The wheel is thread-safe.
+ ******************************************************************************/
+class TimerWheel {
+  public:
+						TimerWheel		();
+						~TimerWheel		();
+
+	long				add				(long msec, long periodMSec=0, void* pData=NULL,
+										 int* pOwner=NULL);
+	MSrvResult			cancel			(long id);
+	void				cancelAll		(int& rOwner);
+	int					expire			(unsigned long now, TimerExpiry* pExpired, int maxExpired);
+	long				nextTimeout		(unsigned long now);
+	int					length			() const {return mCount;}
+
+	static unsigned long	now			();
+
+  private:
+	enum				{Level0Bits=8, LevelBits=6, Levels=4,
+						 Level0Slots=1<<Level0Bits, LevelSlots=1<<LevelBits,
+						 SlotCount=Level0Slots + (Levels-1)*LevelSlots};
+
+	struct Timer {
+		long			mId;        /**< Identifier; negative when free.        */
+		unsigned long	mExpires;   /**< Expiry time in milliseconds.           */
+		long			mPeriod;    /**< Period in milliseconds; 0 if one-shot. */
+		void*			mpData;     /**< Data given when the timer was set.     */
+		int				mSlot;      /**< Slot the timer is in.                  */
+		int				mNext;      /**< Next timer in the slot or free list.   */
+		int				mPrev;      /**< Previous timer in the slot.            */
+		int*			mpOwner;    /**< Owner list; NULL if none.              */
+		int				mOwnerNext; /**< Next timer of the owner.               */
+		int				mOwnerPrev; /**< Previous timer of the owner.           */
+	};
+
+	void				insert			(int index);
+	void				unlink			(int index);
+	void				release			(int index);
+	void				cascade			(int level);
+
+	Timer*				mpTimers;   /**< All timers, free and used.             */
+	int					mSize;      /**< Size of mpTimers.                      */
+	int					mFree;      /**< First free timer.                      */
+	int					mCount;     /**< Number of timers set.                  */
+	long				mSequence;  /**< Makes identifiers of reused timers unique. */
+	unsigned long		mCurrent;   /**< Next millisecond to expire.            */
+	unsigned long		mCascaded;  /**< Last millisecond the wheel cascaded.   */
+	int					mSlots[SlotCount];   /**< First timer of each slot.         */
+	int					mLevelCounts[Levels]; /**< Number of timers on each level.  */
+	ThreadLock			mThreadLock;
+};
+
+end_namespace (MSrv);
+
+#endif
@@ -30,6 +30,7 @@
 #include <magicserver/msrvserver.h>
 #include <magicserver/msrvrequest.h>
 #include <magicserver/msrvcontainer.h>
+#include <magicserver/msrvmetrics.h>
 
 begin_namespace (MSrv);
 
@@ -40,21 +41,72 @@ class Worker;
  *
  * Maintains a pool of @ref Worker objects that each sit in their own
  * thread, waiting for requests to process.
+ *
+ * The requests are passed to the workers through a queue, which is
+ * chosen at construction. The default @ref LockedQueue is unbounded
+ * but takes a lock and allocates on every request. The @ref
+ * LockFreeQueue is a @ref BoundedQueue of MSRV_WORKER_QUEUE_LEN
+ * requests that does neither; when it is full, the requests spill
+ * over to the locked queue until the workers catch up.
+ *
+ * With a work-stealing scheduling policy, chosen at construction,
+ * there is no shared queue. Each worker has a queue and a semaphore
+ * of its own. The listener thread distributes the requests to the
+ * workers either round-robin (@ref StealRoundRobin) or by a hash of
+ * the socket (@ref StealByConnection), and a worker whose queue runs
+ * empty steals requests from the queues of its peers. The queue type
+ * is then ignored; the worker queues are always lock-free, and the
+ * requests that fit in none of them go to the locked queue.
+ *
+ * Normally two requests of the same @ref Connection may be processed
+ * concurrently by different workers. In ordered mode, set with @ref
+ * setOrdered(), the requests of a connection are processed one at a
+ * time and in the order they arrived, with any scheduling policy. A
+ * request that arrives while an earlier one of the connection is
+ * being processed waits in a queue of the connection, and the worker
+ * that finishes the earlier one processes it next. No worker ever
+ * waits for another.
+ *
+ * The pool records the number of queued requests, the time each
+ * request waits for a worker and the time the handler takes in the
+ * @ref ServerMetrics.
  ******************************************************************************/
 class WorkerPool : public RequestHandler {
   public:
-						WorkerPool		(RequestHandler& handler, Log& log, int size=10);
+	/** Type of the request queue. */
+	enum queue_type {LockedQueue   = 0, /**< Mutex-protected linked list. */
+					 LockFreeQueue = 1  /**< Bounded lock-free ring.      */};
+
+	/** Scheduling policy of the requests. */
+	enum scheduling_type {SharedQueue       = 0, /**< All workers pull one queue.       */
+						  StealRoundRobin   = 1, /**< Per-worker queues, round-robin.   */
+						  StealByConnection = 2  /**< Per-worker queues, socket hash.   */};
+
+						WorkerPool		(RequestHandler& handler, Log& log, int size=10,
+										 int queue=LockedQueue, int scheduling=SharedQueue);
 	virtual				~WorkerPool		();
 
+	virtual MSrvResult	init			(ServerListener& rListener);
 	virtual MSrvResult	process		 	(Request* pRequest);
 
-	bool				isShutdown		() const {return mIsShutdown;}
+	bool				isShutdown		() const {return __atomic_load_n (&mIsShutdown, __ATOMIC_ACQUIRE);}
+	void				setOrdered		(bool ordered) {mOrdered = ordered;}
+	bool				isOrdered		() const {return mOrdered;}
+	int					workerCount		() const {return mWorkerCount;}
+	bool				isWorkerIdle	(int worker) const;
+	int					queueLength		() const;
 
   private:
 	MSrvResult			shutdown		(Request* pRequest);
 	RequestHandler&		handler			() {return *mrpHandler;}
-	ThreadLock&			getWaitLock		() {return mQueueWaitLock;}
-	Queue<Request>&		queue			() {return mRequestQueue;}
+	Semaphore&			semaphore		(Worker& rWorker);
+	void				pushRequest		(Request* pRequest);
+	void				dispatchRequest	(Request* pRequest);
+	Request*			pullRequest		(Worker& rWorker);
+	bool				isStealing		() const {return mScheduling != SharedQueue;}
+	void				execute			(Request* pRequest);
+	bool				admitRequest	(Request* pRequest);
+	Request*			nextOrdered		(Connection& rConn);
 
 	friend class Worker;
 
@@ -63,10 +115,15 @@ class WorkerPool : public RequestHandler {
 	Worker**			mpWorkers;      /**< Pool of workers.                    */
 	int      			mWorkerCount;   /**< Number of workers in the pool.      */
 	Queue<Request>		mRequestQueue;  /**< Requests dispensed to workers.      */
+	BoundedQueue<Request>* mpBoundedQueue; /**< Lock-free queue used instead, or NULL. */
 	ThreadLock          mQueueLock;     /**< For locking the request queue.      */
-	ThreadLock			mQueueWaitLock; /**< Lock for waiting the queue.         */
+	Semaphore			mQueueSemaphore; /**< Posted once per queued request.    */
 	bool                mIsShutdown;    /**< Is the worker pool being shut down? */
+	int					mScheduling;    /**< Scheduling policy.                  */
+	uint				mNextWorker;    /**< Next worker in round-robin order.   */
+	bool				mOrdered;       /**< Are connections processed in order? */
 	Log&				mrLog;
+	ServerMetrics&		mrMetrics;      /**< Metrics of the process.             */
 };
 
 /*******************************************************************************
@@ -77,14 +134,21 @@ class WorkerPool : public RequestHandler {
  ******************************************************************************/
 class Worker : public Thread {
   public:
-					Worker (WorkerPool* pool);
+					Worker (WorkerPool* pool, int index);
+	virtual			~Worker		();
 
 	virtual void*	execute		();
 
   private:
 	static void*	startThread	(void* pParam);
 
-	WorkerPool*		mpPool; /**< Owner pool. */
+	friend class WorkerPool;
+
+	WorkerPool*		mpPool;     /**< Owner pool.                                 */
+	int				mIndex;     /**< Index of the worker in the pool.            */
+	BoundedQueue<Request>* mpQueue; /**< Own queue when work-stealing, else NULL. */
+	Semaphore		mSemaphore; /**< Own semaphore when work-stealing.           */
+	bool			mIdle;      /**< Is the worker waiting for requests?         */
 };
 
 end_namespace (MSrv);
@@ -48,15 +48,28 @@ makedox          = 1
 ################################################################################
 include $(SRCDIR)/build/magicdef.mk
 
+################################################################################
+# Compile-time log level: release builds drop Info and Debug messages
+################################################################################
+ifeq ($(BUILDTYPE),debug)
+CXXFLAGS += -DMSRV_LOG_LEVEL=7
+else
+CXXFLAGS += -DMSRV_LOG_LEVEL=5
+endif
+
 ################################################################################
 # Source files for libmagic.a
 ################################################################################
 
 sources = msrvserver.cc msrvlistener.cc msrvlog.cc msrvthread.cc \
-          msrvworker.cc msrvrequest.cc
+          msrvworker.cc msrvrequest.cc msrvevent.cc msrvgroup.cc \
+          msrvbuffer.cc msrvframe.cc msrvtimer.cc msrvasynclog.cc \
+          msrvbinlog.cc msrvmetrics.cc msrvadmin.cc
 
 headers = msrvserver.h msrvlistener.h msrvlog.h msrvthread.h msrvdef.h \
-          msrvworker.h msrvcontainer.h msrverror.h msrvrequest.h
+          msrvworker.h msrvcontainer.h msrverror.h msrvrequest.h msrvevent.h \
+          msrvgroup.h msrvbuffer.h msrvframe.h msrvtimer.h msrvasynclog.h \
+          msrvbinlog.h msrvmetrics.h msrvadmin.h
 
 headersubdir = magicserver
 
@@ -0,0 +1,373 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvadmin.h>
+#include <magicserver/msrvmetrics.h>
+#include <magicserver/msrverror.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <new>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Appends a line to a snapshot, if it fits whole.
+ ******************************************************************************/
+static void appendLine (
+	char*       pBuffer,  /**< The snapshot.                  */
+	int         len,      /**< Length of the buffer.          */
+	int&        rWritten, /**< Length of the snapshot so far. */
+	const char* format,   /**< printf format of the line.     */
+	...)
+{
+	if (rWritten >= len)
+		return;
+
+	va_list args;
+	va_start (args, format);
+	int lineLen = vsnprintf (pBuffer + rWritten, len - rWritten, format, args);
+	va_end (args);
+
+	if (lineLen < 0 || lineLen >= len - rWritten)
+		pBuffer[rWritten] = 0x00;
+	else
+		rWritten += lineLen;
+}
+
+/*******************************************************************************
+ * Creates a handler with no sources.
+ *
+ * \throw std::bad_alloc if the buffers can not be allocated.
+ ******************************************************************************/
+AdminHandler::AdminHandler ()
+{
+	mpStates = (ServerListener::ConnectionState*)
+		malloc (MSRV_ADMIN_CONNECTIONS * sizeof (ServerListener::ConnectionState));
+	mpBuffer = (char*) malloc (MSRV_ADMIN_SNAPSHOT_LEN);
+
+	if (!mpStates || !mpBuffer) {
+		free (mpStates);
+		free (mpBuffer);
+		throw std::bad_alloc ();
+	}
+}
+
+/*******************************************************************************
+ * Destroys the handler.
+ ******************************************************************************/
+AdminHandler::~AdminHandler ()
+{
+	free (mpStates);
+	free (mpBuffer);
+}
+
+/*******************************************************************************
+ * Adds a listener to the snapshot. The name prefixes its lines.
+ ******************************************************************************/
+void AdminHandler::addListener (ServerListener& rListener, const char* name)
+{
+	addSource (&rListener, NULL, NULL, name);
+}
+
+/*******************************************************************************
+ * Adds a worker pool to the snapshot. The name prefixes its lines.
+ ******************************************************************************/
+void AdminHandler::addPool (WorkerPool& rPool, const char* name)
+{
+	addSource (NULL, &rPool, NULL, name);
+}
+
+/*******************************************************************************
+ * Adds a log to the snapshot. The name prefixes its lines.
+ ******************************************************************************/
+void AdminHandler::addLog (Log& rLog, const char* name)
+{
+	addSource (NULL, NULL, &rLog, name);
+}
+
+/*******************************************************************************
+ * Adds a source to the snapshot.
+ ******************************************************************************/
+void AdminHandler::addSource (
+	ServerListener* rpListener, /**< Listener, or NULL.              */
+	WorkerPool*     rpPool,     /**< Worker pool, or NULL.           */
+	Log*            rpLog,      /**< Log, or NULL.                   */
+	const char*     name        /**< Prefix of the lines; not copied. */)
+{
+	Source source;
+	source.mrpListener = rpListener;
+	source.mrpPool     = rpPool;
+	source.mrpLog      = rpLog;
+	source.mpName      = name;
+
+	mSources.add (&source);
+}
+
+/*******************************************************************************
+ * Writes a snapshot of the sources and the global metrics.
+ *
+ * The text is null-terminated. Lines that do not fit in the buffer
+ * are left out whole.
+ *
+ * \return Length of the text written.
+ ******************************************************************************/
+int AdminHandler::snapshot (
+	char* pBuffer, /**< Buffer to write to.   */
+	int   len      /**< Length of the buffer. */)
+{
+	if (len <= 0)
+		return 0;
+
+	int written = 0;
+	pBuffer[0]  = 0x00;
+
+	for (int i=0; i<mSources.length (); ++i) {
+		const Source& rSource = mSources[i];
+		const char*   name    = rSource.mpName;
+
+		if (rSource.mrpListener) {
+			ServerListener& rListener = *rSource.mrpListener;
+
+			/* Only the copy is made under the lock of the listener. */
+			int descriptors = 0;
+			int listed      = rListener.snapshot (mpStates, MSRV_ADMIN_CONNECTIONS, descriptors);
+
+			appendLine (pBuffer, len, written,
+						"%s.connections %d\n%s.descriptors %d\n"
+						"%s.rejected %ld\n%s.idle_disconnects %ld\n%s.broadcast_drops %ld\n",
+						name, rListener.connectionCount (), name, descriptors,
+						name, rListener.rejectedConnections (),
+						name, rListener.idleDisconnects (),
+						name, rListener.broadcastDrops ());
+
+			for (int j=0; j<listed; ++j) {
+				int addr = mpStates[j].mIpAddress;
+				appendLine (pBuffer, len, written, "%s.connection %d %d.%d.%d.%d:%d\n",
+							name, mpStates[j].mSocket,
+							addr & 0xff, (addr >> 8) & 0xff,
+							(addr >> 16) & 0xff, (addr >> 24) & 0xff,
+							mpStates[j].mPort);
+			}
+		}
+
+		if (rSource.mrpPool) {
+			WorkerPool& rPool = *rSource.mrpPool;
+
+			appendLine (pBuffer, len, written, "%s.workers %d\n%s.queue_length %d\n",
+						name, rPool.workerCount (), name, rPool.queueLength ());
+
+			for (int j=0; j<rPool.workerCount (); ++j)
+				appendLine (pBuffer, len, written, "%s.worker.%d %s\n",
+							name, j, rPool.isWorkerIdle (j)? "idle" : "busy");
+		}
+
+		if (rSource.mrpLog)
+			appendLine (pBuffer, len, written, "%s.drops %ld\n",
+						name, rSource.mrpLog->drops ());
+	}
+
+	written += MetricsRegistry::global ().format (pBuffer + written, len - written);
+
+	return written;
+}
+
+/*******************************************************************************
+ * Lets through only the requests the admin connections need.
+ ******************************************************************************/
+MSrvResult AdminHandler::init (ServerListener& rListener)
+{
+	rListener.setRequestMask (Request::NewConnection | Request::ConnectionLost |
+							  Request::Writable | Request::Shutdown);
+	return 0;
+}
+
+/*******************************************************************************
+ * Sends a snapshot to a new client.
+ *
+ * What the socket does not take at once is sent by the listener, and
+ * the end of the snapshot is marked when a @ref WritableRequest tells
+ * that all has been sent.
+ *
+ * @return 0.
+ ******************************************************************************/
+MSrvResult AdminHandler::process (NewConnectionRequest& rRequest)
+{
+	Connection& rConn = rRequest.connection ();
+	int         len   = snapshot (mpBuffer, MSRV_ADMIN_SNAPSHOT_LEN);
+
+	/* Any unsent data blocks the connection, so that we are told */
+	/* when it has all been sent.                                 */
+	rConn.setOutputLimit (0);
+
+	long unsent = rConn.send (mpBuffer, len);
+	if (unsent < 0)
+		rConn.disconnect ();
+	else if (unsent == 0)
+		::shutdown (rConn.socket (), SHUT_WR);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Marks the end of a snapshot that has been sent in full.
+ *
+ * The client sees the end of file and closes the connection, which
+ * is then lost as usual.
+ *
+ * @return 0.
+ ******************************************************************************/
+MSrvResult AdminHandler::process (WritableRequest& rRequest)
+{
+	::shutdown (rRequest.connection ().socket (), SHUT_WR);
+	return 0;
+}
+
+/*******************************************************************************
+ * Runs the listener loop of the admin server.
+ ******************************************************************************/
+void* AdminThread::execute ()
+{
+	return mpServer->run ();
+}
+
+/*******************************************************************************
+ * Creates an admin server. It must be bound and started.
+ *
+ * Clients idle for MSRV_ADMIN_IDLE_MSEC are disconnected, as are
+ * connections over MSRV_ADMIN_MAX_CONNECTIONS.
+ ******************************************************************************/
+AdminServer::AdminServer (
+	Log* rpLog,   /**< Log of the listener. May be NULL.  */
+	int  backend  /**< Event backend type of the listener. */)
+{
+	mpThread   = NULL;
+	mpListener = new ServerListener (mHandler, rpLog, backend);
+
+	mpListener->setMetrics (NULL);
+	mpListener->setMaxConnections (MSRV_ADMIN_MAX_CONNECTIONS);
+	mpListener->setIdleTimeout (MSRV_ADMIN_IDLE_MSEC);
+
+	/* Wake up now and then to notice a shutdown. */
+	mpListener->setTimeout (1, 0);
+}
+
+/*******************************************************************************
+ * Stops and destroys the admin server.
+ ******************************************************************************/
+AdminServer::~AdminServer ()
+{
+	stop ();
+	delete mpListener;
+}
+
+/*******************************************************************************
+ * Binds the admin server to a TCP port.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult AdminServer::bind (int portno)
+{
+	return mpListener->bind (portno, ServerListener::TCP, 0);
+}
+
+/*******************************************************************************
+ * Binds the admin server to a Unix socket, which only local users
+ * with access to the path can connect to.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult AdminServer::bindUnix (const char* path)
+{
+	return mpListener->bindUnix (path);
+}
+
+/*******************************************************************************
+ * Starts serving snapshots in a thread of the admin server.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult AdminServer::start ()
+{
+	if (mpThread)
+		return 0;
+
+	mpThread = new AdminThread (this);
+
+	MSrvResult result = mpThread->start ();
+	if (result < 0) {
+		delete mpThread;
+		mpThread = NULL;
+	}
+
+	return result;
+}
+
+/*******************************************************************************
+ * Stops serving snapshots and waits for the thread to exit.
+ *
+ * The listener notices the shutdown within a second.
+ ******************************************************************************/
+void AdminServer::stop ()
+{
+	if (!mpThread)
+		return;
+
+	mpListener->startShutdown ();
+	mpThread->join (NULL);
+
+	delete mpThread;
+	mpThread = NULL;
+}
+
+/*******************************************************************************
+ * \fn AdminHandler& AdminServer::handler ()
+ *
+ * Returns the handler, to which the sources of the snapshot are
+ * added.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn ServerListener& AdminServer::listener ()
+ *
+ * Returns the listener of the admin socket.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Runs the listener loop until the server is stopped.
+ ******************************************************************************/
+void* AdminServer::run ()
+{
+	MSrvResult result = mpListener->listen ();
+	if (result < 0)
+		mpListener->log().message ("ADMIN", Log::Error, result,
+								   "Admin listener stopped with error %d.", -result);
+
+	return NULL;
+}
+
+end_namespace (MSrv);
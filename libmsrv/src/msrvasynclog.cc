@@ -0,0 +1,523 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvasynclog.h>
+#include <magicserver/msrverror.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <new>
+#include <stdexcept>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * A message in a @ref LogRing.
+ *
+ * The text follows the header. The records are aligned to 8 bytes.
+ ******************************************************************************/
+struct LogRecord {
+	int				mLength;    /**< Bytes taken from the ring; -1 to skip to its start. */
+	int				mFatality;  /**< Severity of the event.                  */
+	int				mErrnum;    /**< Message number.                         */
+	int				mTextLen;   /**< Length of the text.                     */
+	struct timespec	mTime;      /**< Time of the message.                    */
+	char			mModule[16]; /**< Name of the module, cut if longer.     */
+};
+
+/*******************************************************************************
+ * Ring buffer of the messages of one thread.
+ *
+ * Only the owner thread moves mHead and only the writer thread moves
+ * mTail, so the positions are kept on separate cache lines.
+ ******************************************************************************/
+struct LogRing {
+	char*			mpData;     /**< The ring, mLength bytes.                */
+	int				mLength;    /**< Size of the ring, a power of two.       */
+	LogRing*		mpNext;     /**< Next ring of the log.                   */
+	bool			mAbandoned; /**< Has the owner thread exited?            */
+	char			mPad0[MSRV_CACHE_LINE_LEN];
+	unsigned long	mHead;      /**< Position after the last message.        */
+	char			mPad1[MSRV_CACHE_LINE_LEN];
+	unsigned long	mTail;      /**< Position of the first unwritten message. */
+	char			mPad2[MSRV_CACHE_LINE_LEN];
+};
+
+#define MSRV_LOG_RECORD_ALIGN(len) (((len) + 7) & ~7)
+
+/*******************************************************************************
+ * Runs the writer loop of the log.
+ ******************************************************************************/
+void* AsyncLogWriter::execute ()
+{
+	return mpLog->run ();
+}
+
+/*******************************************************************************
+ * Opens an asynchronous log to the given already open stream.
+ *
+ * The ring length is the number of bytes buffered for each thread;
+ * it is rounded up to a power of two.
+ ******************************************************************************/
+AsyncLog::AsyncLog (
+	FILE* stream,  /**< Stream to write the log to.        */
+	int   ringLen  /**< Bytes in the ring of each thread.  */)
+		: LogFile (stream)
+{
+	mRingLen = ringLen;
+	start ();
+}
+
+/*******************************************************************************
+ * Opens an asynchronous log to a file with the given name.
+ *
+ * The log will be appended to existing log file, if it
+ * exists. Otherwise, the log file will be created.
+ ******************************************************************************/
+AsyncLog::AsyncLog (
+	const char* filename, /**< File to write the log to.          */
+	int         ringLen   /**< Bytes in the ring of each thread.  */)
+		: LogFile (filename)
+{
+	mRingLen = ringLen;
+	start ();
+}
+
+/*******************************************************************************
+ * Writes the messages still in the rings and closes the log.
+ ******************************************************************************/
+AsyncLog::~AsyncLog ()
+{
+	/* The writer empties the rings before exiting. */
+	__atomic_store_n (&mStopping, true, __ATOMIC_SEQ_CST);
+	mWakeup.post ();
+	mpWriter->join (NULL);
+	delete mpWriter;
+
+	/* No more rings are created for this log. */
+	pthread_key_delete (mRingKey);
+
+	while (mpRings) {
+		LogRing* pRing = mpRings;
+		mpRings = pRing->mpNext;
+		free (pRing->mpData);
+		delete pRing;
+	}
+
+	free (mpBatch);
+}
+
+/*******************************************************************************
+ * Initializes the state and starts the writer thread.
+ *
+ * @throw std::bad_alloc if out of memory.
+ * @throw std::runtime_error if the thread could not be started.
+ ******************************************************************************/
+void AsyncLog::start ()
+{
+	/* The ring must take at least a few of the longest messages. */
+	int minLen  = 4 * (int) MSRV_LOG_RECORD_ALIGN (sizeof (LogRecord) + MSRV_LOG_MESSAGE_LEN);
+	int ringLen = 1024;
+	while (ringLen < mRingLen || ringLen < minLen)
+		ringLen *= 2;
+	mRingLen = ringLen;
+
+	mpRings       = NULL;
+	mSleeping     = false;
+	mStopping     = false;
+	mBlocking     = false;
+	mDrops        = 0;
+	mDropsWritten = 0;
+	mBatchLen     = 0;
+
+	mpBatch = (char*) malloc (MSRV_LOG_BATCH_LEN);
+	if (!mpBatch)
+		throw std::bad_alloc ();
+
+	pthread_key_create (&mRingKey, ringExit);
+
+	mpWriter = new AsyncLogWriter (this);
+	if (mpWriter->start () < 0) {
+		delete mpWriter;
+		pthread_key_delete (mRingKey);
+		free (mpBatch);
+		throw std::runtime_error ("Starting the log writer thread failed.");
+	}
+}
+
+/*******************************************************************************
+ * Returns the ring of the calling thread, creating it on first use.
+ *
+ * @return The ring, or NULL if out of memory.
+ ******************************************************************************/
+LogRing* AsyncLog::ring ()
+{
+	LogRing* pRing = (LogRing*) pthread_getspecific (mRingKey);
+	if (pRing)
+		return pRing;
+
+	pRing = new (std::nothrow) LogRing;
+	if (!pRing)
+		return NULL;
+
+	pRing->mpData = (char*) malloc (mRingLen);
+	if (!pRing->mpData) {
+		delete pRing;
+		return NULL;
+	}
+	pRing->mLength    = mRingLen;
+	pRing->mAbandoned = false;
+	pRing->mHead      = 0;
+	pRing->mTail      = 0;
+
+	pthread_setspecific (mRingKey, pRing);
+
+	/* The writer walks the list without locking, so publish the ring */
+	/* only after it has been initialized.                            */
+	mRingLock.lock ();
+	pRing->mpNext = mpRings;
+	__atomic_store_n (&mpRings, pRing, __ATOMIC_RELEASE);
+	mRingLock.unlock ();
+
+	return pRing;
+}
+
+/*******************************************************************************
+ * Marks the ring of an exiting thread abandoned.
+ *
+ * The writer frees the ring once its messages have been written.
+ ******************************************************************************/
+void AsyncLog::ringExit (void* pRing)
+{
+	__atomic_store_n (&static_cast <LogRing*> (pRing)->mAbandoned, true, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * Queues a log message for the writer thread.
+ *
+ * The message text is formatted into the ring of the calling thread
+ * right away, so the arguments need not stay valid after the call.
+ * May be called in any thread.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ *         MSRVERR_LOG_RING_FULL if the message was dropped, or
+ *         MSRVERR_OUT_OF_MEMORY if the thread has no ring.
+ ******************************************************************************/
+MSrvResult AsyncLog::message (
+	const char* modulename,  /**< An identifier of the module writing to log. */
+	int         fatality,    /**< Severity of the event.                      */
+	int         errnum,      /**< Possible message number.                    */
+	const char* message,     /**< Message (as a format string for printf).    */
+	...)
+{
+	if (!message || !modulename)
+		return MSRVERR_NULL_ARGUMENT;
+
+	if (fatality < 0 || fatality > Debug)
+		return MSRVERR_LOG_INVALID_FATALITY;
+
+	/* Drop filtered messages before formatting anything. */
+	if (!isLogged (fatality))
+		return 0;
+
+	/* Without a ring, the message is dropped; the ring is tried */
+	/* again with the next message.                              */
+	LogRing* pRing = ring ();
+	if (!pRing) {
+		__atomic_add_fetch (&mDrops, 1, __ATOMIC_RELAXED);
+		return MSRVERR_OUT_OF_MEMORY;
+	}
+
+	unsigned long head   = pRing->mHead;
+	int           offset = head & (pRing->mLength - 1);
+
+	/* Reserve room for the longest message, in one piece. If it does */
+	/* not fit before the end of the ring, skip to the start.         */
+	int need = MSRV_LOG_RECORD_ALIGN (sizeof (LogRecord) + MSRV_LOG_MESSAGE_LEN);
+	int skip = offset + need > pRing->mLength? pRing->mLength - offset : 0;
+	while (pRing->mLength - (long) (head - __atomic_load_n (&pRing->mTail, __ATOMIC_ACQUIRE)) < skip + need) {
+		if (!mBlocking) {
+			__atomic_add_fetch (&mDrops, 1, __ATOMIC_RELAXED);
+			return MSRVERR_LOG_RING_FULL;
+		}
+
+		/* Let the writer make room. */
+		mWakeup.post ();
+		sched_yield ();
+	}
+
+	if (skip) {
+		((LogRecord*) (pRing->mpData + offset))->mLength = -1;
+		offset = 0;
+	}
+
+	LogRecord* pRecord = (LogRecord*) (pRing->mpData + offset);
+	mClock.now (pRecord->mTime);
+	pRecord->mFatality = fatality;
+	pRecord->mErrnum   = errnum < 0? -errnum : errnum;
+
+	int i = 0;
+	for (; i < (int) sizeof (pRecord->mModule) - 1 && modulename[i]; ++i)
+		pRecord->mModule[i] = modulename[i];
+	pRecord->mModule[i] = '\0';
+
+	/* Format the text right after the header. */
+	va_list ap;
+	va_start (ap, message);
+	int len = vsnprintf ((char*) (pRecord + 1), MSRV_LOG_MESSAGE_LEN, message, ap);
+	va_end (ap);
+	if (len < 0)
+		len = 0;
+	else if (len >= MSRV_LOG_MESSAGE_LEN)
+		len = MSRV_LOG_MESSAGE_LEN - 1;
+
+	pRecord->mTextLen = len;
+	pRecord->mLength  = MSRV_LOG_RECORD_ALIGN (sizeof (LogRecord) + len);
+
+	/* Publish the message, then wake the writer if it is asleep. The */
+	/* fence pairs with the one in run(), so that either the writer   */
+	/* sees the message or we see it sleeping.                        */
+	__atomic_store_n (&pRing->mHead, head + skip + pRecord->mLength, __ATOMIC_RELEASE);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&mSleeping, __ATOMIC_RELAXED))
+		mWakeup.post ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Waits until the messages logged so far have been written.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult AsyncLog::flush ()
+{
+	/* Holding the lock keeps the writer from freeing rings under us. */
+	mRingLock.lock ();
+
+	for (LogRing* pRing = mpRings; pRing; pRing = pRing->mpNext) {
+		unsigned long head = __atomic_load_n (&pRing->mHead, __ATOMIC_ACQUIRE);
+		while ((long) (head - __atomic_load_n (&pRing->mTail, __ATOMIC_ACQUIRE)) > 0) {
+			mWakeup.post ();
+
+			struct timespec delay = {0, 1000000};
+			nanosleep (&delay, NULL);
+		}
+	}
+
+	mRingLock.unlock ();
+
+	return LogFile::flush ();
+}
+
+/*******************************************************************************
+ * \fn void AsyncLog::setBlocking (bool blocking)
+ *
+ * Sets whether @ref message() waits for the writer to make room in a
+ * full ring. By default, the message is dropped instead, so that
+ * logging never stalls the caller.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn long AsyncLog::drops () const
+ *
+ * Returns the number of messages dropped because of a full ring, or
+ * because the ring of the thread could not be created.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Runs the writer loop.
+ *
+ * Writes the messages in the rings until the log is destroyed, then
+ * writes the rest and exits.
+ ******************************************************************************/
+void* AsyncLog::run ()
+{
+	while (1) {
+		bool stopping = __atomic_load_n (&mStopping, __ATOMIC_ACQUIRE);
+
+		if (drain () > 0)
+			continue;
+
+		reap ();
+		if (stopping)
+			break;
+
+		/* Go to sleep, unless a message came after the drain. */
+		__atomic_store_n (&mSleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		if (!pending () && !__atomic_load_n (&mStopping, __ATOMIC_ACQUIRE))
+			mWakeup.wait (MSRV_LOG_FLUSH_MSEC / 1000.0);
+		__atomic_store_n (&mSleeping, false, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+ * Writes the messages that are in the rings now.
+ *
+ * The rings are merged by the time of the messages, so that the log
+ * stays in time order across threads.
+ *
+ * @return Number of messages written.
+ ******************************************************************************/
+int AsyncLog::drain ()
+{
+	LogRing* pFirst = __atomic_load_n (&mpRings, __ATOMIC_ACQUIRE);
+	int      count  = 0;
+
+	while (1) {
+		/* Find the oldest message at the tails of the rings. */
+		LogRing*   pOldestRing = NULL;
+		LogRecord* pOldest     = NULL;
+		for (LogRing* pRing = pFirst; pRing; pRing = pRing->mpNext) {
+			unsigned long head = __atomic_load_n (&pRing->mHead, __ATOMIC_ACQUIRE);
+			if (pRing->mTail == head)
+				continue;
+
+			int        offset  = pRing->mTail & (pRing->mLength - 1);
+			LogRecord* pRecord = (LogRecord*) (pRing->mpData + offset);
+			if (pRecord->mLength < 0) {
+				/* The message is at the start of the ring. */
+				__atomic_store_n (&pRing->mTail, pRing->mTail + pRing->mLength - offset,
+								  __ATOMIC_RELEASE);
+				pRecord = (LogRecord*) pRing->mpData;
+			}
+
+			if (!pOldest || pRecord->mTime.tv_sec < pOldest->mTime.tv_sec ||
+				(pRecord->mTime.tv_sec == pOldest->mTime.tv_sec &&
+				 pRecord->mTime.tv_nsec < pOldest->mTime.tv_nsec)) {
+				pOldestRing = pRing;
+				pOldest     = pRecord;
+			}
+		}
+
+		if (!pOldest)
+			break;
+
+		writeLine (pOldest->mTime, pOldest->mModule, pOldest->mFatality,
+				   pOldest->mErrnum, (const char*) (pOldest + 1), pOldest->mTextLen);
+
+		/* The line has been copied; give the room back to the owner. */
+		__atomic_store_n (&pOldestRing->mTail, pOldestRing->mTail + pOldest->mLength,
+						  __ATOMIC_RELEASE);
+		count++;
+	}
+
+	/* Tell about messages lost since the last report. */
+	long drops = __atomic_load_n (&mDrops, __ATOMIC_RELAXED);
+	if (drops != mDropsWritten) {
+		char text[128];
+		int  len = snprintf (text, sizeof (text),
+							 "Dropped %ld log messages; no room in a log ring.",
+							 drops - mDropsWritten);
+		struct timespec now;
+		mClock.now (now);
+		writeLine (now, "LOG", Warning, -MSRVERR_LOG_RING_FULL, text, len);
+		mDropsWritten = drops;
+	}
+
+	if (mBatchLen > 0) {
+		writeBatch ();
+		LogFile::flush ();
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * Checks if any ring has messages to write.
+ ******************************************************************************/
+bool AsyncLog::pending ()
+{
+	for (LogRing* pRing = __atomic_load_n (&mpRings, __ATOMIC_ACQUIRE); pRing; pRing = pRing->mpNext)
+		if (pRing->mTail != __atomic_load_n (&pRing->mHead, __ATOMIC_ACQUIRE))
+			return true;
+
+	return false;
+}
+
+/*******************************************************************************
+ * Frees the empty rings of threads that have exited.
+ ******************************************************************************/
+void AsyncLog::reap ()
+{
+	mRingLock.lock ();
+
+	LogRing** ppRing = &mpRings;
+	while (LogRing* pRing = *ppRing) {
+		if (__atomic_load_n (&pRing->mAbandoned, __ATOMIC_ACQUIRE) &&
+			pRing->mTail == __atomic_load_n (&pRing->mHead, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n (ppRing, pRing->mpNext, __ATOMIC_RELEASE);
+			free (pRing->mpData);
+			delete pRing;
+		} else
+			ppRing = &pRing->mpNext;
+	}
+
+	mRingLock.unlock ();
+}
+
+/*******************************************************************************
+ * Formats a log line into the batch.
+ *
+ * The time prefix is formatted once per second by the log clock.
+ ******************************************************************************/
+void AsyncLog::writeLine (
+	const struct timespec& rTime,      /**< Time of the message.       */
+	const char*            modulename, /**< Module that logged it.     */
+	int                    fatality,   /**< Severity of the event.     */
+	int                    errnum,     /**< Message number.            */
+	const char*            pText,      /**< Message text.              */
+	int                    len         /**< Length of the text.        */)
+{
+	/* The longest line fits in an empty batch. */
+	if (mBatchLen + LogClock::PrefixLen + 64 + len > MSRV_LOG_BATCH_LEN)
+		writeBatch ();
+
+	mBatchLen += mClock.format (rTime, mpBatch + mBatchLen);
+
+	int written = snprintf (mpBatch + mBatchLen, MSRV_LOG_BATCH_LEN - mBatchLen,
+							"%s %s %d: %.*s\n",
+							modulename, fatalityName (fatality),
+							errnum, len, pText);
+	if (written > 0)
+		mBatchLen += written;
+}
+
+/*******************************************************************************
+ * Writes the batch to the log file with one call.
+ ******************************************************************************/
+void AsyncLog::writeBatch ()
+{
+	write (mpBatch, mBatchLen);
+	mBatchLen = 0;
+}
+
+end_namespace (MSrv);
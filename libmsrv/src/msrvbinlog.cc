@@ -0,0 +1,1000 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvbinlog.h>
+#include <magicserver/msrverror.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+#include <stdexcept>
+
+#define MSRV_BINLOG_MAGIC      "MSRVBLOG"
+#define MSRV_BINLOG_VERSION    1
+#define MSRV_BINLOG_ALIGN(len) (((len) + 7) & ~7)
+#define MSRV_BINLOG_NULL       0xffff /* Length of a NULL string argument. */
+
+begin_namespace (MSrv);
+
+/* Types of the raw arguments of a message. */
+enum {ArgInt = 1, ArgLong, ArgDouble, ArgLongDouble, ArgString, ArgPointer};
+
+/*******************************************************************************
+ * A module name or format string stored in a @ref BinaryLog.
+ *
+ * The slot is in use once mpText is set; the other fields are set
+ * before it.
+ ******************************************************************************/
+struct BinaryLogString {
+	const char*		mpText;     /**< Copy of the string, or NULL.               */
+	unsigned long	mHash;      /**< Hash of the string.                        */
+	uint32_t		mId;        /**< Id of the string in the log.               */
+	int				mArgs;      /**< Raw arguments, or -1 if not stored raw.    */
+	unsigned char	mTypes[MSRV_BINLOG_ARGS]; /**< Types of the raw arguments.  */
+};
+
+/*******************************************************************************
+ * Scans a printf conversion.
+ *
+ * Sets the type of the argument it takes, 0 for "%%", and the number
+ * of int arguments taken by '*' before it.
+ *
+ * \return Pointer after the conversion, or NULL if the arguments of
+ * the conversion can not be stored raw.
+ ******************************************************************************/
+static const char* scanConversion (
+	const char* p,      /**< The '%' starting the conversion.   */
+	int*        pType,  /**< Receives the argument type.        */
+	int*        pStars  /**< Receives the '*' arguments.        */)
+{
+	*pStars = 0;
+	if (*++p == '%') {
+		*pType = 0;
+		return p + 1;
+	}
+
+	while (*p && strchr ("-+ #0'I", *p))
+		p++;
+
+	/* Width; positional arguments are not supported. */
+	if (*p == '*') {
+		(*pStars)++;
+		p++;
+	} else
+		while (*p >= '0' && *p <= '9')
+			p++;
+	if (*p == '$' || (*p >= '0' && *p <= '9'))
+		return NULL;
+
+	if (*p == '.') {
+		if (*++p == '*') {
+			(*pStars)++;
+			p++;
+		} else
+			while (*p >= '0' && *p <= '9')
+				p++;
+	}
+
+	/* Length modifiers. */
+	bool isLong = false, isLongDouble = false;
+	for (;; p++) {
+		if (*p == 'l' || *p == 'j' || *p == 'z' || *p == 't' || *p == 'q')
+			isLong = true;
+		else if (*p == 'L')
+			isLongDouble = true;
+		else if (*p != 'h')
+			break;
+	}
+
+	switch (*p) {
+	  case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		  *pType = isLong || isLongDouble? ArgLong : ArgInt;
+		  break;
+	  case 'c':
+		  if (isLong)
+			  return NULL;
+		  *pType = ArgInt;
+		  break;
+	  case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		  *pType = isLongDouble? ArgLongDouble : ArgDouble;
+		  break;
+	  case 's':
+		  if (isLong)
+			  return NULL;
+		  *pType = ArgString;
+		  break;
+	  case 'p':
+		  *pType = ArgPointer;
+		  break;
+	  default:
+		  return NULL;
+	}
+
+	return p + 1;
+}
+
+/*******************************************************************************
+ * Finds the types of the arguments of a format string.
+ *
+ * \return Number of arguments, or -1 if they can not be stored raw.
+ ******************************************************************************/
+static int parseFormat (const char* format, unsigned char* pTypes)
+{
+	int count = 0;
+
+	for (const char* p = format; *p;) {
+		if (*p != '%') {
+			p++;
+			continue;
+		}
+
+		int type, stars;
+		p = scanConversion (p, &type, &stars);
+		if (!p || count + stars + (type? 1 : 0) > MSRV_BINLOG_ARGS)
+			return -1;
+
+		while (stars--)
+			pTypes[count++] = ArgInt;
+		if (type)
+			pTypes[count++] = type;
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * Hashes a string with FNV-1a and finds its length.
+ ******************************************************************************/
+static unsigned long hashString (const char* pText, int* pLen)
+{
+	unsigned long hash = 14695981039346656037UL;
+	const char*   p    = pText;
+
+	for (; *p; ++p)
+		hash = (hash ^ (unsigned char) *p) * 1099511628211UL;
+
+	*pLen = p - pText;
+	return hash;
+}
+
+/*******************************************************************************
+ * Finds the slot of a string, or the free slot where it belongs.
+ ******************************************************************************/
+static BinaryLogString* findString (BinaryLogString* pStrings, unsigned long hash, const char* pText)
+{
+	unsigned int mask = MSRV_BINLOG_STRINGS - 1;
+
+	for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+		BinaryLogString* pString = &pStrings[i];
+		const char*      pStored = __atomic_load_n (&pString->mpText, __ATOMIC_ACQUIRE);
+
+		if (!pStored || (pString->mHash == hash && !strcmp (pStored, pText)))
+			return pString;
+	}
+}
+
+/*******************************************************************************
+ * Opens a binary log file with the given name.
+ *
+ * A new file is preallocated to the given length. An existing file
+ * keeps its length, and the log continues after its last record.
+ ******************************************************************************/
+BinaryLog::BinaryLog (
+	const char* filename, /**< File to write the log to.            */
+	long        length    /**< Length of the file, if it is created. */)
+{
+	mpFilename  = filename? strdup (filename) : NULL;
+	mLength     = length;
+	mFd         = -1;
+	mpMap       = NULL;
+	mMapLen     = 0;
+	mOffset     = 0;
+	mDrops      = 0;
+	mStringCount = 0;
+
+	mpStrings = (BinaryLogString*) calloc (MSRV_BINLOG_STRINGS, sizeof (BinaryLogString));
+	if (!mpStrings) {
+		free (mpFilename);
+		throw std::bad_alloc ();
+	}
+
+	int result = open ();
+	if (result < 0) {
+		free (mpStrings);
+		free (mpFilename);
+		char buffer[1024];
+		sprintf (buffer, "Opening binary log file failed with error %d.", -result);
+		throw std::runtime_error (buffer);
+	}
+}
+
+/*******************************************************************************
+ * Closes the log file
+ ******************************************************************************/
+BinaryLog::~BinaryLog ()
+{
+	close ();
+
+	free (mpStrings);
+	free (mpFilename);
+}
+
+/*******************************************************************************
+ * Opens the log file
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLog::open ()
+{
+	if (!mpFilename)
+		return MSRVERR_LOG_NO_FILENAME;
+
+	if (mpMap)
+		return MSRVERR_LOG_ALREADY_OPEN;
+
+	int fd = ::open (mpFilename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return MSRVERR_LOG_OPEN_FAILED;
+
+	struct stat fileStat;
+	if (fstat (fd, &fileStat) < 0) {
+		::close (fd);
+		return MSRVERR_LOG_OPEN_FAILED;
+	}
+
+	/* Preallocate a new file, so that writing to the map can not fail. */
+	long length = fileStat.st_size;
+	bool isNew  = length < (long) sizeof (BinaryLogHeader);
+	if (isNew) {
+		length = mLength;
+		if (length < 65536)
+			length = 65536;
+		if (posix_fallocate (fd, 0, length) != 0 && ftruncate (fd, length) < 0) {
+			::close (fd);
+			return MSRVERR_LOG_OPEN_FAILED;
+		}
+	}
+
+	char* pMap = (char*) mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pMap == MAP_FAILED) {
+		::close (fd);
+		return MSRVERR_LOG_OPEN_FAILED;
+	}
+
+	BinaryLogHeader* pHeader = (BinaryLogHeader*) pMap;
+	if (isNew) {
+		memset (pHeader, 0, sizeof (BinaryLogHeader));
+		memcpy (pHeader->mMagic, MSRV_BINLOG_MAGIC, sizeof (pHeader->mMagic));
+		pHeader->mVersion   = MSRV_BINLOG_VERSION;
+		pHeader->mHeaderLen = sizeof (BinaryLogHeader);
+		pHeader->mFileLen   = length;
+
+	} else if (memcmp (pHeader->mMagic, MSRV_BINLOG_MAGIC, sizeof (pHeader->mMagic)) ||
+			   pHeader->mVersion != MSRV_BINLOG_VERSION ||
+			   pHeader->mHeaderLen < sizeof (BinaryLogHeader) ||
+			   (long) pHeader->mHeaderLen > length) {
+		munmap (pMap, length);
+		::close (fd);
+		return MSRVERR_LOG_INVALID_FILE;
+	}
+
+	/* Continue after the last record. */
+	long offset = pHeader->mHeaderLen;
+	while (offset + (long) sizeof (BinaryLogRecord) <= length) {
+		const BinaryLogRecord* pRecord = (const BinaryLogRecord*) (pMap + offset);
+		if (pRecord->mLength < sizeof (BinaryLogRecord) || pRecord->mLength % 8 ||
+			offset + (long) pRecord->mLength > length)
+			break;
+		offset += pRecord->mLength;
+	}
+
+	mStringLock.lock ();
+	mFd      = fd;
+	mMapLen  = length;
+	mOffset  = offset;
+	__atomic_store_n (&mpMap, pMap, __ATOMIC_RELEASE);
+	mStringLock.unlock ();
+
+	/* The string ids start again from here. */
+	BinaryLogRecord* pRecord = reserve (0);
+	if (pRecord) {
+		struct timespec now;
+		mClock.now (now);
+		pRecord->mSec  = now.tv_sec;
+		pRecord->mNsec = now.tv_nsec;
+		commit (pRecord, BinaryLogRecord::Open);
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Closes the log file
+ *
+ * The stored strings are forgotten, as their ids start again when
+ * the log is opened.
+ ******************************************************************************/
+void BinaryLog::close ()
+{
+	mStringLock.lock ();
+
+	if (mpMap) {
+		msync (mpMap, mMapLen, MS_ASYNC);
+		munmap (mpMap, mMapLen);
+		::close (mFd);
+		__atomic_store_n (&mpMap, (char*) NULL, __ATOMIC_RELEASE);
+		mFd     = -1;
+		mMapLen = 0;
+	}
+
+	for (int i = 0; i < MSRV_BINLOG_STRINGS; ++i)
+		free ((char*) mpStrings[i].mpText);
+	memset (mpStrings, 0, MSRV_BINLOG_STRINGS * sizeof (BinaryLogString));
+	mStringCount = 0;
+
+	mStringLock.unlock ();
+}
+
+/*******************************************************************************
+ * Writes the mapped records to the file.
+ *
+ * The records reach the file also without this, as the map is
+ * shared; this waits until they are on the disk.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLog::flush ()
+{
+	if (!mpMap)
+		return MSRVERR_LOG_NOT_OPEN;
+
+	return msync (mpMap, mMapLen, MS_SYNC) < 0? MSRVERR_LOG_WRITE_FAILED : 0;
+}
+
+/*******************************************************************************
+ * Reserves a record from the file.
+ *
+ * \return The record with its length set, or NULL if the file is full.
+ ******************************************************************************/
+BinaryLogRecord* BinaryLog::reserve (
+	int payloadLen /**< Bytes after the record header. */)
+{
+	int  len    = MSRV_BINLOG_ALIGN (sizeof (BinaryLogRecord) + payloadLen);
+	long offset = __atomic_fetch_add (&mOffset, len, __ATOMIC_RELAXED);
+
+	if (offset + len > mMapLen) {
+		__atomic_add_fetch (&mDrops, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	BinaryLogRecord* pRecord = (BinaryLogRecord*) (mpMap + offset);
+	pRecord->mLength     = len;
+	pRecord->mPayloadLen = payloadLen;
+	return pRecord;
+}
+
+/*******************************************************************************
+ * Completes a record by setting its type.
+ ******************************************************************************/
+void BinaryLog::commit (BinaryLogRecord* pRecord, int type)
+{
+	__atomic_store_n (&pRecord->mType, (uint8_t) type, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * Finds a stored string, or stores it.
+ *
+ * Known strings are found without locking. A new string gets the
+ * next id and is written to the log in a String record before it is
+ * published, so that the records using it come after it.
+ *
+ * \return The string, or NULL if it can not be stored.
+ ******************************************************************************/
+BinaryLogString* BinaryLog::intern (const char* pText)
+{
+	int              len;
+	unsigned long    hash    = hashString (pText, &len);
+	BinaryLogString* pString = findString (mpStrings, hash, pText);
+
+	if (__atomic_load_n (&pString->mpText, __ATOMIC_ACQUIRE))
+		return pString;
+
+	mStringLock.lock ();
+
+	/* Another thread may have stored it meanwhile. */
+	pString = findString (mpStrings, hash, pText);
+	if (!pString->mpText) {
+		char*            pCopy   = NULL;
+		BinaryLogRecord* pRecord = NULL;
+
+		if (mpMap && mStringCount < MSRV_BINLOG_STRINGS * 3 / 4 && len < MSRV_LOG_MESSAGE_LEN)
+			pCopy = strdup (pText);
+		if (pCopy)
+			pRecord = reserve (len + 1);
+
+		if (pRecord) {
+			uint32_t id = ++mStringCount;
+			pRecord->mFormat = id;
+			memcpy ((char*) (pRecord + 1), pText, len + 1);
+			commit (pRecord, BinaryLogRecord::String);
+
+			pString->mHash = hash;
+			pString->mId   = id;
+			pString->mArgs = parseFormat (pText, pString->mTypes);
+			__atomic_store_n (&pString->mpText, (const char*) pCopy, __ATOMIC_RELEASE);
+		} else {
+			free (pCopy);
+			pString = NULL;
+		}
+	}
+
+	mStringLock.unlock ();
+	return pString;
+}
+
+/*******************************************************************************
+ * Writes a log message
+ *
+ * Copies the raw arguments to a Message record; see @ref BinaryLog.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLog::message (
+	const char* modulename,  /**< An identifier of the module writing to log. */
+	int         fatality,    /**< Severity of the event.                      */
+	int         errnum,      /**< Possible message number.                    */
+	const char* message,     /**< Message (as a format string for printf).    */
+	...)
+{
+	if (!message || !modulename)
+		return MSRVERR_NULL_ARGUMENT;
+
+	if (fatality < 0 || fatality > Debug)
+		return MSRVERR_LOG_INVALID_FATALITY;
+
+	/* Drop filtered messages before copying anything. */
+	if (!isLogged (fatality))
+		return 0;
+
+	if (!__atomic_load_n (&mpMap, __ATOMIC_ACQUIRE))
+		return MSRVERR_LOG_NOT_OPEN;
+
+	/* Ensure that the error code is positive. */
+	if (errnum < 0)
+		errnum = -errnum;
+
+	BinaryLogString* pModule = intern (modulename);
+	BinaryLogString* pFormat = pModule? intern (message) : NULL;
+
+	va_list ap;
+	va_start (ap, message);
+
+	if (!pFormat || pFormat->mArgs < 0) {
+		MSrvResult result = writeText (modulename, fatality, errnum, message, ap);
+		va_end (ap);
+		return result;
+	}
+
+	/* Copy the raw arguments. Each takes at most 16 bytes, except strings. */
+	char payload[MSRV_LOG_MESSAGE_LEN];
+	int  len = 0;
+	for (int i = 0; i < pFormat->mArgs; ++i) {
+		switch (pFormat->mTypes[i]) {
+		  case ArgInt: {
+			  int value = va_arg (ap, int);
+			  memcpy (payload + len, &value, sizeof (value));
+			  len += sizeof (value);
+			  break;
+		  }
+		  case ArgLong: {
+			  long long value = va_arg (ap, long long);
+			  memcpy (payload + len, &value, sizeof (value));
+			  len += sizeof (value);
+			  break;
+		  }
+		  case ArgDouble: {
+			  double value = va_arg (ap, double);
+			  memcpy (payload + len, &value, sizeof (value));
+			  len += sizeof (value);
+			  break;
+		  }
+		  case ArgLongDouble: {
+			  long double value = va_arg (ap, long double);
+			  memcpy (payload + len, &value, sizeof (value));
+			  len += sizeof (value);
+			  break;
+		  }
+		  case ArgPointer: {
+			  void* value = va_arg (ap, void*);
+			  memcpy (payload + len, &value, sizeof (value));
+			  len += sizeof (value);
+			  break;
+		  }
+		  case ArgString: {
+			  const char* value = va_arg (ap, const char*);
+			  int         room  = MSRV_LOG_MESSAGE_LEN - len - 16 * (pFormat->mArgs - i);
+			  uint16_t    strLen = value? strnlen (value, room > 0? room : 0) : MSRV_BINLOG_NULL;
+			  memcpy (payload + len, &strLen, sizeof (strLen));
+			  len += sizeof (strLen);
+			  if (value) {
+				  memcpy (payload + len, value, strLen);
+				  len += strLen;
+			  }
+			  break;
+		  }
+		}
+	}
+	va_end (ap);
+
+	BinaryLogRecord* pRecord = reserve (len);
+	if (!pRecord)
+		return MSRVERR_LOG_FULL;
+
+	struct timespec now;
+	mClock.now (now);
+	pRecord->mFatality = fatality;
+	pRecord->mErrnum   = errnum;
+	pRecord->mModule   = pModule->mId;
+	pRecord->mFormat   = pFormat->mId;
+	pRecord->mSec      = now.tv_sec;
+	pRecord->mNsec     = now.tv_nsec;
+	memcpy ((char*) (pRecord + 1), payload, len);
+	commit (pRecord, BinaryLogRecord::Message);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Formats a message into a Text record.
+ *
+ * Used when the arguments can not be stored raw.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLog::writeText (
+	const char* modulename, /**< Module that logged the message. */
+	int         fatality,   /**< Severity of the event.          */
+	int         errnum,     /**< Message number.                 */
+	const char* message,    /**< Format string.                  */
+	va_list     ap          /**< Arguments of the format.        */)
+{
+	char payload[MSRV_LOG_MESSAGE_LEN];
+	int  moduleLen = strnlen (modulename, 64);
+
+	memcpy (payload, modulename, moduleLen);
+	payload[moduleLen] = '\0';
+
+	int room    = MSRV_LOG_MESSAGE_LEN - moduleLen - 1;
+	int textLen = vsnprintf (payload + moduleLen + 1, room, message, ap);
+	if (textLen < 0)
+		textLen = 0;
+	else if (textLen >= room)
+		textLen = room - 1;
+
+	BinaryLogRecord* pRecord = reserve (moduleLen + 1 + textLen);
+	if (!pRecord)
+		return MSRVERR_LOG_FULL;
+
+	struct timespec now;
+	mClock.now (now);
+	pRecord->mFatality = fatality;
+	pRecord->mErrnum   = errnum;
+	pRecord->mSec      = now.tv_sec;
+	pRecord->mNsec     = now.tv_nsec;
+	memcpy ((char*) (pRecord + 1), payload, moduleLen + 1 + textLen);
+	commit (pRecord, BinaryLogRecord::Text);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Writes a block of data to the log as such
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLog::write (const char* data, int len)
+{
+	if (!data)
+		return MSRVERR_NULL_ARGUMENT;
+
+	if (!__atomic_load_n (&mpMap, __ATOMIC_ACQUIRE))
+		return MSRVERR_LOG_NOT_OPEN;
+
+	while (len > 0) {
+		int chunk = len < MSRV_LOG_MESSAGE_LEN? len : MSRV_LOG_MESSAGE_LEN;
+
+		BinaryLogRecord* pRecord = reserve (chunk);
+		if (!pRecord)
+			return MSRVERR_LOG_FULL;
+
+		memcpy ((char*) (pRecord + 1), data, chunk);
+		commit (pRecord, BinaryLogRecord::Raw);
+		data += chunk;
+		len  -= chunk;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Creates a reader with no file open.
+ ******************************************************************************/
+BinaryLogReader::BinaryLogReader ()
+{
+	mFd         = -1;
+	mpMap       = NULL;
+	mMapLen     = 0;
+	mOffset     = 0;
+	mpStrings   = NULL;
+	mStringsLen = 0;
+}
+
+/*******************************************************************************
+ * Closes the file
+ ******************************************************************************/
+BinaryLogReader::~BinaryLogReader ()
+{
+	close ();
+}
+
+/*******************************************************************************
+ * Opens a binary log file for reading.
+ *
+ * The file may still be written by a @ref BinaryLog.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult BinaryLogReader::open (const char* filename)
+{
+	if (!filename)
+		return MSRVERR_LOG_NO_FILENAME;
+
+	if (mpMap)
+		return MSRVERR_LOG_ALREADY_OPEN;
+
+	int fd = ::open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return MSRVERR_LOG_OPEN_FAILED;
+
+	struct stat fileStat;
+	if (fstat (fd, &fileStat) < 0 || fileStat.st_size < (off_t) sizeof (BinaryLogHeader)) {
+		::close (fd);
+		return MSRVERR_LOG_INVALID_FILE;
+	}
+
+	const char* pMap = (const char*) mmap (NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (pMap == MAP_FAILED) {
+		::close (fd);
+		return MSRVERR_LOG_OPEN_FAILED;
+	}
+
+	const BinaryLogHeader* pHeader = (const BinaryLogHeader*) pMap;
+	if (memcmp (pHeader->mMagic, MSRV_BINLOG_MAGIC, sizeof (pHeader->mMagic)) ||
+		pHeader->mVersion != MSRV_BINLOG_VERSION ||
+		pHeader->mHeaderLen < sizeof (BinaryLogHeader) ||
+		(off_t) pHeader->mHeaderLen > fileStat.st_size) {
+		munmap ((void*) pMap, fileStat.st_size);
+		::close (fd);
+		return MSRVERR_LOG_INVALID_FILE;
+	}
+
+	mFd     = fd;
+	mpMap   = pMap;
+	mMapLen = fileStat.st_size;
+	mOffset = pHeader->mHeaderLen;
+	return 0;
+}
+
+/*******************************************************************************
+ * Closes the file
+ ******************************************************************************/
+void BinaryLogReader::close ()
+{
+	if (mpMap) {
+		munmap ((void*) mpMap, mMapLen);
+		::close (mFd);
+		mpMap = NULL;
+		mFd   = -1;
+	}
+
+	free (mpStrings);
+	mpStrings   = NULL;
+	mStringsLen = 0;
+}
+
+/*******************************************************************************
+ * Renders the next message of the log.
+ *
+ * The line ends with a newline and is cut to fit the buffer.
+ *
+ * \return Length of the line, 0 at the end of the log, or a negative
+ * error code.
+ ******************************************************************************/
+int BinaryLogReader::next (
+	char* pBuffer, /**< Receives the line.          */
+	int   len      /**< Length of the buffer.       */)
+{
+	if (!mpMap)
+		return MSRVERR_LOG_NOT_OPEN;
+
+	if (!pBuffer || len < LogClock::PrefixLen + 64)
+		return MSRVERR_INVALID_ARGUMENT;
+
+	while (mOffset + (long) sizeof (BinaryLogRecord) <= mMapLen) {
+		const BinaryLogRecord* pRecord = (const BinaryLogRecord*) (mpMap + mOffset);
+		if (pRecord->mLength < sizeof (BinaryLogRecord) || pRecord->mLength % 8 ||
+			mOffset + (long) pRecord->mLength > mMapLen ||
+			sizeof (BinaryLogRecord) + pRecord->mPayloadLen > pRecord->mLength)
+			break;
+
+		mOffset += pRecord->mLength;
+
+		switch (__atomic_load_n (&pRecord->mType, __ATOMIC_ACQUIRE)) {
+		  case BinaryLogRecord::Open:
+			  /* The ids start again. */
+			  if (mpStrings)
+				  memset (mpStrings, 0, mStringsLen * sizeof (const char*));
+			  break;
+		  case BinaryLogRecord::String:
+			  define (pRecord);
+			  break;
+		  case BinaryLogRecord::Message:
+		  case BinaryLogRecord::Text:
+		  case BinaryLogRecord::Raw:
+			  return render (pRecord, pBuffer, len);
+		}
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Remembers the string of a String record.
+ ******************************************************************************/
+void BinaryLogReader::define (const BinaryLogRecord* pRecord)
+{
+	const char* pText = (const char*) (pRecord + 1);
+	uint32_t    id    = pRecord->mFormat;
+
+	if (pRecord->mPayloadLen == 0 || pText[pRecord->mPayloadLen - 1] != '\0' ||
+		id == 0 || id > 16 * MSRV_BINLOG_STRINGS)
+		return;
+
+	if ((int) id >= mStringsLen) {
+		int newLen = mStringsLen? mStringsLen : 256;
+		while (newLen <= (int) id)
+			newLen *= 2;
+
+		const char** pStrings = (const char**) realloc (mpStrings, newLen * sizeof (const char*));
+		if (!pStrings)
+			return;
+
+		memset (pStrings + mStringsLen, 0, (newLen - mStringsLen) * sizeof (const char*));
+		mpStrings   = pStrings;
+		mStringsLen = newLen;
+	}
+
+	mpStrings[id] = pText;
+}
+
+/*******************************************************************************
+ * Returns the string of an id, or NULL if it is not defined.
+ ******************************************************************************/
+const char* BinaryLogReader::string (uint32_t id) const
+{
+	return (int) id < mStringsLen? mpStrings[id] : NULL;
+}
+
+/*******************************************************************************
+ * Appends formatted text to a line, cutting it at the end of the buffer.
+ ******************************************************************************/
+static void append (char* pBuffer, int len, int& rPos, const char* format, ...)
+{
+	va_list ap;
+	va_start (ap, format);
+	int written = vsnprintf (pBuffer + rPos, len - rPos, format, ap);
+	va_end (ap);
+
+	if (written > 0)
+		rPos = rPos + written < len? rPos + written : len - 1;
+}
+
+/*******************************************************************************
+ * Ends a line with a newline, cutting it to fit the buffer.
+ *
+ * \return Length of the line.
+ ******************************************************************************/
+static int endLine (char* pBuffer, int len, int pos)
+{
+	if (pos > len - 2)
+		pos = len - 2;
+
+	pBuffer[pos++] = '\n';
+	pBuffer[pos]   = '\0';
+	return pos;
+}
+
+/* Formats a raw argument with the '*' arguments before it. */
+#define MSRV_BINLOG_PRINT(value)												\
+	(stars == 0? snprintf (pBuffer + pos, len - pos, spec, value) :			\
+	 stars == 1? snprintf (pBuffer + pos, len - pos, spec, starArgs[0], value) :	\
+				 snprintf (pBuffer + pos, len - pos, spec, starArgs[0], starArgs[1], value))
+
+/*******************************************************************************
+ * Renders a record as a log line.
+ *
+ * \return Length of the line.
+ ******************************************************************************/
+int BinaryLogReader::render (
+	const BinaryLogRecord* pRecord, /**< A Message, Text or Raw record. */
+	char*                  pBuffer, /**< Receives the line.             */
+	int                    len      /**< Length of the buffer.          */)
+{
+	const char* pPayload = (const char*) (pRecord + 1);
+	const char* pEnd     = pPayload + pRecord->mPayloadLen;
+	int         pos      = 0;
+
+	if (pRecord->mType == BinaryLogRecord::Raw) {
+		append (pBuffer, len, pos, "%.*s", (int) pRecord->mPayloadLen, pPayload);
+		return pos;
+	}
+
+	struct timespec time;
+	time.tv_sec  = pRecord->mSec;
+	time.tv_nsec = pRecord->mNsec;
+	pos = mClock.format (time, pBuffer);
+
+	if (pRecord->mType == BinaryLogRecord::Text) {
+		int moduleLen = strnlen (pPayload, pRecord->mPayloadLen);
+		const char* pText = pPayload + moduleLen + 1;
+		append (pBuffer, len, pos, "%.*s %s %d: %.*s",
+				moduleLen, pPayload, Log::fatalityName (pRecord->mFatality),
+				pRecord->mErrnum, pText < pEnd? (int) (pEnd - pText) : 0, pText);
+		return endLine (pBuffer, len, pos);
+	}
+
+	const char* module = string (pRecord->mModule);
+	const char* format = string (pRecord->mFormat);
+	append (pBuffer, len, pos, "%s %s %d: ", module? module : "?",
+			Log::fatalityName (pRecord->mFatality), pRecord->mErrnum);
+
+	if (!format) {
+		append (pBuffer, len, pos, "<unknown format %u>", pRecord->mFormat);
+		return endLine (pBuffer, len, pos);
+	}
+
+	/* Copy the text and format each conversion with its raw argument. */
+	const char* p = format;
+	while (*p && pos < len - 2) {
+		if (*p != '%') {
+			pBuffer[pos++] = *p++;
+			continue;
+		}
+
+		int         type, stars;
+		const char* pNext = scanConversion (p, &type, &stars);
+		if (!pNext || pNext - p >= 64)
+			break;
+
+		char spec[64];
+		memcpy (spec, p, pNext - p);
+		spec[pNext - p] = '\0';
+		p = pNext;
+
+		if (!type) {
+			pBuffer[pos++] = '%';
+			continue;
+		}
+
+		int starArgs[2] = {0, 0};
+		for (int i = 0; i < stars; ++i) {
+			if (pPayload + sizeof (int) > pEnd)
+				break;
+			memcpy (&starArgs[i], pPayload, sizeof (int));
+			pPayload += sizeof (int);
+		}
+
+		int written = 0;
+		switch (type) {
+		  case ArgInt: {
+			  int value;
+			  if (pPayload + sizeof (value) > pEnd)
+				  break;
+			  memcpy (&value, pPayload, sizeof (value));
+			  pPayload += sizeof (value);
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		  case ArgLong: {
+			  long long value;
+			  if (pPayload + sizeof (value) > pEnd)
+				  break;
+			  memcpy (&value, pPayload, sizeof (value));
+			  pPayload += sizeof (value);
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		  case ArgDouble: {
+			  double value;
+			  if (pPayload + sizeof (value) > pEnd)
+				  break;
+			  memcpy (&value, pPayload, sizeof (value));
+			  pPayload += sizeof (value);
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		  case ArgLongDouble: {
+			  long double value;
+			  if (pPayload + sizeof (value) > pEnd)
+				  break;
+			  memcpy (&value, pPayload, sizeof (value));
+			  pPayload += sizeof (value);
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		  case ArgPointer: {
+			  void* value;
+			  if (pPayload + sizeof (value) > pEnd)
+				  break;
+			  memcpy (&value, pPayload, sizeof (value));
+			  pPayload += sizeof (value);
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		  case ArgString: {
+			  uint16_t strLen;
+			  if (pPayload + sizeof (strLen) > pEnd)
+				  break;
+			  memcpy (&strLen, pPayload, sizeof (strLen));
+			  pPayload += sizeof (strLen);
+
+			  char value[MSRV_LOG_MESSAGE_LEN];
+			  if (strLen == MSRV_BINLOG_NULL)
+				  strcpy (value, "(null)");
+			  else {
+				  if (strLen >= sizeof (value) || pPayload + strLen > pEnd)
+					  break;
+				  memcpy (value, pPayload, strLen);
+				  value[strLen] = '\0';
+				  pPayload += strLen;
+			  }
+			  written = MSRV_BINLOG_PRINT (value);
+			  break;
+		  }
+		}
+
+		if (written > 0)
+			pos = pos + written < len - 1? pos + written : len - 1;
+	}
+
+	return endLine (pBuffer, len, pos);
+}
+
+end_namespace (MSrv);
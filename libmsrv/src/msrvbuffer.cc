@@ -0,0 +1,385 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvbuffer.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Allocates a buffer for data of the given length.
+ *
+ * There is room for a terminating null after the data.
+ *
+ * @return The new buffer, or NULL if out of memory.
+ ******************************************************************************/
+SharedBuffer* SharedBuffer::allocate (int len)
+{
+	SharedBuffer* pBuffer = (SharedBuffer*) malloc (sizeof (SharedBuffer) + len + 1);
+	if (!pBuffer)
+		return NULL;
+
+	pBuffer->mRefCount = 1;
+	pBuffer->mLength   = len;
+	return pBuffer;
+}
+
+/*******************************************************************************
+ * Creates a buffer holding a copy of the given data.
+ *
+ * @return The new buffer, with one reference held by the caller, or
+ *         NULL if out of memory.
+ ******************************************************************************/
+SharedBuffer* SharedBuffer::create (
+	const char* pData, /**< Data to copy to the buffer. */
+	int         len    /**< Length of the data.         */)
+{
+	SharedBuffer* pBuffer = allocate (len);
+	if (pBuffer)
+		memcpy ((char*) pBuffer->data (), pData, len);
+	return pBuffer;
+}
+
+/*******************************************************************************
+ * Creates a buffer holding a formatted string.
+ *
+ * The format is as for printf(). The terminating null is not part of
+ * the data.
+ *
+ * @return The new buffer, with one reference held by the caller, or
+ *         NULL if out of memory.
+ ******************************************************************************/
+SharedBuffer* SharedBuffer::format (const char* format, ...)
+{
+	va_list args;
+
+	/* Find out the length first, so that it is formatted only once */
+	/* into the buffer.                                             */
+	va_start (args, format);
+	int len = vsnprintf (NULL, 0, format, args);
+	va_end (args);
+
+	if (len < 0)
+		len = 0;
+
+	SharedBuffer* pBuffer = allocate (len);
+	if (!pBuffer)
+		return NULL;
+
+	va_start (args, format);
+	vsnprintf ((char*) pBuffer->data (), len + 1, format, args);
+	va_end (args);
+
+	return pBuffer;
+}
+
+/*******************************************************************************
+ * \fn void SharedBuffer::ref ()
+ *
+ * Adds a reference to the buffer.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Drops a reference to the buffer, freeing it if it was the last one.
+ ******************************************************************************/
+void SharedBuffer::unref ()
+{
+	if (__atomic_sub_fetch (&mRefCount, 1, __ATOMIC_ACQ_REL) == 0)
+		free (this);
+}
+
+/*******************************************************************************
+ * \fn const char* SharedBuffer::data () const
+ *
+ * Returns the data of the buffer. It must not be changed.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn int SharedBuffer::length () const
+ *
+ * Returns the length of the data.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates an empty output queue.
+ ******************************************************************************/
+OutputQueue::OutputQueue ()
+{
+	mpRing   = NULL;
+	mSize    = 0;
+	mHead    = 0;
+	mCount   = 0;
+	mOffset  = 0;
+	mBytes   = 0;
+}
+
+/*******************************************************************************
+ * Destroys the queue, dropping the references to any unsent buffers.
+ ******************************************************************************/
+OutputQueue::~OutputQueue ()
+{
+	clear ();
+	free (mpRing);
+}
+
+/*******************************************************************************
+ * Adds a buffer to the end of the queue.
+ *
+ * The queue takes a reference to the buffer.
+ *
+ * @return 0 if successful, or MSRVERR_OUT_OF_MEMORY if the queue
+ *         could not grow, in which case the buffer is not queued.
+ ******************************************************************************/
+MSrvResult OutputQueue::push (SharedBuffer& rBuffer)
+{
+	if (mCount == mSize) {
+		/* Grow the ring, unwrapping it to the start of the new one. */
+		int            newSize = mSize? mSize*2 : 8;
+		SharedBuffer** pNewRing = (SharedBuffer**) malloc (newSize * sizeof (SharedBuffer*));
+		if (!pNewRing)
+			return MSRVERR_OUT_OF_MEMORY;
+
+		for (int i=0; i<mCount; ++i)
+			pNewRing[i] = mpRing[(mHead + i) % mSize];
+
+		free (mpRing);
+		mpRing = pNewRing;
+		mSize  = newSize;
+		mHead  = 0;
+	}
+
+	rBuffer.ref ();
+	mpRing[(mHead + mCount) % mSize] = &rBuffer;
+	mCount++;
+	mBytes += rBuffer.length ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Fills an I/O vector with the unsent data, for sending several
+ * buffers with one call.
+ *
+ * @return Number of vector entries filled.
+ ******************************************************************************/
+int OutputQueue::collect (
+	struct iovec* pVec,   /**< Vector to fill.                */
+	int           maxVec  /**< Number of entries in pVec.     */) const
+{
+	int count = 0;
+	for (; count < mCount && count < maxVec; ++count) {
+		SharedBuffer* pBuffer = mpRing[(mHead + count) % mSize];
+		int           offset  = count == 0? mOffset : 0;
+
+		pVec[count].iov_base = (void*) (pBuffer->data () + offset);
+		pVec[count].iov_len  = pBuffer->length () - offset;
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * Removes sent data from the front of the queue.
+ *
+ * Buffers that have been sent completely are dropped.
+ ******************************************************************************/
+void OutputQueue::consume (
+	long count /**< Number of bytes sent. */)
+{
+	mBytes -= count;
+
+	while (count > 0 && mCount > 0) {
+		SharedBuffer* pFront = mpRing[mHead];
+		long          left   = pFront->length () - mOffset;
+
+		if (count < left) {
+			mOffset += count;
+			return;
+		}
+
+		count  -= left;
+		mOffset = 0;
+		mHead   = (mHead + 1) % mSize;
+		mCount--;
+		pFront->unref ();
+	}
+}
+
+/*******************************************************************************
+ * Drops all the buffers in the queue.
+ ******************************************************************************/
+void OutputQueue::clear ()
+{
+	while (mCount > 0) {
+		mpRing[mHead]->unref ();
+		mHead = (mHead + 1) % mSize;
+		mCount--;
+	}
+
+	mHead   = 0;
+	mOffset = 0;
+	mBytes  = 0;
+}
+
+/*******************************************************************************
+ * \fn long OutputQueue::bytes () const
+ *
+ * Returns the number of bytes waiting to be sent.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates an empty datagram batch.
+ ******************************************************************************/
+DatagramBatch::DatagramBatch (
+	int maxCount /**< Most datagrams in one batch. */)
+{
+	mMaxCount = maxCount;
+	mCount    = 0;
+	mpAddrs   = new struct sockaddr_in [maxCount];
+	mpOffsets = new long [maxCount];
+	mpLengths = new int [maxCount];
+	mpData    = NULL;
+	mDataLen  = 0;
+	mDataSize = 0;
+}
+
+/*******************************************************************************
+ * Destroys the batch. Datagrams not sent are dropped.
+ ******************************************************************************/
+DatagramBatch::~DatagramBatch ()
+{
+	delete [] mpAddrs;
+	delete [] mpOffsets;
+	delete [] mpLengths;
+	free (mpData);
+}
+
+/*******************************************************************************
+ * Adds a datagram to the batch.
+ *
+ * The data is copied, so the caller may reuse its buffer right away.
+ *
+ * @return 0 if successful, MSRVERR_QUEUE_FULL if the batch is full
+ *         and must be sent first, or MSRVERR_OUT_OF_MEMORY if there
+ *         is no room for the data.
+ ******************************************************************************/
+MSrvResult DatagramBatch::add (
+	const struct sockaddr_in& rAddr, /**< Destination address. */
+	const char*               pData, /**< Data to send.        */
+	int                       len    /**< Length of the data.  */)
+{
+	if (mCount == mMaxCount)
+		return MSRVERR_QUEUE_FULL;
+
+	if (mDataLen + len > mDataSize) {
+		long newSize = mDataSize? mDataSize : 4096;
+		while (newSize < mDataLen + len)
+			newSize *= 2;
+
+		char* pNewData = (char*) realloc (mpData, newSize);
+		if (!pNewData)
+			return MSRVERR_OUT_OF_MEMORY;
+
+		mpData    = pNewData;
+		mDataSize = newSize;
+	}
+
+	memcpy (mpData + mDataLen, pData, len);
+
+	mpAddrs[mCount]   = rAddr;
+	mpOffsets[mCount] = mDataLen;
+	mpLengths[mCount] = len;
+	mDataLen += len;
+	mCount++;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Sends all the datagrams in the batch and empties it.
+ *
+ * @return Number of datagrams sent, or a negative error code if
+ *         sending failed before all were sent.
+ ******************************************************************************/
+int DatagramBatch::send (int socket /**< UDP socket to send from. */)
+{
+	int sent = 0;
+
+#ifdef __linux__
+	struct mmsghdr messages[MSRV_DATAGRAM_BATCH];
+	struct iovec   vecs[MSRV_DATAGRAM_BATCH];
+
+	while (sent < mCount) {
+		/* Fill the headers for as many as fit in one call. */
+		int count = mCount - sent;
+		if (count > MSRV_DATAGRAM_BATCH)
+			count = MSRV_DATAGRAM_BATCH;
+
+		memset (messages, 0, count * sizeof (struct mmsghdr));
+		for (int i=0; i<count; ++i) {
+			vecs[i].iov_base = mpData + mpOffsets[sent + i];
+			vecs[i].iov_len  = mpLengths[sent + i];
+
+			messages[i].msg_hdr.msg_name    = &mpAddrs[sent + i];
+			messages[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+			messages[i].msg_hdr.msg_iov     = &vecs[i];
+			messages[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		int result = sendmmsg (socket, messages, count, 0);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0) {
+			clear ();
+			return MSRVERR_WRITE_FAILED;
+		}
+
+		sent += result;
+	}
+#else
+	for (; sent < mCount; ++sent)
+		if (sendto (socket, mpData + mpOffsets[sent], mpLengths[sent], 0,
+					(struct sockaddr*) &mpAddrs[sent], sizeof (struct sockaddr_in)) < 0) {
+			clear ();
+			return MSRVERR_WRITE_FAILED;
+		}
+#endif
+
+	clear ();
+	return sent;
+}
+
+/*******************************************************************************
+ * \fn void DatagramBatch::clear ()
+ *
+ * Drops all the datagrams in the batch.
+ ******************************************************************************/
+
+end_namespace (MSrv);
@@ -0,0 +1,1067 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvevent.h>
+#include <magicserver/msrverror.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifdef MSRV_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Creates an event backend of the given type.
+ *
+ * If the requested backend is not available, falls back to the
+ * portable @ref SelectBackend and writes a warning to the log.
+ *
+ * @return The new backend object. The caller owns it.
+ ******************************************************************************/
+EventBackend* EventBackend::create (
+	int  type, /**< One of the @ref backend_type values. */
+	Log& rLog  /**< Log for reporting fallbacks.         */)
+{
+#ifdef MSRV_HAVE_IO_URING
+	if (type == Uring) {
+		UringBackend* pUring = new UringBackend ();
+		if (pUring->open () == 0)
+			return pUring;
+
+		rLog.message ("LISTENER", Log::Warning, MSRVERR_EVENT_BACKEND_FAILED,
+					  "Creating io_uring backend failed with error %d; %s. "
+					  "Falling back to epoll.",
+					  errno, strerror (errno));
+		delete pUring;
+	}
+#else
+	if (type == Uring)
+		rLog.message ("LISTENER", Log::Warning, MSRVERR_EVENT_BACKEND_FAILED,
+					  "io_uring backend is not available. Falling back.");
+#endif
+
+#ifdef __linux__
+	if (type == Default || type == Epoll || type == Uring) {
+		EpollBackend* pEpoll = new EpollBackend ();
+		if (pEpoll->open () == 0)
+			return pEpoll;
+
+		rLog.message ("LISTENER", Log::Warning, MSRVERR_EVENT_BACKEND_FAILED,
+					  "Creating epoll backend failed with error %d; %s. "
+					  "Falling back to select.",
+					  errno, strerror (errno));
+		delete pEpoll;
+	}
+#else
+	if (type == Epoll)
+		rLog.message ("LISTENER", Log::Warning, MSRVERR_EVENT_BACKEND_FAILED,
+					  "Epoll backend is not available. Falling back to select.");
+#endif
+
+	return new SelectBackend ();
+}
+
+/*******************************************************************************
+ * \fn MSrvResult EventBackend::add (int fd) = 0
+ *
+ * Starts watching a descriptor.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn MSrvResult EventBackend::remove (int fd) = 0
+ *
+ * Stops watching a descriptor.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn MSrvResult EventBackend::watchWrite (int fd, bool on) = 0
+ *
+ * Starts or stops watching a registered descriptor for becoming
+ * writable. May be called in any thread.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn int EventBackend::wait (ReadyEvent* pReady, int maxEvents, long seconds, long microseconds) = 0
+ *
+ * Waits until some of the registered descriptors become readable, or
+ * writable if watched for that, or the timeout expires.
+ *
+ * If both timeout values are zero, waits indefinitely.
+ *
+ * @return Number of ready descriptors stored in pReady, 0 on
+ *         timeout, or a negative error code. The errno is left as set
+ *         by the failed system call.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates a select() backend.
+ ******************************************************************************/
+SelectBackend::SelectBackend ()
+{
+	FD_ZERO (&mReadSet);
+	FD_ZERO (&mWriteSet);
+	mMaxFd = -1;
+}
+
+/*******************************************************************************
+ * Adds a descriptor to the master set.
+ ******************************************************************************/
+MSrvResult SelectBackend::add (int fd)
+{
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return MSRVERR_DESCRIPTOR_OUT_OF_RANGE;
+
+	mThreadLock.lock ();
+
+	FD_SET (fd, &mReadSet);
+	if (fd > mMaxFd)
+		mMaxFd = fd;
+
+	mThreadLock.unlock ();
+	return 0;
+}
+
+/*******************************************************************************
+ * Removes a descriptor from the master set.
+ ******************************************************************************/
+MSrvResult SelectBackend::remove (int fd)
+{
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return MSRVERR_DESCRIPTOR_OUT_OF_RANGE;
+
+	mThreadLock.lock ();
+
+	FD_CLR (fd, &mReadSet);
+	FD_CLR (fd, &mWriteSet);
+
+	/* Drop the highest descriptor down to the next one in use. */
+	while (mMaxFd >= 0 && !FD_ISSET (mMaxFd, &mReadSet))
+		mMaxFd--;
+
+	mThreadLock.unlock ();
+	return 0;
+}
+
+/*******************************************************************************
+ * Adds a descriptor to or removes it from the write set.
+ ******************************************************************************/
+MSrvResult SelectBackend::watchWrite (int fd, bool on)
+{
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return MSRVERR_DESCRIPTOR_OUT_OF_RANGE;
+
+	mThreadLock.lock ();
+
+	if (on)
+		FD_SET (fd, &mWriteSet);
+	else
+		FD_CLR (fd, &mWriteSet);
+
+	mThreadLock.unlock ();
+	return 0;
+}
+
+/*******************************************************************************
+ * Waits with select().
+ ******************************************************************************/
+int SelectBackend::wait (
+	ReadyEvent* pReady,
+	int         maxEvents,
+	long        seconds,
+	long        microseconds)
+{
+	struct timeval timeout;
+	bool           usingTimeout = seconds>0 || microseconds>0;
+
+	timeout.tv_sec  = seconds;
+	timeout.tv_usec = microseconds;
+
+	/* Take a copy of the master sets, as select modifies them. */
+	mThreadLock.lock ();
+	fd_set readset  = mReadSet;
+	fd_set writeset = mWriteSet;
+	int    maxfd    = mMaxFd;
+	mThreadLock.unlock ();
+
+	int selectCount = select (maxfd + 1,
+							  &readset,  /* Read events.      */
+							  &writeset, /* Write events.     */
+							  NULL,      /* Exception events. */
+							  usingTimeout? &timeout : NULL);
+	if (selectCount <= 0)
+		return selectCount < 0? MSRVERR_SELECT_FAILED : 0;
+
+	/* Collect the ready descriptors. The count of select counts */
+	/* a descriptor ready both ways twice.                        */
+	int readyCount = 0;
+	for (int fd=0; fd<=maxfd && readyCount < maxEvents && selectCount > 0; ++fd) {
+		int events = 0;
+		if (FD_ISSET (fd, &readset))
+			events |= Readable, selectCount--;
+		if (FD_ISSET (fd, &writeset))
+			events |= Writable, selectCount--;
+
+		if (events) {
+			pReady[readyCount].mFd     = fd;
+			pReady[readyCount].mEvents = events;
+			readyCount++;
+		}
+	}
+
+	return readyCount;
+}
+
+#ifdef __linux__
+/*******************************************************************************
+ * Creates an epoll backend.
+ *
+ * The epoll instance must be created with @ref open().
+ ******************************************************************************/
+EpollBackend::EpollBackend ()
+{
+	mEpollFd = -1;
+}
+
+/*******************************************************************************
+ * Closes the epoll instance.
+ ******************************************************************************/
+EpollBackend::~EpollBackend ()
+{
+	if (mEpollFd >= 0)
+		::close (mEpollFd);
+}
+
+/*******************************************************************************
+ * Creates the epoll instance.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult EpollBackend::open ()
+{
+	mEpollFd = epoll_create1 (EPOLL_CLOEXEC);
+	if (mEpollFd < 0)
+		return MSRVERR_EVENT_BACKEND_FAILED;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Adds a descriptor to the epoll interest list.
+ *
+ * The descriptor is watched level-triggered, which matches the
+ * semantics of select().
+ ******************************************************************************/
+MSrvResult EpollBackend::add (int fd)
+{
+	struct epoll_event event;
+	memset (&event, 0, sizeof (event));
+	event.events  = EPOLLIN;
+	event.data.fd = fd;
+
+	if (epoll_ctl (mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		return MSRVERR_EVENT_BACKEND_FAILED;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Removes a descriptor from the epoll interest list.
+ ******************************************************************************/
+MSrvResult EpollBackend::remove (int fd)
+{
+	/* The kernel drops closed descriptors from the interest list by */
+	/* itself, so failure here is not an error.                      */
+	epoll_ctl (mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Adds or removes write events in the epoll interest of a descriptor.
+ ******************************************************************************/
+MSrvResult EpollBackend::watchWrite (int fd, bool on)
+{
+	struct epoll_event event;
+	memset (&event, 0, sizeof (event));
+	event.events  = on? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd = fd;
+
+	if (epoll_ctl (mEpollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+		return MSRVERR_EVENT_BACKEND_FAILED;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * \fn int EpollBackend::epollFd () const
+ *
+ * Returns the epoll instance.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Waits with epoll_wait().
+ ******************************************************************************/
+int EpollBackend::wait (
+	ReadyEvent* pReady,
+	int         maxEvents,
+	long        seconds,
+	long        microseconds)
+{
+	struct epoll_event events[MSRV_MAX_READY_EVENTS];
+
+	if (maxEvents > MSRV_MAX_READY_EVENTS)
+		maxEvents = MSRV_MAX_READY_EVENTS;
+
+	/* Round the timeout up to milliseconds; zero means no timeout. */
+	int timeoutMSec = -1;
+	if (seconds>0 || microseconds>0)
+		timeoutMSec = seconds*1000 + (microseconds+999)/1000;
+
+	int readyCount = epoll_wait (mEpollFd, events, maxEvents, timeoutMSec);
+	if (readyCount < 0)
+		return MSRVERR_SELECT_FAILED;
+
+	/* Errors and hangups are reported as readable, so that the */
+	/* following read notices them.                              */
+	for (int i=0; i<readyCount; ++i) {
+		pReady[i].mFd     = events[i].data.fd;
+		pReady[i].mEvents = 0;
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			pReady[i].mEvents |= Readable;
+		if (events[i].events & EPOLLOUT)
+			pReady[i].mEvents |= Writable;
+	}
+
+	return readyCount;
+}
+#endif
+
+#ifdef MSRV_HAVE_IO_URING
+/*******************************************************************************
+ * Thin wrappers for the io_uring system calls, which have no libc wrappers.
+ ******************************************************************************/
+static int uringSetup (unsigned int entries, struct io_uring_params* pParams)
+{
+	return (int) syscall (__NR_io_uring_setup, entries, pParams);
+}
+
+static int uringEnter (int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+	return (int) syscall (__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+/*******************************************************************************
+ * Creates an io_uring backend.
+ *
+ * The rings must be created with @ref open(). The backend starts in
+ * readiness mode.
+ ******************************************************************************/
+UringBackend::UringBackend ()
+{
+	mCompletionMode = false;
+	mRingFd         = -1;
+	mpSqRing        = MAP_FAILED;
+	mpCqRing        = MAP_FAILED;
+	mpSqes          = (struct io_uring_sqe*) MAP_FAILED;
+	mSqTail         = 0;
+	mpReads         = NULL;
+	mReadCount      = 0;
+	mpFreeOps       = NULL;
+	mInFlight       = 0;
+	mpTimeoutOp     = NULL;
+	mpPollWriteOp   = NULL;
+	mActivity       = false;
+}
+
+/*******************************************************************************
+ * Cancels all pending operations and destroys the rings.
+ ******************************************************************************/
+UringBackend::~UringBackend ()
+{
+	if (mRingFd >= 0) {
+		drain ();
+
+		munmap (mpSqes, mSqesSize);
+		if (mpCqRing != mpSqRing)
+			munmap (mpCqRing, mCqRingSize);
+		munmap (mpSqRing, mSqRingSize);
+		::close (mRingFd);
+	}
+
+	/* All operations are in the free list after draining. */
+	while (mpFreeOps) {
+		Operation* pNext = mpFreeOps->mpNextFree;
+		delete mpFreeOps;
+		mpFreeOps = pNext;
+	}
+
+	free (mpReads);
+}
+
+/*******************************************************************************
+ * Creates the epoll instance and the io_uring rings.
+ *
+ * Fails if the kernel does not support io_uring, or is too old to
+ * poll sockets internally for accept and receive operations.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult UringBackend::open (int entries /**< Size of the submission queue. */)
+{
+	MSrvResult result = EpollBackend::open ();
+	if (result < 0)
+		return result;
+
+	struct io_uring_params params;
+	memset (&params, 0, sizeof (params));
+
+	mRingFd = uringSetup (entries, &params);
+	if (mRingFd < 0)
+		return MSRVERR_EVENT_BACKEND_FAILED;
+
+	/* Accept and receive are efficient only with internal polling. */
+	if (! (params.features & IORING_FEAT_FAST_POLL)) {
+		::close (mRingFd);
+		mRingFd = -1;
+		errno = ENOSYS;
+		return MSRVERR_EVENT_BACKEND_FAILED;
+	}
+
+	/* Map the submission and completion rings. */
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (mCqRingSize > mSqRingSize)
+			mSqRingSize = mCqRingSize;
+		mCqRingSize = mSqRingSize;
+	}
+
+	mpSqRing = mmap (NULL, mSqRingSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		mpCqRing = mpSqRing;
+	else
+		mpCqRing = mmap (NULL, mCqRingSize, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+
+	mSqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+	mpSqes = (struct io_uring_sqe*) mmap (NULL, mSqesSize, PROT_READ | PROT_WRITE,
+										  MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+
+	if (mpSqRing == MAP_FAILED || mpCqRing == MAP_FAILED || mpSqes == MAP_FAILED) {
+		if (mpSqes != MAP_FAILED)
+			munmap (mpSqes, mSqesSize);
+		if (mpCqRing != MAP_FAILED && mpCqRing != mpSqRing)
+			munmap (mpCqRing, mCqRingSize);
+		if (mpSqRing != MAP_FAILED)
+			munmap (mpSqRing, mSqRingSize);
+		::close (mRingFd);
+		mRingFd = -1;
+		return MSRVERR_EVENT_BACKEND_FAILED;
+	}
+
+	char* pSq = (char*) mpSqRing;
+	mpSqHead   = (unsigned int*) (pSq + params.sq_off.head);
+	mpSqTail   = (unsigned int*) (pSq + params.sq_off.tail);
+	mpSqMask   = (unsigned int*) (pSq + params.sq_off.ring_mask);
+	mpSqArray  = (unsigned int*) (pSq + params.sq_off.array);
+	mSqEntries = params.sq_entries;
+	mSqTail    = *mpSqTail;
+
+	char* pCq = (char*) mpCqRing;
+	mpCqHead   = (unsigned int*) (pCq + params.cq_off.head);
+	mpCqTail   = (unsigned int*) (pCq + params.cq_off.tail);
+	mpCqMask   = (unsigned int*) (pCq + params.cq_off.ring_mask);
+	mpCqes     = (struct io_uring_cqe*) (pCq + params.cq_off.cqes);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * \fn void UringBackend::setCompletionMode (bool on)
+ *
+ * Switches between completion mode and readiness mode.
+ *
+ * This must be done before any descriptors are added.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Registers a descriptor.
+ *
+ * In completion mode, nothing is submitted until an operation is
+ * armed for the descriptor.
+ ******************************************************************************/
+MSrvResult UringBackend::add (int fd)
+{
+	if (!mCompletionMode)
+		return EpollBackend::add (fd);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Unregisters a descriptor and cancels its pending operation.
+ *
+ * The operation keeps a reference to the socket in the kernel, so it
+ * must be cancelled for the socket to be actually closed. The cancel
+ * is submitted at once, as the listener may be waiting for
+ * completions. May be called in any thread.
+ ******************************************************************************/
+MSrvResult UringBackend::remove (int fd)
+{
+	mRingLock.lock ();
+
+	if (fd >= 0 && fd < mReadCount && mpReads[fd]) {
+		cancel (mpReads[fd]);
+		mpReads[fd] = NULL;
+		submit (0);
+	}
+
+	mRingLock.unlock ();
+
+	/* In completion mode, the descriptor may be in the epoll */
+	/* interest list for writing.                              */
+	return EpollBackend::remove (fd);
+}
+
+/*******************************************************************************
+ * Starts or stops watching a descriptor for becoming writable.
+ *
+ * In completion mode, only the descriptors watched for writing are
+ * in the epoll interest list. May be called in any thread.
+ ******************************************************************************/
+MSrvResult UringBackend::watchWrite (int fd, bool on)
+{
+	if (!mCompletionMode)
+		return EpollBackend::watchWrite (fd, on);
+
+	if (!on) {
+		epoll_ctl (epollFd (), EPOLL_CTL_DEL, fd, NULL);
+		return 0;
+	}
+
+	struct epoll_event event;
+	memset (&event, 0, sizeof (event));
+	event.events  = EPOLLOUT;
+	event.data.fd = fd;
+
+	if (epoll_ctl (epollFd (), EPOLL_CTL_ADD, fd, &event) < 0 &&
+		(errno != EEXIST || epoll_ctl (epollFd (), EPOLL_CTL_MOD, fd, &event) < 0))
+		return MSRVERR_EVENT_BACKEND_FAILED;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Submits a poll of the epoll descriptor, which becomes readable when
+ * any of the descriptors watched for writing is writable.
+ ******************************************************************************/
+void UringBackend::armPollWrite ()
+{
+	struct io_uring_sqe* pSqe = getSqe ();
+	if (!pSqe)
+		return;
+
+	mpPollWriteOp = allocOp (epollFd (), OpPollWrite);
+
+	pSqe->opcode      = IORING_OP_POLL_ADD;
+	pSqe->fd          = epollFd ();
+	pSqe->poll_events = POLLIN;
+	pSqe->user_data   = (unsigned long) mpPollWriteOp;
+}
+
+/*******************************************************************************
+ * Reports the writable sockets as @ref OpWritable completions.
+ *
+ * Sockets that do not fit stay ready and are reported after the next
+ * poll.
+ *
+ * @return Number of completions stored.
+ ******************************************************************************/
+int UringBackend::collectWritable (
+	UringCompletion* pCompletions,
+	int              maxCompletions)
+{
+	struct epoll_event events[MSRV_MAX_READY_EVENTS];
+
+	if (maxCompletions > MSRV_MAX_READY_EVENTS)
+		maxCompletions = MSRV_MAX_READY_EVENTS;
+	if (maxCompletions <= 0)
+		return 0;
+
+	int readyCount = epoll_wait (epollFd (), events, maxCompletions, 0);
+	if (readyCount < 0)
+		return 0;
+
+	for (int i=0; i<readyCount; ++i) {
+		pCompletions[i].mFd      = events[i].data.fd;
+		pCompletions[i].mOp      = OpWritable;
+		pCompletions[i].mResult  = 0;
+		pCompletions[i].mpBuffer = NULL;
+	}
+
+	return readyCount;
+}
+
+/*******************************************************************************
+ * Cancels a pending operation.
+ *
+ * The operation is completed later, and its record is recycled then.
+ ******************************************************************************/
+void UringBackend::cancel (Operation* pOp)
+{
+	pOp->mCancelled = true;
+
+	struct io_uring_sqe* pSqe = getSqe ();
+	if (pSqe) {
+		pSqe->opcode    = IORING_OP_ASYNC_CANCEL;
+		pSqe->fd        = -1;
+		pSqe->addr      = (unsigned long) pOp;
+		pSqe->user_data = 0; /* The cancel itself is not reported. */
+	}
+}
+
+/*******************************************************************************
+ * Submits an accept operation on a listening socket.
+ *
+ * The completion carries the accepted socket and the peer address.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult UringBackend::armAccept (int fd /**< Listening socket. */)
+{
+	MSrvResult result = MSRVERR_EVENT_BACKEND_FAILED;
+
+	mRingLock.lock ();
+
+	struct io_uring_sqe* pSqe = getSqe ();
+	if (pSqe) {
+		Operation* pOp = allocOp (fd, OpAccept);
+		pOp->mAddrLen = sizeof (pOp->mAddr);
+
+		pSqe->opcode    = IORING_OP_ACCEPT;
+		pSqe->fd        = fd;
+		pSqe->addr      = (unsigned long) &pOp->mAddr;
+		pSqe->addr2     = (unsigned long) &pOp->mAddrLen;
+		pSqe->user_data = (unsigned long) pOp;
+
+		result = setRead (fd, pOp);
+	}
+
+	mRingLock.unlock ();
+	return result;
+}
+
+/*******************************************************************************
+ * Submits a receive operation on a socket.
+ *
+ * The completion carries a buffer of at most the given length with
+ * the received data. The buffer is allocated with malloc().
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult UringBackend::armRecv (
+	int fd,   /**< Socket to receive from.       */
+	int len   /**< Maximum length of the data.   */)
+{
+	MSrvResult result = MSRVERR_EVENT_BACKEND_FAILED;
+
+	mRingLock.lock ();
+
+	struct io_uring_sqe* pSqe = getSqe ();
+	if (pSqe) {
+		Operation* pOp = allocOp (fd, OpRecv);
+		/* Leave room for a terminating null. */
+		pOp->mpBuffer = (char*) malloc (len + 1);
+
+		pSqe->opcode    = IORING_OP_RECV;
+		pSqe->fd        = fd;
+		pSqe->addr      = (unsigned long) pOp->mpBuffer;
+		pSqe->len       = len;
+		pSqe->user_data = (unsigned long) pOp;
+
+		result = setRead (fd, pOp);
+	}
+
+	mRingLock.unlock ();
+	return result;
+}
+
+/*******************************************************************************
+ * Submits a poll for a socket to become readable.
+ *
+ * Used when the receiver reads the socket by itself, for example to
+ * receive a batch of datagrams with one call.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult UringBackend::armReadable (int fd /**< Socket to poll. */)
+{
+	MSrvResult result = MSRVERR_EVENT_BACKEND_FAILED;
+
+	mRingLock.lock ();
+
+	struct io_uring_sqe* pSqe = getSqe ();
+	if (pSqe) {
+		Operation* pOp = allocOp (fd, OpReadable);
+
+		pSqe->opcode      = IORING_OP_POLL_ADD;
+		pSqe->fd          = fd;
+		pSqe->poll_events = POLLIN;
+		pSqe->user_data   = (unsigned long) pOp;
+
+		result = setRead (fd, pOp);
+	}
+
+	mRingLock.unlock ();
+	return result;
+}
+
+/*******************************************************************************
+ * Records the pending operation of a descriptor, so that it can be
+ * cancelled when the descriptor is removed.
+ ******************************************************************************/
+MSrvResult UringBackend::setRead (int fd, Operation* pOp)
+{
+	if (fd >= mReadCount) {
+		int newCount = mReadCount? mReadCount : 64;
+		while (newCount <= fd)
+			newCount *= 2;
+
+		Operation** pNewReads = (Operation**) realloc (mpReads, newCount * sizeof (Operation*));
+		if (!pNewReads)
+			return MSRVERR_INVALID_ARGUMENT;
+		memset (pNewReads + mReadCount, 0, (newCount - mReadCount) * sizeof (Operation*));
+
+		mpReads    = pNewReads;
+		mReadCount = newCount;
+	}
+
+	mpReads[fd] = pOp;
+	return 0;
+}
+
+/*******************************************************************************
+ * Submits the queued operations and waits for completions.
+ *
+ * All operations queued since the previous call are submitted with
+ * the same system call that waits for the completions. The rings are
+ * unlocked during the wait, so that other threads can remove
+ * descriptors.
+ *
+ * If both timeout values are zero, waits indefinitely.
+ *
+ * @return Number of completions stored in pCompletions, 0 if the
+ *         timeout expired without any completions, or a negative
+ *         error code.
+ ******************************************************************************/
+int UringBackend::complete (
+	UringCompletion* pCompletions,
+	int              maxCompletions,
+	long             seconds,
+	long             microseconds)
+{
+	int count = 0;
+	while (count == 0) {
+		mRingLock.lock ();
+
+		/* Arm a timeout, unless an earlier one is still pending. */
+		/* A timeout that expired during activity is armed again. */
+		if ((seconds>0 || microseconds>0) && !mpTimeoutOp) {
+			struct io_uring_sqe* pSqe = getSqe ();
+			if (pSqe) {
+				mTimeoutSpec[0] = seconds;
+				mTimeoutSpec[1] = microseconds * 1000;
+
+				mpTimeoutOp = allocOp (-1, OpTimeout);
+				mActivity   = false;
+
+				pSqe->opcode    = IORING_OP_TIMEOUT;
+				pSqe->fd        = -1;
+				pSqe->addr      = (unsigned long) mTimeoutSpec;
+				pSqe->len       = 1;
+				pSqe->user_data = (unsigned long) mpTimeoutOp;
+			}
+		}
+
+		/* Keep the writable sockets polled. */
+		if (!mpPollWriteOp)
+			armPollWrite ();
+
+		unsigned toSubmit = publish ();
+
+		mRingLock.unlock ();
+
+		/* Submit and wait for at least one completion. */
+		if (uringEnter (mRingFd, toSubmit, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			return MSRVERR_SELECT_FAILED;
+
+		mRingLock.lock ();
+
+		bool     timedOut = false;
+		unsigned head     = *mpCqHead;
+		unsigned tail     = __atomic_load_n (mpCqTail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail && count < maxCompletions; ++head) {
+			struct io_uring_cqe* pCqe = &mpCqes[head & *mpCqMask];
+			Operation*           pOp  = (Operation*) pCqe->user_data;
+
+			/* Completions of cancel requests are not interesting. */
+			if (!pOp)
+				continue;
+
+			if (pOp->mOp == OpTimeout) {
+				/* Time out only if nothing happened while waiting. */
+				if (!pOp->mCancelled && !mActivity)
+					timedOut = true;
+				mpTimeoutOp = NULL;
+				freeOp (pOp);
+				continue;
+			}
+
+			mActivity = true;
+
+			if (pOp->mOp == OpPollWrite) {
+				/* Report the writable sockets; the poll is armed again */
+				/* on the next round.                                   */
+				mpPollWriteOp = NULL;
+				if (!pOp->mCancelled)
+					count += collectWritable (pCompletions + count, maxCompletions - count);
+				freeOp (pOp);
+				continue;
+			}
+
+			/* The descriptor was removed; just recycle the buffer. */
+			if (pOp->mCancelled) {
+				if (pOp->mOp == OpAccept && pCqe->res >= 0)
+					::close (pCqe->res);
+				free (pOp->mpBuffer);
+				freeOp (pOp);
+				continue;
+			}
+
+			if (mpReads[pOp->mFd] == pOp)
+				mpReads[pOp->mFd] = NULL;
+
+			UringCompletion& rCompletion = pCompletions[count++];
+			rCompletion.mFd     = pOp->mFd;
+			rCompletion.mOp     = pOp->mOp;
+			rCompletion.mResult = pCqe->res;
+			rCompletion.mpBuffer = pOp->mpBuffer;
+			if (pOp->mOp == OpAccept)
+				rCompletion.mAddr = pOp->mAddr;
+
+			pOp->mpBuffer = NULL;
+			freeOp (pOp);
+		}
+
+		__atomic_store_n (mpCqHead, head, __ATOMIC_RELEASE);
+
+		mRingLock.unlock ();
+
+		if (timedOut && count == 0)
+			return 0;
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * Cancels all pending operations and waits for them to complete.
+ *
+ * The buffers of cancelled reads are released only after the kernel
+ * has completed the operations, as it may write into them until then.
+ ******************************************************************************/
+void UringBackend::drain ()
+{
+	mRingLock.lock ();
+
+	/* Cancel all reads. */
+	for (int fd=0; fd<mReadCount; ++fd)
+		if (mpReads[fd]) {
+			mpReads[fd]->mCancelled = true;
+
+			struct io_uring_sqe* pSqe = getSqe ();
+			if (pSqe) {
+				pSqe->opcode    = IORING_OP_ASYNC_CANCEL;
+				pSqe->fd        = -1;
+				pSqe->addr      = (unsigned long) mpReads[fd];
+				pSqe->user_data = 0;
+			}
+			mpReads[fd] = NULL;
+		}
+
+	/* Cancel the poll of writable sockets. */
+	if (mpPollWriteOp) {
+		cancel (mpPollWriteOp);
+		mpPollWriteOp = NULL;
+	}
+
+	/* Cancel the timeout. */
+	if (mpTimeoutOp) {
+		mpTimeoutOp->mCancelled = true;
+
+		struct io_uring_sqe* pSqe = getSqe ();
+		if (pSqe) {
+			pSqe->opcode    = IORING_OP_TIMEOUT_REMOVE;
+			pSqe->fd        = -1;
+			pSqe->addr      = (unsigned long) mpTimeoutOp;
+			pSqe->user_data = 0;
+		}
+	}
+
+	/* Reap until every operation has completed. */
+	while (mInFlight > 0 || mSqTail != __atomic_load_n (mpSqHead, __ATOMIC_ACQUIRE)) {
+		if (submit (mInFlight > 0? 1 : 0) < 0 && errno != EINTR)
+			break;
+
+		unsigned head = *mpCqHead;
+		unsigned tail = __atomic_load_n (mpCqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			Operation* pOp = (Operation*) mpCqes[head & *mpCqMask].user_data;
+			if (!pOp)
+				continue;
+
+			if (pOp->mOp == OpAccept && mpCqes[head & *mpCqMask].res >= 0)
+				::close (mpCqes[head & *mpCqMask].res);
+			if (pOp == mpTimeoutOp)
+				mpTimeoutOp = NULL;
+			free (pOp->mpBuffer);
+			freeOp (pOp);
+		}
+		__atomic_store_n (mpCqHead, head, __ATOMIC_RELEASE);
+	}
+
+	mRingLock.unlock ();
+}
+
+/*******************************************************************************
+ * Gets an operation record from the free list, or allocates a new one.
+ ******************************************************************************/
+UringBackend::Operation* UringBackend::allocOp (int fd, int op)
+{
+	Operation* pOp = mpFreeOps;
+	if (pOp)
+		mpFreeOps = pOp->mpNextFree;
+	else
+		pOp = new Operation;
+
+	pOp->mFd        = fd;
+	pOp->mOp        = op;
+	pOp->mCancelled = false;
+	pOp->mpBuffer   = NULL;
+	pOp->mpNextFree = NULL;
+
+	mInFlight++;
+	return pOp;
+}
+
+/*******************************************************************************
+ * Returns a completed operation record to the free list.
+ ******************************************************************************/
+void UringBackend::freeOp (Operation* pOp)
+{
+	pOp->mpBuffer   = NULL;
+	pOp->mpNextFree = mpFreeOps;
+	mpFreeOps       = pOp;
+
+	mInFlight--;
+}
+
+/*******************************************************************************
+ * Gets the next free submission queue entry.
+ *
+ * If the queue is full, the queued entries are submitted first. The
+ * rings must be locked.
+ *
+ * @return The cleared entry, or NULL if the queue is still full.
+ ******************************************************************************/
+struct io_uring_sqe* UringBackend::getSqe ()
+{
+	if (mRingFd < 0)
+		return NULL;
+
+	unsigned head = __atomic_load_n (mpSqHead, __ATOMIC_ACQUIRE);
+	if (mSqTail - head >= mSqEntries) {
+		submit (0);
+		head = __atomic_load_n (mpSqHead, __ATOMIC_ACQUIRE);
+		if (mSqTail - head >= mSqEntries)
+			return NULL;
+	}
+
+	unsigned index = mSqTail & *mpSqMask;
+	struct io_uring_sqe* pSqe = &mpSqes[index];
+	memset (pSqe, 0, sizeof (*pSqe));
+
+	mpSqArray[index] = index;
+	mSqTail++;
+
+	return pSqe;
+}
+
+/*******************************************************************************
+ * Publishes the queued entries to the kernel.
+ *
+ * The rings must be locked.
+ *
+ * @return Number of entries the kernel has not consumed yet.
+ ******************************************************************************/
+unsigned int UringBackend::publish ()
+{
+	__atomic_store_n (mpSqTail, mSqTail, __ATOMIC_RELEASE);
+
+	return mSqTail - __atomic_load_n (mpSqHead, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+ * Publishes the queued entries to the kernel and submits them.
+ *
+ * The rings must be locked.
+ *
+ * @return Number of submitted entries, or -1 with errno set.
+ ******************************************************************************/
+int UringBackend::submit (int waitCount /**< Completions to wait for. */)
+{
+	return uringEnter (mRingFd, publish (), waitCount,
+					   waitCount > 0? IORING_ENTER_GETEVENTS : 0);
+}
+#endif
+
+end_namespace (MSrv);
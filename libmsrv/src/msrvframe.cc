@@ -0,0 +1,489 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvframe.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MSRV_HAVE_SIMD_SCAN
+#include <immintrin.h>
+#endif
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * Delimiter scanning kernels.
+ *
+ * Each kernel stores the positions of the given byte in the data,
+ * starting from the given position, until maxFound positions have
+ * been found. It returns the number of positions found.
+ *
+ * The SIMD kernels compare a block of bytes at a time and take the
+ * positions from the bit mask of the matches, so that all the
+ * delimiters in the data are found with one pass. They are compiled
+ * for their instruction set with a target attribute, so the rest of
+ * the library does not require it, and are chosen at startup by what
+ * the processor supports.
+ ******************************************************************************/
+typedef int (*ScanFunc) (const char* pData, int from, int len, char c,
+						 int* pFound, int maxFound);
+
+static int scanScalar (
+	const char* pData,
+	int         from,
+	int         len,
+	char        c,
+	int*        pFound,
+	int         maxFound)
+{
+	int count = 0;
+	while (count < maxFound && from < len) {
+		const char* pMatch = (const char*) memchr (pData + from, c, len - from);
+		if (!pMatch)
+			break;
+
+		pFound[count++] = pMatch - pData;
+		from = pMatch - pData + 1;
+	}
+
+	return count;
+}
+
+#ifdef MSRV_HAVE_SIMD_SCAN
+__attribute__ ((target ("sse2")))
+static int scanSSE2 (
+	const char* pData,
+	int         from,
+	int         len,
+	char        c,
+	int*        pFound,
+	int         maxFound)
+{
+	const __m128i needle = _mm_set1_epi8 (c);
+	int           count  = 0;
+
+	for (; from + 16 <= len; from += 16) {
+		__m128i  block = _mm_loadu_si128 ((const __m128i*) (pData + from));
+		unsigned mask  = _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, needle));
+
+		while (mask) {
+			pFound[count++] = from + __builtin_ctz (mask);
+			if (count == maxFound)
+				return count;
+			mask &= mask - 1;
+		}
+	}
+
+	/* Less than a block is left. */
+	return count + scanScalar (pData, from, len, c, pFound + count, maxFound - count);
+}
+
+__attribute__ ((target ("avx2")))
+static int scanAVX2 (
+	const char* pData,
+	int         from,
+	int         len,
+	char        c,
+	int*        pFound,
+	int         maxFound)
+{
+	const __m256i needle = _mm256_set1_epi8 (c);
+	int           count  = 0;
+
+	for (; from + 32 <= len; from += 32) {
+		__m256i  block = _mm256_loadu_si256 ((const __m256i*) (pData + from));
+		unsigned mask  = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (block, needle));
+
+		while (mask) {
+			pFound[count++] = from + __builtin_ctz (mask);
+			if (count == maxFound)
+				return count;
+			mask &= mask - 1;
+		}
+	}
+
+	/* Less than a block is left. */
+	return count + scanSSE2 (pData, from, len, c, pFound + count, maxFound - count);
+}
+#endif
+
+/*******************************************************************************
+ * Chooses the fastest kernel the processor supports.
+ ******************************************************************************/
+static ScanFunc chooseScan ()
+{
+#ifdef MSRV_HAVE_SIMD_SCAN
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		return scanAVX2;
+	if (__builtin_cpu_supports ("sse2"))
+		return scanSSE2;
+#endif
+	return scanScalar;
+}
+
+static ScanFunc scan = chooseScan ();
+
+/*******************************************************************************
+ * Finds the frames at the beginning of the given data.
+ *
+ * Finds complete frames one after another, until maxFrames have been
+ * found or the rest of the data is not a complete frame. The default
+ * implementation calls @ref frame() for each frame.
+ *
+ * @return Number of frames stored in pFrames, 0 if the first frame is
+ *         not complete yet, or a negative error code if the first
+ *         frame is not valid. An invalid frame after valid ones is
+ *         reported by the next call.
+ ******************************************************************************/
+int Framer::frames (
+	const char* pData,     /**< Received data.                              */
+	int         len,       /**< Length of the data.                         */
+	int         scanned,   /**< Data already examined, as for @ref frame(). */
+	FrameSpan*  pFrames,   /**< Receives the frames.                        */
+	int         maxFrames  /**< Capacity of pFrames.                        */) const
+{
+	int count = 0;
+	int end   = 0;
+
+	while (count < maxFrames && end < len) {
+		int start, length;
+		int frameLen = frame (pData + end, len - end, count? 0 : scanned, start, length);
+		if (frameLen <= 0)
+			return count? count : frameLen;
+
+		pFrames[count].mStart  = end + start;
+		pFrames[count].mLength = length;
+		pFrames[count].mEnd    = end + frameLen;
+
+		end = pFrames[count++].mEnd;
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * \fn int Framer::frame (const char* pData, int len, int scanned, int& rStart, int& rLength) const = 0
+ *
+ * Finds the frame at the beginning of the given data.
+ *
+ * The data may be incomplete, in which case the framer is called
+ * again when more has been received. The scanned parameter tells how
+ * much of the data was already examined by the previous call without
+ * finding the end of a frame, so that a framer searching for a
+ * delimiter does not need to search it again.
+ *
+ * @return Length of the complete frame at the beginning of the data,
+ *         0 if the frame is not complete yet, or a negative error
+ *         code if the data is not valid. The position and length of
+ *         the payload in the frame are stored in rStart and rLength.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn LineFramer::LineFramer (int maxLen)
+ *
+ * Creates a framer for lines of at most maxLen characters.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Finds the first line in the data.
+ ******************************************************************************/
+int LineFramer::frame (
+	const char* pData,   /**< Received data.                         */
+	int         len,     /**< Length of the data.                    */
+	int         scanned, /**< Data already searched for the newline. */
+	int&        rStart,  /**< Receives the start of the payload.     */
+	int&        rLength  /**< Receives the length of the payload.    */) const
+{
+	int lineLen;
+	if (scan (pData, scanned, len, '\n', &lineLen, 1) == 0)
+		return len > mMaxLen? MSRVERR_FRAME_TOO_LONG : 0;
+
+	if (lineLen > mMaxLen)
+		return MSRVERR_FRAME_TOO_LONG;
+
+	/* Leave out the line end. */
+	rStart  = 0;
+	rLength = lineLen;
+	if (lineLen > 0 && pData[lineLen-1] == '\r')
+		rLength--;
+
+	return lineLen + 1;
+}
+
+/*******************************************************************************
+ * Finds the lines at the beginning of the data with one pass.
+ ******************************************************************************/
+int LineFramer::frames (
+	const char* pData,     /**< Received data.                         */
+	int         len,       /**< Length of the data.                    */
+	int         scanned,   /**< Data already searched for the newline. */
+	FrameSpan*  pFrames,   /**< Receives the frames.                   */
+	int         maxFrames  /**< Capacity of pFrames.                   */) const
+{
+	int newlines[MSRV_FRAME_BATCH];
+	if (maxFrames > MSRV_FRAME_BATCH)
+		maxFrames = MSRV_FRAME_BATCH;
+
+	int found = scan (pData, scanned, len, '\n', newlines, maxFrames);
+	int count = 0;
+	int start = 0;
+
+	for (; count < found; ++count) {
+		int lineLen = newlines[count] - start;
+		if (lineLen > mMaxLen)
+			break;
+
+		/* Leave out the line end. */
+		pFrames[count].mStart  = start;
+		pFrames[count].mLength = lineLen;
+		pFrames[count].mEnd    = newlines[count] + 1;
+		if (lineLen > 0 && pData[newlines[count]-1] == '\r')
+			pFrames[count].mLength--;
+
+		start = pFrames[count].mEnd;
+	}
+
+	if (count == 0 && (found > 0 || len > mMaxLen))
+		return MSRVERR_FRAME_TOO_LONG;
+
+	return count;
+}
+
+/*******************************************************************************
+ * Returns the name of the instruction set used to search newlines:
+ * "avx2", "sse2" or "scalar".
+ ******************************************************************************/
+const char* LineFramer::scanner ()
+{
+#ifdef MSRV_HAVE_SIMD_SCAN
+	if (scan == scanAVX2)
+		return "avx2";
+	if (scan == scanSSE2)
+		return "sse2";
+#endif
+	return "scalar";
+}
+
+/*******************************************************************************
+ * Selects the instruction set used to search newlines by its name, as
+ * returned by @ref scanner(). Meant for comparing the kernels; the
+ * fastest one is chosen at startup.
+ *
+ * This must not be called while lines are being framed.
+ *
+ * @return true if successful, false if the processor or the build
+ *         does not support the instruction set.
+ ******************************************************************************/
+bool LineFramer::setScanner (const char* name)
+{
+	if (!strcmp (name, "scalar")) {
+		scan = scanScalar;
+		return true;
+	}
+
+#ifdef MSRV_HAVE_SIMD_SCAN
+	__builtin_cpu_init ();
+	if (!strcmp (name, "sse2") && __builtin_cpu_supports ("sse2")) {
+		scan = scanSSE2;
+		return true;
+	}
+	if (!strcmp (name, "avx2") && __builtin_cpu_supports ("avx2")) {
+		scan = scanAVX2;
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+/*******************************************************************************
+ * Creates a framer for length-prefixed frames.
+ *
+ * Throws std::invalid_argument if the prefix length is not 1, 2 or 4.
+ ******************************************************************************/
+LengthFramer::LengthFramer (
+	int prefixLen, /**< Bytes in the length prefix: 1, 2 or 4. */
+	int byteOrder, /**< One of @ref byte_order.                */
+	int maxLen     /**< Longest payload accepted.              */)
+{
+	if (prefixLen != 1 && prefixLen != 2 && prefixLen != 4)
+		throw std::invalid_argument ("Length prefix must be 1, 2 or 4 bytes.");
+
+	mPrefixLen = prefixLen;
+	mByteOrder = byteOrder;
+	mMaxLen    = maxLen;
+}
+
+/*******************************************************************************
+ * Finds the first length-prefixed frame in the data.
+ ******************************************************************************/
+int LengthFramer::frame (
+	const char* pData,   /**< Received data.                     */
+	int         len,     /**< Length of the data.                */
+	int         scanned, /**< Not used.                          */
+	int&        rStart,  /**< Receives the start of the payload. */
+	int&        rLength  /**< Receives the length of the payload. */) const
+{
+	if (len < mPrefixLen)
+		return 0;
+
+	/* Decode the length. */
+	const unsigned char* pPrefix = (const unsigned char*) pData;
+	unsigned long        payload = 0;
+	for (int i=0; i<mPrefixLen; ++i) {
+		int shift = (mByteOrder == BigEndian? mPrefixLen-1-i : i) * 8;
+		payload |= (unsigned long) pPrefix[i] << shift;
+	}
+
+	if (payload > (unsigned long) mMaxLen)
+		return MSRVERR_FRAME_TOO_LONG;
+
+	if ((unsigned long) (len - mPrefixLen) < payload)
+		return 0;
+
+	rStart  = mPrefixLen;
+	rLength = payload;
+	return mPrefixLen + payload;
+}
+
+/*******************************************************************************
+ * Creates a framer for frames of the given size.
+ *
+ * Throws std::invalid_argument if the size is not positive.
+ ******************************************************************************/
+FixedFramer::FixedFramer (int size)
+{
+	if (size <= 0)
+		throw std::invalid_argument ("Frame size must be positive.");
+
+	mSize = size;
+}
+
+/*******************************************************************************
+ * Finds the first fixed-size frame in the data.
+ ******************************************************************************/
+int FixedFramer::frame (
+	const char* pData,   /**< Received data.                     */
+	int         len,     /**< Length of the data.                */
+	int         scanned, /**< Not used.                          */
+	int&        rStart,  /**< Receives the start of the payload. */
+	int&        rLength  /**< Receives the length of the payload. */) const
+{
+	if (len < mSize)
+		return 0;
+
+	rStart  = 0;
+	rLength = mSize;
+	return mSize;
+}
+
+/*******************************************************************************
+ * Creates an empty buffer. Memory is allocated when data is appended.
+ ******************************************************************************/
+FrameBuffer::FrameBuffer ()
+{
+	mpData   = NULL;
+	mSize    = 0;
+	mStart   = 0;
+	mLen     = 0;
+	mScanned = 0;
+}
+
+/*******************************************************************************
+ * Frees the buffer.
+ ******************************************************************************/
+FrameBuffer::~FrameBuffer ()
+{
+	free (mpData);
+}
+
+/*******************************************************************************
+ * Appends received data to the buffer.
+ *
+ * @return 0 if successful, or MSRVERR_OUT_OF_MEMORY if the buffer
+ *         could not grow, in which case nothing is appended.
+ ******************************************************************************/
+MSrvResult FrameBuffer::append (
+	const char* pData, /**< Data to append.     */
+	int         len    /**< Length of the data. */)
+{
+	if (mStart + mLen + len > mSize) {
+		/* Drop the consumed data from the front. */
+		if (mStart > 0) {
+			memmove (mpData, mpData + mStart, mLen);
+			mStart = 0;
+		}
+
+		/* Grow if it still does not fit. */
+		if (mLen + len > mSize) {
+			int newSize = mSize? mSize : MSRV_READ_BUFFER_LEN;
+			while (newSize < mLen + len)
+				newSize *= 2;
+
+			char* pNewData = (char*) realloc (mpData, newSize);
+			if (!pNewData)
+				return MSRVERR_OUT_OF_MEMORY;
+
+			mpData = pNewData;
+			mSize  = newSize;
+		}
+	}
+
+	memcpy (mpData + mStart + mLen, pData, len);
+	mLen += len;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Drops a frame from the front of the buffer.
+ ******************************************************************************/
+void FrameBuffer::consume (int count)
+{
+	mStart   += count;
+	mLen     -= count;
+	mScanned  = 0;
+
+	if (mLen == 0)
+		mStart = 0;
+}
+
+/*******************************************************************************
+ * \fn const char* FrameBuffer::data () const
+ *
+ * Returns the unconsumed data in the buffer.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn int FrameBuffer::scanned () const
+ *
+ * Returns how much of the data has been examined by the @ref Framer
+ * without finding a complete frame.
+ ******************************************************************************/
+
+end_namespace (MSrv);
@@ -0,0 +1,277 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvgroup.h>
+#include <magicserver/msrverror.h>
+#include <magicserver/msrvlog.h>
+#include <magicserver/msrvrequest.h>
+
+#include <unistd.h>
+
+begin_namespace (MSrv);
+
+/*******************************************************************************
+ * \fn RequestHandler* HandlerFactory::create (int reactor) = 0
+ *
+ * Creates the request handler for the given reactor of a @ref
+ * ServerGroup. The group deletes the handler when it is destroyed.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates a group of reactors that share one request handler.
+ *
+ * The handler is called concurrently from all reactor threads, so it
+ * must be thread-safe.
+ *
+ * @param rHandler Handler of the requests of all reactors.
+ * @param rpLog    Log to write messages to. May be NULL.
+ * @param reactors Number of reactors; 0 for one per online processor.
+ * @param backend  Event backend type of the reactors; one of @ref
+ *                 EventBackend::backend_type.
+ ******************************************************************************/
+ServerGroup::ServerGroup (
+	RequestHandler& rHandler,
+	Log*            rpLog,
+	int             reactors,
+	int             backend)
+{
+	create (&rHandler, NULL, rpLog, reactors, backend);
+}
+
+/*******************************************************************************
+ * Creates a group of reactors that each have a request handler of
+ * their own.
+ *
+ * @param rFactory Creates the handler of each reactor.
+ * @param rpLog    Log to write messages to. May be NULL.
+ * @param reactors Number of reactors; 0 for one per online processor.
+ * @param backend  Event backend type of the reactors; one of @ref
+ *                 EventBackend::backend_type.
+ ******************************************************************************/
+ServerGroup::ServerGroup (
+	HandlerFactory& rFactory,
+	Log*            rpLog,
+	int             reactors,
+	int             backend)
+{
+	create (NULL, &rFactory, rpLog, reactors, backend);
+}
+
+/*******************************************************************************
+ * Creates the reactors. Used by the constructors.
+ ******************************************************************************/
+void ServerGroup::create (
+	RequestHandler* rpHandler,
+	HandlerFactory* rpFactory,
+	Log*            rpLog,
+	int             reactors,
+	int             backend)
+{
+	if (reactors <= 0)
+		reactors = sysconf (_SC_NPROCESSORS_ONLN);
+	if (reactors <= 0)
+		reactors = 1;
+
+	mrpLog        = rpLog;
+	mReactorCount = reactors;
+	mpReactors    = new Reactor* [reactors];
+
+	for (int i=0; i<mReactorCount; ++i) {
+		if (rpFactory)
+			mpReactors[i] = new Reactor (this, rpFactory->create (i), true, rpLog, backend);
+		else
+			mpReactors[i] = new Reactor (this, rpHandler, false, rpLog, backend);
+	}
+}
+
+/*******************************************************************************
+ * Destroys the group and the reactors.
+ *
+ * \note The group must not be listening when destroyed.
+ ******************************************************************************/
+ServerGroup::~ServerGroup ()
+{
+	for (int i=0; i<mReactorCount; ++i)
+		delete mpReactors[i];
+
+	delete [] mpReactors;
+}
+
+/*******************************************************************************
+ * Binds every reactor to the same port.
+ *
+ * The flags are passed to @ref ServerListener::bind() with
+ * BINDF_REUSEPORT added.
+ *
+ * @return 0 if successful, otherwise the error of the first reactor
+ *         that failed to bind.
+ ******************************************************************************/
+MSrvResult ServerGroup::bind (
+	int                           portno,
+	ServerListener::protocol_type protocol,
+	uint                          flags)
+{
+	for (int i=0; i<mReactorCount; ++i) {
+		MSrvResult result = mpReactors[i]->listener().bind (portno, protocol,
+															 flags | ServerListener::BINDF_REUSEPORT);
+		if (result < 0)
+			return result;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Runs the listener loops of all reactors.
+ *
+ * Each reactor runs in its own thread. Returns after all the reactors
+ * have shut down.
+ *
+ * @return 0 if successful, otherwise the error of the first reactor
+ *         that failed.
+ ******************************************************************************/
+MSrvResult ServerGroup::listen ()
+{
+	MSrvResult result  = 0;
+	int        started = 0;
+
+	/* Start the reactor threads. */
+	for (; started<mReactorCount; ++started) {
+		result = mpReactors[started]->start ();
+		if (result < 0) {
+			/* Stop the ones already started. */
+			startShutdown ();
+			break;
+		}
+	}
+
+	if (mrpLog && result == 0)
+		mrpLog->message ("SERVER", Log::Info, 0,
+						 "Started %d reactor threads successfully.",
+						 mReactorCount);
+
+	/* Wait for all of them to exit. */
+	for (int i=0; i<started; ++i) {
+		mpReactors[i]->join (NULL);
+
+		if (result == 0 && mpReactors[i]->result () < 0)
+			result = mpReactors[i]->result ();
+	}
+
+	return result;
+}
+
+/*******************************************************************************
+ * Initiates shutdown of all the reactors.
+ *
+ * As with @ref Listener::startShutdown(), the reactors notice the
+ * shutdown when they next wake up.
+ ******************************************************************************/
+void ServerGroup::startShutdown ()
+{
+	for (int i=0; i<mReactorCount; ++i)
+		mpReactors[i]->listener().startShutdown ();
+}
+
+/*******************************************************************************
+ * \fn int ServerGroup::reactorCount () const
+ *
+ * Returns the number of reactors in the group.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Returns the listener of the given reactor.
+ ******************************************************************************/
+ServerListener& ServerGroup::reactor (int i)
+{
+	return mpReactors[i]->listener ();
+}
+
+/*******************************************************************************
+ * Sets the request mask of every reactor.
+ *
+ * \see ServerListener::setRequestMask()
+ ******************************************************************************/
+void ServerGroup::setRequestMask (uint mask)
+{
+	for (int i=0; i<mReactorCount; ++i)
+		mpReactors[i]->listener().setRequestMask (mask);
+}
+
+/*******************************************************************************
+ * Sets the connection factory of every reactor.
+ *
+ * The factory is called concurrently from all reactor threads.
+ *
+ * \see ServerListener::setConnectionFactory()
+ ******************************************************************************/
+void ServerGroup::setConnectionFactory (ConnectionFactory& factory)
+{
+	for (int i=0; i<mReactorCount; ++i)
+		mpReactors[i]->listener().setConnectionFactory (factory);
+}
+
+/*******************************************************************************
+ * Creates a reactor and its listener.
+ ******************************************************************************/
+Reactor::Reactor (
+	ServerGroup*    pGroup,      /**< Owner group.                           */
+	RequestHandler* pHandler,    /**< Handler of the requests.               */
+	bool            ownsHandler, /**< Should the handler be deleted with us? */
+	Log*            rpLog,       /**< Log of the listener. May be NULL.      */
+	int             backend      /**< Event backend type of the listener.    */)
+{
+	mpGroup      = pGroup;
+	mpHandler    = pHandler;
+	mOwnsHandler = ownsHandler;
+	mResult      = 0;
+	mpListener   = new ServerListener (*pHandler, rpLog, backend);
+}
+
+/*******************************************************************************
+ * Destroys the reactor and its listener.
+ ******************************************************************************/
+Reactor::~Reactor ()
+{
+	delete mpListener;
+
+	if (mOwnsHandler)
+		delete mpHandler;
+}
+
+/*******************************************************************************
+ * Runs the listener loop.
+ *
+ * When the loop exits, the rest of the group is shut down too.
+ ******************************************************************************/
+void* Reactor::execute ()
+{
+	mResult = mpListener->listen ();
+
+	mpGroup->startShutdown ();
+
+	return NULL;
+}
+
+end_namespace (MSrv);
@@ -52,17 +52,28 @@ static DummyLog dummyLog;
 
 /*******************************************************************************
  * Default constructor for Listener objects.
+ *
+ * @param rpLog   Log to write messages to. May be NULL.
+ * @param backend Type of the @ref EventBackend used for watching the
+ *                descriptors; one of @ref EventBackend::backend_type.
  ******************************************************************************/
-Listener::Listener (Log* rpLog)
+Listener::Listener (Log* rpLog, int backend)
 {
 	mTimeoutSec     = 1;
 	mTimeoutUSec    = 0;
 	mShutdownStatus = false;
+	mLastEvent      = TimerWheel::now ();
 
 	if (rpLog)
 		mrpLog = rpLog;
 	else
 		mrpLog = &dummyLog;
+
+	mpBackend = EventBackend::create (backend, *mrpLog);
+
+	/* Report the messages suppressed by the log limiters once their */
+	/* interval is over, even if no more messages pass.              */
+	mLimiterTimer = mTimers.add (MSRV_LOG_LIMIT_MSEC, MSRV_LOG_LIMIT_MSEC);
 }
 
 /*******************************************************************************
@@ -72,6 +83,7 @@ Listener::Listener (Log* rpLog)
  ******************************************************************************/
 Listener::~Listener ()
 {
+	delete mpBackend;
 }
 
 /*******************************************************************************
@@ -81,53 +93,37 @@ Listener::~Listener ()
  ******************************************************************************/
 MSrvResult Listener::listen ()
 {
-	struct timeval timeout;         /* Timeout for select.                */
-	int            errorcount = 0;  /* For counting consecutive failures. */
-	fd_set         fdset;           /* Set of descriptors.                */
+	int errorcount = 0;                    /* For counting consecutive failures. */
+	ReadyEvent ready[MSRV_MAX_READY_EVENTS]; /* Descriptors with a status change. */
+
+	mrpLog->message ("LISTENER", Log::Info, 0, "Starting listening with %s...",
+					 mpBackend->name ());
 
-	mrpLog->message ("LISTENER", Log::Info, 0, "Starting listening...");
-	
 	while (1) {
-		mThreadLock.lock ();
+		/* Wait for a status change in any of the descriptors, but */
+		/* no longer than to the next timeout or timer.            */
+		long waitSec, waitUSec;
+		waitTimeout (waitSec, waitUSec);
+
+		int selectCount = mpBackend->wait (ready, MSRV_MAX_READY_EVENTS,
+										   waitSec, waitUSec);
+		if (selectCount < 0 && errno == EINTR)
+			/* A signal, such as SIGHUP reopening the log, is no error. */
+			selectCount = 0;
 
-		/* Are we using a timeout? */
-		bool usingTimeout = mTimeoutSec>0 || mTimeoutUSec>0;
-		
-		/* Set select timeout. */
-		timeout.tv_sec  = mTimeoutSec;
-		timeout.tv_usec = mTimeoutUSec;
-
-		/* Put all watched descriptors to the descriptor set. */
-		FD_ZERO (&fdset); /* Empty the FD set.                */
-		int maxfd = 0;    /* Highest descriptor in the set.   */
-		for (int i=0; i<mDescriptors.length(); ++i) {
-			/* Put a descriptor in descriptor set. */
-			FD_SET (mDescriptors[i].mFd, &fdset);
-
-			/* Track highest descriptor in the set. */
-			if (mDescriptors[i].mFd > maxfd)
-				maxfd = mDescriptors[i].mFd;
-		}
-		mThreadLock.unlock ();
-		
-		/* Wait for a status change in any of the descriptors. */
-		int selectCount = select (maxfd + 1,
-								  &fdset,   /* Read events.      */
-								  NULL,     /* No write events.  */
-								  NULL,     /* Exception events. */
-								  usingTimeout? &timeout : NULL);
 		if (selectCount < 0) {
-			mrpLog->message ("LISTENER", Log::Warning, MSRVERR_SELECT_FAILED,
-							 "Select failed with error %d; %s.",
-							 errno, strerror (errno));
+			MSRV_LOG_LIMITED (*mrpLog, "LISTENER", Log::Warning, MSRVERR_SELECT_FAILED,
+							  "Waiting with %s failed with error %d; %s.",
+							  mpBackend->name (), errno, strerror (errno));
 
 			/* We don't want to fail completely at first problem, so we try */
 			/* again and hope the problem goes away. It probably doesn't.   */
 			++errorcount;
 
 		} else if (selectCount == 0) {
-			/* Select exited because of timeout. */
-			int result = timeoutEvent ();
+			/* Select exited because of timeout. It may have been */
+			/* only for a timer.                                  */
+			int result = idleExpired ()? timeoutEvent () : 0;
 			
 			/* Check if the event caused shutdown. */
 			if (result == MSRVERR_SHUTDOWN_EVENT)
@@ -137,32 +133,46 @@ MSrvResult Listener::listen ()
 
 		} else {
 			/* State of some descriptor(s) has changed. */
+			idleRestart ();
+
 			mThreadLock.lock ();
 
-			/* Check which descriptors have a status change. */
-			bool foundChange = false;
-			for (int i=0; i<mDescriptors.length(); ++i)
-				/* Check a descriptor for status change. */
-				if (FD_ISSET (mDescriptors[i].mFd, &fdset)) {
-					/* Status has changed. Handle event. */
-					int result = descriptorEvent (mDescriptors[i].mFd,
-												  mDescriptors[i].mpData);
-
-					/* Check if the event caused shutdown. */
-					if (result == MSRVERR_SHUTDOWN_EVENT)
-						startShutdown ();
-					else if (result < 0)
-						/* TODO: Handle error. */;
-					
-					foundChange = true;
+			/* Handle only the descriptors that have a status change. */
+			for (int i=0; i<selectCount; ++i) {
+				/* An earlier event in this batch may have removed it. */
+				Descriptor* pDesc = mDescriptors.find (ready[i].mFd);
+				if (!pDesc)
+					continue;
+
+				/* Send queued data first, which may make room for more. */
+				int result = 0;
+				if (ready[i].mEvents & EventBackend::Writable)
+					result = writableEvent (pDesc->mFd, pDesc->mpData);
+
+				/* Status has changed. Handle event. The descriptor may */
+				/* have been removed while writing.                     */
+				if ((ready[i].mEvents & EventBackend::Readable) && result != MSRVERR_SHUTDOWN_EVENT) {
+					pDesc = mDescriptors.find (ready[i].mFd);
+					if (pDesc)
+						result = descriptorEvent (pDesc->mFd, pDesc->mpData);
 				}
 
+				/* Check if the event caused shutdown. */
+				if (result == MSRVERR_SHUTDOWN_EVENT)
+					startShutdown ();
+				else if (result < 0)
+					/* TODO: Handle error. */;
+			}
+
 			/* All is ok again, reset the error count. */
 			errorcount = 0;
 
 			mThreadLock.unlock ();
 		}
 
+		/* Timers expire regardless of the other events. */
+		expireTimers ();
+
 		/* Check if the select has failed too many times consecutively. */
 		if (errorcount > MSRV_MAX_SELECT_ERROR_COUNT) {
 			mrpLog->message ("LISTENER",
@@ -181,6 +191,19 @@ MSrvResult Listener::listen ()
 	shutdown ();
 
 	/* Close any descriptors still open. */
+	closeDescriptors ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Closes any descriptors still open after shutdown.
+ *
+ * Called at the end of @ref listen(), after @ref shutdown(). Writes a
+ * warning to the log if any descriptors had to be closed.
+ ******************************************************************************/
+void Listener::closeDescriptors ()
+{
 	if (mDescriptors.length() > 0) {
 		for (int i=0; i<mDescriptors.length(); ++i)
 			::close (mDescriptors[i].mFd);
@@ -191,8 +214,6 @@ MSrvResult Listener::listen ()
 						 "%d still open descriptors were closed by Listener.",
 						 mDescriptors.length());
 	}
-
-	return 0;
 }
 
 /*******************************************************************************
@@ -205,7 +226,7 @@ MSrvResult Listener::listen ()
  ******************************************************************************/
 void Listener::startShutdown ()
 {
-	mShutdownStatus = true;
+	__atomic_store_n (&mShutdownStatus, true, __ATOMIC_RELEASE);
 }
 
 /*******************************************************************************
@@ -218,7 +239,9 @@ void Listener::startShutdown ()
  * Sets timeout for listening.
  *
  * During the execution of @ref listen(), after the timeout expires
- * without events in descriptors, @ref timeoutEvent() is called.
+ * without events in descriptors, @ref timeoutEvent() is called. For
+ * something to be done periodically also under load, use @ref
+ * addTimer() instead.
  *
  * This should not be very small, preferably more than a second.
  *
@@ -237,16 +260,130 @@ void Listener::setTimeout (
 /*******************************************************************************
  * Returns the amount of timeout counter left since the last event.
  *
- * The values will be non-zero only if the last event raised by the
- * Listener was not timeoutEvent.
+ * The counter restarts at each event in the descriptors and at each
+ * @ref timeoutEvent(). The values are zero if the timeout is disabled
+ * or has expired.
  ******************************************************************************/
 void Listener::timeoutLeft (
  	long& seconds,
 	long& microseconds) const
 {
-	/* TODO: Return the values. */
+	long timeout = mTimeoutSec*1000000 + mTimeoutUSec;
+	long elapsed = (long) (TimerWheel::now () - mLastEvent) * 1000;
+	long left    = timeout > elapsed? timeout - elapsed : 0;
+
+	seconds      = left / 1000000;
+	microseconds = left % 1000000;
+}
+
+/*******************************************************************************
+ * Tells how long @ref listen() may wait for events.
+ *
+ * This is the time left of the timeout, or the time to the next timer
+ * if that is earlier. Zero values mean waiting without a timeout.
+ ******************************************************************************/
+void Listener::waitTimeout (
+	long& seconds,     /**< Receives the seconds.      */
+	long& microseconds /**< Receives the microseconds. */)
+{
+	long msec = -1;
+	if (mTimeoutSec>0 || mTimeoutUSec>0) {
+		long leftSec, leftUSec;
+		timeoutLeft (leftSec, leftUSec);
+		msec = leftSec*1000 + (leftUSec+999)/1000;
+	}
+
+	long timerMSec = mTimers.nextTimeout (TimerWheel::now ());
+	if (timerMSec >= 0 && (msec < 0 || timerMSec < msec))
+		msec = timerMSec;
+
+	seconds      = 0;
+	microseconds = 0;
+	if (msec == 0)
+		microseconds = 1; /* Just poll; zero would wait forever. */
+	else if (msec > 0) {
+		seconds      = msec / 1000;
+		microseconds = (msec % 1000) * 1000;
+	}
 }
 
+/*******************************************************************************
+ * Tells if the timeout has expired, and if so, restarts it.
+ ******************************************************************************/
+bool Listener::idleExpired ()
+{
+	if (mTimeoutSec<=0 && mTimeoutUSec<=0)
+		return false;
+
+	long seconds, microseconds;
+	timeoutLeft (seconds, microseconds);
+	if (seconds>0 || microseconds>0)
+		return false;
+
+	idleRestart ();
+	return true;
+}
+
+/*******************************************************************************
+ * \fn void Listener::idleRestart ()
+ *
+ * Restarts the timeout counter, as an event has occurred.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Calls @ref timerEvent() for each expired timer.
+ *
+ * The timer of the log limiter reports is handled here.
+ ******************************************************************************/
+void Listener::expireTimers ()
+{
+	TimerExpiry   expired[MSRV_TIMER_BATCH];
+	unsigned long now = TimerWheel::now ();
+	int           count;
+
+	do {
+		count = mTimers.expire (now, expired, MSRV_TIMER_BATCH);
+
+		mThreadLock.lock ();
+		for (int i=0; i<count; ++i)
+			if (expired[i].mId == mLimiterTimer)
+				LogLimiter::reportAll ();
+			else if (timerEvent (expired[i].mId, expired[i].mpData) == MSRVERR_SHUTDOWN_EVENT)
+				startShutdown ();
+		mThreadLock.unlock ();
+
+	} while (count == MSRV_TIMER_BATCH);
+}
+
+/*******************************************************************************
+ * \fn long Listener::addTimer (long msec, long periodMSec)
+ *
+ * Sets a timer of the listener. When the timer expires, @ref
+ * timerEvent() is called in the listener thread. If periodMSec is
+ * not zero, the timer is periodic and expires every periodMSec after
+ * the first expiry, until cancelled.
+ *
+ * Timers set in other threads are noticed when the listener next
+ * wakes up, at the latest when the timeout set with @ref setTimeout()
+ * expires.
+ *
+ * @return Identifier of the timer, or a negative error code.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn MSrvResult Listener::cancelTimer (long id)
+ *
+ * Cancels a timer set with @ref addTimer().
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn TimerWheel& Listener::timers ()
+ *
+ * Returns the @ref TimerWheel of the listener.
+ ******************************************************************************/
+
 /*******************************************************************************
  * \fn void Listener::setLog (Log& rLog)
  *
@@ -259,6 +396,47 @@ void Listener::timeoutLeft (
  * Returns a reference to the log to which the Listener messages are printed.
  ******************************************************************************/
 
+/*******************************************************************************
+ * \fn const char* Listener::backendName () const
+ *
+ * Returns the name of the @ref EventBackend watching the descriptors.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn EventBackend& Listener::backend ()
+ *
+ * Returns the @ref EventBackend watching the descriptors.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Adds a descriptor (a socket) to be listened.
+ *
+ * @return 0 if successful, otherwise an error code.
+ ******************************************************************************/
+MSrvResult Listener::addDescriptor (
+	int   fd,    /**< Descriptor to listen.                                 */
+	void* pData  /**< Data object passed to @ref descriptorEvent(). May be NULL. */)
+{
+	mThreadLock.lock ();
+
+	/* Register with the backend first, as it may refuse the descriptor. */
+	MSrvResult result = mpBackend->add (fd);
+	if (result == 0) {
+		result = mDescriptors.add (fd, Descriptor (fd, pData));
+		if (result < 0)
+			mpBackend->remove (fd);
+	}
+
+	mThreadLock.unlock ();
+
+	if (result < 0)
+		mrpLog->message ("LISTENER", Log::Error, result,
+						 "Adding descriptor %d to %s failed.",
+						 fd, mpBackend->name ());
+
+	return result;
+}
+
 /*******************************************************************************
  * Removes a descriptor (a socket) from the listener.
  *
@@ -269,30 +447,63 @@ void Listener::timeoutLeft (
  ******************************************************************************/
 MSrvResult Listener::removeDescriptor (int fd)
 {
-	/* Note: This method is a bit too crowded with array manipulation. */
-	
 	mThreadLock.lock ();
 
-	/* Find the descriptor. */
-	bool found = false;
-	for (int i=0; i<mDescriptors.length(); ++i)
-		if (mDescriptors[i].mFd == fd) {
-			/* Found it. Remove it. */
-			mDescriptors.remove (i);
+	/* Stop watching the descriptor. */
+	mpBackend->remove (fd);
 
-			found = true; /* Note that we found a descriptor. */
-			break;
-		}
+	Descriptor* pDesc  = mDescriptors.find (fd);
+	void*       pData  = pDesc? pDesc->mpData : NULL;
+	MSrvResult  result = mDescriptors.remove (fd);
+
+	if (result >= 0)
+		descriptorRemoved (fd, pData);
 
 	mThreadLock.unlock ();
 
 	/* If no descriptor was found, the argument was invalid. */
-	if (!found)
+	if (result < 0)
 		return MSRVERR_DESCRIPTOR_NOT_FOUND;
 	
 	return 0;
 }
 
+/*******************************************************************************
+ * Starts or stops watching a descriptor for becoming writable.
+ *
+ * While the watch is on, @ref writableEvent() is called whenever the
+ * descriptor can take more data. It should be on only while there is
+ * data waiting to be sent. May be called in any thread.
+ *
+ * @return 0 if successful, otherwise an error code.
+ ******************************************************************************/
+MSrvResult Listener::watchWrite (
+	int  fd, /**< Descriptor added with @ref addDescriptor(). */
+	bool on  /**< Start or stop watching?                     */)
+{
+	return mpBackend->watchWrite (fd, on);
+}
+
+/*******************************************************************************
+ * Finds the data object associated with a descriptor.
+ *
+ * The caller must hold the thread lock of the Listener, as it is held
+ * during @ref descriptorEvent().
+ *
+ * @return true if the descriptor is listened, otherwise false.
+ ******************************************************************************/
+bool Listener::findDescriptor (
+	int    fd,     /**< Descriptor to look up.                          */
+	void*& rpData  /**< Receives the data given to @ref addDescriptor(). */)
+{
+	Descriptor* pDesc = mDescriptors.find (fd);
+	if (!pDesc)
+		return false;
+
+	rpData = pDesc->mpData;
+	return true;
+}
+
 /*******************************************************************************
  * Descriptor status changed.
  *
@@ -309,6 +520,54 @@ MSrvResult Listener::descriptorEvent (
 	return 0;
 }
 
+/*******************************************************************************
+ * A timer has expired.
+ *
+ * Called in the listener thread with the thread lock held. Inheritor
+ * should reimplement this to handle timers.
+ *
+ * @return 0 if successful, otherwise error. If the return value is
+ *         MSRVERR_SHUTDOWN_EVENT, the @ref listen() will stop as soon as
+ *         possible.
+ ******************************************************************************/
+MSrvResult Listener::timerEvent (
+	long  id,   /**< Identifier of the timer.                     */
+	void* pData /**< Data given when the timer was set, if any.   */)
+{
+	return 0;
+}
+
+/*******************************************************************************
+ * A descriptor has been removed from the listener.
+ *
+ * Called with the thread lock held, in whichever thread removed the
+ * descriptor. Inheritor may reimplement this to release bookkeeping
+ * kept for the descriptor.
+ ******************************************************************************/
+void Listener::descriptorRemoved (
+	int   fd,  /**< Descriptor that was removed.                            */
+	void* data /**< Pointer to data object associated with the descriptor. */)
+{
+}
+
+/*******************************************************************************
+ * Descriptor has become writable.
+ *
+ * Called only for descriptors watched with @ref watchWrite().
+ * Inheritor should reimplement this to send data waiting for the
+ * descriptor.
+ *
+ * @return 0 if successful, otherwise error. If the return value is
+ *         MSRVERR_SHUTDOWN_EVENT, the @ref listen() will stop as soon as
+ *         possible.
+ ******************************************************************************/
+MSrvResult Listener::writableEvent (
+	int   fd,  /**< Descriptor which became writable.                      */
+	void* data /**< Pointer to data object associated with the descriptor. */)
+{
+	return 0;
+}
+
 /*******************************************************************************
  * Timeout event occurred during @ref listen().
  *
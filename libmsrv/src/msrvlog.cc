@@ -25,13 +25,32 @@
 #include <magicserver/msrverror.h>
 #include <magicserver/msrvlog.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdexcept>
 #include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* The coarse clock is read from the vDSO without a system call. */
+#ifdef CLOCK_REALTIME_COARSE
+#define MSRV_LOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define MSRV_LOG_CLOCK CLOCK_REALTIME
+#endif
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define MSRV_LOG_LIMIT_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define MSRV_LOG_LIMIT_CLOCK CLOCK_MONOTONIC
+#endif
 
 begin_namespace (MSrv);
 
+/* Log reopened on SIGHUP. */
+static LogFile* spHangupLog = NULL;
+
 /*******************************************************************************
  * \fn MSrvResult Log::open()=0
  *
@@ -45,9 +64,28 @@ begin_namespace (MSrv);
  ******************************************************************************/
 
 /*******************************************************************************
- * \fn MSrvResult Log::message (const char* modulename, int fatality, int errno, const char* message, ...)=0;
+ * \fn MSrvResult Log::message (const char* modulename, int fatality, int errnum, const char* message, ...)=0;
  *
  * Writes a message to the log.
+ *
+ * Implementations must return without formatting anything if the
+ * fatality is filtered out by @ref level(). Use @ref MSRV_LOG to
+ * skip also the evaluation of the arguments.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void Log::setLevel (int level)
+ *
+ * Sets the least severe fatality written to the log. Messages of
+ * lower severity (a higher @ref fatality value) are dropped before
+ * they are formatted. The default is Log::Debug, which writes all
+ * messages. May be called in any thread.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn bool Log::isLogged (int fatality) const
+ *
+ * Checks if messages of the given fatality pass the log level.
  ******************************************************************************/
 
 /*******************************************************************************
@@ -56,6 +94,284 @@ begin_namespace (MSrv);
  * Writes to the log.
  ******************************************************************************/
 
+/*******************************************************************************
+ * Returns the name of a fatality, as written in the log lines.
+ ******************************************************************************/
+const char* Log::fatalityName (int fatality)
+{
+	static const char* fatalities[8] = {"EMERGENCY",
+										"ALERT",
+										"CRITICAL",
+										"ERROR",
+										"WARNING",
+										"NOTICE",
+										"INFO",
+										"DEBUG"};
+
+	if (fatality < 0 || fatality > Debug)
+		return "UNKNOWN";
+
+	return fatalities[fatality];
+}
+
+LogLimiter* LogLimiter::spEnlisted = NULL;
+
+/*******************************************************************************
+ * Returns the lock guarding the list of enlisted limiters.
+ ******************************************************************************/
+static ThreadLock& enlistLock ()
+{
+	static ThreadLock sLock;
+	return sLock;
+}
+
+/*******************************************************************************
+ * Returns the time of the limiter clock in milliseconds.
+ ******************************************************************************/
+static long limiterNow ()
+{
+	struct timespec now;
+	clock_gettime (MSRV_LOG_LIMIT_CLOCK, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*******************************************************************************
+ * Creates a limit of count messages in msec milliseconds.
+ ******************************************************************************/
+LogLimiter::LogLimiter (
+	int  count, /**< Messages passed in an interval.        */
+	long msec   /**< Length of an interval in milliseconds. */)
+{
+	mLimit      = count;
+	mInterval   = msec;
+	mStart      = 0;
+	mCount      = 0;
+	mSuppressed = 0;
+	mrpLog      = NULL;
+	mpModule    = NULL;
+	mFatality   = 0;
+	mErrnum     = 0;
+	mpFile      = NULL;
+	mLine       = 0;
+	mpNext      = NULL;
+}
+
+/*******************************************************************************
+ * Checks if a message may be written.
+ *
+ * The first caller of each interval starts it and takes the count of
+ * the messages suppressed before, to be reported with its message.
+ * Concurrent callers may see the count reset a little late, so a few
+ * more messages than the limit may pass when an interval starts.
+ *
+ * \return true if the message may be written.
+ ******************************************************************************/
+bool LogLimiter::allow (
+	long& rSuppressed /**< Receives the messages to report as suppressed. */)
+{
+	long msec  = limiterNow ();
+	long start = __atomic_load_n (&mStart, __ATOMIC_RELAXED);
+
+	rSuppressed = 0;
+	if (msec - start >= mInterval &&
+		__atomic_compare_exchange_n (&mStart, &start, msec, false,
+									 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n (&mCount, 0, __ATOMIC_RELAXED);
+		rSuppressed = __atomic_exchange_n (&mSuppressed, 0, __ATOMIC_RELAXED);
+	}
+
+	/* Once the limit is reached, only the suppressed count changes. */
+	if (__atomic_load_n (&mCount, __ATOMIC_RELAXED) < mLimit &&
+		__atomic_fetch_add (&mCount, 1, __ATOMIC_RELAXED) < mLimit)
+		return true;
+
+	/* Keep the count for the next message that passes. */
+	__atomic_add_fetch (&mSuppressed, rSuppressed + 1, __ATOMIC_RELAXED);
+	rSuppressed = 0;
+	return false;
+}
+
+/*******************************************************************************
+ * Lists the limiter for @ref reportAll(), unless it is listed already.
+ *
+ * Called when a message has been suppressed. The count is reported
+ * to the log and with the module, fatality and number of the first
+ * suppressed message. The source location tells which messages were
+ * suppressed, as their text is not formatted.
+ ******************************************************************************/
+void LogLimiter::enlist (
+	Log&        rLog,       /**< Log of the limited messages.          */
+	const char* modulename, /**< Module of the limited messages.       */
+	int         fatality,   /**< Fatality of the limited messages.     */
+	int         errnum,     /**< Number of the limited messages.       */
+	const char* file,       /**< Source file of the limited messages.  */
+	int         line        /**< Source line of the limited messages.  */)
+{
+	if (__atomic_load_n (&mrpLog, __ATOMIC_ACQUIRE))
+		return;
+
+	ThreadLock& rLock = enlistLock ();
+	rLock.lock ();
+
+	if (!mrpLog) {
+		mpModule  = modulename;
+		mFatality = fatality;
+		mErrnum   = errnum;
+		mpFile    = strrchr (file, '/')? strrchr (file, '/') + 1 : file;
+		mLine     = line;
+		mpNext    = spEnlisted;
+		spEnlisted = this;
+		__atomic_store_n (&mrpLog, &rLog, __ATOMIC_RELEASE);
+	}
+
+	rLock.unlock ();
+}
+
+/*******************************************************************************
+ * Writes the count of the suppressed messages of each enlisted
+ * limiter whose interval is over.
+ *
+ * Without this, a count would only be written with the next message
+ * that passes, which may never come once a storm is over. Called
+ * periodically by the @ref Listener.
+ ******************************************************************************/
+void LogLimiter::reportAll ()
+{
+	long msec = limiterNow ();
+
+	ThreadLock& rLock = enlistLock ();
+	rLock.lock ();
+
+	for (LogLimiter* pLimiter = spEnlisted; pLimiter; pLimiter = pLimiter->mpNext)
+		pLimiter->report (msec);
+
+	rLock.unlock ();
+}
+
+/*******************************************************************************
+ * Writes the count of the suppressed messages if the interval is
+ * over. The next message that passes then has no count to report.
+ ******************************************************************************/
+void LogLimiter::report (long msec /**< Time of the limiter clock. */)
+{
+	if (msec - __atomic_load_n (&mStart, __ATOMIC_RELAXED) < mInterval ||
+		!__atomic_load_n (&mSuppressed, __ATOMIC_RELAXED))
+		return;
+
+	long suppressed = __atomic_exchange_n (&mSuppressed, 0, __ATOMIC_RELAXED);
+	if (suppressed > 0)
+		mrpLog->message (mpModule, mFatality, mErrnum,
+						 "Suppressed %ld messages at %s:%d.",
+						 suppressed, mpFile, mLine);
+}
+
+/*******************************************************************************
+ * \fn int LogClock::precision () const
+ *
+ * Returns the precision of the time stamps.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates a clock with the given precision.
+ ******************************************************************************/
+LogClock::LogClock (
+	int precision /**< LogClock::Seconds or LogClock::Microseconds. */)
+{
+	mSecond    = -1;
+	mPrefixLen = 0;
+	setPrecision (precision);
+}
+
+/*******************************************************************************
+ * Sets the precision of the time stamps.
+ *
+ * With LogClock::Microseconds, the monotonic clock is tied to the
+ * wall clock time of this call. Set the precision before logging.
+ ******************************************************************************/
+void LogClock::setPrecision (
+	int precision /**< LogClock::Seconds or LogClock::Microseconds. */)
+{
+	mPrecision = precision == Microseconds? Microseconds : Seconds;
+
+	struct timespec wall, mono;
+	clock_gettime (CLOCK_REALTIME, &wall);
+	clock_gettime (CLOCK_MONOTONIC, &mono);
+
+	mOffset.tv_sec  = wall.tv_sec - mono.tv_sec;
+	mOffset.tv_nsec = wall.tv_nsec - mono.tv_nsec;
+	if (mOffset.tv_nsec < 0) {
+		mOffset.tv_sec--;
+		mOffset.tv_nsec += 1000000000L;
+	}
+}
+
+/*******************************************************************************
+ * Reads the time of a log message.
+ *
+ * May be called in any thread.
+ ******************************************************************************/
+void LogClock::now (
+	struct timespec& rTime /**< Receives the time. */) const
+{
+	if (mPrecision == Seconds) {
+		clock_gettime (MSRV_LOG_CLOCK, &rTime);
+		return;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &rTime);
+	rTime.tv_sec  += mOffset.tv_sec;
+	rTime.tv_nsec += mOffset.tv_nsec;
+	if (rTime.tv_nsec >= 1000000000L) {
+		rTime.tv_sec++;
+		rTime.tv_nsec -= 1000000000L;
+	}
+}
+
+/*******************************************************************************
+ * Writes the time stamp of a log line, followed by a space.
+ *
+ * The date and time are formatted only when the second changes;
+ * otherwise they are copied from the previous call.
+ *
+ * \return Length of the stamp, at most LogClock::PrefixLen.
+ ******************************************************************************/
+int LogClock::format (
+	const struct timespec& rTime,  /**< Time from @ref now().               */
+	char*                  pBuffer /**< Receives LogClock::PrefixLen bytes. */)
+{
+	if (rTime.tv_sec != mSecond) {
+		struct tm timeTm;
+		localtime_r (&rTime.tv_sec, &timeTm);
+		mPrefixLen = snprintf (mPrefix, sizeof (mPrefix),
+							   "%04d/%02d/%02d %02d:%02d:%02d",
+							   1900+timeTm.tm_year,
+							   timeTm.tm_mon+1,
+							   timeTm.tm_mday,
+							   timeTm.tm_hour,
+							   timeTm.tm_min,
+							   timeTm.tm_sec);
+		if (mPrefixLen < 0 || mPrefixLen > (int) sizeof (mPrefix) - 9)
+			mPrefixLen = 0;
+		mSecond = rTime.tv_sec;
+	}
+
+	memcpy (pBuffer, mPrefix, mPrefixLen);
+	int len = mPrefixLen;
+
+	if (mPrecision == Microseconds) {
+		long usec = rTime.tv_nsec / 1000;
+		pBuffer[len++] = '.';
+		for (int i = 5; i >= 0; --i) {
+			pBuffer[len + i] = '0' + usec % 10;
+			usec /= 10;
+		}
+		len += 6;
+	}
+
+	pBuffer[len++] = ' ';
+	return len;
+}
+
 /*******************************************************************************
  * Opens log to the given already open stream.
  *
@@ -68,7 +384,16 @@ begin_namespace (MSrv);
 LogFile::LogFile (
 	FILE* stream /**< Stream to write the log to. */)
 {
-	mpLogStream = stream;
+	mpLogStream      = stream;
+	mpFilename       = NULL;
+	mFileLen         = 0;
+	mMaxLen          = 0;
+	mInterval        = 0;
+	mKeep            = MSRV_LOG_ROTATE_KEEP;
+	mNextRotation    = 0;
+	mRotation        = 0;
+	mRotatorStopping = false;
+	mpRotator        = NULL;
 }
 
 /*******************************************************************************
@@ -80,7 +405,15 @@ LogFile::LogFile (
 LogFile::LogFile (
 	const char* filename /**< File to write the log to. */)
 {
-	mpLogStream = NULL;
+	mpLogStream      = NULL;
+	mFileLen         = 0;
+	mMaxLen          = 0;
+	mInterval        = 0;
+	mKeep            = MSRV_LOG_ROTATE_KEEP;
+	mNextRotation    = 0;
+	mRotation        = 0;
+	mRotatorStopping = false;
+	mpRotator        = NULL;
 
 	if (!filename)
 		mpFilename = NULL; /* A problematic situation. */
@@ -100,11 +433,23 @@ LogFile::LogFile (
  ******************************************************************************/
 LogFile::~LogFile ()
 {
+	/* Stop reopening on SIGHUP and stop the rotator. */
+	LogFile* pThis = this;
+	__atomic_compare_exchange_n (&spHangupLog, &pThis, (LogFile*) NULL,
+								 false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+	if (mpRotator) {
+		__atomic_store_n (&mRotatorStopping, true, __ATOMIC_SEQ_CST);
+		mRotatorWakeup.post ();
+		mpRotator->join (NULL);
+		delete mpRotator;
+	}
+
 	mThreadLock.lock ();
 
 	close ();
 
-	delete mpFilename;
+	free (mpFilename);
 
 	mThreadLock.unlock ();
 }
@@ -124,7 +469,7 @@ MSrvResult LogFile::setFilename (const char* filename)
 
 	mThreadLock.lock ();
 	if (mpFilename)
-		delete mpFilename;
+		free (mpFilename);
 
 	mpFilename = strdup (filename);
 
@@ -162,8 +507,11 @@ MSrvResult LogFile::open ()
 			FILE* logStream = fopen (mpFilename, "a");
 			if (logStream == NULL)
 				result = MSRVERR_LOG_OPEN_FAILED;
-			else
+			else {
 				mpLogStream = logStream;
+				fseek (logStream, 0, SEEK_END);
+				mFileLen = ftell (logStream);
+			}
 		}
 	}
 
@@ -194,20 +542,54 @@ void LogFile::close ()
  ******************************************************************************/
 MSrvResult LogFile::write (const char* data, int len)
 {
+	int result = 0;
+
 	mThreadLock.lock ();
 
 	if (! mpLogStream)
-		return MSRVERR_LOG_NOT_OPEN;
+		result = MSRVERR_LOG_NOT_OPEN;
+	else if (!data)
+		result = MSRVERR_NULL_ARGUMENT;
+	else if ((int) fwrite (data, 1, len, mpLogStream) < len)
+		result = MSRVERR_SHORT_WRITE;
+	else if (mMaxLen > 0 && (mFileLen += len) >= mMaxLen)
+		requestRotation (RotateFile);
 
-	if (!data)
-		return MSRVERR_NULL_ARGUMENT;
+	mThreadLock.unlock ();
+	return result;
+}
+
+/*******************************************************************************
+ * Writes the buffered log lines to the file.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::flush ()
+{
+	int result = 0;
 
-	int written = fwrite (data, 1, len, mpLogStream);
-	if (written < len)
-		return MSRVERR_SHORT_WRITE;
+	mThreadLock.lock ();
+
+	if (! mpLogStream)
+		result = MSRVERR_LOG_NOT_OPEN;
+	else if (fflush (mpLogStream) != 0)
+		result = MSRVERR_LOG_WRITE_FAILED;
 
 	mThreadLock.unlock ();
-	return 0;
+	return result;
+}
+
+/*******************************************************************************
+ * Sets the precision of the time stamps of the lines.
+ *
+ * See @ref LogClock::setPrecision(). Set the precision before logging.
+ ******************************************************************************/
+void LogFile::setPrecision (
+	int precision /**< LogClock::Seconds or LogClock::Microseconds. */)
+{
+	mThreadLock.lock ();
+	mClock.setPrecision (precision);
+	mThreadLock.unlock ();
 }
 
 /*******************************************************************************
@@ -227,79 +609,355 @@ MSrvResult LogFile::write (const char* data, int len)
 MSrvResult LogFile::message (
 	const char* modulename,  /**< An identifier of the module writing to log. */
 	int         fatality,    /**< Severity of the event.                      */
-	int         errno,       /**< Possible message number.                    */
+	int         errnum,      /**< Possible message number.                    */
 	const char* message,     /**< Message (as a format string for printf).    */
 	...)
 {
-	static const char* fatalities[8] = {"EMERGENCY",
-										"ALERT",
-										"CRITICAL",
-										"ERROR",
-										"WARNING",
-										"NOTICE",
-										"INFO",
-										"DEBUG"};
-
-	mThreadLock.lock ();
-
-	if (! mpLogStream)
-		return MSRVERR_LOG_NOT_OPEN;
-
 	if (!message)
 		return MSRVERR_NULL_ARGUMENT;
 
 	if (fatality < 0 || fatality > Debug)
 		return MSRVERR_LOG_INVALID_FATALITY;
 
+	/* Drop filtered messages before formatting anything. */
+	if (!isLogged (fatality))
+		return 0;
+
 	/* Ensure that the error code is positive. */
-	if (errno < 0)
-		errno = -errno;
-
-	/* Write current time. */
-	time_t currentTime = time (NULL);
-	struct tm* pTimeTm = localtime (&currentTime);
-	int written = fprintf (mpLogStream,
-						   "%04d/%02d/%02d %02d:%02d:%02d ",
-						   1900+pTimeTm->tm_year,
-						   pTimeTm->tm_mon,
-						   pTimeTm->tm_mday,
-						   pTimeTm->tm_hour,
-						   pTimeTm->tm_min,
-						   pTimeTm->tm_sec);
-	if (written <= 0)
-		return MSRVERR_LOG_WRITE_FAILED;
+	if (errnum < 0)
+		errnum = -errnum;
+
+	mThreadLock.lock ();
+
+	if (! mpLogStream) {
+		mThreadLock.unlock ();
+		return MSRVERR_LOG_NOT_OPEN;
+	}
+
+	/* Write current time from the cached prefix. */
+	struct timespec now;
+	char            stamp[LogClock::PrefixLen];
+	mClock.now (now);
+	int len     = mClock.format (now, stamp);
+	int written = (int) fwrite (stamp, 1, len, mpLogStream) == len? len : -1;
 
 	/* Write log line header. */
+	if (written > 0) {
 		written = fprintf (mpLogStream,
 						   "%s %s %d: ",
 						   modulename,
-						   fatalities[fatality],
-						   errno);
-	if (written <= 0)
-		return MSRVERR_LOG_WRITE_FAILED;
-
-	/* Open ellipsis list. */
-	va_list ap;
-	va_start (ap, message);
-
-	/* Write the message with optional ellipsis. */
-	written = vfprintf (mpLogStream, message, ap);
-	if (written < 0)
-		return MSRVERR_LOG_WRITE_FAILED;
-
-	/* Close the ellipsis handling. */
-	va_end (ap);
-	
+						   fatalityName (fatality),
+						   errnum);
+		len += written;
+	}
+
+	if (written > 0) {
+		/* Write the message with optional ellipsis. */
+		va_list ap;
+		va_start (ap, message);
+		written = vfprintf (mpLogStream, message, ap);
+		va_end (ap);
+		len += written;
+	}
+
 	/* Write the ending newline. */
-	written = fprintf (mpLogStream, "\n");
-	if (written <= 0)
-		return MSRVERR_LOG_WRITE_FAILED;
+	if (written >= 0)
+		written = fprintf (mpLogStream, "\n");
 
 	fflush (mpLogStream);
+
+	if (written > 0 && mMaxLen > 0 && (mFileLen += len + 1) >= mMaxLen)
+		requestRotation (RotateFile);
 	
 	mThreadLock.unlock ();
+	return written > 0? 0 : MSRVERR_LOG_WRITE_FAILED;
+}
+
+/*******************************************************************************
+ * Renames a log file and its rotated copies.
+ *
+ * The file becomes filename.1, filename.1 becomes filename.2 and so
+ * on; the copy beyond keep is removed. With keep 0, the file is
+ * removed.
+ ******************************************************************************/
+static void shiftFiles (const char* filename, int keep)
+{
+	if (keep <= 0) {
+		unlink (filename);
+		return;
+	}
+
+	int   len   = strlen (filename) + 16;
+	char* pFrom = (char*) malloc (len);
+	char* pTo   = (char*) malloc (len);
+
+	if (pFrom && pTo)
+		for (int i = keep - 1; i >= 1; --i) {
+			snprintf (pFrom, len, "%s.%d", filename, i);
+			snprintf (pTo, len, "%s.%d", filename, i + 1);
+			rename (pFrom, pTo);
+		}
+
+	if (pTo) {
+		snprintf (pTo, len, "%s.1", filename);
+		rename (filename, pTo);
+	}
+
+	free (pFrom);
+	free (pTo);
+}
+
+/*******************************************************************************
+ * Catches SIGHUP.
+ ******************************************************************************/
+static void hangupHandler (int)
+{
+	LogFile* pLog = __atomic_load_n (&spHangupLog, __ATOMIC_SEQ_CST);
+	if (pLog)
+		pLog->requestReopen ();
+}
+
+/*******************************************************************************
+ * Executes the rotator.
+ ******************************************************************************/
+void* LogRotator::execute ()
+{
+	return mpLog->runRotator ();
+}
+
+/*******************************************************************************
+ * Sets when the log file is rotated.
+ *
+ * The file is renamed to filename.1 and a new file is opened when
+ * it grows to maxLen bytes, and every interval seconds; the times
+ * are multiples of the interval since the epoch, so that an interval
+ * of 86400 rotates at midnight UTC. Zero disables either. Earlier
+ * files are renamed up to filename.<keep>, and older ones removed.
+ *
+ * The length is checked after each write, so a file may grow past
+ * maxLen by the lines written before the rotator has swapped it.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::setRotation (
+	long maxLen,   /**< Rotate at this length in bytes, or 0.  */
+	long interval, /**< Rotate every this many seconds, or 0.  */
+	int  keep      /**< Rotated files kept.                    */)
+{
+	if (maxLen < 0 || interval < 0 || keep < 0)
+		return MSRVERR_INVALID_ARGUMENT;
+
+	MSrvResult result = startRotator ();
+	if (result < 0)
+		return result;
+
+	mThreadLock.lock ();
+	mMaxLen       = maxLen;
+	mInterval     = interval;
+	mKeep         = keep;
+	mNextRotation = interval > 0? (time (NULL) / interval + 1) * interval : 0;
+	mThreadLock.unlock ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Rotates the log file now.
+ *
+ * The renaming and opening are done without the log lock; the lines
+ * logged meanwhile go to the old file. May be called in any thread.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::rotate ()
+{
+	return swapStream (true);
+}
+
+/*******************************************************************************
+ * Reopens the log file by its name.
+ *
+ * Used after an external tool has renamed the file. As with @ref
+ * rotate(), logging threads do not wait for the file to be opened.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::reopen ()
+{
+	return swapStream (false);
+}
+
+/*******************************************************************************
+ * Asks the rotator to reopen the log file.
+ *
+ * Safe to call in a signal handler. Needs the rotator, started by
+ * @ref setRotation() or @ref reopenOnHangup(). On Linux the rotator
+ * is woken up at once; elsewhere it notices the request within
+ * MSRV_LOG_ROTATE_MSEC.
+ ******************************************************************************/
+void LogFile::requestReopen ()
+{
+	__atomic_or_fetch (&mRotation, (int) ReopenFile, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	mRotatorWakeup.post ();
+#endif
+}
+
+/*******************************************************************************
+ * Reopens the log file when the process gets SIGHUP.
+ *
+ * Installs a handler for SIGHUP and starts the rotator. Only one log
+ * is reopened; a later call moves the handling to its log.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::reopenOnHangup ()
+{
+	MSrvResult result = startRotator ();
+	if (result < 0)
+		return result;
+
+	__atomic_store_n (&spHangupLog, this, __ATOMIC_SEQ_CST);
+
+	struct sigaction action;
+	memset (&action, 0, sizeof (action));
+	action.sa_handler = hangupHandler;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset (&action.sa_mask);
+	if (sigaction (SIGHUP, &action, NULL) < 0)
+		return MSRVERR_INVALID_ARGUMENT;
+
 	return 0;
 }
 
+/*******************************************************************************
+ * Starts the rotator, if not yet started.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::startRotator ()
+{
+	MSrvResult result = 0;
+
+	mRotateLock.lock ();
+
+	if (!mpRotator) {
+		mpRotator = new LogRotator (this);
+		result = mpRotator->start ();
+		if (result < 0) {
+			delete mpRotator;
+			mpRotator = NULL;
+		}
+	}
+
+	mRotateLock.unlock ();
+	return result;
+}
+
+/*******************************************************************************
+ * Asks the rotator to rotate or reopen the file.
+ *
+ * Wakes the rotator only when the flag was not set already.
+ ******************************************************************************/
+void LogFile::requestRotation (int rotation)
+{
+	if (!(__atomic_fetch_or (&mRotation, rotation, __ATOMIC_SEQ_CST) & rotation))
+		mRotatorWakeup.post ();
+}
+
+/*******************************************************************************
+ * Main loop of the rotator.
+ ******************************************************************************/
+void* LogFile::runRotator ()
+{
+	while (!__atomic_load_n (&mRotatorStopping, __ATOMIC_SEQ_CST)) {
+		/* Sleep until the next rotation by interval, or a request. */
+		double timeout = MSRV_LOG_ROTATE_MSEC / 1000.0;
+		mThreadLock.lock ();
+		if (mInterval > 0) {
+			struct timespec now;
+			clock_gettime (CLOCK_REALTIME, &now);
+			double left = (mNextRotation - now.tv_sec) - now.tv_nsec / 1000000000.0;
+			if (left < timeout)
+				timeout = left > 0.001? left : 0.001;
+		}
+		mThreadLock.unlock ();
+
+		mRotatorWakeup.wait (timeout);
+
+		/* Schedule the next rotation by interval even if this one fails. */
+		mThreadLock.lock ();
+		time_t now = time (NULL);
+		bool   due = mInterval > 0 && now >= mNextRotation;
+		if (due)
+			mNextRotation = (now / mInterval + 1) * mInterval;
+		mThreadLock.unlock ();
+
+		int rotation = __atomic_exchange_n (&mRotation, 0, __ATOMIC_SEQ_CST);
+		if (due || (rotation & RotateFile))
+			swapStream (true);
+		else if (rotation & ReopenFile)
+			swapStream (false);
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+ * Opens the file by its name and swaps it in place of the current one.
+ *
+ * The file is renamed first, if asked. The log lock is held only
+ * while the streams are swapped; the old stream is flushed and closed
+ * after it.
+ *
+ * \return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult LogFile::swapStream (
+	bool rotateFiles /**< Rename the files before opening? */)
+{
+	mRotateLock.lock ();
+
+	mThreadLock.lock ();
+	char* filename = mpFilename && strcmp (mpFilename, "-")? strdup (mpFilename) : NULL;
+	bool  isOpen   = mpLogStream != NULL;
+	int   keep     = mKeep;
+	mThreadLock.unlock ();
+
+	MSrvResult result = 0;
+	FILE*      stream = NULL;
+	if (!filename)
+		result = MSRVERR_LOG_NO_FILENAME;
+	else if (!isOpen)
+		result = MSRVERR_LOG_NOT_OPEN;
+	else {
+		if (rotateFiles)
+			shiftFiles (filename, keep);
+
+		/* Keep writing to the old file if this fails. */
+		stream = fopen (filename, "a");
+		if (!stream)
+			result = MSRVERR_LOG_OPEN_FAILED;
+	}
+	free (filename);
+
+	if (stream) {
+		fseek (stream, 0, SEEK_END);
+		long len = ftell (stream);
+
+		mThreadLock.lock ();
+		FILE* oldStream = mpLogStream;
+		if (oldStream) {
+			mpLogStream = stream;
+			mFileLen    = len;
+		}
+		mThreadLock.unlock ();
+
+		/* The log may have been closed meanwhile. */
+		fclose (oldStream? oldStream : stream);
+	}
+
+	mRotateLock.unlock ();
+	return result;
+}
 
 end_namespace (MSrv);
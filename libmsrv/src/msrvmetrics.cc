@@ -0,0 +1,607 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvmetrics.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <new>
+
+#define MSRV_HISTOGRAM_SUB_LEN (1 << MSRV_HISTOGRAM_SUB_BITS)
+#define MSRV_METRIC_SHARED     (MSRV_METRIC_SHARDS - 1) /* Shard of the extra threads. */
+
+#if MSRV_METRIC_SHARDS > 64
+#error "MSRV_METRIC_SHARDS may be at most 64."
+#endif
+
+begin_namespace (MSrv);
+
+__thread int Metric::sShard = 0;
+
+/* Shards free to be taken by a thread, one bit each. */
+static unsigned long  sFreeShards = (1UL << MSRV_METRIC_SHARED) - 1;
+static pthread_key_t  sShardKey;
+static pthread_once_t sShardOnce  = PTHREAD_ONCE_INIT;
+
+/*******************************************************************************
+ * Creates the key that releases the shard of an exiting thread.
+ ******************************************************************************/
+void Metric::createShardKey ()
+{
+	pthread_key_create (&sShardKey, Metric::releaseShard);
+}
+
+/*******************************************************************************
+ * Creates a metric with the given name.
+ *
+ * The name must exist as long as the metric, typically as a string
+ * literal.
+ ******************************************************************************/
+Metric::Metric (const char* name)
+{
+	mpName      = name;
+	mpNext      = NULL;
+	mrpRegistry = NULL;
+}
+
+/*******************************************************************************
+ * Destroys the metric and removes it from its registry.
+ ******************************************************************************/
+Metric::~Metric ()
+{
+	if (mrpRegistry)
+		mrpRegistry->remove (*this);
+}
+
+/*******************************************************************************
+ * \fn const char* Metric::name () const
+ *
+ * Returns the name of the metric.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void Metric::setName (const char* name)
+ *
+ * Sets the name of the metric. The name is not copied.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn int Metric::format (char* pBuffer, int len) const
+ *
+ * Writes the metric as text lines of a name and a value to the
+ * buffer, like snprintf().
+ *
+ * \return The length of the text, which is len or more if it did not
+ * fit.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn int Metric::shard ()
+ *
+ * Returns the shard the calling thread records in.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void Metric::addTo (long& rValue, int shard, long n)
+ *
+ * Adds n to a value in the given shard, which must be the shard of
+ * the calling thread.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Gives the calling thread a free shard, or the shared one if none is
+ * free.
+ *
+ * \return The shard.
+ ******************************************************************************/
+int Metric::assignShard ()
+{
+	unsigned long free  = __atomic_load_n (&sFreeShards, __ATOMIC_ACQUIRE);
+	int           shard = MSRV_METRIC_SHARED;
+
+	while (free) {
+		int bit = __builtin_ctzl (free);
+		if (__atomic_compare_exchange_n (&sFreeShards, &free, free & ~(1UL << bit), false,
+										 __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			shard = bit;
+			break;
+		}
+	}
+
+	/* Have the shard released when the thread exits. */
+	if (shard != MSRV_METRIC_SHARED) {
+		pthread_once (&sShardOnce, createShardKey);
+		pthread_setspecific (sShardKey, (void*) (long) (shard + 1));
+	}
+
+	sShard = shard + 1;
+	return shard;
+}
+
+/*******************************************************************************
+ * Frees the shard of an exiting thread for the next new thread.
+ *
+ * The values recorded in the shard stay in it. Anything the thread
+ * records after this goes to the shared shard.
+ ******************************************************************************/
+void Metric::releaseShard (void* pShard)
+{
+	int shard = (int) (long) pShard - 1;
+
+	sShard = MSRV_METRIC_SHARED + 1;
+	__atomic_or_fetch (&sFreeShards, 1UL << shard, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * Returns the monotonic time in nanoseconds, for measuring latencies.
+ ******************************************************************************/
+long Metric::now ()
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*******************************************************************************
+ * Creates a counter with the given name, starting from zero.
+ ******************************************************************************/
+Counter::Counter (const char* name)
+		: Metric (name)
+{
+	memset (mShards, 0, sizeof (mShards));
+}
+
+/*******************************************************************************
+ * \fn void Counter::add (long n)
+ *
+ * Adds n to the count.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Returns the count, the sum of the shards.
+ ******************************************************************************/
+long Counter::value () const
+{
+	long value = 0;
+	for (int i=0; i<MSRV_METRIC_SHARDS; ++i)
+		value += __atomic_load_n (&mShards[i].mValue, __ATOMIC_RELAXED);
+
+	return value;
+}
+
+/*******************************************************************************
+ * Writes the counter as a line of its name and value.
+ ******************************************************************************/
+int Counter::format (char* pBuffer, int len) const
+{
+	return snprintf (pBuffer, len, "%s %ld\n", name (), value ());
+}
+
+/*******************************************************************************
+ * \fn void Gauge::sub (long n)
+ *
+ * Subtracts n from the level.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates an empty histogram with the given name.
+ *
+ * \throw std::bad_alloc if the buckets can not be allocated.
+ ******************************************************************************/
+Histogram::Histogram (const char* name)
+		: Metric (name)
+{
+	mShardLen = SumLen + Buckets;
+	mpBuckets = (long*) calloc (MSRV_METRIC_SHARDS * mShardLen, sizeof (long));
+	if (!mpBuckets)
+		throw std::bad_alloc ();
+}
+
+/*******************************************************************************
+ * Destroys the histogram.
+ ******************************************************************************/
+Histogram::~Histogram ()
+{
+	free (mpBuckets);
+}
+
+/*******************************************************************************
+ * Records a value. Negative values are recorded as 0.
+ ******************************************************************************/
+void Histogram::record (long value)
+{
+	int   shard  = Metric::shard ();
+	long* pShard = mpBuckets + shard * mShardLen;
+
+	if (value < 0)
+		value = 0;
+
+	addTo (pShard[0], shard, value);
+	addTo (pShard[SumLen + bucket (value)], shard, 1);
+}
+
+/*******************************************************************************
+ * Returns the bucket of a value of 0 or more.
+ *
+ * The values below 2^MSRV_HISTOGRAM_SUB_BITS have a bucket each.
+ * Above them, the bucket is given by the highest set bit and the
+ * MSRV_HISTOGRAM_SUB_BITS bits below it.
+ ******************************************************************************/
+int Histogram::bucket (long value)
+{
+	if (value < MSRV_HISTOGRAM_SUB_LEN)
+		return value;
+
+	int high = 63 - __builtin_clzl (value);
+	int less = high - MSRV_HISTOGRAM_SUB_BITS;
+
+	return ((less + 1) << MSRV_HISTOGRAM_SUB_BITS) + (int) (value >> less) - MSRV_HISTOGRAM_SUB_LEN;
+}
+
+/*******************************************************************************
+ * Returns the highest value of a bucket.
+ ******************************************************************************/
+long Histogram::bucketValue (int bucket)
+{
+	if (bucket < MSRV_HISTOGRAM_SUB_LEN)
+		return bucket;
+
+	int  less  = (bucket >> MSRV_HISTOGRAM_SUB_BITS) - 1;
+	long lower = (long) ((bucket & (MSRV_HISTOGRAM_SUB_LEN - 1)) + MSRV_HISTOGRAM_SUB_LEN) << less;
+
+	return lower + ((1L << less) - 1);
+}
+
+/*******************************************************************************
+ * Returns the number of values in a bucket over all shards.
+ ******************************************************************************/
+long Histogram::bucketCount (int bucket) const
+{
+	long count = 0;
+	for (int i=0; i<MSRV_METRIC_SHARDS; ++i)
+		count += __atomic_load_n (&mpBuckets[i * mShardLen + SumLen + bucket], __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/*******************************************************************************
+ * Returns the number of recorded values.
+ ******************************************************************************/
+long Histogram::count () const
+{
+	long count = 0;
+	for (int i=0; i<Buckets; ++i)
+		count += bucketCount (i);
+
+	return count;
+}
+
+/*******************************************************************************
+ * Returns the sum of the recorded values.
+ ******************************************************************************/
+long Histogram::sum () const
+{
+	long sum = 0;
+	for (int i=0; i<MSRV_METRIC_SHARDS; ++i)
+		sum += __atomic_load_n (&mpBuckets[i * mShardLen], __ATOMIC_RELAXED);
+
+	return sum;
+}
+
+/*******************************************************************************
+ * Returns the highest value of the highest bucket in use, or 0 if
+ * there are no values.
+ ******************************************************************************/
+long Histogram::max () const
+{
+	for (int i=Buckets-1; i>0; --i)
+		if (bucketCount (i))
+			return bucketValue (i);
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Finds the values at the given percentiles.
+ *
+ * The percentiles are from 0 to 100 and in ascending order. Each
+ * value is the highest value of the bucket holding the percentile,
+ * so it is at most 1/2^MSRV_HISTOGRAM_SUB_BITS above the exact one.
+ * The values are 0 if nothing was recorded.
+ ******************************************************************************/
+void Histogram::percentiles (
+	const double* pPercents, /**< Percentiles to find, ascending.  */
+	long*         pValues,   /**< Receives the values.             */
+	int           count      /**< Number of percentiles.           */) const
+{
+	long total = this->count ();
+	long seen  = 0;
+	int  next  = 0;
+
+	for (int i=0; i<Buckets && next<count && total>0; ++i) {
+		seen += bucketCount (i);
+
+		while (next < count) {
+			/* The rank of the value, from 1 to total. */
+			double exact = pPercents[next] * total / 100.0;
+			long   rank  = (long) exact;
+			if (rank < exact)
+				rank++;
+			if (rank < 1)
+				rank = 1;
+
+			if (seen < rank)
+				break;
+
+			pValues[next++] = bucketValue (i);
+		}
+	}
+
+	/* Values recorded while counting may leave the last ones unfound. */
+	long last = total > 0? max () : 0;
+	while (next < count)
+		pValues[next++] = last;
+}
+
+/*******************************************************************************
+ * Writes the count, mean, median, 90th, 99th and 99.9th percentiles
+ * and maximum of the histogram, each on a line of its own.
+ ******************************************************************************/
+int Histogram::format (char* pBuffer, int len) const
+{
+	static const double percents[] = {50.0, 90.0, 99.0, 99.9};
+	long                values[4];
+
+	long total = count ();
+	long mean  = total > 0? sum () / total : 0;
+
+	percentiles (percents, values, 4);
+
+	return snprintf (pBuffer, len,
+					 "%s.count %ld\n%s.mean %ld\n%s.p50 %ld\n%s.p90 %ld\n"
+					 "%s.p99 %ld\n%s.p999 %ld\n%s.max %ld\n",
+					 name (), total, name (), mean, name (), values[0],
+					 name (), values[1], name (), values[2], name (), values[3],
+					 name (), max ());
+}
+
+/*******************************************************************************
+ * Creates an empty registry.
+ ******************************************************************************/
+MetricsRegistry::MetricsRegistry ()
+{
+	mpFirst = NULL;
+}
+
+/*******************************************************************************
+ * Destroys the registry. The metrics listed are left as they are.
+ ******************************************************************************/
+MetricsRegistry::~MetricsRegistry ()
+{
+	mLock.lock ();
+	for (Metric* pMetric = mpFirst; pMetric; pMetric = pMetric->mpNext)
+		pMetric->mrpRegistry = NULL;
+	mpFirst = NULL;
+	mLock.unlock ();
+}
+
+/*******************************************************************************
+ * Adds a metric to the end of the list.
+ *
+ * A metric may be listed in one registry at a time; a metric already
+ * listed is left where it is.
+ ******************************************************************************/
+void MetricsRegistry::add (Metric& rMetric)
+{
+	mLock.lock ();
+
+	if (!rMetric.mrpRegistry) {
+		Metric** ppLast = &mpFirst;
+		while (*ppLast)
+			ppLast = &(*ppLast)->mpNext;
+
+		rMetric.mpNext      = NULL;
+		rMetric.mrpRegistry = this;
+		*ppLast             = &rMetric;
+	}
+
+	mLock.unlock ();
+}
+
+/*******************************************************************************
+ * Removes a metric from the list.
+ ******************************************************************************/
+void MetricsRegistry::remove (Metric& rMetric)
+{
+	mLock.lock ();
+
+	for (Metric** ppMetric = &mpFirst; *ppMetric; ppMetric = &(*ppMetric)->mpNext)
+		if (*ppMetric == &rMetric) {
+			*ppMetric           = rMetric.mpNext;
+			rMetric.mpNext      = NULL;
+			rMetric.mrpRegistry = NULL;
+			break;
+		}
+
+	mLock.unlock ();
+}
+
+/*******************************************************************************
+ * Writes the metrics as text lines of a name and a value.
+ *
+ * The text is null-terminated. The metrics that do not fit in the
+ * buffer are left out whole.
+ *
+ * \return Length of the text written.
+ ******************************************************************************/
+int MetricsRegistry::format (
+	char* pBuffer, /**< Buffer to write to.    */
+	int   len      /**< Length of the buffer.  */)
+{
+	if (len <= 0)
+		return 0;
+
+	int written = 0;
+	pBuffer[0]  = 0x00;
+
+	mLock.lock ();
+
+	for (Metric* pMetric = mpFirst; pMetric; pMetric = pMetric->mpNext) {
+		int metricLen = pMetric->format (pBuffer + written, len - written);
+		if (metricLen < 0 || metricLen >= len - written) {
+			/* Cut off the partly written metric. */
+			pBuffer[written] = 0x00;
+			break;
+		}
+
+		written += metricLen;
+	}
+
+	mLock.unlock ();
+
+	return written;
+}
+
+/*******************************************************************************
+ * Returns the registry of the process, which lists the @ref
+ * ServerMetrics.
+ ******************************************************************************/
+MetricsRegistry& MetricsRegistry::global ()
+{
+	static MetricsRegistry sRegistry;
+	return sRegistry;
+}
+
+/*******************************************************************************
+ * Creates the metrics of the library and lists them in the global
+ * registry.
+ ******************************************************************************/
+ServerMetrics::ServerMetrics ()
+		: mAccepts         ("server.accepts"),
+		  mConnectionsLost ("server.connections_lost"),
+		  mBytesRead       ("server.bytes_read"),
+		  mQueueDepth      ("workers.queue_depth"),
+		  mWaitTime        ("workers.wait_ns"),
+		  mHandlerTime     ("workers.handler_ns")
+{
+	/* In the bit order of Request::requesttype. */
+	static const char* requestNames[RequestTypes] = {"requests.new_connection",
+													 "requests.stream_data",
+													 "requests.datagram",
+													 "requests.connection_lost",
+													 "requests.shutdown",
+													 "requests.timeout",
+													 "requests.writable"};
+
+	MetricsRegistry& rRegistry = MetricsRegistry::global ();
+
+	rRegistry.add (mAccepts);
+	rRegistry.add (mConnectionsLost);
+	rRegistry.add (mBytesRead);
+	for (int i=0; i<RequestTypes; ++i) {
+		mRequests[i].setName (requestNames[i]);
+		rRegistry.add (mRequests[i]);
+	}
+	rRegistry.add (mQueueDepth);
+	rRegistry.add (mWaitTime);
+	rRegistry.add (mHandlerTime);
+}
+
+/*******************************************************************************
+ * \fn void ServerMetrics::accepted ()
+ *
+ * Counts an accepted connection.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::connectionLost ()
+ *
+ * Counts a lost connection.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::bytesRead (long n)
+ *
+ * Counts bytes received.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::queued ()
+ *
+ * Counts a request into the queue of the workers.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::dequeued ()
+ *
+ * Counts a request out of the queue of the workers.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::waited (long nsec)
+ *
+ * Records the time a request waited for a worker.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerMetrics::handled (long nsec)
+ *
+ * Records the time the handler of a worker took.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Counts a request of a type of @ref Request::requesttype.
+ ******************************************************************************/
+void ServerMetrics::request (int type)
+{
+	int i = __builtin_ffs (type) - 1;
+	if (i >= 0 && i < RequestTypes)
+		mRequests[i].add ();
+}
+
+/*******************************************************************************
+ * Returns the number of requests of a type created so far.
+ ******************************************************************************/
+long ServerMetrics::requests (int type) const
+{
+	int i = __builtin_ffs (type) - 1;
+	if (i < 0 || i >= RequestTypes)
+		return 0;
+
+	return mRequests[i].value ();
+}
+
+/*******************************************************************************
+ * Returns the metrics of the process.
+ ******************************************************************************/
+ServerMetrics& ServerMetrics::global ()
+{
+	static ServerMetrics sMetrics;
+	return sMetrics;
+}
+
+end_namespace (MSrv);
@@ -23,9 +23,249 @@
  ***************************************************************************/
 
 #include <magicserver/msrvrequest.h>
+#include <magicserver/msrvmetrics.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
 
 begin_namespace (MSrv);
 
+/*******************************************************************************
+ * Creates an empty pool, referenced by its owner.
+ *
+ * The size classes are powers of two from minLen up to at least
+ * maxLen.
+ ******************************************************************************/
+BlockPool::BlockPool (
+	size_t minLen, /**< Size of the smallest blocks. */
+	size_t maxLen  /**< Size of the largest blocks.  */)
+{
+	mRefCount    = 1;
+	mServed      = 0;
+	mAllocations = 0;
+
+	mClassCount = 1;
+	for (size_t len = minLen; len < maxLen; len *= 2)
+		mClassCount++;
+
+	mpClasses = new SizeClass [mClassCount];
+	for (int i=0; i<mClassCount; ++i) {
+		mpClasses[i].mpFree     = NULL;
+		mpClasses[i].mpReturned = NULL;
+		mpClasses[i].mLen       = minLen << i;
+	}
+}
+
+/*******************************************************************************
+ * Frees all the blocks. Called when the last reference is dropped.
+ ******************************************************************************/
+BlockPool::~BlockPool ()
+{
+	for (int i=0; i<mClassCount; ++i) {
+		while (Block* pBlock = mpClasses[i].mpFree) {
+			mpClasses[i].mpFree = pBlock->mpNext;
+			free (pBlock);
+		}
+
+		while (Block* pBlock = mpClasses[i].mpReturned) {
+			mpClasses[i].mpReturned = pBlock->mpNext;
+			free (pBlock);
+		}
+	}
+
+	delete [] mpClasses;
+}
+
+/*******************************************************************************
+ * Allocates a block in the owner thread.
+ *
+ * Blocks larger than the largest size class are allocated from the
+ * heap.
+ *
+ * @return Memory of at least the given size.
+ ******************************************************************************/
+void* BlockPool::allocate (size_t size)
+{
+	Block* pBlock = NULL;
+
+	/* Find the smallest class that fits. */
+	int sizeClass = 0;
+	while (sizeClass < mClassCount && mpClasses[sizeClass].mLen < size)
+		sizeClass++;
+
+	if (sizeClass < mClassCount) {
+		SizeClass& rClass = mpClasses[sizeClass];
+
+		/* Take back the blocks released by other threads. */
+		if (!rClass.mpFree)
+			rClass.mpFree = __atomic_exchange_n (&rClass.mpReturned, (Block*) NULL, __ATOMIC_ACQUIRE);
+
+		pBlock = rClass.mpFree;
+		if (pBlock)
+			rClass.mpFree = pBlock->mpNext;
+		else {
+			pBlock = (Block*) malloc (sizeof (Block) + rClass.mLen);
+			if (!pBlock)
+				throw std::bad_alloc ();
+			__atomic_add_fetch (&mAllocations, 1, __ATOMIC_RELAXED);
+		}
+
+		pBlock->mpPool = this;
+		pBlock->mClass = sizeClass;
+		__atomic_add_fetch (&mRefCount, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch (&mAllocations, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch (&mServed, 1, __ATOMIC_RELAXED);
+		return allocateHeap (size);
+	}
+
+	__atomic_add_fetch (&mServed, 1, __ATOMIC_RELAXED);
+
+	return pBlock + 1;
+}
+
+/*******************************************************************************
+ * Allocates a block that does not belong to any pool.
+ *
+ * The block can be freed with @ref release() like pooled blocks.
+ ******************************************************************************/
+void* BlockPool::allocateHeap (size_t size)
+{
+	Block* pBlock = (Block*) malloc (sizeof (Block) + size);
+	if (!pBlock)
+		throw std::bad_alloc ();
+
+	pBlock->mpPool = NULL;
+	return pBlock + 1;
+}
+
+/*******************************************************************************
+ * Returns a block to its pool, in any thread.
+ ******************************************************************************/
+void BlockPool::release (void* pObject)
+{
+	if (!pObject)
+		return;
+
+	Block*     pBlock = ((Block*) pObject) - 1;
+	BlockPool* pPool  = pBlock->mpPool;
+
+	if (!pPool) {
+		free (pBlock);
+		return;
+	}
+
+	/* Push the block to the returned list. Only the owner takes */
+	/* from the list, and it takes all at once, so there is no   */
+	/* ABA problem.                                               */
+	SizeClass& rClass = pPool->mpClasses[pBlock->mClass];
+	Block*     pHead  = __atomic_load_n (&rClass.mpReturned, __ATOMIC_RELAXED);
+	do {
+		pBlock->mpNext = pHead;
+	} while (!__atomic_compare_exchange_n (&rClass.mpReturned, &pHead, pBlock, true,
+										   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	pPool->unref ();
+}
+
+/*******************************************************************************
+ * Drops a reference to the pool.
+ *
+ * The owner calls this instead of deleting the pool. The pool is
+ * destroyed when the owner and all blocks in use have dropped their
+ * references.
+ ******************************************************************************/
+void BlockPool::unref ()
+{
+	if (__atomic_sub_fetch (&mRefCount, 1, __ATOMIC_ACQ_REL) == 0)
+		delete this;
+}
+
+/*******************************************************************************
+ * \fn long BlockPool::served () const
+ *
+ * Returns the number of blocks served by the pool.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn long BlockPool::allocations () const
+ *
+ * Returns the number of blocks allocated from the heap. After warm-up
+ * this stays constant while @ref served() grows, as the blocks are
+ * recycled.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Creates an empty request pool with blocks that fit any request.
+ ******************************************************************************/
+RequestPool::RequestPool ()
+		: BlockPool (requestLen (), requestLen ())
+{
+}
+
+/*******************************************************************************
+ * Returns the size of the largest request class of the library.
+ ******************************************************************************/
+size_t RequestPool::requestLen ()
+{
+	size_t len = sizeof (NewConnectionRequest);
+	if (len < sizeof (StreamDataRequest))
+		len = sizeof (StreamDataRequest);
+	if (len < sizeof (DatagramRequest))
+		len = sizeof (DatagramRequest);
+	if (len < sizeof (ConnectionLostRequest))
+		len = sizeof (ConnectionLostRequest);
+	if (len < sizeof (ShutdownRequest))
+		len = sizeof (ShutdownRequest);
+	if (len < sizeof (TimeoutRequest))
+		len = sizeof (TimeoutRequest);
+	if (len < sizeof (WritableRequest))
+		len = sizeof (WritableRequest);
+
+	return len;
+}
+
+/*******************************************************************************
+ * \fn long RequestPool::requests () const
+ *
+ * Returns the number of request objects created in the pool.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Allocates a request that does not belong to any pool.
+ ******************************************************************************/
+void* Request::operator new (size_t size)
+{
+	return BlockPool::allocateHeap (size);
+}
+
+/*******************************************************************************
+ * Allocates a request in a pool.
+ *
+ * Use as "new (rPool) StreamDataRequest (...)".
+ ******************************************************************************/
+void* Request::operator new (size_t size, BlockPool& rPool)
+{
+	return rPool.allocate (size);
+}
+
+/*******************************************************************************
+ * Frees a request, returning the memory to its pool if it has one.
+ ******************************************************************************/
+void Request::operator delete (void* pObject)
+{
+	BlockPool::release (pObject);
+}
+
+/*******************************************************************************
+ * Frees a pooled request whose constructor failed.
+ ******************************************************************************/
+void Request::operator delete (void* pObject, BlockPool& rPool)
+{
+	BlockPool::release (pObject);
+}
+
 /*******************************************************************************
  * Creates a request
  ******************************************************************************/
@@ -37,6 +277,11 @@ Request::Request (
 	mSocket          = socket;
 	mRequestType     = reqt;
 	mpServerListener = &rListener;
+	mQueueTime       = 0;
+
+	ServerMetrics* pMetrics = rListener.metrics ();
+	if (pMetrics)
+		pMetrics->request (reqt);
 }
 
 /*******************************************************************************
@@ -69,6 +314,20 @@ Request::Request (
  * of a request, without needing to use slow and laborius dynamic_cast.
  ******************************************************************************/
 
+/*******************************************************************************
+ * \fn void Request::setQueueTime (long nsec)
+ *
+ * Sets the time the request was queued for processing, from
+ * @ref Metric::now().
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn long Request::queueTime () const
+ *
+ * Returns the time the request was queued for processing, or 0 if it
+ * was not queued.
+ ******************************************************************************/
+
 /*******************************************************************************
  * Constructor for a connection request.
  ******************************************************************************/
@@ -112,26 +371,37 @@ DataRequest::DataRequest (
 {
 	mpData   = 0;
 	mDataLen = 0;
+	mPooled  = false;
 }
 
 /*******************************************************************************
- * \fn DataRequest::~DataRequest ()
- *
  * Destroys the request and the associated data buffer.
  ******************************************************************************/
+DataRequest::~DataRequest ()
+{
+	setData (NULL, 0);
+}
 
 /*******************************************************************************
  * Sets the data of the request.
  *
- * \note The request object takes ownership of the data buffer.
+ * \note The request object takes ownership of the data buffer. The
+ * buffer must have been allocated with malloc(), or from a @ref
+ * BufferPool if pooled is true.
  ******************************************************************************/
 void DataRequest::setData (
-	char* pData,
-	int   len)
+	char* pData,  /**< Data buffer.                              */
+	int   len,    /**< Length of the data.                       */
+	bool  pooled  /**< Is the buffer from a @ref BufferPool?     */)
 {
-	delete mpData;
+	if (mPooled)
+		BlockPool::release (mpData);
+	else
+		free (mpData);
+
 	mpData   = pData;
 	mDataLen = len;
+	mPooled  = pooled;
 }
 
 /*******************************************************************************
@@ -156,8 +426,15 @@ DatagramRequest::DatagramRequest (
 		:  Request (socket, Request::Datagram, rListener),
 		   DataRequest (socket, Request::Datagram, rListener)
 {
+	memset (&mAddress, 0, sizeof (mAddress));
 }
 
+/*******************************************************************************
+ * \fn const sockaddr_in& DatagramRequest::address () const
+ *
+ * Returns the address the datagram was sent from.
+ ******************************************************************************/
+
 /*******************************************************************************
  * Constructor for a connection lost request.
  ******************************************************************************/
@@ -182,6 +459,45 @@ ConnectionLostRequest::~ConnectionLostRequest ()
 	delete mrpConn;
 }
 
+/*******************************************************************************
+ * Constructor for a request of an expired timer.
+ ******************************************************************************/
+TimeoutRequest::TimeoutRequest (
+	int             socket,    /**< Socket of the connection, or -1.         */
+	long            timerId,   /**< Identifier of the expired timer.         */
+	Connection*     pConn,     /**< Connection of the timer. May be NULL.    */
+	ServerListener& rListener  /**< Listener the timer was set in.           */)
+		: Request (socket, Request::Timeout, rListener)
+{
+	mTimerId = timerId;
+	mrpConn  = pConn;
+}
+
+/*******************************************************************************
+ * \fn long TimeoutRequest::timerId () const
+ *
+ * Returns the identifier of the expired timer, as returned when the
+ * timer was set, or -1 for a timeout of the listener.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn Connection* TimeoutRequest::connection ()
+ *
+ * Returns the connection the timer was set for, or NULL.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Constructor for a writable request.
+ ******************************************************************************/
+WritableRequest::WritableRequest (
+	int             socket,   /**< Socket of the connection.              */
+	Connection&     rConn,    /**< Connection that has sent its data.     */
+	ServerListener& rListener /**< Listener that manages the socket.      */)
+		:  Request (socket, Request::Writable, rListener),
+		   ConnectionRequest (socket, Request::Writable, rConn, rListener)
+{
+}
+
 /*******************************************************************************
  * \fn char* DataRequest::getData () const = 0
  *
@@ -259,6 +575,10 @@ MSrvResult RequestHandler::process (Request* pRequest)
 	  case Request::Timeout: {
 		  result = process (*dynamic_cast<TimeoutRequest*> (pRequest));
 	  } break;
+
+	  case Request::Writable: {
+		  result = process (*dynamic_cast<WritableRequest*> (pRequest));
+	  } break;
 		
 	  default: {
 		  pRequest->serverListener().log().message ("REQUEST", Log::Warning, 0,
@@ -331,4 +651,16 @@ MSrvResult RequestHandler::process (TimeoutRequest&  pRequest)
 	return 0;
 }
 
+/*******************************************************************************
+ * Notifies that a connection has sent all the data queued with @ref
+ * Connection::send() after exceeding its output limit. The handler
+ * may resume sending.
+ *
+ * @return Should return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult RequestHandler::process (WritableRequest&  pRequest)
+{
+	return 0;
+}
+
 end_namespace (MSrv);
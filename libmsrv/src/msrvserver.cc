@@ -26,9 +26,14 @@
 #include <magicserver/msrvrequest.h>
 #include <magicserver/msrverror.h>
 #include <magicserver/msrvlog.h>
+#include <magicserver/msrvmetrics.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -39,28 +44,189 @@
 
 begin_namespace (MSrv);
 
+/*******************************************************************************
+ * Creates an empty counter.
+ ******************************************************************************/
+AddressCounter::AddressCounter ()
+{
+	mpEntries = NULL;
+	mCapacity = 0;
+	mUsed     = 0;
+}
+
+/*******************************************************************************
+ * Destroys the counter.
+ ******************************************************************************/
+AddressCounter::~AddressCounter ()
+{
+	free (mpEntries);
+}
+
+/*******************************************************************************
+ * Finds the slot of an address, or the empty slot where it belongs.
+ *
+ * The table must have been allocated.
+ ******************************************************************************/
+int AddressCounter::slot (uint address) const
+{
+	/* Mix the bits, as the low bytes of nearby addresses are alike. */
+	uint hash = address * 2654435761u;
+	int  i    = (hash ^ (hash >> 16)) & (mCapacity - 1);
+
+	while (mpEntries[i].mCount && mpEntries[i].mAddress != address)
+		i = (i + 1) & (mCapacity - 1);
+
+	return i;
+}
+
+/*******************************************************************************
+ * Doubles the size of the table.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult AddressCounter::grow ()
+{
+	int    oldCapacity = mCapacity;
+	Entry* pOld        = mpEntries;
+
+	mCapacity = mCapacity? mCapacity * 2 : 64;
+	mpEntries = (Entry*) calloc (mCapacity, sizeof (Entry));
+	if (!mpEntries) {
+		mpEntries = pOld;
+		mCapacity = oldCapacity;
+		return MSRVERR_OUT_OF_MEMORY;
+	}
+
+	for (int i=0; i<oldCapacity; ++i)
+		if (pOld[i].mCount)
+			mpEntries[slot (pOld[i].mAddress)] = pOld[i];
+
+	free (pOld);
+	return 0;
+}
+
+/*******************************************************************************
+ * Returns the number of connections counted for an address.
+ ******************************************************************************/
+int AddressCounter::count (uint address) const
+{
+	if (!mCapacity)
+		return 0;
+
+	return mpEntries[slot (address)].mCount;
+}
+
+/*******************************************************************************
+ * Counts a new connection from an address.
+ *
+ * @return The new count of the address, or a negative error code if
+ *         the table could not grow.
+ ******************************************************************************/
+int AddressCounter::increment (uint address)
+{
+	/* Keep the table at most half full, so that probes stay short. */
+	if ((mUsed + 1) * 2 > mCapacity) {
+		MSrvResult result = grow ();
+		if (result < 0)
+			return result;
+	}
+
+	Entry& rEntry = mpEntries[slot (address)];
+	if (!rEntry.mCount) {
+		rEntry.mAddress = address;
+		mUsed++;
+	}
+
+	return ++rEntry.mCount;
+}
+
+/*******************************************************************************
+ * Counts out a closed connection from an address.
+ ******************************************************************************/
+void AddressCounter::decrement (uint address)
+{
+	if (!mCapacity)
+		return;
+
+	int i = slot (address);
+	if (!mpEntries[i].mCount || --mpEntries[i].mCount)
+		return;
+
+	/* The address is gone. Move the entries probed past its slot back */
+	/* into the hole, so that no lookup stops at it too early.         */
+	mUsed--;
+	int hole = i;
+	for (int j = (i + 1) & (mCapacity - 1); mpEntries[j].mCount; j = (j + 1) & (mCapacity - 1)) {
+		uint hash = mpEntries[j].mAddress * 2654435761u;
+		int  home = (hash ^ (hash >> 16)) & (mCapacity - 1);
+
+		/* Move the entry unless its home is cyclically in (hole, j]. */
+		if (((j - home) & (mCapacity - 1)) >= ((j - hole) & (mCapacity - 1))) {
+			mpEntries[hole] = mpEntries[j];
+			mpEntries[j].mCount = 0;
+			hole = j;
+		}
+	}
+}
+
 /*******************************************************************************
  * Default constructor.
  *
+ * The backend is one of @ref EventBackend::backend_type and selects
+ * how the sockets are watched; see @ref Listener.
+ *
  * \note Newly created ServerListener does not have an associated log. You
  *       need to attach it to a log before operating with it.
  ******************************************************************************/
 ServerListener::ServerListener (
 	RequestHandler& rHandler,
-	Log*            rpLog)
-		: Listener (rpLog)
+	Log*            rpLog,
+	int             backend)
+		: Listener (rpLog, backend)
 {
 	mSocket              = 0;
 	mProtocol            = TCP;
 	mrpHandler           = &rHandler;
 	mrpConnectionFactory = NULL;
+	mrpFramer            = NULL;
+	mpRequestPool        = new RequestPool ();
+	mpBufferPool         = new BufferPool ();
+	mSlowPolicy          = SlowBuffer;
+	mSlowLimit           = MSRV_MAX_OUTPUT_LEN;
+	mBroadcastDrops      = 0;
+	mDatagramLen         = MSRV_DATAGRAM_LEN;
+	mpReplies            = new DatagramBatch ();
+	mListenerThread      = pthread_self ();
+	mDeferReplies        = false;
+	for (int i=0; i<MSRV_DATAGRAM_BATCH; ++i)
+		mpRecvBuffers[i] = NULL;
+	mBacklog             = MSRV_LISTEN_BACKLOG;
+	mMaxConnections      = 0;
+	mMaxPerAddress       = 0;
+	mConnectionCount     = 0;
+	mRejected            = 0;
+	mLimitReached        = false;
+	mIdleTimeout         = 0;
+	mIdleTimer           = -1;
+	mIdleDisconnects     = 0;
+	mrpMetrics           = &ServerMetrics::global ();
+	mpUnixPath           = NULL;
+	mrpIdleFirst         = NULL;
+	mrpIdleLast          = NULL;
 	mRequestMask         = Request::NewConnection | Request::StreamData |
                            Request::Datagram | Request::ConnectionLost |
-		                   Request::Shutdown;
+		                   Request::Shutdown | Request::Writable;
 
 	/* Ignore signals when a host closes connection unexpectedly. */
 	signal (SIGPIPE, SIG_IGN);
 
+#ifdef MSRV_HAVE_IO_URING
+	/* Use completions if the io_uring backend was created. */
+	UringBackend* pUring = dynamic_cast <UringBackend*> (&Listener::backend ());
+	if (pUring)
+		pUring->setCompletionMode (true);
+#endif
+
 	/* Initialize request handler.               */
 	/* It can make some settings on this object. */
 	mrpHandler->init (*this);
@@ -71,10 +237,28 @@ ServerListener::ServerListener (
  ******************************************************************************/
 ServerListener::~ServerListener ()
 {
+	for (int i=0; i<MSRV_DATAGRAM_BATCH; ++i)
+		BlockPool::release (mpRecvBuffers[i]);
+	delete mpReplies;
+
+	/* Requests still in use keep the pools alive. */
+	mpRequestPool->unref ();
+	mpBufferPool->unref ();
+
+	if (mpUnixPath) {
+		unlink (mpUnixPath);
+		free (mpUnixPath);
+	}
 }
 
 /*******************************************************************************
  * Initializes the server for listening a socket
+ *
+ * The flags are a combination of @ref bindflags. With BINDF_REUSEPORT,
+ * several listeners may bind the same port; see @ref ServerGroup.
+ *
+ * The queue length of pending TCP connections must be set with @ref
+ * setBacklog() before binding.
  ******************************************************************************/
 MSrvResult ServerListener::bind (
 	int           portno,
@@ -115,6 +299,29 @@ MSrvResult ServerListener::bind (
 			return MSRVERR_SET_SOCKET_OPTIONS_FAILED;
 		}
 	}
+
+	/* Let other sockets bind to the same port; the kernel balances */
+	/* new connections and datagrams between them.                  */
+	if (flags & BINDF_REUSEPORT) {
+#ifdef SO_REUSEPORT
+		int reuseport = 1;
+		result = setsockopt (sockfd,
+							 SOL_SOCKET,
+							 SO_REUSEPORT,
+							 (void*) &reuseport,
+							 sizeof (reuseport));
+#else
+		result = -1;
+		errno  = ENOPROTOOPT;
+#endif
+		if (result < 0) {
+			log().message ("SERVER", Log::Critical, MSRVERR_SET_SOCKET_OPTIONS_FAILED,
+						   "Setting SO_REUSEPORT failed with error %d; %s.",
+						   errno, strerror (errno));
+			::close (sockfd);
+			return MSRVERR_SET_SOCKET_OPTIONS_FAILED;
+		}
+	}
 	
 	log().message ("SERVER", Log::Info, 0,
 					"Binding to %s port %d...",
@@ -139,7 +346,7 @@ MSrvResult ServerListener::bind (
 
 	/* On TCP ports, set the listening queue length. */
 	if (protocol == ServerListener::TCP) {
-		result = ::listen (sockfd, 10);
+		result = ::listen (sockfd, mBacklog);
 		if (result) {
 			log().message ("SERVER", Log::Critical, MSRVERR_LISTEN_FAILED,
 						   "Listen failed with error %d; %s",
@@ -153,12 +360,91 @@ MSrvResult ServerListener::bind (
 	mThreadLock.lock ();
 	mSocket   = sockfd;
 	mProtocol = protocol;
-	mDescriptors.add (new Descriptor (mSocket, NULL));
+	result    = addDescriptor (mSocket, NULL);
 	mThreadLock.unlock ();
+
+	if (result < 0) {
+		::close (sockfd);
+		return result;
+	}
 	
 	return 0;
 }
 
+/*******************************************************************************
+ * Initializes the server for listening a Unix stream socket.
+ *
+ * The connections are handled as TCP connections, except that they
+ * have no client address. A socket left at the path by an earlier
+ * run is replaced; any other file there makes the bind fail. The
+ * socket is removed when the listener is destroyed.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::bindUnix (
+	const char* path /**< Path of the socket. */)
+{
+	struct sockaddr_un myaddr;
+
+	if (!path)
+		return MSRVERR_NULL_ARGUMENT;
+	if (strlen (path) >= sizeof (myaddr.sun_path))
+		return MSRVERR_INVALID_ARGUMENT;
+
+	/* Create the server listening socket. */
+	int sockfd = socket (PF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		log().message ("SERVER", Log::Critical, MSRVERR_SOCKET_FAILED,
+					   "Creating socket failed with error %d; %s.",
+					   errno, strerror (errno));
+		return MSRVERR_SOCKET_FAILED;
+	}
+
+	log().message ("SERVER", Log::Info, 0,
+				   "Binding to Unix socket %s...", path);
+
+	/* Replace a stale socket, but nothing else. */
+	struct stat st;
+	if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode))
+		unlink (path);
+
+	memset (&myaddr, 0, sizeof (myaddr));
+	myaddr.sun_family = AF_UNIX;
+	strcpy (myaddr.sun_path, path);
+
+	if (::bind (sockfd, (sockaddr*) &myaddr, sizeof (myaddr)) < 0) {
+		log().message ("SERVER", Log::Critical, MSRVERR_BIND_FAILED,
+					   "Bind failed with error %d; %s",
+					   errno, strerror (errno));
+		::close (sockfd);
+		return MSRVERR_BIND_FAILED;
+	}
+
+	if (::listen (sockfd, mBacklog)) {
+		log().message ("SERVER", Log::Critical, MSRVERR_LISTEN_FAILED,
+					   "Listen failed with error %d; %s",
+					   errno, strerror (errno));
+		::close (sockfd);
+		unlink (path);
+		return MSRVERR_LISTEN_FAILED;
+	}
+
+	/* Store the server socket. */
+	mThreadLock.lock ();
+	mSocket     = sockfd;
+	mProtocol   = TCP;
+	mpUnixPath  = strdup (path);
+	int result  = addDescriptor (mSocket, NULL);
+	mThreadLock.unlock ();
+
+	if (result < 0) {
+		::close (sockfd);
+		return result;
+	}
+
+	return 0;
+}
+
 /*******************************************************************************
  * \fn void ServerListener::setRequestMask (uint mask)
  *
@@ -196,18 +482,56 @@ MSrvResult ServerListener::accept ()
 								 (sockaddr*) &clientAddr,
 								 (socklen_t*) &clientAddrLen);
 	if (clientsocket < 0) {
-		log().message ("SERVER", Log::Critical, MSRVERR_ACCEPT_FAILED,
-					   "Accept failed with error %d; %s.",
-					   errno, strerror (errno));
+		MSRV_LOG_LIMITED (log(), "SERVER", Log::Critical, MSRVERR_ACCEPT_FAILED,
+						  "Accept failed with error %d; %s.",
+						  errno, strerror (errno));
 		return MSRVERR_ACCEPT_FAILED;
 	}
-	
-	log().message ("SERVER", Log::Info, 0,
-				   "Accepted connection from %d.%d.%d.%d",
-				   ((clientAddr.sin_addr.s_addr) & 0xff),
-				   ((clientAddr.sin_addr.s_addr >> 8) & 0xff),
-				   ((clientAddr.sin_addr.s_addr >> 16) & 0xff),
-				   ((clientAddr.sin_addr.s_addr >> 24) & 0xff));
+
+	/* Clients of a Unix socket have no IP address. */
+	if (clientAddr.sin_family != AF_INET)
+		memset (&clientAddr, 0, sizeof (clientAddr));
+
+	return acceptConnection (clientsocket, clientAddr);
+}
+
+/*******************************************************************************
+ * Starts listening a newly accepted client socket.
+ *
+ * Creates the @ref Connection object and sends a @ref
+ * NewConnectionRequest to the request handler. A connection over the
+ * connection limits is reset instead.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::acceptConnection (
+	int                       clientsocket, /**< Accepted client socket. */
+	const struct sockaddr_in& clientAddr    /**< Client address.         */)
+{
+	if (!admit (clientAddr)) {
+		reject (clientsocket);
+		return MSRVERR_CONNECTION_LIMIT;
+	}
+
+	MSRV_LOG (log(), "SERVER", Log::Info, 0,
+			  "Accepted connection from %d.%d.%d.%d",
+			  ((clientAddr.sin_addr.s_addr) & 0xff),
+			  ((clientAddr.sin_addr.s_addr >> 8) & 0xff),
+			  ((clientAddr.sin_addr.s_addr >> 16) & 0xff),
+			  ((clientAddr.sin_addr.s_addr >> 24) & 0xff));
+
+	/* Count the address in before anything else, as the table */
+	/* may fail to grow.                                         */
+	mThreadLock.lock ();
+	MSrvResult result = mAddressCounts.increment (clientAddr.sin_addr.s_addr);
+	mThreadLock.unlock ();
+
+	if (result < 0) {
+		::close (clientsocket);
+		log().message ("SERVER", Log::Error, result,
+					   "Out of memory counting connections. Closed the connection.");
+		return result;
+	}
 
 	/* Create new connection object, with a factory, if available */
 	Connection* pNewConn = NULL;
@@ -216,14 +540,36 @@ MSrvResult ServerListener::accept ()
 	else
 		pNewConn = new Connection (clientsocket, clientAddr, *this);
 
+	/* The handler may choose another framer for the connection. */
+	pNewConn->setFramer (mrpFramer);
+
 	/* Start listening to the client socket. */
-	mDescriptors.add (new Descriptor (clientsocket, pNewConn));
+	if (addDescriptor (clientsocket, pNewConn) < 0) {
+		/* The backend cannot watch any more descriptors. */
+		mThreadLock.lock ();
+		mAddressCounts.decrement (clientAddr.sin_addr.s_addr);
+		mThreadLock.unlock ();
+
+		delete pNewConn;
+		return MSRVERR_ACCEPT_FAILED;
+	}
+
+	/* Count the connection in; it is counted out when removed. */
+	mThreadLock.lock ();
+	__atomic_add_fetch (&mConnectionCount, 1, __ATOMIC_RELAXED);
+	mLimitReached = false;
+	idleTouch (*pNewConn);
+	if (mrpMetrics)
+		mrpMetrics->accepted ();
+	if (mIdleTimeout > 0 && mIdleTimer < 0)
+		mIdleTimer = timers().add (mIdleTimeout);
+	mThreadLock.unlock ();
 
 	/* Tell the request handler about the new connection. */
 	if (mRequestMask & Request::NewConnection) {
-		Request* pRequest = new NewConnectionRequest (clientsocket,
-													  *pNewConn,
-													  *this);
+		Request* pRequest = new (*mpRequestPool) NewConnectionRequest (clientsocket,
+																	   *pNewConn,
+																	   *this);
 		getHandler()->process (pRequest);
 	}
 
@@ -231,213 +577,1172 @@ MSrvResult ServerListener::accept ()
 }
 
 /*******************************************************************************
- * Handles an event on a descriptor (socket).
+ * Checks if a new connection from the given address fits in the
+ * connection limits.
  *
- * The meaning of the event depends on the socket type.
- *
- * Generates a request and calls request handler with
- * RequestHandler::process().
+ * @return true if the connection may be accepted.
  ******************************************************************************/
-MSrvResult ServerListener::descriptorEvent (
-	int   fd,              /**< Descriptor.                                   */
-	void* pDescriptorData) /**< Ptr to data associated with the descriptor.   */
+bool ServerListener::admit (const struct sockaddr_in& rAddr)
 {
-	char buffer[MSRV_READ_BUFFER_LEN];
-
-	if (fd == mSocket && mProtocol == TCP) {
-		/* It's the TCP server socket; accept a new connection. */
-		accept ();
-
-	} else {
-		/* Data has become data available in the socket.               */
-		/* The socket can be a TCP client socket or UDP server socket. */
-
-		/* Read all data available from the socket.           */
-		char* dynbuffer = NULL;
-		int   dynpos    = 0;
-		int   readcount = 0;
-		do {
-			/* Read a block of data from the socket. */
-			readcount = ::read (fd, buffer, MSRV_READ_BUFFER_LEN);
-
-			if (readcount < 0) {
-				/* Error. */
-				log().message ("SERVER", Log::Warning, MSRVERR_READ_FAILED,
-							   "Read failed with error %d; %s.",
-							   errno, strerror (errno));
-				break;
-				
-			} else if (readcount > 0) {
-				/* Allocate enough space in the target buffer. */
-				if (dynbuffer)
-					dynbuffer = (char*) realloc (dynbuffer, dynpos + readcount);
-				else
-					dynbuffer = (char*) malloc (readcount);
-
-				/* Copy the new block to the target buffer. */
-				memcpy (dynbuffer + dynpos, buffer, readcount);
-				
-				dynpos += readcount;
-			} else {
-				/* No (more) data. */
-				break;
-			}
-
-			/* Terminate when there is no more data available. */
-		} while (readcount == MSRV_READ_BUFFER_LEN);
-
-		if (dynpos > 0) {
-			/* Put the data into a request object. */
-			DataRequest* pRequest = NULL;
-			if (mProtocol == TCP)
-				if (mRequestMask & Request::StreamData)
-					pRequest = new StreamDataRequest (fd,
-													  *static_cast <Connection*> (pDescriptorData),
-													  *this);
-				else
-					pRequest = NULL;
-			else
-				if (mRequestMask & Request::Datagram)
-					pRequest = new DatagramRequest (fd, *this);
-				else
-					pRequest = NULL;
-
-			if (pRequest) {
-				pRequest->setData (dynbuffer, dynpos);
-				
-				/* Send the request to handler. */
-				getHandler()->process (pRequest);
-
-				/* The handler must have destroyed the request object. */
-			}
-
-		} else if (readcount == 0 && dynpos == 0) {
-			/* No data was available from the socket.     */
-			/* This must imply that the socket is closed. */
-			
-			log().message ("SERVER", Log::Info, 0,
-						   "Connection lost. Closing the connection.");
-
-
-			/* Send a ConnectionLost request to handler. */
-			if (mRequestMask & Request::ConnectionLost) {
-				Connection* pConn = static_cast <Connection*> (pDescriptorData);
+	if (mMaxConnections > 0 && connectionCount () >= mMaxConnections)
+		return false;
 
-				Request* pRequest = new ConnectionLostRequest (fd,
-															   *pConn,
-															   *this);
-				getHandler()->process (pRequest);
-			}
-
-			/* Remove the descriptor from Listener. */
-			removeDescriptor (fd);
-
-			/* Note:                                                        */
-			/* The associated Connection object will be removed from the    */
-			/* Listener and  destroyed by the desctructor of the Request.   */
-			/* This is because we can't destroy it here because the Request */
-			/* may need the Connection object.                              */
-			/* See Connection::close for notes.                             */
-		}
-	}
+	if (mMaxPerAddress > 0 && mAddressCounts.count (rAddr.sin_addr.s_addr) >= mMaxPerAddress)
+		return false;
 
-	return 0;
+	return true;
 }
 
 /*******************************************************************************
- * Handle Listener timeout event
+ * Resets a connection that is over the connection limits.
+ *
+ * The socket is closed with a zero linger time, so that the client
+ * gets a reset right away and the socket does not linger in
+ * TIME_WAIT. Only the first rejection of an overload is logged.
  ******************************************************************************/
-MSrvResult ServerListener::timeoutEvent ()
+void ServerListener::reject (int clientsocket)
 {
-	MSrvResult result = 0;
-	
-	if (mRequestMask & Request::Timeout) {
-		Request* pRequest = new TimeoutRequest (*this);
-		result = getHandler()->process (pRequest);
+	struct linger lingering;
+	lingering.l_onoff  = 1;
+	lingering.l_linger = 0;
+	setsockopt (clientsocket, SOL_SOCKET, SO_LINGER, &lingering, sizeof (lingering));
+	::close (clientsocket);
+
+	__atomic_add_fetch (&mRejected, 1, __ATOMIC_RELAXED);
+
+	if (!mLimitReached) {
+		mLimitReached = true;
+		log().message ("SERVER", Log::Warning, MSRVERR_CONNECTION_LIMIT,
+					   "Connection limit reached with %d connections. "
+					   "Rejecting new connections.",
+					   connectionCount ());
 	}
-
-	return result;
 }
 
 /*******************************************************************************
- * Performs shutdown of the ServerListener.
+ * \fn void ServerListener::setBacklog (int backlog)
  *
- * Sends a @ref ShutdownRequest to associated @ref RequestHandler.
+ * Sets the queue length of TCP connections pending to be accepted.
+ * Must be called before @ref bind(). The default is
+ * MSRV_LISTEN_BACKLOG; the system may limit it further.
  ******************************************************************************/
-MSrvResult ServerListener::shutdown ()
-{
-	int result = 0;
-	
-	/* Inform the user application about the shutdown. */
-	if (mRequestMask & Request::Shutdown)
-		result = getHandler()->process (new ShutdownRequest (*this));
 
-	/* Close all client sockets still open. */
-	for (ConnIter conn_i (*this); !conn_i.exhausted (); conn_i.next())
-		close (&conn_i.get());
-
-	/* Close server socket. */
-	::close (mSocket);
-
-	/* Remove it from the Listener. */
-	removeDescriptor (mSocket);
-
-	return result;
-}
+/*******************************************************************************
+ * \fn void ServerListener::setMaxConnections (int max)
+ *
+ * Sets the most connections open at a time. Connections accepted
+ * over the limit are reset. The default is 0, which means no limit.
+ ******************************************************************************/
 
 /*******************************************************************************
- * Closes a client connection
+ * \fn void ServerListener::setMaxPerAddress (int max)
  *
- * The Connection object will be destroyed during this call and will
- * be invalid afterwards.
+ * Sets the most connections open at a time from one client IP
+ * address. Connections accepted over the limit are reset. The default
+ * is 0, which means no limit.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn long ServerListener::rejectedConnections () const
  *
- * @return 0 if successful, otherwise an error code.
+ * Returns the number of connections reset because of the connection
+ * limits. May be called in any thread.
  ******************************************************************************/
-MSrvResult ServerListener::close (Connection* pConn) {
-	if (!pConn)
-		return MSRVERR_NULL_ARGUMENT;
 
+/*******************************************************************************
+ * Sets the time after which connections that have received nothing
+ * are disconnected.
+ *
+ * The idle connections are disconnected with @ref
+ * Connection::disconnect(), so the handler gets a @ref
+ * ConnectionLostRequest for them as usual. 0 turns the idle timeout
+ * off, which is the default.
+ ******************************************************************************/
+void ServerListener::setIdleTimeout (long msec /**< Idle time in milliseconds. */)
+{
 	mThreadLock.lock ();
 
-	pConn->close ();
+	mIdleTimeout = msec;
+	if (mIdleTimer >= 0) {
+		timers().cancel (mIdleTimer);
+		mIdleTimer = -1;
+	}
 
-	mThreadLock.lock ();
+	/* Check the current connections against the new timeout. */
+	reapIdle ();
 
-	return 0;
+	mThreadLock.unlock ();
 }
 
 /*******************************************************************************
- * Constructor for connection iterator.
+ * Marks a connection as the most recently active one.
+ *
+ * Moves the connection to the end of the idle list. The caller must
+ * hold the thread lock.
  ******************************************************************************/
-ServerListener::ConnIter::ConnIter (ServerListener& server)
-		: rServer (server), mDescIter (server.mDescriptors)
+void ServerListener::idleTouch (Connection& rConn)
 {
-	while (!mDescIter.exhausted() && mDescIter.get().mFd == rServer.mSocket)
-		mDescIter.next ();
+	rConn.mLastActive = lastEvent ();
+
+	if (rConn.mIdleListed) {
+		if (&rConn == mrpIdleLast)
+			return;
+		idleUnlink (rConn);
+	}
+
+	rConn.mrpIdlePrev = mrpIdleLast;
+	rConn.mrpIdleNext = NULL;
+	if (mrpIdleLast)
+		mrpIdleLast->mrpIdleNext = &rConn;
+	else
+		mrpIdleFirst = &rConn;
+	mrpIdleLast      = &rConn;
+	rConn.mIdleListed = true;
 }
 
 /*******************************************************************************
- * Retrieves current object.
+ * Removes a connection from the idle list, if it is there.
+ *
+ * The caller must hold the thread lock.
  ******************************************************************************/
-Connection&	ServerListener::ConnIter::get ()
+void ServerListener::idleUnlink (Connection& rConn)
 {
-	return *static_cast <Connection*> (mDescIter.get ().mpData);
+	if (!rConn.mIdleListed)
+		return;
+
+	if (rConn.mrpIdlePrev)
+		rConn.mrpIdlePrev->mrpIdleNext = rConn.mrpIdleNext;
+	else
+		mrpIdleFirst = rConn.mrpIdleNext;
+
+	if (rConn.mrpIdleNext)
+		rConn.mrpIdleNext->mrpIdlePrev = rConn.mrpIdlePrev;
+	else
+		mrpIdleLast = rConn.mrpIdlePrev;
+
+	rConn.mrpIdlePrev = NULL;
+	rConn.mrpIdleNext = NULL;
+	rConn.mIdleListed = false;
 }
 
 /*******************************************************************************
- * Retrieves current object.
+ * Disconnects the connections that have been idle for too long.
+ *
+ * The idle connections are at the head of the idle list, so the
+ * check stops at the first connection that is still active. A timer
+ * is then set for the time when that connection would become idle.
+ * The caller must hold the thread lock.
  ******************************************************************************/
-void ServerListener::ConnIter::next		()
+void ServerListener::reapIdle ()
 {
-	do {
-		mDescIter.next();
-	} while (!mDescIter.exhausted() && mDescIter.get().mFd == rServer.mSocket);
+	mIdleTimer = -1;
+	if (mIdleTimeout <= 0)
+		return;
+
+	unsigned long now = TimerWheel::now ();
+	while (mrpIdleFirst && now - mrpIdleFirst->mLastActive >= (unsigned long) mIdleTimeout) {
+		Connection* pConn = mrpIdleFirst;
+
+		/* The connection is counted out when it is noticed as lost. */
+		idleUnlink (*pConn);
+		pConn->disconnect ();
+
+		__atomic_add_fetch (&mIdleDisconnects, 1, __ATOMIC_RELAXED);
+		MSRV_LOG (log(), "SERVER", Log::Info, 0,
+				  "Connection idle for %ld ms. Disconnecting.",
+				  (long) (now - pConn->mLastActive));
+	}
+
+	if (mrpIdleFirst)
+		mIdleTimer = timers().add (mrpIdleFirst->mLastActive + mIdleTimeout - now);
 }
 
 /*******************************************************************************
- * Is iterator past last item?
+ * Counts out a connection whose descriptor has been removed.
+ *
+ * Called with the thread lock held when a connection is closed or
+ * lost.
  ******************************************************************************/
-bool ServerListener::ConnIter::exhausted ()
+void ServerListener::descriptorRemoved (
+	int   fd,   /**< Descriptor that was removed.               */
+	void* data  /**< The @ref Connection, or NULL for the server socket. */)
+{
+	if (fd == mSocket || !data)
+		return;
+
+	Connection* pConn = static_cast <Connection*> (data);
+	__atomic_sub_fetch (&mConnectionCount, 1, __ATOMIC_RELAXED);
+	mAddressCounts.decrement (pConn->ipAddress ());
+	idleUnlink (*pConn);
+}
+
+/*******************************************************************************
+ * Handles an event on a descriptor (socket).
+ *
+ * The meaning of the event depends on the socket type.
+ *
+ * Generates a request and calls request handler with
+ * RequestHandler::process().
+ ******************************************************************************/
+MSrvResult ServerListener::descriptorEvent (
+	int   fd,              /**< Descriptor.                                   */
+	void* pDescriptorData) /**< Ptr to data associated with the descriptor.   */
+{
+	if (fd == mSocket && mProtocol == TCP) {
+		/* It's the TCP server socket; accept a new connection. */
+		accept ();
+
+	} else if (fd == mSocket) {
+		/* It's the UDP server socket; receive a batch of datagrams. */
+		receiveDatagrams ();
+
+	} else {
+		/* Data has become data available in a TCP client socket. */
+
+		/* Ask how much data there is, so that it can be read with a */
+		/* single call straight into a buffer of the right size.     */
+		int available = 0;
+		if (ioctl (fd, FIONREAD, &available) < 0 || available <= 0)
+			available = MSRV_READ_BUFFER_LEN;
+		else if (available >= MSRV_MAX_READ_LEN)
+			available = MSRV_MAX_READ_LEN - 1;
+
+		/* Leave room for a terminating null. */
+		char* pBuffer   = (char*) mpBufferPool->allocate (available + 1);
+		int   readcount = ::read (fd, pBuffer, available);
+
+		if (readcount > 0) {
+			pBuffer[readcount] = 0x00;
+
+			/* The request adopts the buffer. Anything left over in */
+			/* the socket is reported again by the next wait.       */
+			dataEvent (fd, pDescriptorData, pBuffer, readcount, true);
+
+		} else {
+			BlockPool::release (pBuffer);
+
+			if (readcount < 0) {
+				/* Error. */
+				MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, MSRVERR_READ_FAILED,
+								  "Read failed with error %d; %s.",
+								  errno, strerror (errno));
+
+			} else {
+				/* No data was available from the socket.     */
+				/* This must imply that the socket is closed. */
+				connectionLost (fd, pDescriptorData);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Receives the datagrams waiting in the UDP server socket.
+ *
+ * Up to MSRV_DATAGRAM_BATCH datagrams are received with one call,
+ * each straight into a buffer of the @ref BufferPool, which the
+ * @ref DatagramRequest adopts. Datagrams longer than the length set
+ * with @ref setDatagramLen() are dropped.
+ *
+ * The replies given by the handler in this thread while handling the
+ * batch are sent together after it.
+ ******************************************************************************/
+MSrvResult ServerListener::receiveDatagrams ()
+{
+	struct sockaddr_in addrs[MSRV_DATAGRAM_BATCH];
+
+	/* Prepare a buffer for each datagram, with room for a terminating */
+	/* null. Buffers left unused are kept for the next batch.          */
+	for (int i=0; i<MSRV_DATAGRAM_BATCH; ++i)
+		if (!mpRecvBuffers[i])
+			mpRecvBuffers[i] = (char*) mpBufferPool->allocate (mDatagramLen + 1);
+
+#ifdef __linux__
+	struct mmsghdr messages[MSRV_DATAGRAM_BATCH];
+	struct iovec   vecs[MSRV_DATAGRAM_BATCH];
+
+	memset (messages, 0, sizeof (messages));
+	for (int i=0; i<MSRV_DATAGRAM_BATCH; ++i) {
+		vecs[i].iov_base = mpRecvBuffers[i];
+		vecs[i].iov_len  = mDatagramLen;
+
+		messages[i].msg_hdr.msg_name    = &addrs[i];
+		messages[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+		messages[i].msg_hdr.msg_iov     = &vecs[i];
+		messages[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	int count = recvmmsg (mSocket, messages, MSRV_DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+#else
+	socklen_t addrlen = sizeof (struct sockaddr_in);
+	int       len     = recvfrom (mSocket, mpRecvBuffers[0], mDatagramLen, MSG_DONTWAIT,
+								  (struct sockaddr*) &addrs[0], &addrlen);
+	int       count   = len < 0? -1 : 1;
+#endif
+
+	if (count < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, MSRVERR_READ_FAILED,
+							  "Receiving datagrams failed with error %d; %s.",
+							  errno, strerror (errno));
+		return 0;
+	}
+
+	mDeferReplies = true;
+
+	for (int i=0; i<count; ++i) {
+		char* pBuffer    = mpRecvBuffers[i];
+		mpRecvBuffers[i] = NULL;
+
+#ifdef __linux__
+		int  len       = messages[i].msg_len;
+		bool truncated = messages[i].msg_hdr.msg_flags & MSG_TRUNC;
+#else
+		bool truncated = false;
+#endif
+		if (truncated)
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, MSRVERR_READ_FAILED,
+							  "Dropped a datagram longer than %d bytes.", mDatagramLen);
+
+		if (truncated || len == 0) {
+			BlockPool::release (pBuffer);
+			continue;
+		}
+
+		pBuffer[len] = 0x00;
+		dataEvent (mSocket, NULL, pBuffer, len, true, &addrs[i]);
+	}
+
+	mDeferReplies = false;
+
+	return flushReplies ();
+}
+
+/*******************************************************************************
+ * Sends a reply to a datagram.
+ *
+ * The reply is added to a @ref DatagramBatch. When called by a
+ * handler in the listener thread, the batch is sent after the whole
+ * batch of received datagrams has been handled; in other threads, it
+ * is sent right away. The data is copied, so the caller may reuse its
+ * buffer.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::reply (
+	DatagramRequest& rRequest, /**< Datagram to reply to. */
+	const char*      pData,    /**< Reply data.           */
+	int              len       /**< Length of the reply.  */)
+{
+	mReplyLock.lock ();
+
+	MSrvResult result = mpReplies->add (rRequest.address (), pData, len);
+
+	/* Send a full batch and make room. */
+	if (result == MSRVERR_QUEUE_FULL) {
+		flushReplies ();
+		result = mpReplies->add (rRequest.address (), pData, len);
+	}
+
+	bool deferred = mDeferReplies && pthread_equal (pthread_self (), mListenerThread);
+	if (result == 0 && !deferred)
+		result = flushReplies ();
+
+	mReplyLock.unlock ();
+
+	return result;
+}
+
+/*******************************************************************************
+ * Sends the replies given with @ref reply() that are still waiting.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::flushReplies ()
+{
+	mReplyLock.lock ();
+
+	int result = 0;
+	if (mpReplies->length () > 0)
+		result = mpReplies->send (mSocket);
+
+	mReplyLock.unlock ();
+
+	if (result < 0) {
+		MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, result,
+						  "Sending datagrams failed with error %d; %s.",
+						  errno, strerror (errno));
+		return result;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * \fn void ServerListener::setDatagramLen (int len)
+ *
+ * Sets the length of the buffer each datagram is received into.
+ * Longer datagrams are dropped. The default is MSRV_DATAGRAM_LEN.
+ * This must be set before @ref listen().
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Handles a connection socket that has become writable.
+ *
+ * Sends the queued data of the connection. If the connection was
+ * blocked by its output limit and has now sent everything, sends a
+ * @ref WritableRequest to the request handler.
+ ******************************************************************************/
+MSrvResult ServerListener::writableEvent (
+	int   fd,              /**< Descriptor that became writable.            */
+	void* pDescriptorData) /**< Ptr to data associated with the descriptor. */
+{
+	if (fd == mSocket)
+		return 0;
+
+	Connection* pConn = static_cast <Connection*> (pDescriptorData);
+	pConn->flush ();
+
+	if (pConn->unblock () && (mRequestMask & Request::Writable)) {
+		Request* pRequest = new (*mpRequestPool) WritableRequest (fd, *pConn, *this);
+		getHandler()->process (pRequest);
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Handles data received from a socket.
+ *
+ * Puts the data into a request object and sends it to the request
+ * handler. The request takes ownership of the data buffer, which must
+ * have been allocated with malloc(), or from the @ref bufferPool() if
+ * pooled is true.
+ ******************************************************************************/
+MSrvResult ServerListener::dataEvent (
+	int   fd,              /**< Descriptor the data was received from.     */
+	void* pDescriptorData, /**< Ptr to data associated with the descriptor. */
+	char* pData,           /**< Received data.                              */
+	int   len,             /**< Length of the received data.                */
+	bool  pooled,          /**< Is the buffer from the @ref BufferPool?     */
+	const struct sockaddr_in* pAddr /**< Sender of a datagram. May be NULL.  */)
+{
+	if (mrpMetrics)
+		mrpMetrics->bytesRead (len);
+
+	/* Split a stream into frames, if a framer is set. */
+	if (mProtocol == TCP) {
+		Connection* pConn = static_cast <Connection*> (pDescriptorData);
+		if (pConn->mIdleListed)
+			idleTouch (*pConn);
+		if (pConn->mrpFramer)
+			return frameEvent (fd, *pConn, pData, len, pooled);
+	}
+
+	DataRequest* pRequest = NULL;
+	if (mProtocol == TCP)
+		if (mRequestMask & Request::StreamData)
+			pRequest = new (*mpRequestPool) StreamDataRequest (fd,
+															   *static_cast <Connection*> (pDescriptorData),
+															   *this);
+		else
+			pRequest = NULL;
+	else
+		if (mRequestMask & Request::Datagram) {
+			DatagramRequest* pDatagram = new (*mpRequestPool) DatagramRequest (fd, *this);
+			if (pAddr)
+				pDatagram->setAddress (*pAddr);
+			pRequest = pDatagram;
+		} else
+			pRequest = NULL;
+
+	if (!pRequest) {
+		/* Nobody wants the data. */
+		if (pooled)
+			BlockPool::release (pData);
+		else
+			free (pData);
+		return 0;
+	}
+
+	pRequest->setData (pData, len, pooled);
+
+	/* Send the request to handler. */
+	getHandler()->process (pRequest);
+
+	/* The handler must have destroyed the request object. */
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Splits data received from a connection into frames.
+ *
+ * The frames are taken straight from the received data as long as
+ * there is no partial frame left from earlier reads; otherwise the
+ * data is appended to the @ref FrameBuffer of the connection first.
+ * The framer finds up to MSRV_FRAME_BATCH frames with one pass over
+ * the data. A partial frame at the end is kept in the FrameBuffer.
+ *
+ * When the data is exactly one frame, which is the usual case, the
+ * request adopts the read buffer without copying. Otherwise each
+ * payload is copied to a buffer of its own.
+ *
+ * If the data is not valid for the framer, or a partial frame cannot
+ * be kept for lack of memory, the connection is disconnected.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::frameEvent (
+	int         fd,     /**< Socket of the connection.                 */
+	Connection& rConn,  /**< Connection the data was received from.    */
+	char*       pData,  /**< Received data. Adopted by this method.    */
+	int         len,    /**< Length of the received data.              */
+	bool        pooled  /**< Is the buffer from the @ref BufferPool?   */)
+{
+	FrameBuffer& rFrames = rConn.mFrames;
+	MSrvResult   result  = 0;
+	int          offset  = 0; /* Frames taken from pData. */
+	bool         closed  = false;
+	FrameSpan    spans[MSRV_FRAME_BATCH];
+
+	if (rFrames.length () > 0) {
+		result = rFrames.append (pData, len);
+		offset = len;
+	}
+
+	while (!closed && result == 0) {
+		/* The data not yet framed is in the FrameBuffer, or in pData */
+		/* if the FrameBuffer is empty.                               */
+		const char* pSrc    = pData + offset;
+		int         srcLen  = len - offset;
+		int         scanned = 0;
+		if (rFrames.length () > 0) {
+			pSrc    = rFrames.data ();
+			srcLen  = rFrames.length ();
+			scanned = rFrames.scanned ();
+		}
+
+		if (srcLen == 0)
+			break;
+
+		/* The handler may have changed the framer. Without one, */
+		/* the rest of the data is passed on as such.            */
+		const Framer* pFramer = rConn.mrpFramer;
+		int           count   = 1;
+		if (pFramer)
+			count = pFramer->frames (pSrc, srcLen, scanned, spans, MSRV_FRAME_BATCH);
+		else {
+			spans[0].mStart  = 0;
+			spans[0].mLength = srcLen;
+			spans[0].mEnd    = srcLen;
+		}
+
+		if (count == 0) {
+			/* Keep the partial frame until the rest arrives. */
+			if (rFrames.length () == 0) {
+				result = rFrames.append (pSrc, srcLen);
+				offset = len;
+			}
+			rFrames.setScanned (rFrames.length ());
+			break;
+		}
+
+		if (count < 0) {
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, count,
+							  "Invalid frame received. Disconnecting.");
+			rFrames.clear ();
+			rConn.disconnect ();
+			result = count;
+			break;
+		}
+
+		int end = 0;
+		for (int i=0; i<count; ++i) {
+			int   length       = spans[i].mLength;
+			char* pBuffer      = NULL;
+			bool  bufferPooled = true;
+			if (pSrc == pData && spans[i].mEnd == len && end == 0) {
+				/* The read is exactly one frame. Move the payload to */
+				/* the front, and let the request adopt the buffer.   */
+				memmove (pData, pData + spans[i].mStart, length);
+				pBuffer      = pData;
+				bufferPooled = pooled;
+				pData        = NULL;
+			} else {
+				pBuffer = (char*) mpBufferPool->allocate (length + 1);
+				memcpy (pBuffer, pSrc + spans[i].mStart, length);
+			}
+			pBuffer[length] = 0x00;
+
+			/* Consume the frame before the handler can see the buffer. */
+			if (rFrames.length () > 0)
+				rFrames.consume (spans[i].mEnd - end);
+			else
+				offset += spans[i].mEnd - end;
+			end = spans[i].mEnd;
+
+			frameReceived (fd, rConn, pBuffer, length, bufferPooled);
+
+			/* The handler may have closed the connection, or changed */
+			/* the framer for the rest of the data.                   */
+			closed = rConn.socket () != fd;
+			if (closed || rConn.mrpFramer != pFramer)
+				break;
+		}
+	}
+
+	/* Data was lost, so the rest of the stream cannot be framed. */
+	if (result == MSRVERR_OUT_OF_MEMORY) {
+		MSRV_LOG_LIMITED (log(), "SERVER", Log::Error, result,
+						  "Out of memory keeping a partial frame. Disconnecting.");
+		rFrames.clear ();
+		rConn.disconnect ();
+	}
+
+	if (pData) {
+		if (pooled)
+			BlockPool::release (pData);
+		else
+			free (pData);
+	}
+
+	return result;
+}
+
+/*******************************************************************************
+ * Sends a @ref StreamDataRequest for a received frame to the handler.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::frameReceived (
+	int         fd,     /**< Socket of the connection.                  */
+	Connection& rConn,  /**< Connection the frame was received from.    */
+	char*       pData,  /**< Payload of the frame. Adopted by the request. */
+	int         len,    /**< Length of the payload.                     */
+	bool        pooled  /**< Is the buffer from the @ref BufferPool?    */)
+{
+	if (!(mRequestMask & Request::StreamData)) {
+		/* Nobody wants the data. */
+		if (pooled)
+			BlockPool::release (pData);
+		else
+			free (pData);
+		return 0;
+	}
+
+	DataRequest* pRequest = new (*mpRequestPool) StreamDataRequest (fd, rConn, *this);
+	pRequest->setData (pData, len, pooled);
+
+	return getHandler()->process (pRequest);
+}
+
+/*******************************************************************************
+ * \fn void ServerListener::setFramer (const Framer* pFramer)
+ *
+ * Sets the @ref Framer given to new connections. The framer is not
+ * owned by the listener and must exist as long as the connections.
+ * The default is NULL, which passes the received data on as it was
+ * read. The framer of a single connection can be changed with @ref
+ * Connection::setFramer().
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Handles a lost client connection.
+ *
+ * Sends a @ref ConnectionLostRequest to the request handler and stops
+ * listening to the socket.
+ ******************************************************************************/
+MSrvResult ServerListener::connectionLost (
+	int   fd,              /**< Descriptor of the lost connection.          */
+	void* pDescriptorData) /**< Ptr to data associated with the descriptor. */
+{
+	MSRV_LOG (log(), "SERVER", Log::Info, 0,
+			  "Connection lost. Closing the connection.");
+
+
+	Connection* pConn = static_cast <Connection*> (pDescriptorData);
+
+	if (mrpMetrics)
+		mrpMetrics->connectionLost ();
+
+	/* No more timers for the connection. */
+	timers().cancelAll (pConn->mTimers);
+
+	/* Send a ConnectionLost request to handler. */
+	if (mRequestMask & Request::ConnectionLost) {
+
+		Request* pRequest = new (*mpRequestPool) ConnectionLostRequest (fd,
+																		*pConn,
+																		*this);
+		getHandler()->process (pRequest);
+	}
+
+	/* Remove the descriptor from Listener. */
+	removeDescriptor (fd);
+
+	/* Note:                                                        */
+	/* The associated Connection object will be removed from the    */
+	/* Listener and  destroyed by the desctructor of the Request.   */
+	/* This is because we can't destroy it here because the Request */
+	/* may need the Connection object.                              */
+	/* See Connection::close for notes.                             */
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Runs the listener loop.
+ *
+ * Uses io_uring completions if the listener was created with the
+ * io_uring backend, otherwise the readiness loop of @ref
+ * Listener::listen().
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::listen ()
+{
+	/* Replies given in this thread may be batched. */
+	mListenerThread = pthread_self ();
+
+#ifdef MSRV_HAVE_IO_URING
+	UringBackend* pUring = dynamic_cast <UringBackend*> (&backend ());
+	if (pUring && pUring->completionMode ())
+		return listenCompletions (*pUring);
+#endif
+
+	return Listener::listen ();
+}
+
+#ifdef MSRV_HAVE_IO_URING
+/*******************************************************************************
+ * Runs the listener loop on io_uring completions.
+ *
+ * Works as @ref Listener::listen(), but instead of waiting for the
+ * sockets to become readable, an accept or a read is kept pending on
+ * each socket. The operations queued while handling one batch of
+ * completions are submitted together with the next wait.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult ServerListener::listenCompletions (UringBackend& rUring)
+{
+	UringCompletion completions[MSRV_MAX_READY_EVENTS];
+	int             errorcount = 0; /* For counting consecutive failures. */
+
+	log().message ("LISTENER", Log::Info, 0, "Starting listening with %s...",
+				   rUring.name ());
+
+	/* Start receiving on the server socket. */
+	mThreadLock.lock ();
+	if (mProtocol == TCP)
+		rUring.armAccept (mSocket);
+	else
+		rUring.armReadable (mSocket);
+	mThreadLock.unlock ();
+
+	while (1) {
+		/* Submit the pending operations and wait for completions, */
+		/* but no longer than to the next timeout or timer.         */
+		long waitSec, waitUSec;
+		waitTimeout (waitSec, waitUSec);
+
+		int count = rUring.complete (completions, MSRV_MAX_READY_EVENTS,
+									 waitSec, waitUSec);
+		if (count < 0 && errno == EINTR)
+			/* A signal, such as SIGHUP reopening the log, is no error. */
+			count = 0;
+
+		if (count < 0) {
+			MSRV_LOG_LIMITED (log(), "LISTENER", Log::Warning, MSRVERR_SELECT_FAILED,
+							  "Waiting with %s failed with error %d; %s.",
+							  rUring.name (), errno, strerror (errno));
+			++errorcount;
+
+		} else if (count == 0) {
+			/* Timeout without any completions. */
+			if (idleExpired () && timeoutEvent () == MSRVERR_SHUTDOWN_EVENT)
+				startShutdown ();
+
+		} else {
+			idleRestart ();
+
+			mThreadLock.lock ();
+
+			for (int i=0; i<count; ++i)
+				if (completionEvent (rUring, completions[i]) == MSRVERR_SHUTDOWN_EVENT)
+					startShutdown ();
+
+			/* All is ok again, reset the error count. */
+			errorcount = 0;
+
+			mThreadLock.unlock ();
+		}
+
+		/* Timers expire regardless of the other events. */
+		expireTimers ();
+
+		/* Check if the wait has failed too many times consecutively. */
+		if (errorcount > MSRV_MAX_SELECT_ERROR_COUNT) {
+			log().message ("LISTENER", Log::Critical, MSRVERR_TOO_MANY_ERRORS,
+						   "Too many errors in %s.", rUring.name ());
+			startShutdown ();
+		}
+
+		if (isShutdown())
+			break;
+	}
+
+	/* Closing the sockets cancels their operations. */
+	shutdown ();
+
+	/* Wait for the cancelled operations before closing the rest. */
+	rUring.drain ();
+	closeDescriptors ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Handles a completed io_uring operation.
+ *
+ * A completed accept creates the connection, a completed read is sent
+ * to the request handler with the data buffer, and a read of zero
+ * bytes on a connection means that the connection was lost. A new
+ * operation is armed on the socket while it is still listened. A
+ * writable socket sends its queued data.
+ ******************************************************************************/
+MSrvResult ServerListener::completionEvent (
+	UringBackend&    rUring,
+	UringCompletion& rCompletion)
+{
+	int   fd    = rCompletion.mFd;
+	void* pData = NULL;
+
+	if (rCompletion.mOp == UringBackend::OpWritable) {
+		if (findDescriptor (fd, pData))
+			return writableEvent (fd, pData);
+		return 0;
+	}
+
+	if (rCompletion.mOp == UringBackend::OpReadable) {
+		/* The UDP server socket is read in batches by ourselves. */
+		if (findDescriptor (fd, pData)) {
+			receiveDatagrams ();
+			rUring.armReadable (fd);
+		}
+		return 0;
+	}
+
+	if (rCompletion.mOp == UringBackend::OpAccept) {
+		if (rCompletion.mResult < 0)
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Critical, MSRVERR_ACCEPT_FAILED,
+							  "Accept failed with error %d; %s.",
+							  -rCompletion.mResult, strerror (-rCompletion.mResult));
+		else {
+			int clientsocket = rCompletion.mResult;
+
+			/* Clients of a Unix socket have no IP address. */
+			if (rCompletion.mAddr.sin_family != AF_INET)
+				memset (&rCompletion.mAddr, 0, sizeof (rCompletion.mAddr));
+
+			acceptConnection (clientsocket, rCompletion.mAddr);
+
+			/* The handler may have closed the connection already. */
+			if (findDescriptor (clientsocket, pData))
+				rUring.armRecv (clientsocket, MSRV_URING_RECV_LEN);
+		}
+
+		/* Keep accepting. */
+		if (!isShutdown () && findDescriptor (fd, pData))
+			rUring.armAccept (fd);
+
+		return 0;
+	}
+
+	/* Drop reads on sockets that have been removed meanwhile. */
+	if (!findDescriptor (fd, pData)) {
+		free (rCompletion.mpBuffer);
+		return 0;
+	}
+
+	if (rCompletion.mResult > 0) {
+		/* The request adopts the buffer as such. Terminate the  */
+		/* data like descriptorEvent() does, in the spare byte. */
+		rCompletion.mpBuffer[rCompletion.mResult] = 0x00;
+		dataEvent (fd, pData, rCompletion.mpBuffer, rCompletion.mResult);
+
+	} else {
+		free (rCompletion.mpBuffer);
+
+		if (rCompletion.mResult < 0)
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, MSRVERR_READ_FAILED,
+							  "Read failed with error %d; %s.",
+							  -rCompletion.mResult, strerror (-rCompletion.mResult));
+		else if (mProtocol == TCP) {
+			/* End of stream; the connection is lost. */
+			return connectionLost (fd, pData);
+		}
+	}
+
+	/* Keep reading while the socket is listened. */
+	if (findDescriptor (fd, pData))
+		rUring.armRecv (fd, MSRV_URING_RECV_LEN);
+
+	return 0;
+}
+#endif
+
+/*******************************************************************************
+ * Handle Listener timeout event
+ ******************************************************************************/
+MSrvResult ServerListener::timeoutEvent ()
+{
+	MSrvResult result = 0;
+	
+	if (mRequestMask & Request::Timeout) {
+		Request* pRequest = new (*mpRequestPool) TimeoutRequest (*this);
+		result = getHandler()->process (pRequest);
+	}
+
+	return result;
+}
+
+/*******************************************************************************
+ * Sends a @ref TimeoutRequest for an expired timer to the handler.
+ *
+ * Timers of connections that have been closed meanwhile are dropped.
+ * The request is sent whether Request::Timeout is in the request mask
+ * or not, as the timer was set on purpose. The timer of the idle
+ * timeout is handled here.
+ ******************************************************************************/
+MSrvResult ServerListener::timerEvent (
+	long  id,   /**< Identifier of the timer.                       */
+	void* pData /**< Connection of the timer, or NULL.              */)
+{
+	if (id == mIdleTimer) {
+		reapIdle ();
+		return 0;
+	}
+
+	Connection* pConn  = static_cast <Connection*> (pData);
+	int         socket = -1;
+	if (pConn) {
+		void* pListened = NULL;
+		if (!findDescriptor (pConn->socket (), pListened) || pListened != pConn)
+			return 0;
+		socket = pConn->socket ();
+	}
+
+	Request* pRequest = new (*mpRequestPool) TimeoutRequest (socket, id, pConn, *this);
+	return getHandler()->process (pRequest);
+}
+
+/*******************************************************************************
+ * Sets what @ref broadcast() does with connections that can not keep up.
+ *
+ * A connection is slow when the data queued for it but not yet sent
+ * would exceed the limit. With @ref SlowDrop, a message is not queued
+ * for a connection that still has any unsent data.
+ ******************************************************************************/
+void ServerListener::setSlowPolicy (
+	int  policy, /**< One of @ref slow_policy.                  */
+	long limit   /**< Maximum unsent bytes per connection.      */)
+{
+	mSlowPolicy = policy;
+	mSlowLimit  = limit;
+}
+
+/*******************************************************************************
+ * Sends a message to all connections of the listener.
+ *
+ * The buffer is queued on the outbound queue of each connection, which
+ * takes its own reference to it; the caller keeps its reference and
+ * must drop it. The data is sent right away as far as the socket
+ * buffers take it, and the rest later.
+ *
+ * May be called in any thread.
+ *
+ * @return Number of connections the message was queued for.
+ ******************************************************************************/
+int ServerListener::broadcast (
+	SharedBuffer& rBuffer, /**< Message to send.                          */
+	Connection*   pExcept  /**< Connection not to send to. May be NULL.   */)
+{
+	int queued = 0;
+
+	/* When dropping, any unsent data makes a connection slow. */
+	long limit = mSlowPolicy == SlowDrop? rBuffer.length () : mSlowLimit;
+
+	mThreadLock.lock ();
+
+	for (ConnIter conn_i (*this); !conn_i.exhausted (); conn_i.next ()) {
+		Connection& rConn = conn_i.get ();
+		if (&rConn == pExcept)
+			continue;
+
+		MSrvResult result = rConn.enqueue (rBuffer, limit);
+		if (result == 0) {
+			queued++;
+			continue;
+		}
+
+		__atomic_add_fetch (&mBroadcastDrops, 1, __ATOMIC_RELAXED);
+
+		if (result == MSRVERR_OUTPUT_FULL && mSlowPolicy == SlowDisconnect) {
+			MSRV_LOG_LIMITED (log(), "SERVER", Log::Warning, result,
+							  "Disconnecting a slow connection with %ld bytes unsent.",
+							  rConn.pendingBytes ());
+			rConn.disconnect ();
+		}
+	}
+
+	mThreadLock.unlock ();
+
+	return queued;
+}
+
+/*******************************************************************************
+ * \fn long ServerListener::broadcastDrops () const
+ *
+ * Returns the number of times @ref broadcast() did not queue a message
+ * for a connection, because it was slow or had failed, or memory ran
+ * out.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Performs shutdown of the ServerListener.
+ *
+ * Sends a @ref ShutdownRequest to associated @ref RequestHandler.
+ ******************************************************************************/
+MSrvResult ServerListener::shutdown ()
+{
+	int result = 0;
+	
+	/* Inform the user application about the shutdown. */
+	if (mRequestMask & Request::Shutdown)
+		result = getHandler()->process (new (*mpRequestPool) ShutdownRequest (*this));
+
+	/* Close all client sockets still open. */
+	for (ConnIter conn_i (*this); !conn_i.exhausted (); conn_i.next())
+		close (&conn_i.get());
+
+	/* Close server socket. */
+	::close (mSocket);
+
+	/* Remove it from the Listener. */
+	removeDescriptor (mSocket);
+
+	return result;
+}
+
+/*******************************************************************************
+ * Closes a client connection
+ *
+ * The Connection object will be destroyed during this call and will
+ * be invalid afterwards.
+ *
+ * @return 0 if successful, otherwise an error code.
+ ******************************************************************************/
+MSrvResult ServerListener::close (Connection* pConn) {
+	if (!pConn)
+		return MSRVERR_NULL_ARGUMENT;
+
+	mThreadLock.lock ();
+
+	pConn->close ();
+
+	mThreadLock.unlock ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * \fn ServerMetrics* ServerListener::metrics ()
+ *
+ * Returns the metrics the listener records to, or NULL if it records
+ * none.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn void ServerListener::setMetrics (ServerMetrics* pMetrics)
+ *
+ * Sets the metrics the listener records to. The default is @ref
+ * ServerMetrics::global(); NULL records none, which suits listeners
+ * that are not part of the service, such as an @ref AdminServer.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Copies the state of the connections for reporting.
+ *
+ * Only the copy is made with the thread lock held, so that the
+ * caller can format it at leisure without holding up the listener.
+ * At most max connections are copied.
+ *
+ * @return Number of connections copied.
+ ******************************************************************************/
+int ServerListener::snapshot (
+	ConnectionState* pStates,     /**< Receives the connections.           */
+	int              max,         /**< Length of pStates.                  */
+	int&             rDescriptors /**< Receives the number of descriptors. */)
+{
+	int count = 0;
+
+	mThreadLock.lock ();
+
+	rDescriptors = mDescriptors.length ();
+
+	for (int i=0; i<mDescriptors.length () && count<max; ++i) {
+		Descriptor& rDesc = mDescriptors[i];
+		if (rDesc.mFd == mSocket || !rDesc.mpData)
+			continue;
+
+		Connection* pConn = static_cast <Connection*> (rDesc.mpData);
+		pStates[count].mSocket    = rDesc.mFd;
+		pStates[count].mIpAddress = pConn->ipAddress ();
+		pStates[count].mPort      = ntohs (pConn->address ().sin_port);
+		count++;
+	}
+
+	mThreadLock.unlock ();
+
+	return count;
+}
+
+/*******************************************************************************
+ * Constructor for connection iterator.
+ ******************************************************************************/
+ServerListener::ConnIter::ConnIter (ServerListener& server)
+		: rServer (server), mDescIter (server.mDescriptors)
+{
+	while (!mDescIter.exhausted() && mDescIter.get().mFd == rServer.mSocket)
+		mDescIter.next ();
+}
+
+/*******************************************************************************
+ * Retrieves current object.
+ ******************************************************************************/
+Connection&	ServerListener::ConnIter::get ()
+{
+	return *static_cast <Connection*> (mDescIter.get ().mpData);
+}
+
+/*******************************************************************************
+ * Retrieves current object.
+ ******************************************************************************/
+void ServerListener::ConnIter::next		()
+{
+	do {
+		mDescIter.next();
+	} while (!mDescIter.exhausted() && mDescIter.get().mFd == rServer.mSocket);
+}
+
+/*******************************************************************************
+ * Is iterator past last item?
+ ******************************************************************************/
+bool ServerListener::ConnIter::exhausted ()
 {
 	return mDescIter.exhausted();
 }
@@ -453,8 +1758,18 @@ Connection::Connection (
 	const struct sockaddr_in& rAddr,    /**< Client address.                  */
 	Listener&                 pListener /** < Listener the connection belongs.*/)
 {
-	mSocket     = socket;
-	mrpListener = &pListener;
+	mSocket      = socket;
+	mrpListener  = &pListener;
+	mOrderBusy   = false;
+	mOutputLimit = MSRV_MAX_OUTPUT_LEN;
+	mBlocked     = false;
+	mWatching    = false;
+	mrpFramer    = NULL;
+	mTimers      = -1;
+	mrpIdlePrev  = NULL;
+	mrpIdleNext  = NULL;
+	mLastActive  = 0;
+	mIdleListed  = false;
 
 	mpAddress = (sockaddr_in*) malloc (sizeof (sockaddr_in));
 	memcpy (mpAddress, &rAddr, sizeof (sockaddr_in));
@@ -497,6 +1812,291 @@ int Connection::ipAddress () const
  * Returns the thread lock that protects access to the connection object.
  ******************************************************************************/
 
+/*******************************************************************************
+ * \fn void Connection::setFramer (const Framer* pFramer)
+ *
+ * Sets the @ref Framer that splits the data received from the
+ * connection, or NULL to pass the data on as it was read. Data that
+ * has been received but not yet framed is framed with the new framer,
+ * so a handler can switch the framing after a handshake, for example.
+ *
+ * Must be called in the listener thread, for example when handling
+ * a request of the connection.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Sets a timer for the connection.
+ *
+ * When the timer expires, a @ref TimeoutRequest with the identifier
+ * of the timer and the connection is sent to the handler. If
+ * periodMSec is not zero, the timer expires every periodMSec after
+ * the first expiry, until cancelled. The timers of a connection are
+ * cancelled when it is closed or lost.
+ *
+ * Timers set in other threads than the listener are noticed when the
+ * listener next wakes up.
+ *
+ * @return Identifier of the timer, or a negative error code.
+ ******************************************************************************/
+long Connection::addTimer (
+	long msec,       /**< Time to the expiry in milliseconds.         */
+	long periodMSec  /**< Period of a periodic timer; 0 for one-shot. */)
+{
+	return mrpListener->timers().add (msec, periodMSec, this, &mTimers);
+}
+
+/*******************************************************************************
+ * Cancels a timer set with @ref addTimer().
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult Connection::cancelTimer (long id)
+{
+	return mrpListener->timers().cancel (id);
+}
+
+/*******************************************************************************
+ * Sends data on the connection without blocking.
+ *
+ * As much of the data as the socket takes is sent right away, and the
+ * rest is copied to the outbound queue of the connection, to be sent
+ * by the listener when the socket becomes writable.
+ *
+ * When the unsent data exceeds the output limit, the connection
+ * becomes blocked (see @ref isBlocked()). The handler should then
+ * stop sending until it gets a @ref WritableRequest, which is sent
+ * when all the data has been sent.
+ *
+ * May be called in any thread.
+ *
+ * @return Number of bytes left unsent on the connection, 0 if all
+ *         was sent, or a negative error code if the connection has
+ *         failed or been closed.
+ ******************************************************************************/
+long Connection::send (
+	const char* pData, /**< Data to send.       */
+	int         len    /**< Length of the data. */)
+{
+	long result = 0;
+
+	mOutputLock.lock ();
+
+	/* With nothing queued, try sending directly, so that only the */
+	/* part that does not fit needs to be copied.                  */
+	if (!mSocket)
+		result = MSRVERR_CONNECTION_NO_SOCKET;
+	else if (mOutput.isEmpty ()) {
+		ssize_t sent;
+		do {
+			sent = ::send (mSocket, pData, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		} while (sent < 0 && errno == EINTR);
+
+		if (sent > 0) {
+			pData += sent;
+			len   -= sent;
+		} else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			result = MSRVERR_WRITE_FAILED;
+	}
+
+	if (result == 0 && len > 0) {
+		SharedBuffer* pBuffer = SharedBuffer::create (pData, len);
+		if (pBuffer) {
+			result = send (*pBuffer);
+			pBuffer->unref ();
+		} else
+			result = MSRVERR_OUT_OF_MEMORY;
+	}
+
+	mOutputLock.unlock ();
+
+	return result;
+}
+
+/*******************************************************************************
+ * Sends a shared buffer on the connection without blocking.
+ *
+ * The outbound queue takes a reference to the buffer, so the data is
+ * never copied. Otherwise as the other variant of @ref send().
+ *
+ * @return Number of bytes left unsent on the connection, 0 if all
+ *         was sent, or a negative error code if the connection has
+ *         failed or been closed.
+ ******************************************************************************/
+long Connection::send (SharedBuffer& rBuffer)
+{
+	mOutputLock.lock ();
+
+	long result = mSocket? mOutput.push (rBuffer) : MSRVERR_CONNECTION_NO_SOCKET;
+	if (result == 0)
+		result = flush ();
+	if (result == 0) {
+		result = mOutput.bytes ();
+		if (result > mOutputLimit)
+			mBlocked = true;
+	}
+
+	mOutputLock.unlock ();
+
+	return result;
+}
+
+/*******************************************************************************
+ * Queues data to be sent on the connection, unless it is over a limit.
+ *
+ * The queue takes a reference to the buffer. Data queued earlier and
+ * then the new data are sent right away as far as the socket buffer
+ * takes them, without blocking. Used by @ref ServerListener::broadcast().
+ *
+ * May be called in any thread.
+ *
+ * @return 0 if successful. MSRVERR_OUTPUT_FULL if the unsent data
+ *         would exceed the limit, or MSRVERR_OUT_OF_MEMORY if the
+ *         queue could not grow, in which case the buffer is not
+ *         queued. MSRVERR_WRITE_FAILED if the connection has failed,
+ *         or MSRVERR_CONNECTION_NO_SOCKET if it has been closed.
+ ******************************************************************************/
+MSrvResult Connection::enqueue (
+	SharedBuffer& rBuffer, /**< Data to send.                                */
+	long          limit    /**< Maximum unsent bytes, or negative for none.  */)
+{
+	mOutputLock.lock ();
+
+	/* Make room by sending what is already queued. */
+	MSrvResult result = flush ();
+
+	if (result == 0 && limit >= 0 && mOutput.bytes () + rBuffer.length () > limit)
+		result = MSRVERR_OUTPUT_FULL;
+
+	if (result == 0)
+		result = mOutput.push (rBuffer);
+
+	if (result == 0)
+		result = flush ();
+
+	mOutputLock.unlock ();
+
+	return result;
+}
+
+/*******************************************************************************
+ * Sends queued data as far as the socket buffer takes it.
+ *
+ * Up to MSRV_MAX_IOVEC queued buffers are sent with one call. Never
+ * blocks. While data remains, the socket is watched for becoming
+ * writable, so that the listener calls this again. If the socket has
+ * failed or been closed, the queued data is dropped.
+ *
+ * @return 0 if successful, otherwise a negative error code.
+ ******************************************************************************/
+MSrvResult Connection::flush ()
+{
+	MSrvResult result = 0;
+
+	mOutputLock.lock ();
+
+	/* The socket is closed under the output lock, so it stays open */
+	/* while it is used here.                                       */
+	if (!mSocket) {
+		mOutput.clear ();
+		result = MSRVERR_CONNECTION_NO_SOCKET;
+	}
+
+	while (!mOutput.isEmpty ()) {
+		struct iovec  vec[MSRV_MAX_IOVEC];
+		struct msghdr msg;
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov    = vec;
+		msg.msg_iovlen = mOutput.collect (vec, MSRV_MAX_IOVEC);
+
+		/* Like writev(), but never blocks or raises SIGPIPE. */
+		ssize_t sent = ::sendmsg (mSocket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent > 0)
+			mOutput.consume (sent);
+		else if (sent < 0 && errno == EINTR)
+			continue;
+		else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else {
+			/* The connection has failed; the loss is noticed on read. */
+			mOutput.clear ();
+			result = MSRVERR_WRITE_FAILED;
+		}
+	}
+
+	/* Watch for room in the socket only while data is waiting. */
+	bool waiting = !mOutput.isEmpty ();
+	if (waiting != mWatching && mSocket && mrpListener) {
+		mrpListener->watchWrite (mSocket, waiting);
+		mWatching = waiting;
+	}
+
+	mOutputLock.unlock ();
+
+	return result;
+}
+
+/*******************************************************************************
+ * Clears the blocked state when all the data has been sent.
+ *
+ * @return true if the connection was blocked and is not anymore.
+ ******************************************************************************/
+bool Connection::unblock ()
+{
+	mOutputLock.lock ();
+
+	bool unblocked = mBlocked && mOutput.isEmpty ();
+	if (unblocked)
+		mBlocked = false;
+
+	mOutputLock.unlock ();
+
+	return unblocked;
+}
+
+/*******************************************************************************
+ * \fn void Connection::setOutputLimit (long limit)
+ *
+ * Sets the amount of unsent data after which @ref send() blocks the
+ * connection. The default is MSRV_MAX_OUTPUT_LEN.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * \fn bool Connection::isBlocked () const
+ *
+ * Tells if the unsent data has exceeded the output limit and not yet
+ * been sent. See @ref send().
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Disconnects the connection and drops any unsent data.
+ *
+ * Unlike @ref close(), the connection is not closed right away; the
+ * socket is shut down, so that the listener notices the connection
+ * as lost and sends the @ref ConnectionLostRequest as usual.
+ ******************************************************************************/
+void Connection::disconnect ()
+{
+	mOutputLock.lock ();
+
+	mOutput.clear ();
+	if (mSocket)
+		::shutdown (mSocket, SHUT_RDWR);
+
+	mOutputLock.unlock ();
+}
+
+/*******************************************************************************
+ * Returns the number of bytes queued but not yet sent.
+ ******************************************************************************/
+long Connection::pendingBytes ()
+{
+	mOutputLock.lock ();
+	long bytes = mOutput.bytes ();
+	mOutputLock.unlock ();
+
+	return bytes;
+}
+
 /*******************************************************************************
  * Closes the connection
  *
@@ -518,17 +2118,29 @@ MSrvResult Connection::close ()
 
 		/* NOTE: Removing will fail if the connection was lost. */
 		if (result < 0)
-			mrpListener->log().message ("SERVER", Log::Warning, 0,
-										"Removing descriptor failed with error %d.",
-										result);
+			MSRV_LOG_LIMITED (mrpListener->log(), "SERVER", Log::Warning, 0,
+							  "Removing descriptor failed with error %d.",
+							  result);
 	}
 
-	/* Close the socket. */
-	::close (mSocket);
-	mSocket = 0;
+	/* No more timers for the connection. */
+	if (mrpListener)
+		mrpListener->timers().cancelAll (mTimers);
+
+	/* Close the socket under the output lock, so that no other */
+	/* thread sends to it after its number has been reused.     */
+	mOutputLock.lock ();
+
+	if (mSocket) {
+		::close (mSocket);
+		mSocket = 0;
+	}
+	mOutput.clear ();
+
+	mOutputLock.unlock ();
 
-	mrpListener->log().message ("SERVER", Log::Info, 0,
-								"Connection closed.");
+	MSRV_LOG (mrpListener->log(), "SERVER", Log::Info, 0,
+			  "Connection closed.");
 
 	return result;
 }
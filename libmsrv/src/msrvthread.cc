@@ -28,6 +28,12 @@
 
 #include <sys/time.h>
 #include <errno.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#endif
 
 begin_namespace (MSrv);
 
@@ -188,6 +194,185 @@ void ThreadLock::initCond ()
 	}
 }
 
+#ifdef __linux__
+/*******************************************************************************
+ * Blocks while the futex word has the expected value.
+ *
+ * @return 0 when woken or the value differed, -1 with errno set on
+ *         timeout or error.
+ ******************************************************************************/
+static int futexWait (int* pWord, int expected, const struct timespec* pTimeout)
+{
+	return syscall (SYS_futex, pWord, FUTEX_WAIT_PRIVATE, expected, pTimeout, NULL, 0);
+}
+
+/*******************************************************************************
+ * Wakes at most the given number of threads blocked on the futex word.
+ ******************************************************************************/
+static void futexWake (int* pWord, int count)
+{
+	syscall (SYS_futex, pWord, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#endif
+
+/*******************************************************************************
+ * Creates a semaphore with the given initial count.
+ ******************************************************************************/
+Semaphore::Semaphore (int count)
+{
+	mCount   = count;
+	mWaiters = 0;
+#ifndef __linux__
+	pthread_mutex_init (&mMutex, NULL);
+	pthread_cond_init (&mCond, NULL);
+#endif
+}
+
+/*******************************************************************************
+ * Destroys the semaphore.
+ *
+ * \note No threads may be waiting in @ref wait().
+ ******************************************************************************/
+Semaphore::~Semaphore ()
+{
+#ifndef __linux__
+	pthread_cond_destroy (&mCond);
+	pthread_mutex_destroy (&mMutex);
+#endif
+}
+
+/*******************************************************************************
+ * Raises the count and wakes up to as many waiting threads.
+ ******************************************************************************/
+void Semaphore::post (int count)
+{
+#ifdef __linux__
+	__atomic_add_fetch (&mCount, count, __ATOMIC_SEQ_CST);
+
+	/* A waiter registers before checking the count in the kernel, */
+	/* so if none is registered now, none can miss the new count.  */
+	if (__atomic_load_n (&mWaiters, __ATOMIC_SEQ_CST) > 0)
+		futexWake (&mCount, count);
+#else
+	pthread_mutex_lock (&mMutex);
+	mCount += count;
+	if (mWaiters > 0)
+		pthread_cond_broadcast (&mCond);
+	pthread_mutex_unlock (&mMutex);
+#endif
+}
+
+/*******************************************************************************
+ * Takes one pass without blocking.
+ *
+ * @return true if a pass was taken, false if the count was zero.
+ ******************************************************************************/
+bool Semaphore::tryWait ()
+{
+#ifdef __linux__
+	int count = __atomic_load_n (&mCount, __ATOMIC_RELAXED);
+	while (count > 0)
+		if (__atomic_compare_exchange_n (&mCount, &count, count - 1, true,
+										 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+
+	return false;
+#else
+	pthread_mutex_lock (&mMutex);
+	bool result = mCount > 0;
+	if (result)
+		mCount--;
+	pthread_mutex_unlock (&mMutex);
+
+	return result;
+#endif
+}
+
+/*******************************************************************************
+ * Takes one pass, blocking until the count is raised if it is zero.
+ *
+ * If seconds is zero or less, waits indefinitely.
+ *
+ * @return 0 if successful, MSRVERR_TIMEOUT on timeout.
+ ******************************************************************************/
+MSrvResult Semaphore::wait (double seconds)
+{
+	/* Determine the timeout time. */
+	struct timespec deadline;
+	if (seconds > 0.0) {
+#ifdef __linux__
+		clock_gettime (CLOCK_MONOTONIC, &deadline);
+#else
+		/* The condition variable runs on the real-time clock. */
+		struct timeval now;
+		gettimeofday (&now, NULL);
+		deadline.tv_sec  = now.tv_sec;
+		deadline.tv_nsec = now.tv_usec * 1000;
+#endif
+		deadline.tv_sec  += long (seconds);
+		deadline.tv_nsec += long ((seconds - double (long (seconds))) * 1000000000.0);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+#ifdef __linux__
+	while (!tryWait ()) {
+		struct timespec  timeout;
+		struct timespec* pTimeout = NULL;
+
+		/* The futex takes a relative timeout. */
+		if (seconds > 0.0) {
+			struct timespec now;
+			clock_gettime (CLOCK_MONOTONIC, &now);
+
+			timeout.tv_sec  = deadline.tv_sec - now.tv_sec;
+			timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (timeout.tv_nsec < 0) {
+				timeout.tv_sec--;
+				timeout.tv_nsec += 1000000000;
+			}
+			if (timeout.tv_sec < 0)
+				return MSRVERR_TIMEOUT;
+
+			pTimeout = &timeout;
+		}
+
+		/* Sleep only if the count is still zero. */
+		__atomic_add_fetch (&mWaiters, 1, __ATOMIC_SEQ_CST);
+		int result = futexWait (&mCount, 0, pTimeout);
+		__atomic_sub_fetch (&mWaiters, 1, __ATOMIC_SEQ_CST);
+
+		if (result < 0 && errno == ETIMEDOUT)
+			return tryWait ()? 0 : MSRVERR_TIMEOUT;
+	}
+
+	return 0;
+#else
+	MSrvResult result = 0;
+
+	pthread_mutex_lock (&mMutex);
+
+	mWaiters++;
+	while (mCount == 0 && result == 0) {
+		if (seconds > 0.0) {
+			if (pthread_cond_timedwait (&mCond, &mMutex, &deadline) == ETIMEDOUT && mCount == 0)
+				result = MSRVERR_TIMEOUT;
+		} else
+			pthread_cond_wait (&mCond, &mMutex);
+	}
+	mWaiters--;
+
+	if (result == 0)
+		mCount--;
+
+	pthread_mutex_unlock (&mMutex);
+
+	return result;
+#endif
+}
+
 /*******************************************************************************
  * Creates a thread object.
  *
@@ -0,0 +1,428 @@
+/******************************************************************************
+ *   This file is part of the MagiCServer++ library.                          *
+ *                                                                            *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                          *
+ *                                                                            *
+ ******************************************************************************
+ *                                                                            *
+ *  This library is free software; you can redistribute it and/or             *
+ *  modify it under the terms of the GNU Library General Public               *
+ *  License as published by the Free Software Foundation; either              *
+ *  version 2 of the License, or (at your option) any later version.          *
+ *                                                                            *
+ *  This library is distributed in the hope that it will be useful,           *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU         *
+ *  Library General Public License for more details.                          *
+ *                                                                            *
+ *  You should have received a copy of the GNU Library General Public         *
+ *  License along with this library; see the file COPYING.LIB.  If            *
+ *  not, write to the Free Software Foundation, Inc., 59 Temple Place         *
+ *  - Suite 330, Boston, MA 02111-1307, USA.                                  *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <magicserver/msrvtimer.h>
+
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+
+begin_namespace (MSrv);
+
+/* The timer identifier holds the index of the timer in the low bits */
+/* and a sequence number in the rest, so that a stale identifier of  */
+/* a reused timer does not match.                                    */
+#define TIMER_INDEX_BITS 24
+#define TIMER_INDEX_MASK ((1L << TIMER_INDEX_BITS) - 1)
+#define TIMER_SEQ_MASK   (LONG_MAX >> TIMER_INDEX_BITS)
+
+/* Is time a before time b? Works across wrap-around. */
+#define TIME_BEFORE(a,b) ((long) ((a) - (b)) < 0)
+
+/*******************************************************************************
+ * Creates an empty timer wheel.
+ ******************************************************************************/
+TimerWheel::TimerWheel ()
+{
+	mpTimers   = NULL;
+	mSize      = 0;
+	mFree      = -1;
+	mCount     = 0;
+	mSequence  = 0;
+	mCurrent   = now ();
+	mCascaded  = mCurrent - 1;
+
+	for (int i=0; i<SlotCount; ++i)
+		mSlots[i] = -1;
+	for (int i=0; i<Levels; ++i)
+		mLevelCounts[i] = 0;
+}
+
+/*******************************************************************************
+ * Destroys the wheel and any timers still set.
+ ******************************************************************************/
+TimerWheel::~TimerWheel ()
+{
+	free (mpTimers);
+}
+
+/*******************************************************************************
+ * Returns the current time of a monotonic clock, in milliseconds.
+ ******************************************************************************/
+unsigned long TimerWheel::now ()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*******************************************************************************
+ * Sets a timer.
+ *
+ * The timer expires after the given time. A periodic timer is set
+ * again each time it expires, until it is cancelled; a one-shot timer
+ * is removed when it expires.
+ *
+ * If an owner list is given, the timer is linked to it, so that it
+ * can be cancelled with @ref cancelAll(). The list must be
+ * initialized to -1 and must exist as long as it has timers.
+ *
+ * @return Identifier of the timer, or a negative error code.
+ ******************************************************************************/
+long TimerWheel::add (
+	long  msec,       /**< Time to the expiry in milliseconds.          */
+	long  periodMSec, /**< Period of a periodic timer; 0 for one-shot.  */
+	void* pData,      /**< Data returned with the expired timer.        */
+	int*  pOwner      /**< Owner list for the timer. May be NULL.       */)
+{
+	if (msec < 0 || periodMSec < 0)
+		return MSRVERR_INVALID_ARGUMENT;
+
+	mThreadLock.lock ();
+
+	/* Grow the array when all the timers are in use. */
+	if (mFree < 0) {
+		int newSize = mSize? mSize*2 : 64;
+		if (newSize > TIMER_INDEX_MASK + 1) {
+			mThreadLock.unlock ();
+			return MSRVERR_QUEUE_FULL;
+		}
+
+		Timer* pNewTimers = (Timer*) realloc (mpTimers, newSize * sizeof (Timer));
+		if (!pNewTimers) {
+			mThreadLock.unlock ();
+			return MSRVERR_OUT_OF_MEMORY;
+		}
+
+		for (int i=mSize; i<newSize; ++i) {
+			pNewTimers[i].mId   = -1;
+			pNewTimers[i].mNext = i+1 < newSize? i+1 : -1;
+		}
+
+		mpTimers = pNewTimers;
+		mFree    = mSize;
+		mSize    = newSize;
+	}
+
+	/* While no timers are set, the wheel is not turned, so catch up. */
+	if (mCount == 0)
+		mCurrent = now ();
+
+	int    index  = mFree;
+	Timer& rTimer = mpTimers[index];
+	mFree = rTimer.mNext;
+
+	mSequence = (mSequence + 1) & TIMER_SEQ_MASK;
+	rTimer.mId      = (mSequence << TIMER_INDEX_BITS) | index;
+	rTimer.mExpires = now () + msec;
+	rTimer.mPeriod  = periodMSec;
+	rTimer.mpData   = pData;
+
+	/* Link to the owner. */
+	rTimer.mpOwner   = pOwner;
+	rTimer.mOwnerPrev = -1;
+	rTimer.mOwnerNext = -1;
+	if (pOwner) {
+		rTimer.mOwnerNext = *pOwner;
+		if (*pOwner >= 0)
+			mpTimers[*pOwner].mOwnerPrev = index;
+		*pOwner = index;
+	}
+
+	insert (index);
+	mCount++;
+
+	long id = rTimer.mId;
+
+	mThreadLock.unlock ();
+
+	return id;
+}
+
+/*******************************************************************************
+ * Cancels a timer.
+ *
+ * @return 0 if successful, or MSRVERR_TIMER_NOT_FOUND if there is no
+ *         such timer, for example because a one-shot timer has
+ *         already expired.
+ ******************************************************************************/
+MSrvResult TimerWheel::cancel (long id)
+{
+	int index = id & TIMER_INDEX_MASK;
+
+	mThreadLock.lock ();
+
+	if (id < 0 || index >= mSize || mpTimers[index].mId != id) {
+		mThreadLock.unlock ();
+		return MSRVERR_TIMER_NOT_FOUND;
+	}
+
+	unlink (index);
+	release (index);
+
+	mThreadLock.unlock ();
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Cancels all the timers linked to an owner list.
+ ******************************************************************************/
+void TimerWheel::cancelAll (int& rOwner)
+{
+	mThreadLock.lock ();
+
+	while (rOwner >= 0) {
+		int index = rOwner;
+		unlink (index);
+		release (index); /* Unlinks from the owner. */
+	}
+
+	mThreadLock.unlock ();
+}
+
+/*******************************************************************************
+ * Turns the wheel up to the given time and returns the expired timers.
+ *
+ * At most maxExpired timers are returned by one call; if the array
+ * is filled, the call should be repeated. Periodic timers are set
+ * again for their next period; a periodic timer that has fallen more
+ * than a period behind skips the missed expiries.
+ *
+ * @return Number of expired timers stored in pExpired.
+ ******************************************************************************/
+int TimerWheel::expire (
+	unsigned long now,        /**< Current time, from @ref now().  */
+	TimerExpiry*  pExpired,   /**< Receives the expired timers.    */
+	int           maxExpired  /**< Capacity of pExpired.           */)
+{
+	int count = 0;
+
+	mThreadLock.lock ();
+
+	while (!TIME_BEFORE (now, mCurrent)) {
+		/* Nothing to turn. */
+		if (mCount == 0) {
+			mCurrent = now + 1;
+			break;
+		}
+
+		/* When the first level turns around, spread the next slot */
+		/* of the level above to it, and so on upwards.            */
+		int slot = mCurrent & (Level0Slots - 1);
+		if (slot == 0 && mCascaded != mCurrent) {
+			mCascaded = mCurrent;
+			for (int level=1; level<Levels; ++level) {
+				cascade (level);
+				if ((mCurrent >> (Level0Bits + (level-1)*LevelBits)) & (LevelSlots - 1))
+					break;
+			}
+		}
+
+		while (mSlots[slot] >= 0) {
+			if (count == maxExpired) {
+				mThreadLock.unlock ();
+				return count;
+			}
+
+			int    index  = mSlots[slot];
+			Timer& rTimer = mpTimers[index];
+
+			pExpired[count].mId    = rTimer.mId;
+			pExpired[count].mpData = rTimer.mpData;
+			count++;
+
+			unlink (index);
+			if (rTimer.mPeriod > 0) {
+				rTimer.mExpires += rTimer.mPeriod;
+				if (!TIME_BEFORE (now, rTimer.mExpires))
+					rTimer.mExpires = now + rTimer.mPeriod;
+				insert (index);
+			} else
+				release (index);
+		}
+
+		mCurrent++;
+
+		/* Skip to the next turn of the first level if it is empty. */
+		if (mLevelCounts[0] == 0 && (mCurrent & (Level0Slots - 1))) {
+			unsigned long turn = (mCurrent | (Level0Slots - 1)) + 1;
+			mCurrent = TIME_BEFORE (now, turn)? now + 1 : turn;
+		}
+	}
+
+	mThreadLock.unlock ();
+
+	return count;
+}
+
+/*******************************************************************************
+ * Returns the time until the wheel has work to do.
+ *
+ * This is the time to the next expiry on the first level, or to the
+ * next turn of the first level, whichever is earlier. The listener
+ * waits at most this long.
+ *
+ * @return Milliseconds, 0 if timers have expired already, or -1 if no
+ *         timers are set.
+ ******************************************************************************/
+long TimerWheel::nextTimeout (unsigned long now)
+{
+	mThreadLock.lock ();
+
+	if (mCount == 0) {
+		mThreadLock.unlock ();
+		return -1;
+	}
+
+	unsigned long next = mCurrent;
+	if ((mCurrent & (Level0Slots - 1)) || mCascaded == mCurrent) {
+		unsigned long turn = (mCurrent | (Level0Slots - 1)) + 1;
+		next = turn;
+		if (mLevelCounts[0] > 0)
+			for (unsigned long tick=mCurrent; tick!=turn; ++tick)
+				if (mSlots[tick & (Level0Slots - 1)] >= 0) {
+					next = tick;
+					break;
+				}
+	}
+
+	mThreadLock.unlock ();
+
+	return TIME_BEFORE (now, next)? (long) (next - now) : 0;
+}
+
+/*******************************************************************************
+ * \fn int TimerWheel::length () const
+ *
+ * Returns the number of timers set.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Puts a timer in the slot of its expiry time.
+ ******************************************************************************/
+void TimerWheel::insert (int index)
+{
+	Timer&        rTimer  = mpTimers[index];
+	unsigned long expires = rTimer.mExpires;
+	long          delta   = (long) (expires - mCurrent);
+
+	/* Expired timers go to the slot expired next. */
+	if (delta < 0) {
+		delta   = 0;
+		expires = mCurrent;
+	}
+
+	int level = 0;
+	int slot;
+	if (delta < Level0Slots)
+		slot = expires & (Level0Slots - 1);
+	else {
+		/* Find the lowest level that reaches the expiry time. */
+		level = 1;
+		while (level < Levels-1 &&
+			   delta >= 1L << (Level0Bits + level*LevelBits))
+			level++;
+
+		/* Beyond the reach of the wheel, wait in the farthest slot. */
+		long reach = 1L << (Level0Bits + (Levels-1)*LevelBits);
+		if (delta >= reach)
+			expires = mCurrent + reach - 1;
+
+		int shift = Level0Bits + (level-1)*LevelBits;
+		slot = Level0Slots + (level-1)*LevelSlots + ((expires >> shift) & (LevelSlots - 1));
+	}
+
+	rTimer.mSlot = slot;
+	rTimer.mPrev = -1;
+	rTimer.mNext = mSlots[slot];
+	if (mSlots[slot] >= 0)
+		mpTimers[mSlots[slot]].mPrev = index;
+	mSlots[slot] = index;
+
+	mLevelCounts[level]++;
+}
+
+/*******************************************************************************
+ * Takes a timer out of its slot.
+ ******************************************************************************/
+void TimerWheel::unlink (int index)
+{
+	Timer& rTimer = mpTimers[index];
+
+	if (rTimer.mPrev >= 0)
+		mpTimers[rTimer.mPrev].mNext = rTimer.mNext;
+	else
+		mSlots[rTimer.mSlot] = rTimer.mNext;
+	if (rTimer.mNext >= 0)
+		mpTimers[rTimer.mNext].mPrev = rTimer.mPrev;
+
+	int level = rTimer.mSlot < Level0Slots? 0 : 1 + (rTimer.mSlot - Level0Slots) / LevelSlots;
+	mLevelCounts[level]--;
+}
+
+/*******************************************************************************
+ * Unlinks a timer from its owner and frees it. The timer must have
+ * been taken out of its slot.
+ ******************************************************************************/
+void TimerWheel::release (int index)
+{
+	Timer& rTimer = mpTimers[index];
+
+	if (rTimer.mpOwner) {
+		if (rTimer.mOwnerPrev >= 0)
+			mpTimers[rTimer.mOwnerPrev].mOwnerNext = rTimer.mOwnerNext;
+		else
+			*rTimer.mpOwner = rTimer.mOwnerNext;
+		if (rTimer.mOwnerNext >= 0)
+			mpTimers[rTimer.mOwnerNext].mOwnerPrev = rTimer.mOwnerPrev;
+	}
+
+	rTimer.mId   = -1;
+	rTimer.mNext = mFree;
+	mFree        = index;
+	mCount--;
+}
+
+/*******************************************************************************
+ * Spreads the timers in the current slot of a level to the levels
+ * below it.
+ ******************************************************************************/
+void TimerWheel::cascade (int level)
+{
+	int shift = Level0Bits + (level-1)*LevelBits;
+	int slot  = Level0Slots + (level-1)*LevelSlots + ((mCurrent >> shift) & (LevelSlots - 1));
+
+	int index = mSlots[slot];
+	mSlots[slot] = -1;
+
+	while (index >= 0) {
+		int next = mpTimers[index].mNext;
+		mLevelCounts[level]--;
+		insert (index);
+		index = next;
+	}
+}
+
+end_namespace (MSrv);
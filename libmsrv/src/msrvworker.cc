@@ -29,20 +29,33 @@ begin_namespace (MSrv);
 
 /*******************************************************************************
  * Creates a worker pool of given size.
+ *
+ * The queue is one of @ref queue_type and the scheduling one of @ref
+ * scheduling_type.
  ******************************************************************************/
-WorkerPool::WorkerPool (RequestHandler& rHandler, Log& log, int size)
-		: mrLog (log)
+WorkerPool::WorkerPool (RequestHandler& rHandler, Log& log, int size, int queue,
+						int scheduling)
+		: mrLog (log), mrMetrics (ServerMetrics::global ())
 {
 	mrpHandler       = &rHandler;
 	mIsShutdown      = false;
 	mWorkerCount     = size;
 	mpWorkers        = new Worker* [size];
+	mpBoundedQueue   = NULL;
+	mScheduling      = scheduling;
+	mNextWorker      = 0;
+	mOrdered         = false;
+
+	if (queue == LockFreeQueue && !isStealing ())
+		mpBoundedQueue = new BoundedQueue<Request> (MSRV_WORKER_QUEUE_LEN);
 
-	/* Create the workers. */
-	for (int i=0; i<mWorkerCount; ++i) {
-		mpWorkers[i] = new Worker (this);
+	/* Create all the workers before starting any, as a started */
+	/* worker may try to steal from the others.                  */
+	for (int i=0; i<mWorkerCount; ++i)
+		mpWorkers[i] = new Worker (this, i);
+
+	for (int i=0; i<mWorkerCount; ++i)
 		mpWorkers[i]->start ();
-	}
 
 	mrLog.message ("WORKER", Log::Info, 0,
 				   "Started %d worker threads successfully.",
@@ -71,6 +84,15 @@ WorkerPool::~WorkerPool ()
 		delete mpWorkers[i];
 	
 	delete mpWorkers;
+	delete mpBoundedQueue;
+}
+
+/*******************************************************************************
+ * Lets the handler of the workers configure the listener.
+ ******************************************************************************/
+MSrvResult WorkerPool::init (ServerListener& rListener)
+{
+	return mrpHandler->init (rListener);
 }
 
 /*******************************************************************************
@@ -84,16 +106,258 @@ MSrvResult WorkerPool::process (Request* pRequest)
 		  break;
 
 	  default:
+		pRequest->setQueueTime (Metric::now ());
+
+		/* Hold back the request if its connection is busy. */
+		if (mOrdered && !admitRequest (pRequest))
+			break;
+
+		if (isStealing ()) {
+			/* Give the request to a worker; it awakens the worker itself. */
+			dispatchRequest (pRequest);
+			break;
+		}
+
 		/* Put the request in queue. */
-		mRequestQueue.push (pRequest);
+		pushRequest (pRequest);
 		
-		/* Awaken one worker. */
-		getWaitLock().signal ();
+		/* Let one worker through to take it. */
+		mQueueSemaphore.post ();
 	}
 	
 	return 0;
 }
 
+/*******************************************************************************
+ * Puts a request in the request queue.
+ *
+ * If the lock-free queue is full, the request goes to the locked
+ * queue, which the workers empty after the lock-free one. The
+ * listener never waits for the workers, as it may hold locks that
+ * they need.
+ ******************************************************************************/
+void WorkerPool::pushRequest (Request* pRequest)
+{
+	mrMetrics.queued ();
+
+	if (!mpBoundedQueue || mpBoundedQueue->push (pRequest) == MSRVERR_QUEUE_FULL)
+		mRequestQueue.push (pRequest);
+}
+
+/*******************************************************************************
+ * Puts a request in the queue of one worker when work-stealing.
+ *
+ * The worker is chosen by the scheduling policy. If its queue is
+ * full, the request goes to the next worker with room, and if all
+ * the queues are full, to the overflow queue that the workers empty
+ * after their own. The chosen worker is awakened, and if it is busy, also an idle worker is
+ * awakened so that it can steal the request.
+ ******************************************************************************/
+void WorkerPool::dispatchRequest (Request* pRequest)
+{
+	mrMetrics.queued ();
+
+	int first;
+	if (mScheduling == StealByConnection)
+		first = (uint) pRequest->socket () % mWorkerCount;
+	else
+		first = __atomic_fetch_add (&mNextWorker, 1, __ATOMIC_RELAXED) % mWorkerCount;
+
+	/* Find a worker with room in its queue. */
+	int target = first;
+	while (mpWorkers[target]->mpQueue->push (pRequest) == MSRVERR_QUEUE_FULL) {
+		target = (target + 1) % mWorkerCount;
+
+		/* All queues full; never wait for the workers here, as */
+		/* the listener may hold locks that they need.          */
+		if (target == first) {
+			mRequestQueue.push (pRequest);
+			break;
+		}
+	}
+
+	mpWorkers[target]->mSemaphore.post ();
+
+	/* A busy worker gets to its queue late; have an idle one steal. */
+	if (!__atomic_load_n (&mpWorkers[target]->mIdle, __ATOMIC_ACQUIRE))
+		for (int i=1; i<mWorkerCount; ++i) {
+			Worker* pWorker = mpWorkers[(target + i) % mWorkerCount];
+			if (__atomic_load_n (&pWorker->mIdle, __ATOMIC_ACQUIRE)) {
+				pWorker->mSemaphore.post ();
+				break;
+			}
+		}
+}
+
+/*******************************************************************************
+ * Takes the next request for a worker to process.
+ *
+ * When work-stealing, the worker takes from its own queue first,
+ * then steals from its peers, starting from the next worker, and
+ * last takes from the overflow queue.
+ *
+ * @return The request, or NULL if there is nothing to process.
+ ******************************************************************************/
+Request* WorkerPool::pullRequest (Worker& rWorker)
+{
+	Request* pRequest;
+
+	if (isStealing ()) {
+		pRequest = rWorker.mpQueue->pull ();
+
+		for (int i=1; !pRequest && i<mWorkerCount; ++i)
+			pRequest = mpWorkers[(rWorker.mIndex + i) % mWorkerCount]->mpQueue->pull ();
+
+		if (!pRequest)
+			pRequest = mRequestQueue.pull ();
+
+	} else {
+		pRequest = mpBoundedQueue? mpBoundedQueue->pull () : NULL;
+
+		/* Requests that did not fit in the lock-free queue. */
+		if (!pRequest)
+			pRequest = mRequestQueue.pull ();
+	}
+
+	if (pRequest)
+		mrMetrics.dequeued ();
+
+	return pRequest;
+}
+
+/*******************************************************************************
+ * Processes a request in a worker thread.
+ *
+ * In ordered mode, goes on to process the requests of the same
+ * connection that arrived meanwhile, until there are none left. The
+ * wait of a held-back request includes the time it was held back.
+ ******************************************************************************/
+void WorkerPool::execute (Request* pRequest)
+{
+	while (pRequest) {
+		ConnectionRequest* pConnRequest = NULL;
+		if (mOrdered)
+			pConnRequest = dynamic_cast <ConnectionRequest*> (pRequest);
+
+		/* Take these before the handler destroys the request. */
+		Connection* pConn = pConnRequest? &pConnRequest->connection () : NULL;
+		bool        lost  = pRequest->getType () == Request::ConnectionLost;
+		long        start = Metric::now ();
+
+		mrMetrics.waited (start - pRequest->queueTime ());
+
+		/* Invoke the request handler to handle the request. */
+		handler ().process (pRequest);
+
+		mrMetrics.handled (Metric::now () - start);
+
+		/* A lost connection was destroyed with its request. */
+		if (!pConn || lost)
+			break;
+
+		pRequest = nextOrdered (*pConn);
+	}
+}
+
+/*******************************************************************************
+ * Lets a connection request through to the workers in ordered mode.
+ *
+ * If an earlier request of the connection is being processed, the
+ * request is put in the queue of the connection instead.
+ *
+ * @return true if the request may be queued for the workers, false
+ *         if it was held back.
+ ******************************************************************************/
+bool WorkerPool::admitRequest (Request* pRequest)
+{
+	ConnectionRequest* pConnRequest = dynamic_cast <ConnectionRequest*> (pRequest);
+	if (!pConnRequest)
+		return true;
+
+	Connection& rConn = pConnRequest->connection ();
+
+	rConn.mOrderLock.lock ();
+
+	bool admit = !rConn.mOrderBusy;
+	if (admit)
+		rConn.mOrderBusy = true;
+	else
+		rConn.mOrderQueue.push (pRequest);
+
+	rConn.mOrderLock.unlock ();
+
+	return admit;
+}
+
+/*******************************************************************************
+ * Takes the next held-back request of a connection in ordered mode.
+ *
+ * If there is none, the connection is marked idle, so that its next
+ * request goes to the workers.
+ *
+ * @return The request, or NULL if there is none.
+ ******************************************************************************/
+Request* WorkerPool::nextOrdered (Connection& rConn)
+{
+	rConn.mOrderLock.lock ();
+
+	Request* pRequest = rConn.mOrderQueue.pull ();
+	if (!pRequest)
+		rConn.mOrderBusy = false;
+
+	rConn.mOrderLock.unlock ();
+
+	return pRequest;
+}
+
+/*******************************************************************************
+ * Returns the semaphore a worker waits on for new requests.
+ *
+ * The shared semaphore is posted once for each queued request, and a
+ * worker semaphore once for each request given to the worker.
+ ******************************************************************************/
+Semaphore& WorkerPool::semaphore (Worker& rWorker)
+{
+	if (isStealing ())
+		return rWorker.mSemaphore;
+
+	return mQueueSemaphore;
+}
+
+/*******************************************************************************
+ * \fn int WorkerPool::workerCount () const
+ *
+ * Returns the number of workers in the pool.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * Tells if a worker is waiting for requests, as opposed to processing
+ * them.
+ ******************************************************************************/
+bool WorkerPool::isWorkerIdle (int worker) const
+{
+	return __atomic_load_n (&mpWorkers[worker]->mIdle, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+ * Returns the number of requests queued for the workers.
+ *
+ * Requests held back in ordered mode are not counted. Taken without
+ * locking, the length is only a hint while requests come and go.
+ ******************************************************************************/
+int WorkerPool::queueLength () const
+{
+	int length = mRequestQueue.length ();
+
+	if (isStealing ())
+		for (int i=0; i<mWorkerCount; ++i)
+			length += mpWorkers[i]->mpQueue->length ();
+	else if (mpBoundedQueue)
+		length += mpBoundedQueue->length ();
+
+	return length;
+}
+
 /*******************************************************************************
  * Orders all worker threads to shut down.
  *
@@ -107,16 +371,18 @@ MSrvResult WorkerPool::shutdown (Request* pRequest /**< Final request. May be NU
 		return MSRVERR_REPEAT_SHUTDOWN_REQUEST;
 	
 	/* Go to shutdown state. */
-	mIsShutdown = true;
+	__atomic_store_n (&mIsShutdown, true, __ATOMIC_RELEASE);
 
 	mrLog.message ("WORKER", Log::Info, 0,
 				   "Shutting down worker threads...");
 
 	/* Awaken all workers. */
-	getWaitLock().broadcast ();
+	mQueueSemaphore.post (mWorkerCount);
+	for (int i=0; i<mWorkerCount; ++i)
+		mpWorkers[i]->mSemaphore.post ();
 
-	/* Join all the workers except one. */
-	for (int i=1; i<mWorkerCount; ++i)
+	/* Join all the workers. */
+	for (int i=0; i<mWorkerCount; ++i)
 		mpWorkers[i]->join (NULL);
 
 	mrLog.message ("WORKER", Log::Info, 0,
@@ -142,9 +408,25 @@ MSrvResult WorkerPool::shutdown (Request* pRequest /**< Final request. May be NU
  *
  * The worker thread must be started with @ref start().
  ******************************************************************************/
-Worker::Worker (WorkerPool* pPool)
+Worker::Worker (
+	WorkerPool* pPool,  /**< Owner pool.                      */
+	int         index   /**< Index of the worker in the pool. */)
+{
+	mpPool  = pPool;
+	mIndex  = index;
+	mpQueue = NULL;
+	mIdle   = false;
+
+	if (pPool->isStealing ())
+		mpQueue = new BoundedQueue<Request> (MSRV_WORKER_QUEUE_LEN);
+}
+
+/*******************************************************************************
+ * Destroys the worker and any requests left in its queue.
+ ******************************************************************************/
+Worker::~Worker ()
 {
-	mpPool = pPool;
+	delete mpQueue;
 }
 
 /*******************************************************************************
@@ -156,18 +438,18 @@ Worker::Worker (WorkerPool* pPool)
 void* Worker::execute ()
 {
 	while (1) {
-		if (mpPool->isShutdown ())
-			break;
-
-		/* Wait for a signal from the worker pool, indicating either */
-		/* that there is a new request to process, or the server is  */
-		/* shutting down.                                            */
-		mpPool->getWaitLock ().wait ();
+		/* Wait for the worker pool to post, indicating either that  */
+		/* there is a new request to process, or the server is       */
+		/* shutting down. A post made while we were busy is not lost; */
+		/* the wait then passes at once.                             */
+		__atomic_store_n (&mIdle, true, __ATOMIC_RELEASE);
+		mpPool->semaphore (*this).wait ();
+		__atomic_store_n (&mIdle, false, __ATOMIC_RELEASE);
 
 		/* Process requests until queue is empty.                   */
 
 		/* Pull the topmost request from the request queue. */
-		while (Request* pRequest = mpPool->queue ().pull ()) {
+		while (Request* pRequest = mpPool->pullRequest (*this)) {
 			/* NOTICE that as the shutdown flag is not checked here,    */
 			/* we WILL empty the queue before letting server shut down. */
 			/* I guess we could have an "immediate" flag to leave       */
@@ -175,8 +457,11 @@ void* Worker::execute ()
 
 			/* Invoke the request handler to handle the request. */
 			if (pRequest)
-				mpPool->handler ().process (pRequest);
+				mpPool->execute (pRequest);
 		}
+
+		if (mpPool->isShutdown ())
+			break;
 	}
 
 	return NULL;
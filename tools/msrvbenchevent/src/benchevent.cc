@@ -0,0 +1,367 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvserver.h>
+#include <magicserver/msrvrequest.h>
+#include <magicserver/msrvthread.h>
+#include <magicserver/msrvlog.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace MSrv;
+
+/** System calls made so far by the calling thread through the wrappers below. */
+static __thread long sSystemCalls = 0;
+
+/*******************************************************************************
+ * Defines a wrapper of a libc function that counts the call in
+ * sSystemCalls and then calls the function of libc.
+ *
+ * The library is linked statically into this program, so its calls
+ * come here. Calls that libc makes internally, such as those of
+ * contended mutexes, are not counted.
+ ******************************************************************************/
+#define COUNTED_CALL(type, name, params, args, throws)							\
+	extern "C" type name params throws											\
+	{																			\
+		static type (*spReal) params =											\
+			(type (*) params) dlsym (RTLD_NEXT, #name);							\
+		sSystemCalls++;															\
+		return spReal args;														\
+	}
+
+COUNTED_CALL (int, accept, (int fd, struct sockaddr* pAddr, socklen_t* pLen),
+			  (fd, pAddr, pLen), )
+COUNTED_CALL (int, close, (int fd), (fd), )
+COUNTED_CALL (ssize_t, read, (int fd, void* pBuffer, size_t len), (fd, pBuffer, len), )
+COUNTED_CALL (ssize_t, write, (int fd, const void* pBuffer, size_t len), (fd, pBuffer, len), )
+COUNTED_CALL (ssize_t, send, (int fd, const void* pBuffer, size_t len, int flags),
+			  (fd, pBuffer, len, flags), )
+COUNTED_CALL (ssize_t, sendmsg, (int fd, const struct msghdr* pMessage, int flags),
+			  (fd, pMessage, flags), )
+COUNTED_CALL (ssize_t, sendto, (int fd, const void* pBuffer, size_t len, int flags,
+								const struct sockaddr* pAddr, socklen_t addrLen),
+			  (fd, pBuffer, len, flags, pAddr, addrLen), )
+COUNTED_CALL (int, sendmmsg, (int fd, struct mmsghdr* pMessages, unsigned int count, int flags),
+			  (fd, pMessages, count, flags), )
+COUNTED_CALL (ssize_t, recvfrom, (int fd, void* pBuffer, size_t len, int flags,
+								  struct sockaddr* pAddr, socklen_t* pLen),
+			  (fd, pBuffer, len, flags, pAddr, pLen), )
+COUNTED_CALL (int, recvmmsg, (int fd, struct mmsghdr* pMessages, unsigned int count,
+							  int flags, struct timespec* pTimeout),
+			  (fd, pMessages, count, flags, pTimeout), )
+COUNTED_CALL (int, shutdown, (int fd, int how), (fd, how), __THROW)
+COUNTED_CALL (int, setsockopt, (int fd, int level, int name, const void* pValue,
+								socklen_t len),
+			  (fd, level, name, pValue, len), __THROW)
+COUNTED_CALL (int, epoll_wait, (int fd, struct epoll_event* pEvents, int count, int timeout),
+			  (fd, pEvents, count, timeout), )
+COUNTED_CALL (int, epoll_ctl, (int fd, int op, int target, struct epoll_event* pEvent),
+			  (fd, op, target, pEvent), __THROW)
+
+/*******************************************************************************
+ * Counts an ioctl() call, which has one argument after the request in
+ * all the uses of the library.
+ ******************************************************************************/
+extern "C" int ioctl (int fd, unsigned long request, ...) __THROW
+{
+	static int (*spReal) (int, unsigned long, ...) =
+		(int (*) (int, unsigned long, ...)) dlsym (RTLD_NEXT, "ioctl");
+
+	va_list args;
+	va_start (args, request);
+	void* pArg = va_arg (args, void*);
+	va_end (args);
+
+	sSystemCalls++;
+	return spReal (fd, request, pArg);
+}
+
+/*******************************************************************************
+ * Counts a syscall() call, which the library uses for io_uring_enter()
+ * and the futexes of its locks. Passes on the six arguments that a
+ * system call can have.
+ ******************************************************************************/
+extern "C" long syscall (long number, ...) __THROW
+{
+	static long (*spReal) (long, ...) = (long (*) (long, ...)) dlsym (RTLD_NEXT, "syscall");
+
+	long    arg[6];
+	va_list args;
+	va_start (args, number);
+	for (int i = 0; i < 6; i++)
+		arg[i] = va_arg (args, long);
+	va_end (args);
+
+	sSystemCalls++;
+	return spReal (number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
+
+/*******************************************************************************
+ * Handler that sends back whatever a connection sends.
+ ******************************************************************************/
+class EchoHandler : public RequestHandler {
+  public:
+	virtual MSrvResult	process		(StreamDataRequest& rRequest);
+};
+
+/*******************************************************************************
+ * Sends the data back to the connection.
+ ******************************************************************************/
+MSrvResult EchoHandler::process (StreamDataRequest& rRequest)
+{
+	rRequest.connection().send (rRequest.getData (), rRequest.dataLen ());
+	return 0;
+}
+
+/*******************************************************************************
+ * Client sending messages over one connection, one at a time, and
+ * waiting for the echo of each.
+ ******************************************************************************/
+class EchoClient : public Thread {
+  public:
+					EchoClient	(int port, int size, volatile bool* pStop);
+
+	virtual void*	execute		();
+	long			roundTrips	() const {return mRoundTrips;}
+
+  private:
+	int				mPort;        /**< Port of the server.              */
+	int				mSize;        /**< Length of a message.             */
+	volatile bool*	mpStop;       /**< Set when the clients should stop. */
+	long			mRoundTrips;  /**< Messages echoed so far.          */
+};
+
+/*******************************************************************************
+ * Creates a client of the server at the given port.
+ ******************************************************************************/
+EchoClient::EchoClient (int port, int size, volatile bool* pStop)
+{
+	mPort       = port;
+	mSize       = size;
+	mpStop      = pStop;
+	mRoundTrips = 0;
+}
+
+/*******************************************************************************
+ * Connects and sends messages until stopped.
+ ******************************************************************************/
+void* EchoClient::execute ()
+{
+	int sock = socket (AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return NULL;
+
+	int on = 1;
+	setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+
+	struct sockaddr_in addr;
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons (mPort);
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (connect (sock, (struct sockaddr*) &addr, sizeof (addr)) < 0) {
+		::close (sock);
+		return NULL;
+	}
+
+	char* pMessage = (char*) malloc (mSize);
+	char* pEcho    = (char*) malloc (mSize);
+	memset (pMessage, 'x', mSize);
+	pMessage[mSize - 1] = '\n';
+
+	while (!*mpStop) {
+		if (write (sock, pMessage, mSize) != mSize)
+			break;
+
+		/* The echo may come back in pieces. */
+		int got = 0;
+		while (got < mSize) {
+			int len = read (sock, pEcho + got, mSize - got);
+			if (len <= 0)
+				break;
+			got += len;
+		}
+		if (got < mSize)
+			break;
+
+		mRoundTrips++;
+	}
+
+	free (pMessage);
+	free (pEcho);
+	::close (sock);
+	return NULL;
+}
+
+/*******************************************************************************
+ * Thread that shuts the listener down after the measured time.
+ ******************************************************************************/
+class StopTimer : public Thread {
+  public:
+					StopTimer	(Listener& rListener, int seconds, volatile bool* pStop)
+							: mrListener (rListener), mSeconds (seconds), mpStop (pStop) {;}
+
+	virtual void*	execute		();
+
+  private:
+	Listener&		mrListener;  /**< Listener to shut down.             */
+	int				mSeconds;    /**< Time to run the clients.           */
+	volatile bool*	mpStop;      /**< Set when the clients should stop. */
+};
+
+/*******************************************************************************
+ * Sleeps the measured time, then stops the clients and the listener.
+ ******************************************************************************/
+void* StopTimer::execute ()
+{
+	sleep (mSeconds);
+	*mpStop = true;
+	mrListener.startShutdown ();
+	return NULL;
+}
+
+/*******************************************************************************
+ * Returns the CPU time in microseconds.
+ ******************************************************************************/
+static double microseconds (const struct timeval& rTime)
+{
+	return rTime.tv_sec * 1e6 + rTime.tv_usec;
+}
+
+/*******************************************************************************
+ * Runs the echo server with one event backend, with the given number
+ * of clients, and prints the throughput and the cost per request of
+ * the listener thread.
+ ******************************************************************************/
+static int runBackend (int backend, int port, int clients, int size, int seconds)
+{
+	DummyLog       log;
+	EchoHandler    handler;
+	ServerListener listener (handler, &log, backend);
+	listener.setTimeout (0, 100000);
+
+	if (listener.bind (port, ServerListener::TCP, 0) < 0) {
+		fprintf (stderr, "Binding port %d failed.\n", port);
+		return 1;
+	}
+
+	volatile bool stop     = false;
+	EchoClient**  pClients = new EchoClient* [clients];
+	for (int i = 0; i < clients; i++) {
+		pClients[i] = new EchoClient (port, size, &stop);
+		pClients[i]->start ();
+	}
+
+	StopTimer timer (listener, seconds, &stop);
+	timer.start ();
+
+	/* The listener runs in this thread, so its usage can be measured. */
+	struct rusage before, after;
+	getrusage (RUSAGE_THREAD, &before);
+	long calls = sSystemCalls;
+	listener.listen ();
+	calls = sSystemCalls - calls;
+	getrusage (RUSAGE_THREAD, &after);
+
+	timer.join (NULL);
+
+	long requests = 0;
+	for (int i = 0; i < clients; i++) {
+		pClients[i]->join (NULL);
+		requests += pClients[i]->roundTrips ();
+		delete pClients[i];
+	}
+	delete [] pClients;
+
+	if (requests == 0) {
+		fprintf (stderr, "%s: no requests were served.\n", listener.backendName ());
+		return 1;
+	}
+
+	double user     = microseconds (after.ru_utime) - microseconds (before.ru_utime);
+	double system   = microseconds (after.ru_stime) - microseconds (before.ru_stime);
+	long   switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+
+	printf ("%-8s %12.0f %12.2f %12.2f %12.3f %12.3f\n",
+			listener.backendName (),
+			(double) requests / seconds,
+			user / requests,
+			system / requests,
+			(double) calls / requests,
+			(double) switches / requests);
+	return 0;
+}
+
+/*******************************************************************************
+ * Compares the throughput of the epoll and io_uring backends of
+ * ServerListener with an echo server on the loopback interface.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	int  port    = 7300;
+	int  clients = 16;
+	int  size    = 64;
+	int  seconds = 5;
+	bool usage   = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && !strcmp (argv[arg], "-p"))
+			port = atoi (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-c"))
+			clients = atoi (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-s"))
+			size = atoi (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-t"))
+			seconds = atoi (argv[++arg]);
+		else
+			usage = true;
+	}
+
+	if (usage || port <= 0 || clients <= 0 || size <= 0 || seconds <= 0) {
+		fprintf (stderr, "Usage: %s [-p port] [-c clients] [-s size] [-t seconds]\n"
+				 "  -p  Port of the echo server (7300).\n"
+				 "  -c  Number of client connections (16).\n"
+				 "  -s  Length of a message in bytes (64).\n"
+				 "  -t  Seconds to run each backend (5).\n"
+				 "The CPU time, the system calls and the context switches\n"
+				 "are those of the listener thread. The system calls are\n"
+				 "counted by wrapping the libc functions that the library\n"
+				 "calls.\n", argv[0]);
+		return 1;
+	}
+
+	printf ("%-8s %12s %12s %12s %12s %12s\n", "backend", "requests/s",
+			"user us/req", "sys us/req", "syscalls/req", "cswitch/req");
+
+	int result = runBackend (EventBackend::Epoll, port, clients, size, seconds);
+	if (result == 0)
+		result = runBackend (EventBackend::Uring, port, clients, size, seconds);
+
+	return result;
+}
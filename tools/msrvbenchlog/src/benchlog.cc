@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvlog.h>
+#include <magicserver/msrvasynclog.h>
+#include <magicserver/msrvbinlog.h>
+#include <magicserver/msrvmetrics.h>
+#include <magicserver/msrvthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+using namespace MSrv;
+
+/*******************************************************************************
+ * Thread writing messages to a log and recording how long each call
+ * of message() takes.
+ ******************************************************************************/
+class Producer : public Thread {
+  public:
+					Producer	(Log& rLog, Histogram& rLatency, int messages, bool* pGo)
+							: mrLog (rLog), mrLatency (rLatency), mMessages (messages), mpGo (pGo) {;}
+
+	virtual void*	execute		();
+
+  private:
+	Log&			mrLog;      /**< Log being measured.                 */
+	Histogram&		mrLatency;  /**< Receives the latencies in ns.       */
+	int				mMessages;  /**< Messages to write.                  */
+	bool*			mpGo;       /**< Set when all the threads may start. */
+};
+
+/*******************************************************************************
+ * Writes the messages, like those of lost connections.
+ ******************************************************************************/
+void* Producer::execute ()
+{
+	while (!__atomic_load_n (mpGo, __ATOMIC_ACQUIRE))
+		sched_yield ();
+
+	for (int i = 0; i < mMessages; i++) {
+		long start = Metric::now ();
+		mrLog.message ("BENCH", Log::Warning, i,
+					   "Connection from 10.0.%d.%d port %d lost after %ld bytes.",
+					   (i >> 8) & 0xff, i & 0xff, 1024 + i % 60000, (long) i * 1500);
+		mrLatency.record (Metric::now () - start);
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+ * Writes messages to the log from the given number of threads and
+ * prints the latency of message().
+ ******************************************************************************/
+static void measure (const char* name, Log& rLog, int threads, int messages)
+{
+	Histogram  latency;
+	bool       go = false;
+	Producer** pProducers = new Producer* [threads];
+
+	for (int i = 0; i < threads; i++) {
+		pProducers[i] = new Producer (rLog, latency, messages, &go);
+		pProducers[i]->start ();
+	}
+
+	long start = Metric::now ();
+	__atomic_store_n (&go, true, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < threads; i++) {
+		pProducers[i]->join (NULL);
+		delete pProducers[i];
+	}
+	long elapsed = Metric::now () - start;
+	delete [] pProducers;
+
+	static const double percents[] = {50.0, 90.0, 99.0, 99.9};
+	long                values[4];
+	latency.percentiles (percents, values, 4);
+
+	printf ("%-8s %8ld %8ld %8ld %8ld %8ld %8ld %10.0f %8ld\n", name,
+			latency.sum () / latency.count (), values[0], values[1], values[2],
+			values[3], latency.max (),
+			latency.count () * 1e9 / elapsed, rLog.drops ());
+}
+
+/*******************************************************************************
+ * Measures the latency of Log::message() with LogFile, AsyncLog and
+ * BinaryLog, written to concurrently by 16 threads.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	const char* dir      = "/tmp";
+	int         threads  = 16;
+	int         messages = 20000;
+	bool        blocking = false;
+	bool        usage    = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && !strcmp (argv[arg], "-d"))
+			dir = argv[++arg];
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-c"))
+			threads = atoi (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-n"))
+			messages = atoi (argv[++arg]);
+		else if (!strcmp (argv[arg], "-block"))
+			blocking = true;
+		else
+			usage = true;
+	}
+
+	if (usage || threads <= 0 || messages <= 0) {
+		fprintf (stderr, "Usage: %s [-d dir] [-c threads] [-n messages] [-block]\n"
+				 "  -d      Directory of the log files (/tmp).\n"
+				 "  -c      Number of threads writing messages (16).\n"
+				 "  -n      Messages written by each thread (20000).\n"
+				 "  -block  AsyncLog waits for room instead of dropping.\n"
+				 "The latencies are in nanoseconds and include reading the\n"
+				 "clock twice.\n", argv[0]);
+		return 1;
+	}
+
+	char textFile[1024], asyncFile[1024], binaryFile[1024];
+	snprintf (textFile,   sizeof (textFile),   "%s/msrvbenchlog.log", dir);
+	snprintf (asyncFile,  sizeof (asyncFile),  "%s/msrvbenchlog-async.log", dir);
+	snprintf (binaryFile, sizeof (binaryFile), "%s/msrvbenchlog.bin", dir);
+
+	printf ("%d threads, %d messages each\n", threads, messages);
+	printf ("%-8s %8s %8s %8s %8s %8s %8s %10s %8s\n", "log",
+			"mean", "p50", "p90", "p99", "p99.9", "max", "msgs/s", "drops");
+
+	{
+		LogFile log (textFile);
+		measure ("LogFile", log, threads, messages);
+	}
+	{
+		AsyncLog log (asyncFile);
+		log.setBlocking (blocking);
+		measure ("AsyncLog", log, threads, messages);
+		log.flush ();
+	}
+	{
+		BinaryLog log (binaryFile);
+		measure ("BinLog", log, threads, messages);
+		log.flush ();
+	}
+
+	unlink (textFile);
+	unlink (asyncFile);
+	unlink (binaryFile);
+	return 0;
+}
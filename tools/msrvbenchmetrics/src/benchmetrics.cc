@@ -0,0 +1,203 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvmetrics.h>
+#include <magicserver/msrvthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+using namespace MSrv;
+
+/** Operation measured by a run. */
+enum operation {SharedAdd,    /**< One counter shared with atomic adds. */
+				CounterAdd,   /**< Counter::add().                      */
+				GaugeAddSub,  /**< Gauge::add() and Gauge::sub().       */
+				HistRecord,   /**< Histogram::record().                 */
+				ClockRead,    /**< Metric::now().                       */
+				Operations};
+
+static const char* sOperationNames[Operations] = {
+	"atomic add (unsharded)",
+	"Counter::add",
+	"Gauge::add + sub",
+	"Histogram::record",
+	"Metric::now"
+};
+
+/*******************************************************************************
+ * Metrics updated by the threads of a run.
+ ******************************************************************************/
+struct Run {
+	int			mOperation;  /**< One of @ref operation.                     */
+	long		mCount;      /**< Operations done by each thread.            */
+	bool		mGo;         /**< Set when all the threads may start.        */
+	long		mShared;     /**< Counter shared by all threads.             */
+	Counter		mCounter;    /**< Sharded counter.                           */
+	Gauge		mGauge;      /**< Sharded gauge.                             */
+	Histogram	mHistogram;  /**< Latency histogram.                         */
+	long		mElapsed;    /**< Sum of the CPU times of the threads in ns. */
+	long		mSink;       /**< Keeps the clock reads from being dropped.  */
+};
+
+/*******************************************************************************
+ * Returns the CPU time of the calling thread in nanoseconds, so that
+ * time spent waiting for a processor is not counted.
+ ******************************************************************************/
+static long threadTime ()
+{
+	struct timespec time;
+	clock_gettime (CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+/*******************************************************************************
+ * Thread updating a metric in a loop.
+ ******************************************************************************/
+class Updater : public Thread {
+  public:
+					Updater		(Run& rRun) : mrRun (rRun) {;}
+
+	virtual void*	execute		();
+
+  private:
+	Run&			mrRun;   /**< State of the run. */
+};
+
+/*******************************************************************************
+ * Does the operations of the run and adds the time they took.
+ ******************************************************************************/
+void* Updater::execute ()
+{
+	while (!__atomic_load_n (&mrRun.mGo, __ATOMIC_ACQUIRE))
+		sched_yield ();
+
+	long count = mrRun.mCount;
+	long sink  = 0;
+	long start = threadTime ();
+
+	switch (mrRun.mOperation) {
+	  case SharedAdd:
+		for (long i = 0; i < count; i++)
+			__atomic_add_fetch (&mrRun.mShared, 1, __ATOMIC_RELAXED);
+		break;
+	  case CounterAdd:
+		for (long i = 0; i < count; i++)
+			mrRun.mCounter.add ();
+		break;
+	  case GaugeAddSub:
+		for (long i = 0; i < count; i++) {
+			mrRun.mGauge.add ();
+			mrRun.mGauge.sub ();
+		}
+		break;
+	  case HistRecord:
+		for (long i = 0; i < count; i++)
+			mrRun.mHistogram.record ((i * 2654435761L) & 0xfffff);
+		break;
+	  case ClockRead:
+		for (long i = 0; i < count; i++)
+			sink += Metric::now ();
+		break;
+	}
+
+	__atomic_add_fetch (&mrRun.mElapsed, threadTime () - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&mrRun.mSink, sink, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*******************************************************************************
+ * Runs the operation in the given number of threads.
+ *
+ * @return CPU nanoseconds per operation.
+ ******************************************************************************/
+static double measure (int operation, int threads, long count)
+{
+	Run run;
+	run.mOperation = operation;
+	run.mCount     = count;
+	run.mGo        = false;
+	run.mShared    = 0;
+	run.mElapsed   = 0;
+	run.mSink      = 0;
+
+	Updater** pUpdaters = new Updater* [threads];
+	for (int i = 0; i < threads; i++) {
+		pUpdaters[i] = new Updater (run);
+		pUpdaters[i]->start ();
+	}
+
+	__atomic_store_n (&run.mGo, true, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < threads; i++) {
+		pUpdaters[i]->join (NULL);
+		delete pUpdaters[i];
+	}
+	delete [] pUpdaters;
+
+	/* Check that no update was lost. */
+	long expected = count * threads;
+	if ((operation == SharedAdd && run.mShared != expected) ||
+		(operation == CounterAdd && run.mCounter.value () != expected) ||
+		(operation == GaugeAddSub && run.mGauge.value () != 0) ||
+		(operation == HistRecord && run.mHistogram.count () != expected))
+		fprintf (stderr, "%s lost updates with %d threads.\n",
+				 sOperationNames[operation], threads);
+
+	return (double) run.mElapsed / expected;
+}
+
+/*******************************************************************************
+ * Measures the cost of updating counters, gauges and histograms from
+ * 1, 4 and 16 threads, compared with an unsharded atomic counter.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	long count = 10000000;
+	bool usage = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && !strcmp (argv[arg], "-n"))
+			count = atol (argv[++arg]);
+		else
+			usage = true;
+	}
+
+	if (usage || count <= 0) {
+		fprintf (stderr, "Usage: %s [-n count]\n"
+				 "  -n  Operations in each run, divided between the threads (%ld).\n",
+				 argv[0], count);
+		return 1;
+	}
+
+	static const int threadCounts[] = {1, 4, 16};
+	static const int runs = sizeof (threadCounts) / sizeof (threadCounts[0]);
+
+	printf ("%-24s", "ns per operation");
+	for (int t = 0; t < runs; t++)
+		printf (" %7d thr", threadCounts[t]);
+	printf ("\n");
+
+	for (int op = 0; op < Operations; op++) {
+		printf ("%-24s", sOperationNames[op]);
+		for (int t = 0; t < runs; t++)
+			printf (" %11.2f", measure (op, threadCounts[t], count / threadCounts[t]));
+		printf ("\n");
+	}
+
+	return 0;
+}
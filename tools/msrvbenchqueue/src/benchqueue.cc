@@ -0,0 +1,205 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvdef.h>
+#include <magicserver/msrvthread.h>
+#include <magicserver/msrvcontainer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+using namespace MSrv;
+
+/** Item passed through the queues; only its address is used. */
+static int sItem;
+
+/*******************************************************************************
+ * Pushes an item to a locked queue, which never fails.
+ ******************************************************************************/
+static inline bool tryPush (Queue<int>& rQueue, int* pItem)
+{
+	rQueue.push (pItem);
+	return true;
+}
+
+/*******************************************************************************
+ * Pushes an item to a lock-free queue, failing when it is full.
+ ******************************************************************************/
+static inline bool tryPush (BoundedQueue<int>& rQueue, int* pItem)
+{
+	return rQueue.push (pItem) == 0;
+}
+
+/*******************************************************************************
+ * State shared by the threads of one run.
+ ******************************************************************************/
+template <class QUEUE>
+struct Run {
+	QUEUE*		mpQueue;     /**< Queue being measured.               */
+	long		mItems;      /**< Items pushed by each producer.      */
+	long		mLeft;       /**< Items not pulled yet.               */
+	bool		mGo;         /**< Set when all the threads may start. */
+};
+
+/*******************************************************************************
+ * Thread pushing items to the queue.
+ ******************************************************************************/
+template <class QUEUE>
+class Producer : public Thread {
+  public:
+					Producer	(Run<QUEUE>& rRun) : mrRun (rRun) {;}
+
+	virtual void*	execute		() {
+		while (!__atomic_load_n (&mrRun.mGo, __ATOMIC_ACQUIRE))
+			sched_yield ();
+
+		for (long i = 0; i < mrRun.mItems; i++)
+			while (!tryPush (*mrRun.mpQueue, &sItem))
+				sched_yield ();
+
+		return NULL;
+	}
+
+  private:
+	Run<QUEUE>&		mrRun;   /**< State of the run. */
+};
+
+/*******************************************************************************
+ * Thread pulling items from the queue until all have been pulled.
+ ******************************************************************************/
+template <class QUEUE>
+class Consumer : public Thread {
+  public:
+					Consumer	(Run<QUEUE>& rRun) : mrRun (rRun) {;}
+
+	virtual void*	execute		() {
+		while (!__atomic_load_n (&mrRun.mGo, __ATOMIC_ACQUIRE))
+			sched_yield ();
+
+		while (__atomic_load_n (&mrRun.mLeft, __ATOMIC_RELAXED) > 0) {
+			if (mrRun.mpQueue->pull ())
+				__atomic_sub_fetch (&mrRun.mLeft, 1, __ATOMIC_RELAXED);
+			else
+				sched_yield ();
+		}
+
+		return NULL;
+	}
+
+  private:
+	Run<QUEUE>&		mrRun;   /**< State of the run. */
+};
+
+/*******************************************************************************
+ * Returns the monotonic time in seconds.
+ ******************************************************************************/
+static double now ()
+{
+	struct timespec time;
+	clock_gettime (CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*******************************************************************************
+ * Passes the given number of items through the queue with the given
+ * number of producer and consumer threads each.
+ *
+ * @return Nanoseconds per item.
+ ******************************************************************************/
+template <class QUEUE>
+static double measure (QUEUE& rQueue, int threads, long items)
+{
+	Run<QUEUE> run;
+	run.mpQueue = &rQueue;
+	run.mItems  = items / threads;
+	run.mLeft   = run.mItems * threads;
+	run.mGo     = false;
+
+	Producer<QUEUE>** pProducers = new Producer<QUEUE>* [threads];
+	Consumer<QUEUE>** pConsumers = new Consumer<QUEUE>* [threads];
+	for (int i = 0; i < threads; i++) {
+		pProducers[i] = new Producer<QUEUE> (run);
+		pConsumers[i] = new Consumer<QUEUE> (run);
+		pProducers[i]->start ();
+		pConsumers[i]->start ();
+	}
+
+	double start = now ();
+	__atomic_store_n (&run.mGo, true, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < threads; i++) {
+		pProducers[i]->join (NULL);
+		pConsumers[i]->join (NULL);
+		delete pProducers[i];
+		delete pConsumers[i];
+	}
+	double elapsed = now () - start;
+
+	delete [] pProducers;
+	delete [] pConsumers;
+
+	return elapsed * 1e9 / (run.mItems * threads);
+}
+
+/*******************************************************************************
+ * Compares the locked Queue with the lock-free BoundedQueue at 1, 4,
+ * 16 and 64 producer and consumer threads.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	long items    = 2000000;
+	int  capacity = MSRV_WORKER_QUEUE_LEN;
+	bool usage    = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && !strcmp (argv[arg], "-n"))
+			items = atol (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-q"))
+			capacity = atoi (argv[++arg]);
+		else
+			usage = true;
+	}
+
+	if (usage || items <= 0 || capacity <= 0) {
+		fprintf (stderr, "Usage: %s [-n items] [-q capacity]\n"
+				 "  -n  Items passed through the queue in each run (%ld).\n"
+				 "  -q  Capacity of the lock-free queue (%d).\n",
+				 argv[0], items, capacity);
+		return 1;
+	}
+
+	static const int threadCounts[] = {1, 4, 16, 64};
+
+	printf ("%8s %17s %17s %17s %17s\n", "threads",
+			"Queue ns/item", "Queue items/s",
+			"Bounded ns/item", "Bounded items/s");
+
+	for (unsigned i = 0; i < sizeof (threadCounts) / sizeof (threadCounts[0]); i++) {
+		int threads = threadCounts[i];
+
+		Queue<int>        locked;
+		BoundedQueue<int> lockFree (capacity);
+
+		double lockedNs   = measure (locked, threads, items);
+		double lockFreeNs = measure (lockFree, threads, items);
+
+		printf ("%8d %17.1f %17.0f %17.1f %17.0f\n", threads,
+				lockedNs, 1e9 / lockedNs, lockFreeNs, 1e9 / lockFreeNs);
+	}
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvframe.h>
+#include <magicserver/msrvdef.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+using namespace MSrv;
+
+/*******************************************************************************
+ * Distribution of the lengths of the lines in a receive buffer.
+ *
+ * The lengths are log-normal around the median, limited to the given
+ * range, or uniform over the range if the spread is zero.
+ ******************************************************************************/
+struct Distribution {
+	const char*	mpName;     /**< Name shown in the results.           */
+	const char*	mpExample;  /**< Kind of traffic that it resembles.   */
+	int			mMin;       /**< Shortest line, including the newline. */
+	int			mMax;       /**< Longest line, including the newline.  */
+	double		mMedian;    /**< Median length.                       */
+	double		mSpread;    /**< Standard deviation of the logarithm. */
+};
+
+static const Distribution sDistributions[] = {
+	{"tiny",   "commands and chat lines",     4,    64,    0.0, 0.0},
+	{"header", "HTTP/SMTP header lines",      8,    512,   32.0, 0.6},
+	{"log",    "syslog and access log lines", 40,   2048,  140.0, 0.5},
+	{"json",   "JSON-RPC and NDJSON records", 64,   16384, 700.0, 0.8},
+	{"bulk",   "bulk records and file lines", 4096, 32768, 0.0, 0.0}
+};
+
+/*******************************************************************************
+ * Draws a line length from the distribution.
+ ******************************************************************************/
+static int drawLength (const Distribution& rDist)
+{
+	if (rDist.mSpread == 0.0)
+		return rDist.mMin + (int) (drand48 () * (rDist.mMax - rDist.mMin + 1));
+
+	/* Box-Muller transform of two uniform numbers to a normal one. */
+	double normal = sqrt (-2.0 * log (1.0 - drand48 ())) * cos (2.0 * M_PI * drand48 ());
+	int    len    = (int) (rDist.mMedian * exp (rDist.mSpread * normal));
+
+	return len < rDist.mMin? rDist.mMin : len > rDist.mMax? rDist.mMax : len;
+}
+
+/*******************************************************************************
+ * Fills a buffer with lines of printable text drawn from the
+ * distribution. The buffer ends with a complete line.
+ *
+ * @return Length of the data.
+ ******************************************************************************/
+static int fillLines (char* pData, int size, const Distribution& rDist, int& rLines)
+{
+	int len = 0;
+	rLines  = 0;
+
+	while (1) {
+		int lineLen = drawLength (rDist);
+		if (len + lineLen > size)
+			break;
+
+		for (int i = 0; i < lineLen - 1; i++)
+			pData[len + i] = 'a' + (len + i) % 26;
+		pData[len + lineLen - 1] = '\n';
+
+		len += lineLen;
+		rLines++;
+	}
+
+	return len;
+}
+
+/*******************************************************************************
+ * Frames all the lines in the data with the line framer.
+ *
+ * @return Number of lines found.
+ ******************************************************************************/
+static int frameAll (const LineFramer& rFramer, const char* pData, int len)
+{
+	FrameSpan spans[MSRV_FRAME_BATCH];
+	int       lines  = 0;
+	int       offset = 0;
+
+	while (offset < len) {
+		int count = rFramer.frames (pData + offset, len - offset, 0,
+									spans, MSRV_FRAME_BATCH);
+		if (count <= 0)
+			break;
+
+		lines  += count;
+		offset += spans[count - 1].mEnd;
+	}
+
+	return lines;
+}
+
+/*******************************************************************************
+ * Frames all the lines in the data by comparing every byte, as a
+ * handler without a framer would.
+ *
+ * @return Number of lines found.
+ ******************************************************************************/
+static int frameBytewise (const char* pData, int len)
+{
+	int lines = 0;
+	for (int i = 0; i < len; i++)
+		if (pData[i] == '\n')
+			lines++;
+
+	return lines;
+}
+
+/*******************************************************************************
+ * Returns the monotonic time in seconds.
+ ******************************************************************************/
+static double now ()
+{
+	struct timespec time;
+	clock_gettime (CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*******************************************************************************
+ * Frames the data repeatedly with the given scanner, or byte by byte
+ * if it is NULL, and prints the throughput.
+ ******************************************************************************/
+static void measure (const char* pData, int len, int lines, const char* pScanner,
+					 double seconds)
+{
+	LineFramer framer;
+	if (pScanner && !LineFramer::setScanner (pScanner)) {
+		printf ("  %-8s not supported\n", pScanner);
+		return;
+	}
+
+	long   rounds = 0;
+	long   found  = 0;
+	double start  = now ();
+	double elapsed;
+
+	do {
+		for (int i = 0; i < 16; i++, rounds++)
+			found += pScanner? frameAll (framer, pData, len) : frameBytewise (pData, len);
+		elapsed = now () - start;
+	} while (elapsed < seconds);
+
+	if (found != rounds * lines) {
+		printf ("  %-8s found %ld lines instead of %ld\n",
+				pScanner? pScanner : "bytewise", found, rounds * lines);
+		return;
+	}
+
+	printf ("  %-8s %10.0f MB/s %10.1f ns/line\n",
+			pScanner? pScanner : "bytewise",
+			rounds * (double) len / elapsed / 1e6,
+			elapsed * 1e9 / (rounds * (double) lines));
+}
+
+/*******************************************************************************
+ * Compares the SIMD and the scalar newline scanning of LineFramer
+ * over buffers of lines with realistic length distributions.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	int    size    = 1 << 20;
+	double seconds = 0.5;
+	bool   usage   = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (arg + 1 < argc && !strcmp (argv[arg], "-b"))
+			size = atoi (argv[++arg]);
+		else if (arg + 1 < argc && !strcmp (argv[arg], "-t"))
+			seconds = atof (argv[++arg]);
+		else
+			usage = true;
+	}
+
+	if (usage || size < 65536 || seconds <= 0.0) {
+		fprintf (stderr, "Usage: %s [-b bytes] [-t seconds]\n"
+				 "  -b  Size of the buffer of lines, at least 65536 (1048576).\n"
+				 "  -t  Seconds to measure each scanner (0.5).\n", argv[0]);
+		return 1;
+	}
+
+	static const char* scanners[] = {"avx2", "sse2", "scalar"};
+
+	char* pData = (char*) malloc (size);
+	srand48 (1);
+
+	printf ("Default scanner: %s\n", LineFramer::scanner ());
+
+	for (unsigned d = 0; d < sizeof (sDistributions) / sizeof (sDistributions[0]); d++) {
+		const Distribution& rDist = sDistributions[d];
+
+		int lines;
+		int len = fillLines (pData, size, rDist, lines);
+
+		printf ("%s: %s, %d-%d bytes, mean %.0f\n", rDist.mpName, rDist.mpExample,
+				rDist.mMin, rDist.mMax, (double) len / lines);
+
+		for (unsigned s = 0; s < sizeof (scanners) / sizeof (scanners[0]); s++)
+			measure (pData, len, lines, scanners[s], seconds);
+		measure (pData, len, lines, NULL, seconds);
+	}
+
+	free (pData);
+	return 0;
+}
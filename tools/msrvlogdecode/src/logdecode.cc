@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   This file is part of the MagiCServer++ library.                       *
+ *                                                                         *
+ *   Copyright (C) 2003 Marko Grnroos <magi@iki.fi>                       *
+ *                                                                         *
+ ***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <magicserver/msrvbinlog.h>
+#include <magicserver/msrverror.h>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace MSrv;
+
+/*******************************************************************************
+ * Renders a binary log file as text log lines to the standard output.
+ ******************************************************************************/
+int main (int argc, char** argv)
+{
+	const char* filename  = NULL;
+	int         precision = LogClock::Seconds;
+	bool        usage     = false;
+
+	for (int arg = 1; arg < argc; arg++) {
+		if (!strcmp (argv[arg], "-u"))
+			precision = LogClock::Microseconds;
+		else if (argv[arg][0] != '-' && !filename)
+			filename = argv[arg];
+		else
+			usage = true;
+	}
+
+	if (usage || !filename) {
+		fprintf (stderr, "Usage: %s [-u] <binary log file>\n"
+				 "  -u  Write the time with microseconds.\n", argv[0]);
+		return 1;
+	}
+
+	BinaryLogReader reader;
+	reader.setPrecision (precision);
+
+	int result = reader.open (filename);
+	if (result < 0) {
+		fprintf (stderr, "%s: Opening %s failed with error %d.\n",
+				 argv[0], filename, -result);
+		return 1;
+	}
+
+	char line[4 * MSRV_LOG_MESSAGE_LEN];
+	int  len;
+	while ((len = reader.next (line, sizeof (line))) > 0)
+		fwrite (line, 1, len, stdout);
+
+	return len < 0? 1 : 0;
+}